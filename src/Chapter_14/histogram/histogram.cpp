@@ -12,9 +12,14 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/time.h>
+#endif
 
 #ifdef  __APPLE__
     #include <OpenCL/opencl.h>
@@ -22,136 +27,298 @@
     #include <CL/cl.h>
 #endif
 
+#include "histogram.h"
+
 const char  cl_kernel_histogram_filename[]    = "histogram_image.cl";
 
+// pixels per work-item of the image histogram kernels, unless a tuned launch (--tune) says otherwise
 const int num_pixels_per_work_item = 32;
 static int num_iterations = 1000;
+static int image_width = 1920;
+static int image_height = 1080;
 
+// streaming mode (--stream / --raw): number of frames (0 = all of raw_file), and the depth of the image ring
+static int stream_mode = 0;
+static int stream_frames = 0;
+static int ring_depth = 3;
+static const char *raw_file = NULL;
 
-// fill an image of w x h pixels with 4-channels / pixel with random data
-// each channel is an unisgned 8-bit value
-//
-static void *
-create_image_data_unorm8(int w, int h)
+// copies of the partial histogram each work-group keeps in local memory (--sub-histograms, 0 = pick from the
+// device's local memory), and whether to fill the test images with a few dark colors instead of noise (--skewed)
+#define MAX_SUB_HISTOGRAMS  16
+static int num_sub_histograms = 0;
+static int skewed_data = 0;
+
+static const char *channel_names[] = { "rgb", "rgba", "luma", "hsv", "yuv" };
+
+// the histogram to compute (--bins, --channels), and the input formats to test (--input, -1 = CL_UNORM_INT8
+// and CL_FLOAT).  bin * NUM_BINS must fit in 32 bits for the 16-bit levels.
+#define MAX_BINS    4096
+static int num_bins = 256;
+static int channels = CHANNELS_RGB;
+static int input_selection = -1;
+
+// how the work-group histograms are combined (--reduce): partial histograms summed by a second kernel, and/or
+// a single pass merging them into the final histogram with global atomics.  the benchmark times both by default.
+#define REDUCE_TWO_PASS     1
+#define REDUCE_SINGLE_PASS  2
+static int reduce_mode = REDUCE_TWO_PASS | REDUCE_SINGLE_PASS;
+static int has_global_atomics = 0;
+
+// histogram planar YUV 4:2:0 frames with histogram_yuv instead of RGBA images (--yuv)
+#define YUV_NONE    0
+#define YUV_NV12    1
+#define YUV_I420    2
+static int yuv_layout = YUV_NONE;
+static const char *yuv_names[] = { "", "nv12", "i420" };
+
+// exposure correction chained on the device after the histogram (--equalize, --auto-levels): the cdf, the bins of
+// the low and high percentiles (--percentiles), a tone curve, and the image rewritten through it
+#define POST_NONE           0
+#define POST_EQUALIZE       1
+#define POST_AUTO_LEVELS    2
+static int post_mode = POST_NONE;
+static float percentiles[2] = { 1.0f, 99.0f };
+
+// histogram batch_images images of image_width x image_height pixels, packed in one buffer, with one pair of
+// launches (--batch), and compare with creating, histogramming and reading back one image at a time
+#define BATCH_ITERATIONS    10
+static int batch_images = 0;
+
+// per-region histograms in one launch: a grid of tiles_x x tiles_y tiles covering the image (--tiles), followed
+// by the regions of interest of roi_list, each x, y, width, height (--roi)
+#define MAX_REGIONS 4096
+#define MAX_ROIS    64
+static int tiles_x = 0;
+static int tiles_y = 0;
+static int roi_list[MAX_ROIS * 4];
+static int num_rois = 0;
+
+// the best launch of the image histogram kernels found by --tune for a device, driver, image size, histogram
+// and reduction (two-pass or single-pass): the work-group shape and the pixels per work-item.  kept in tuning_filename, one per line, so
+// later runs on the same device and driver use it without tuning again.
+typedef struct
 {
-    unsigned char   *p = (unsigned char *)malloc(w * h * 4);
-    int             i;
-    
-    for (i=0; i<w*h*4; i++)
-        p[i] = (unsigned char)(rand() & 0xFF);
+    char                device_name[256];
+    char                driver_version[128];
+    int                 w, h;
+    histogram_config    config;
+    int                 single_pass;
+    int                 local_x, local_y;
+    int                 pixels_per_work_item;
+    double              ms;
+} histogram_tuning;
+
+#define MAX_TUNINGS     256
+#define TUNE_ITERATIONS 20
+const char  tuning_filename[] = "histogram_tuning.txt";
+static histogram_tuning histogram_tunings[MAX_TUNINGS];
+static int num_histogram_tunings = 0;
+static int tune_mode = 0;
+
+// where the histogram is computed (--backend): the OpenCL device, or the host with cpu_histogram() in
+// histogram_cpu.cpp on cpu_threads threads (--threads, 0 = one per hardware thread)
+#define BACKEND_OPENCL  0
+#define BACKEND_CPU     1
+static int backend = BACKEND_OPENCL;
+static int cpu_threads = 0;
+
+// the input image formats: the largest channel value each stores, 0 for floating-point
+typedef struct
+{
+    const char          *option;
+    const char          *name;
+    cl_channel_type     channel_type;
+    int                 input_max;
+    size_t              channel_size;
+} input_format;
+
+#define INPUT_UNORM8    0
+#define INPUT_UNORM16   1
+#define INPUT_FLOAT     2
+
+static const input_format input_formats[] =
+{
+    { "unorm8",  "CL_UNORM_INT8",  CL_UNORM_INT8,  255,   sizeof(unsigned char) },
+    { "unorm16", "CL_UNORM_INT16", CL_UNORM_INT16, 65535, sizeof(unsigned short) },
+    { "float",   "CL_FLOAT",       CL_FLOAT,       0,     sizeof(float) },
+};
 
-    return (void *)p;
+// a built variant, kept for the rest of the run
+typedef struct
+{
+    histogram_config    config;
+    cl_context          context;
+    cl_device_id        device;
+    cl_program          program;
+    cl_kernel           histogram_image;
+    cl_kernel           histogram_sum_partial_results;
+    cl_kernel           histogram_image_single_pass;
+    cl_kernel           histogram_clear;
+    cl_kernel           histogram_image_regions;
+    cl_kernel           histogram_cdf;
+    cl_kernel           histogram_percentiles;
+    cl_kernel           histogram_build_lut;
+    cl_kernel           histogram_apply_lut;
+    cl_kernel           histogram_batch;
+    cl_kernel           histogram_batch_sum_partial_results;
+    cl_kernel           histogram_yuv;                  // CHANNELS_YUV variants only
+    int                 num_sub_histograms;
+    int                 inexact_float_bins;             // the device's float bins may be one off the host's
+} histogram_variant;
+
+#define MAX_HISTOGRAM_VARIANTS  16
+static histogram_variant histogram_variants[MAX_HISTOGRAM_VARIANTS];
+static int num_histogram_variants = 0;
+
+
+static void
+histogram_config_for_input(histogram_config *config, const input_format *format)
+{
+    config->num_bins = num_bins;
+    config->channels = channels;
+    config->input_max = format->input_max;
+    config->overflow_bin = (format->input_max == 0);
 }
 
-// generate the reference results for unsigned 8-bit RGBA image.  
-// this reference result will be compared with histogram results generated by the OpenCL device.
+
+// fill an image of w x h pixels with 4-channels / pixel with random data in the given format:
+// integer levels for the normalized formats, values in [0, 1] for floating-point.
+// if skewed_data is set every channel is one of 8 dark levels instead.
 //
 static void *
-generate_reference_histogram_results_unorm8(void *image_data, int w, int h)
+create_image_data(const input_format *format, int w, int h)
 {
-    unsigned int    *ref_histogram_results = (unsigned int *)malloc(256 * 3 * sizeof(unsigned int));
-    unsigned char   *img = (unsigned char *)image_data;
-    unsigned int    *ptr = ref_histogram_results;
-    int             i;
-    
-    memset(ref_histogram_results, 0x0, 256 * 3 * sizeof(unsigned int));
-    for (i=0; i<w*h*4; i+=4)
-    {
-        int indx = img[i];
-        ptr[indx]++;
-    }
-    
-    ptr += 256;
-    for (i=1; i<w*h*4; i+=4)
+    void    *p = malloc((size_t)w * h * 4 * format->channel_size);
+    int     i;
+
+    for (i=0; i<w*h*4; i++)
     {
-        int indx = img[i];
-        ptr[indx]++;
+        switch (format->channel_type)
+        {
+            case CL_UNORM_INT8:
+                ((unsigned char *)p)[i] = (unsigned char)(rand() & (skewed_data ? 0x07 : 0xFF));
+                break;
+            case CL_UNORM_INT16:
+                ((unsigned short *)p)[i] = (unsigned short)(skewed_data ? (rand() & 0x07) << 8 : ((rand() << 8) ^ rand()) & 0xFFFF);
+                break;
+            default:
+                ((float *)p)[i] = skewed_data ? (float)(rand() & 0x07) / 255.0f : (float)rand() / (float)RAND_MAX;
+                break;
+        }
     }
 
-    ptr += 256;
-    for (i=2; i<w*h*4; i+=4)
+    return p;
+}
+
+// add the pixels of the rw x rh rectangle at (x, y) of an RGBA image w pixels wide, in the format config
+// describes, to ref_histogram_results
+//
+static void
+add_reference_region(const histogram_config *config, const void *image_data, int w, int x, int y, int rw, int rh, unsigned int *ref_histogram_results)
+{
+    int             num_channels = histogram_num_channels(config);
+    int             bins_per_channel = config->num_bins + config->overflow_bin;
+    unsigned int    bins[4];
+    size_t          i;
+    int             px, py, c;
+
+    for (py=y; py<y+rh; py++)
+    for (px=x; px<x+rw; px++)
     {
-        int indx = img[i];
-        ptr[indx]++;
+        i = ((size_t)py * w + px) * 4;
+        if (config->input_max == 255)
+        {
+            const unsigned char *img = (const unsigned char *)image_data + i;
+            histogram_pixel_bins_level(config, img[0], img[1], img[2], img[3], bins);
+        }
+        else if (config->input_max)
+        {
+            const unsigned short *img = (const unsigned short *)image_data + i;
+            histogram_pixel_bins_level(config, img[0], img[1], img[2], img[3], bins);
+        }
+        else
+        {
+            const float *img = (const float *)image_data + i;
+            histogram_pixel_bins_float(config, img[0], img[1], img[2], img[3], bins);
+        }
+
+        for (c=0; c<num_channels; c++)
+            ref_histogram_results[c * bins_per_channel + bins[c]]++;
     }
-    
-    return ref_histogram_results;
 }
 
-// fill an image of w x h pixels with 4-channels / pixel with random data
-// each channel is a single precision floating-point value
+// generate the reference results for an RGBA image in the format config describes.
+// this reference result will be compared with histogram results generated by the OpenCL device.
 //
-static void *
-create_image_data_fp32(int w, int h)
+static unsigned int *
+generate_reference_histogram(const histogram_config *config, const void *image_data, int w, int h)
 {
-    float   *p = (float *)malloc(w * h * 4 * sizeof(float));
-    int     i;
-    
-    for (i=0; i<w*h*4; i++)
-        p[i] = (float)rand() / (float)RAND_MAX;
+    unsigned int    *ref_histogram_results = (unsigned int *)calloc(histogram_size(config), sizeof(unsigned int));
 
-    return (void *)p;
+    add_reference_region(config, image_data, w, 0, 0, w, h, ref_histogram_results);
+    return ref_histogram_results;
 }
 
-
-// generate the reference results for floating-point RGBA image.  
-// this reference result will be compared with histogram results generated by the OpenCL device.
+// generate the reference results for a planar YUV 4:2:0 frame of w x h pixels, NV12 or I420 as histogram_yuv
+// in histogram_image.cl reads it: the Y histogram of the pixels, then the U and V histograms of the chroma samples
 //
-static void *
-generate_reference_histogram_results_fp32(void *image_data, int w, int h)
+static unsigned int *
+generate_reference_yuv_histogram(const histogram_config *config, const unsigned char *frame, int w, int h, int layout)
 {
-    unsigned int    *ref_histogram_results = (unsigned int *)malloc(257 * 3 * sizeof(unsigned int));
-    float           *img = (float *)image_data;
-    unsigned int    *ptr = ref_histogram_results;
-    int             i;
-    
-    memset(ref_histogram_results, 0x0, 257 * 3 * sizeof(unsigned int));
-    for (i=0; i<w*h*4; i+=4)
-    {
-        float           f = img[i];
-        unsigned int    indx;
-        if (f > 1.0f)
-          f = 1.0f;
-          
-        f *= 256.0f;
-        indx = (unsigned int)f;
-        ptr[indx]++;
-    }
-    
-    ptr += 257;
-    for (i=1; i<w*h*4; i+=4)
-    {
-        float           f = img[i];
-        unsigned int    indx;
-        if (f > 1.0f)
-          f = 1.0f;
-          
-        f *= 256.0f;
-        indx = (unsigned int)f;
-        ptr[indx]++;
-    }
-
-    ptr += 257;
-    for (i=2; i<w*h*4; i+=4)
-    {
-        float           f = img[i];
-        unsigned int    indx;
-        if (f > 1.0f)
-          f = 1.0f;
-          
-        f *= 256.0f;
-        indx = (unsigned int)f;
-        ptr[indx]++;
+    int             bins_per_channel = config->num_bins + config->overflow_bin;
+    int             chroma_size = ((w + 1) / 2) * ((h + 1) / 2);
+    unsigned int    *ref_histogram_results = (unsigned int *)calloc(histogram_size(config), sizeof(unsigned int));
+    const unsigned char *chroma = frame + (size_t)w * h;
+    int             i, u, v;
+
+    for (i=0; i<w*h; i++)
+        ref_histogram_results[(frame[i] * config->num_bins) >> 8]++;
+    for (i=0; i<chroma_size; i++)
+    {
+        u = (layout == YUV_NV12) ? chroma[2*i] : chroma[i];
+        v = (layout == YUV_NV12) ? chroma[2*i + 1] : chroma[chroma_size + i];
+        ref_histogram_results[bins_per_channel + ((u * config->num_bins) >> 8)]++;
+        ref_histogram_results[2 * bins_per_channel + ((v * config->num_bins) >> 8)]++;
     }
-    
+
     return ref_histogram_results;
 }
 
+// compare num_entries histogram entries to the reference.  if bins_per_channel is not 0 a pixel may be
+// counted one bin off the reference (see inexact_float_bins): within each channel's run of bins_per_channel
+// bins the totals must match, and no more pixels may cross an edge between two bins than the reference
+// counts in the two.
+//
 static int
-verify_histogram_results(const char *str, unsigned int *histogram_results, unsigned int *ref_histogram_results, int num_entries)
+verify_histogram_results(const char *str, unsigned int *histogram_results, unsigned int *ref_histogram_results, int num_entries,
+                         int bins_per_channel)
 {
     int     i;
     
+    if (bins_per_channel)
+    {
+        long long   below = 0, ref_below = 0;
+
+        for (i=0; i<num_entries; i++)
+        {
+            if (i % bins_per_channel == 0)
+                below = ref_below = 0;
+            below += histogram_results[i];
+            ref_below += ref_histogram_results[i];
+            if ((i % bins_per_channel == bins_per_channel - 1) ? (below != ref_below) :
+                (llabs(below - ref_below) > (long long)ref_histogram_results[i] + ref_histogram_results[i+1]))
+            {
+                printf("%s: verify_histogram_results failed for indx = %d, gpu result = %d, expected result = %d (+/- 1 bin)\n",
+                                                            str, i, histogram_results[i], ref_histogram_results[i]);
+                return -1;
+            }
+        }
+
+        printf("%s: VERIFIED (to within a bin per pixel)\n", str);
+        return 0;
+    }
+
     for (i=0; i<num_entries; i++)
     {
         if (histogram_results[i] != ref_histogram_results[i])
@@ -166,6 +333,14 @@ verify_histogram_results(const char *str, unsigned int *histogram_results, unsig
     return 0;
 }
 
+// the bins_per_channel of verify_histogram_results for the results of a variant
+//
+static int
+verify_bins_per_channel(const histogram_variant *variant)
+{
+    return variant->inexact_float_bins ? variant->config.num_bins + variant->config.overflow_bin : 0;
+}
+
 
 static int 
 read_kernel_from_file(const char *filename, char **source, size_t *len)
@@ -190,55 +365,62 @@ read_kernel_from_file(const char *filename, char **source, size_t *len)
 }
 
 
-int
-test_histogram(cl_context context, cl_command_queue queue, cl_device_id device)
+// number of sub-histograms the image kernel keeps per work-group for a histogram of size entries: the largest
+// power of 2 whose copies fit in half the local memory, so that two work-groups can still share a compute unit.
+// local memory which is really global memory (CPU devices) has no banks to spread the atomics over.
+//
+static int
+choose_num_sub_histograms(cl_device_id device, int size)
 {
-    cl_program          program;
-    cl_kernel           histogram_rgba_unorm8;
-    cl_kernel           histogram_rgba_fp;
-    cl_kernel           histogram_sum_partial_results_unorm8;
-    cl_kernel           histogram_sum_partial_results_fp;
-    cl_image_format     image_format;
-    int                 image_width = 1920;
-    int                 image_height = 1080;
-    size_t              global_work_size[2];
-    size_t              local_work_size[2];
-    size_t              partial_global_work_size[2];
-    size_t              partial_local_work_size[2];
-    size_t              workgroup_size;
-    size_t              num_groups;
-    unsigned int        *ref_histogram_results, *histogram_results;
-    void                *image_data_unorm8;
-    cl_mem              input_image_unorm8;
-    void                *image_data_fp32;
-    cl_mem              input_image_fp32;
-    cl_mem              histogram_buffer;
-    cl_mem              partial_histogram_buffer;
-    cl_event            events[2];
-    cl_ulong            time_start, time_end;
-	size_t              src_len[1];
-    char                *source[1];
-    int                 i, err;
+    cl_device_local_mem_type    local_mem_type;
+    cl_ulong                    local_mem_size;
+    int                         n = 1;
 
+    if (num_sub_histograms > 0)
+        return num_sub_histograms;
+
+    if (clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_TYPE, sizeof(local_mem_type), &local_mem_type, NULL) ||
+        clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size), &local_mem_size, NULL) ||
+        local_mem_type != CL_LOCAL)
+        return 1;
+
+    while ((n*2 <= MAX_SUB_HISTOGRAMS) && ((cl_ulong)n * 2 * size * sizeof(cl_uint) <= local_mem_size / 2))
+        n *= 2;
+    return n;
+}
+
+// read histogram_image.cl and build it for device, specialized for config.  with correctly_rounded the float
+// divisions and square roots are correctly rounded (-cl-fp32-correctly-rounded-divide-sqrt), as on the host.
+// returns NULL (after printing why) on failure.
+//
+static cl_program
+build_histogram_program(cl_context context, cl_device_id device, const histogram_config *config, int sub_histograms, int correctly_rounded)
+{
+    cl_program  program;
+    size_t      src_len[1];
+    char        *source[1];
+    char        options[256];
+    int         err;
 
-    srand(0);
-    
     err = read_kernel_from_file(cl_kernel_histogram_filename, &source[0], &src_len[0]);
     if(err)
     {
         printf("read_kernel_from_file() failed. (%s) file not found\n", cl_kernel_histogram_filename);
-        return EXIT_FAILURE;
+        return NULL;
     }
 
     program = clCreateProgramWithSource(context, 1, (const char **)source, (size_t *)src_len, &err);
     if(!program || err)
     {
         printf("clCreateProgramWithSource() failed. (%d)\n", err);
-        return EXIT_FAILURE;
+        return NULL;
     }
     free(source[0]);
-  
-    err = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+
+    sprintf(options, "-DNUM_BINS=%d -DCHANNELS=%d -DINPUT_MAX=%d -DOVERFLOW_BIN=%d -DNUM_SUB_HISTOGRAMS=%d%s",
+                            config->num_bins, config->channels, config->input_max, config->overflow_bin, sub_histograms,
+                            correctly_rounded ? " -cl-fp32-correctly-rounded-divide-sqrt" : "");
+    err = clBuildProgram(program, 1, &device, options, NULL, NULL);
     if(err != CL_SUCCESS)
     {
         char    buffer[2048] = "";
@@ -246,349 +428,2106 @@ test_histogram(cl_context context, cl_command_queue queue, cl_device_id device)
         printf("clBuildProgram() failed.\n");
         clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buffer), buffer, NULL);
         printf("Log:\n%s\n", buffer);
-        return EXIT_FAILURE;
+        clReleaseProgram(program);
+        return NULL;
     }
-    
-    histogram_rgba_unorm8 = clCreateKernel(program, "histogram_image_rgba_unorm8", &err);
-    if(!histogram_rgba_unorm8 || err)
+    return program;
+}
+
+// the variant of the histogram program for config, built on first use and then reused.
+// returns NULL (after printing why) on failure.
+//
+static histogram_variant *
+get_histogram_variant(cl_context context, cl_device_id device, const histogram_config *config)
+{
+    histogram_variant   *variant;
+    cl_device_fp_config fp_config;
+    cl_ulong            local_mem_size, local_bytes;
+    int                 correctly_rounded;
+    int                 i, err;
+
+    for (i=0; i<num_histogram_variants; i++)
     {
-        printf("clCreateKernel() failed creating kernel void histogram_rgba_unorm8(). (%d)\n", err);
-        return EXIT_FAILURE;
+        variant = &histogram_variants[i];
+        if (variant->context == context && variant->device == device && !memcmp(&variant->config, config, sizeof(*config)))
+            return variant;
     }
-    histogram_rgba_fp = clCreateKernel(program, "histogram_image_rgba_fp", &err);
-    if(!histogram_rgba_fp || err)
+    if (num_histogram_variants == MAX_HISTOGRAM_VARIANTS)
     {
-        printf("clCreateKernel() failed creating kernel void histogram_image_rgba_fp(). (%d)\n", err);
-        return EXIT_FAILURE;
+        printf("Too many histogram program variants\n");
+        return NULL;
     }
-    histogram_sum_partial_results_unorm8 = clCreateKernel(program, "histogram_sum_partial_results_unorm8", &err);
-    if(!histogram_sum_partial_results_unorm8 || err)
+
+    variant = &histogram_variants[num_histogram_variants];
+    variant->config = *config;
+    variant->context = context;
+    variant->device = device;
+    variant->num_sub_histograms = choose_num_sub_histograms(device, histogram_size(config));
+
+    // every image kernel keeps the NUM_SUB_HISTOGRAMS copies of the histogram in local memory
+    local_bytes = (cl_ulong)histogram_size(config) * variant->num_sub_histograms * sizeof(cl_uint);
+    err = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size), &local_mem_size, NULL);
+    if (err)
     {
-        printf("clCreateKernel() failed creating kernel void histogram_sum_partial_results_unorm8(). (%d)\n", err);
-        return EXIT_FAILURE;
+        printf("clGetDeviceInfo() failed for CL_DEVICE_LOCAL_MEM_SIZE. (%d)\n", err);
+        return NULL;
     }
-    histogram_sum_partial_results_fp = clCreateKernel(program, "histogram_sum_partial_results_fp", &err);
-    if(!histogram_sum_partial_results_fp || err)
+    if (local_bytes > local_mem_size)
     {
-        printf("clCreateKernel() failed creating kernel void histogram_sum_partial_results_fp(). (%d)\n", err);
-        return EXIT_FAILURE;
+        printf("A histogram of %d bins x %s%s with %d sub-histograms needs %llu bytes of local memory, the device has %llu\n",
+                    config->num_bins, channel_names[config->channels], config->overflow_bin ? " (+ overflow bin)" : "",
+                    variant->num_sub_histograms, (unsigned long long)local_bytes, (unsigned long long)local_mem_size);
+        return NULL;
     }
 
-    histogram_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, 257*3*sizeof(unsigned int), NULL, &err);
-    if (!histogram_buffer || err)
-    {
-        printf("clCreateBuffer() failed. (%d)\n", err);
-        return EXIT_FAILURE;
-    }
+    // the hue of a float HSV histogram takes divisions, which the device may round differently than the host
+    // (OpenCL allows 2.5 ulp) unless they are correctly rounded; a pixel then may land one bin off.
+    if (clGetDeviceInfo(device, CL_DEVICE_SINGLE_FP_CONFIG, sizeof(fp_config), &fp_config, NULL))
+        fp_config = 0;
+    correctly_rounded = (fp_config & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT) != 0;
+    variant->inexact_float_bins = !correctly_rounded && config->input_max == 0 && config->channels == CHANNELS_HSV;
 
-    image_format.image_channel_order = CL_RGBA;
-    image_format.image_channel_data_type = CL_UNORM_INT8;
-    image_data_unorm8 = create_image_data_unorm8(image_width, image_height);
-    input_image_unorm8 = clCreateImage2D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  
-                                            &image_format, image_width, image_height, 0, image_data_unorm8, &err);
-    if (!input_image_unorm8 || err)
+    variant->program = build_histogram_program(context, device, config, variant->num_sub_histograms, correctly_rounded);
+    if (!variant->program)
+        return NULL;
+
+    variant->histogram_image = clCreateKernel(variant->program, "histogram_image", &err);
+    if(!variant->histogram_image || err)
     {
-        printf("clCreateImage2D() failed. (%d)\n", err);
-        return EXIT_FAILURE;
+        printf("clCreateKernel() failed creating kernel void histogram_image(). (%d)\n", err);
+        return NULL;
     }
-    image_format.image_channel_order = CL_RGBA;
-    image_format.image_channel_data_type = CL_FLOAT;
-    image_data_fp32 = create_image_data_fp32(image_width, image_height);
-    input_image_fp32 = clCreateImage2D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,  
-                                            &image_format, image_width, image_height, 0, image_data_fp32, &err);
-    if (!input_image_fp32 || err)
+    variant->histogram_sum_partial_results = clCreateKernel(variant->program, "histogram_sum_partial_results", &err);
+    if(!variant->histogram_sum_partial_results || err)
     {
-        printf("clCreateImage2D() failed. (%d)\n", err);
-        return EXIT_FAILURE;
+        printf("clCreateKernel() failed creating kernel void histogram_sum_partial_results(). (%d)\n", err);
+        return NULL;
     }
-    
-    /************  Testing RGBA 8-bit histogram **********/
-    
-    clGetKernelWorkGroupInfo(histogram_rgba_unorm8, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    // the program only has the single-pass kernel when the device has global atomics
+    if (has_global_atomics)
     {
-        size_t  gsize[2];
-        int     w;
-        
-        if (workgroup_size <= 256)
-        {
-            gsize[0] = 16;
-            gsize[1] = workgroup_size / 16;
-        }
-        else if (workgroup_size <= 1024)
+        variant->histogram_image_single_pass = clCreateKernel(variant->program, "histogram_image_single_pass", &err);
+        if(!variant->histogram_image_single_pass || err)
         {
-            gsize[0] = workgroup_size / 16;
-            gsize[1] = 16;
+            printf("clCreateKernel() failed creating kernel void histogram_image_single_pass(). (%d)\n", err);
+            return NULL;
         }
-        else
+    }
+    variant->histogram_clear = clCreateKernel(variant->program, "histogram_clear", &err);
+    if(!variant->histogram_clear || err)
+    {
+        printf("clCreateKernel() failed creating kernel void histogram_clear(). (%d)\n", err);
+        return NULL;
+    }
+    variant->histogram_image_regions = clCreateKernel(variant->program, "histogram_image_regions", &err);
+    if(!variant->histogram_image_regions || err)
+    {
+        printf("clCreateKernel() failed creating kernel void histogram_image_regions(). (%d)\n", err);
+        return NULL;
+    }
+    variant->histogram_cdf = clCreateKernel(variant->program, "histogram_cdf", &err);
+    if(!variant->histogram_cdf || err)
+    {
+        printf("clCreateKernel() failed creating kernel void histogram_cdf(). (%d)\n", err);
+        return NULL;
+    }
+    variant->histogram_percentiles = clCreateKernel(variant->program, "histogram_percentiles", &err);
+    if(!variant->histogram_percentiles || err)
+    {
+        printf("clCreateKernel() failed creating kernel void histogram_percentiles(). (%d)\n", err);
+        return NULL;
+    }
+    variant->histogram_build_lut = clCreateKernel(variant->program, "histogram_build_lut", &err);
+    if(!variant->histogram_build_lut || err)
+    {
+        printf("clCreateKernel() failed creating kernel void histogram_build_lut(). (%d)\n", err);
+        return NULL;
+    }
+    variant->histogram_apply_lut = clCreateKernel(variant->program, "histogram_apply_lut", &err);
+    if(!variant->histogram_apply_lut || err)
+    {
+        printf("clCreateKernel() failed creating kernel void histogram_apply_lut(). (%d)\n", err);
+        return NULL;
+    }
+    variant->histogram_batch = clCreateKernel(variant->program, "histogram_batch", &err);
+    if(!variant->histogram_batch || err)
+    {
+        printf("clCreateKernel() failed creating kernel void histogram_batch(). (%d)\n", err);
+        return NULL;
+    }
+    variant->histogram_batch_sum_partial_results = clCreateKernel(variant->program, "histogram_batch_sum_partial_results", &err);
+    if(!variant->histogram_batch_sum_partial_results || err)
+    {
+        printf("clCreateKernel() failed creating kernel void histogram_batch_sum_partial_results(). (%d)\n", err);
+        return NULL;
+    }
+    variant->histogram_yuv = NULL;
+    if (config->channels == CHANNELS_YUV)
+    {
+        variant->histogram_yuv = clCreateKernel(variant->program, "histogram_yuv", &err);
+        if(!variant->histogram_yuv || err)
         {
-            gsize[0] = workgroup_size / 32;
-            gsize[1] = 32;
+            printf("clCreateKernel() failed creating kernel void histogram_yuv(). (%d)\n", err);
+            return NULL;
         }
-        
-        local_work_size[0] = gsize[0];
-        local_work_size[1] = gsize[1];
-        
-        w = (image_width + num_pixels_per_work_item - 1) / num_pixels_per_work_item;
-        global_work_size[0] = ((w + gsize[0] - 1) / gsize[0]);
-        global_work_size[1] = ((image_height + gsize[1] - 1) / gsize[1]);
+    }
 
-        num_groups = global_work_size[0] * global_work_size[1];    
-        global_work_size[0] *= gsize[0];
-        global_work_size[1] *= gsize[1];
-    }    
+    printf("Built histogram: %d bins x %s%s, input max = %d, sub-histograms per work-group = %d\n",
+                    config->num_bins, channel_names[config->channels], config->overflow_bin ? " (+ overflow bin)" : "",
+                    config->input_max, variant->num_sub_histograms);
+    num_histogram_variants++;
+    return variant;
+}
 
-    partial_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, num_groups*257*3*sizeof(unsigned int), NULL, &err);
-    if (!partial_histogram_buffer || err)
+static void
+release_histogram_variants(void)
+{
+    int     i;
+
+    for (i=0; i<num_histogram_variants; i++)
     {
-        printf("clCreateBuffer() failed. (%d)\n", err);
-        return EXIT_FAILURE;
+        clReleaseKernel(histogram_variants[i].histogram_image);
+        clReleaseKernel(histogram_variants[i].histogram_sum_partial_results);
+        if (histogram_variants[i].histogram_image_single_pass)
+            clReleaseKernel(histogram_variants[i].histogram_image_single_pass);
+        clReleaseKernel(histogram_variants[i].histogram_clear);
+        clReleaseKernel(histogram_variants[i].histogram_image_regions);
+        clReleaseKernel(histogram_variants[i].histogram_cdf);
+        clReleaseKernel(histogram_variants[i].histogram_percentiles);
+        clReleaseKernel(histogram_variants[i].histogram_build_lut);
+        clReleaseKernel(histogram_variants[i].histogram_apply_lut);
+        clReleaseKernel(histogram_variants[i].histogram_batch);
+        clReleaseKernel(histogram_variants[i].histogram_batch_sum_partial_results);
+        if (histogram_variants[i].histogram_yuv)
+            clReleaseKernel(histogram_variants[i].histogram_yuv);
+        clReleaseProgram(histogram_variants[i].program);
     }
+    num_histogram_variants = 0;
+}
 
-    clSetKernelArg(histogram_rgba_unorm8, 0, sizeof(cl_mem), &input_image_unorm8);
-    clSetKernelArg(histogram_rgba_unorm8, 1, sizeof(int), &num_pixels_per_work_item);
-    clSetKernelArg(histogram_rgba_unorm8, 2, sizeof(cl_mem), &partial_histogram_buffer);
-    
-    clSetKernelArg(histogram_sum_partial_results_unorm8, 0, sizeof(cl_mem), &partial_histogram_buffer);
-    clSetKernelArg(histogram_sum_partial_results_unorm8, 1, sizeof(int), &num_groups);
-    clSetKernelArg(histogram_sum_partial_results_unorm8, 2, sizeof(cl_mem), &histogram_buffer);
+// read the tunings saved by earlier runs from tuning_filename, if there is one
+//
+static void
+load_histogram_tunings(void)
+{
+    FILE                *fh = fopen(tuning_filename, "r");
+    histogram_tuning    *t;
+    char                line[512];
 
+    if (!fh)
+        return;
+    while (num_histogram_tunings < MAX_TUNINGS && fgets(line, sizeof(line), fh))
+    {
+        t = &histogram_tunings[num_histogram_tunings];
+        if (sscanf(line, "%d %d %d %d %d %d %d %d %d %d %lg\t%255[^\t]\t%127[^\n]", &t->w, &t->h,
+                        &t->config.num_bins, &t->config.channels, &t->config.input_max, &t->config.overflow_bin, &t->single_pass,
+                        &t->local_x, &t->local_y, &t->pixels_per_work_item, &t->ms, t->device_name, t->driver_version) == 13)
+            num_histogram_tunings++;
+    }
+    fclose(fh);
+}
 
-    // verify that the kernel works correctly.  also acts as a warmup
-    err = clEnqueueNDRangeKernel(queue, histogram_rgba_unorm8, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
-    if (err)
+static void
+save_histogram_tunings(void)
+{
+    FILE    *fh = fopen(tuning_filename, "w");
+    int     i;
+
+    if (!fh)
     {
-        printf("clEnqueueNDRangeKernel() failed for histogram_rgba_unorm8 kernel. (%d)\n", err);
-        return EXIT_FAILURE;
+        printf("Could not write %s\n", tuning_filename);
+        return;
     }
-    
-    // verify that the kernel works correctly.  also acts as a warmup
-    clGetKernelWorkGroupInfo(histogram_sum_partial_results_unorm8, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
-    if (workgroup_size < 256)
+    for (i=0; i<num_histogram_tunings; i++)
     {
-        printf("A min. of 256 work-items in work-group is needed for histogram_sum_partial_results_unorm8 kernel. (%d)\n", (int)workgroup_size);
-        return EXIT_FAILURE;
+        const histogram_tuning  *t = &histogram_tunings[i];
+
+        fprintf(fh, "%d %d %d %d %d %d %d %d %d %d %g\t%s\t%s\n", t->w, t->h,
+                    t->config.num_bins, t->config.channels, t->config.input_max, t->config.overflow_bin, t->single_pass,
+                    t->local_x, t->local_y, t->pixels_per_work_item, t->ms, t->device_name, t->driver_version);
     }
-    partial_global_work_size[0] = 256*3;
-    partial_local_work_size[0] = (workgroup_size > 256) ? 256 : workgroup_size;
-    err = clEnqueueNDRangeKernel(queue, histogram_sum_partial_results_unorm8, 1, NULL, partial_global_work_size, partial_local_work_size, 0, NULL, NULL);
-    if (err)
+    fclose(fh);
+}
+
+// the saved tuning of config and the reduction single_pass over a w x h image on device, or NULL.  with add, a new entry (its launch still to
+// be filled in) is made if there is none, replacing the oldest one if the table is full.
+//
+static histogram_tuning *
+find_histogram_tuning(cl_device_id device, const histogram_config *config, int w, int h, int single_pass, int add)
+{
+    char                device_name[256];
+    char                driver_version[128];
+    histogram_tuning    *t;
+    int                 i;
+
+    if (clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL) ||
+        clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver_version), driver_version, NULL))
+        return NULL;
+
+    for (i=0; i<num_histogram_tunings; i++)
     {
-        printf("clEnqueueNDRangeKernel() failed for histogram_sum_partial_results_unorm8 kernel. (%d)\n", err);
-        return EXIT_FAILURE;
+        t = &histogram_tunings[i];
+        if (t->w == w && t->h == h && !memcmp(&t->config, config, sizeof(*config)) && t->single_pass == single_pass &&
+            !strcmp(t->device_name, device_name) && !strcmp(t->driver_version, driver_version))
+            return t;
     }
+    if (!add)
+        return NULL;
 
-    ref_histogram_results = (unsigned int *)generate_reference_histogram_results_unorm8(image_data_unorm8, image_width, image_height);
-    histogram_results = (unsigned int *)malloc(257*3*sizeof(unsigned int));
-    err = clEnqueueReadBuffer(queue, histogram_buffer, CL_TRUE, 0, 256*3*sizeof(unsigned int), histogram_results, 0, NULL, NULL);
-    if (err)
+    if (num_histogram_tunings == MAX_TUNINGS)
     {
-        printf("clEnqueueReadBuffer() failed. (%d)\n", err);
-        return EXIT_FAILURE;
+        memmove(&histogram_tunings[0], &histogram_tunings[1], (MAX_TUNINGS - 1) * sizeof(histogram_tuning));
+        num_histogram_tunings--;
     }
-    verify_histogram_results("Image Histogram for image type = CL_RGBA, CL_UNORM_INT8", histogram_results, ref_histogram_results, 256*3);
+    t = &histogram_tunings[num_histogram_tunings++];
+    memset(t, 0, sizeof(*t));
+    strcpy(t->device_name, device_name);
+    strcpy(t->driver_version, driver_version);
+    t->w = w;
+    t->h = h;
+    t->config = *config;
+    t->single_pass = single_pass;
+    return t;
+}
+
+// pick the work-group shape for the image histogram kernels and the pixels per work-item, from tuning if not
+// NULL, and the global size that covers an image of w x h pixels.
+//
+static void
+get_histogram_work_sizes(size_t workgroup_size, const histogram_tuning *tuning, int w, int h, size_t *global_work_size, size_t *local_work_size,
+                         int *pixels_per_work_item, size_t *num_groups)
+{
+    size_t  gsize[2];
     
-    // now measure performance
-    err = clEnqueueMarker(queue, &events[0]);
-    if (err)
+    *pixels_per_work_item = num_pixels_per_work_item;
+    if (tuning)
     {
-        printf("clEnqeueMarker() failed for histogram_rgba_unorm8 kernel. (%d)\n", err);
-        return EXIT_FAILURE;
+        gsize[0] = tuning->local_x;
+        gsize[1] = tuning->local_y;
+        *pixels_per_work_item = tuning->pixels_per_work_item;
     }
-    for (i=0; i<num_iterations; i++)
+    else if (workgroup_size <= 256)
+    {
+        gsize[0] = 16;
+        gsize[1] = workgroup_size / 16;
+    }
+    else if (workgroup_size <= 1024)
+    {
+        gsize[0] = workgroup_size / 16;
+        gsize[1] = 16;
+    }
+    else
+    {
+        gsize[0] = workgroup_size / 32;
+        gsize[1] = 32;
+    }
+    
+    local_work_size[0] = gsize[0];
+    local_work_size[1] = gsize[1];
+    
+    w = (w + *pixels_per_work_item - 1) / *pixels_per_work_item;
+    global_work_size[0] = ((w + gsize[0] - 1) / gsize[0]);
+    global_work_size[1] = ((h + gsize[1] - 1) / gsize[1]);
+
+    *num_groups = global_work_size[0] * global_work_size[1];    
+    global_work_size[0] *= gsize[0];
+    global_work_size[1] *= gsize[1];
+}
+
+// work sizes for the partial-sum kernel: a work-item per histogram entry, in work-groups of up to 256
+//
+static void
+get_sum_work_sizes(histogram_variant *variant, size_t *global_work_size, size_t *local_work_size)
+{
+    size_t  workgroup_size;
+    size_t  size = (size_t)histogram_size(&variant->config);
+
+    clGetKernelWorkGroupInfo(variant->histogram_sum_partial_results, variant->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    local_work_size[0] = (workgroup_size > 256) ? 256 : workgroup_size;
+    global_work_size[0] = ((size + local_work_size[0] - 1) / local_work_size[0]) * local_work_size[0];
+}
+
+// the launch of one histogram with a variant's kernels, their arguments already set
+typedef struct
+{
+    histogram_variant   *variant;
+    int                 single_pass;
+    int                 num_groups;
+    int                 pixels_per_work_item;
+    size_t              global_work_size[2];
+    size_t              local_work_size[2];
+    size_t              partial_global_work_size[1];
+    size_t              partial_local_work_size[1];
+} histogram_launch;
+
+// enqueue one histogram: the image kernel then the partial sums, or with single_pass the clear then the
+// single-pass kernel.  the first command waits on wait_list and returns its event in first_event if not NULL;
+// the event of the last command, after which the histogram is complete, is returned in last_event if not NULL.
+//
+static int
+enqueue_histogram(cl_command_queue queue, const histogram_launch *launch, cl_uint num_events, const cl_event *wait_list, cl_event *first_event,
+                  cl_event *last_event)
+{
+    histogram_variant   *variant = launch->variant;
+    int                 err;
+
+    if (launch->single_pass)
     {
-        err = clEnqueueNDRangeKernel(queue, histogram_rgba_unorm8, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
+        err = clEnqueueNDRangeKernel(queue, variant->histogram_clear, 1, NULL, launch->partial_global_work_size, launch->partial_local_work_size, num_events, wait_list, first_event);
         if (err)
         {
-            printf("clEnqueueNDRangeKernel() failed for histogram_rgba_unorm8 kernel. (%d)\n", err);
-            return EXIT_FAILURE;
+            printf("clEnqueueNDRangeKernel() failed for histogram_clear kernel. (%d)\n", err);
+            return -1;
         }
-        
-        err = clEnqueueNDRangeKernel(queue, histogram_sum_partial_results_unorm8, 1, NULL, partial_global_work_size, partial_local_work_size, 0, NULL, NULL);
+        err = clEnqueueNDRangeKernel(queue, variant->histogram_image_single_pass, 2, NULL, launch->global_work_size, launch->local_work_size, 0, NULL, last_event);
         if (err)
         {
-            printf("clEnqueueNDRangeKernel() failed for histogram_sum_partial_results_unorm8 kernel. (%d)\n", err);
-            return EXIT_FAILURE;
-        }        
+            printf("clEnqueueNDRangeKernel() failed for histogram_image_single_pass kernel. (%d)\n", err);
+            return -1;
+        }
+        return 0;
     }
-    err = clEnqueueMarker(queue, &events[1]);
+
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_image, 2, NULL, launch->global_work_size, launch->local_work_size, num_events, wait_list, first_event);
     if (err)
     {
-        printf("clEnqeueMarker() failed for histogram_rgba_unorm8 kernel. (%d)\n", err);
-        return EXIT_FAILURE;
+        printf("clEnqueueNDRangeKernel() failed for histogram_image kernel. (%d)\n", err);
+        return -1;
     }
-    err = clWaitForEvents(1, &events[1]);
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_sum_partial_results, 1, NULL, launch->partial_global_work_size, launch->partial_local_work_size, 0, NULL, last_event);
     if (err)
     {
-        printf("clWaitForEvents() failed for histogram_rgba_unorm8 kernel. (%d)\n", err);
-        return EXIT_FAILURE;
-    }    
-    
+        printf("clEnqueueNDRangeKernel() failed for histogram_sum_partial_results kernel. (%d)\n", err);
+        return -1;
+    }
+    return 0;
+}
+
+// set up launch for variant over an image of w x h pixels with the launch of tuning (NULL = the default one):
+// the work sizes, and the number of work-groups of the image kernels, which sizes the partial histogram buffer.
+//
+static void
+init_histogram_launch_tuned(histogram_launch *launch, histogram_variant *variant, int w, int h, int single_pass, const histogram_tuning *tuning)
+{
+    size_t  workgroup_size;
+    size_t  num_groups;
+
+    launch->variant = variant;
+    launch->single_pass = single_pass;
+    clGetKernelWorkGroupInfo(variant->histogram_image, variant->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    if (tuning && (size_t)tuning->local_x * tuning->local_y > workgroup_size)
+        tuning = NULL;
+    get_histogram_work_sizes(workgroup_size, tuning, w, h, launch->global_work_size, launch->local_work_size, &launch->pixels_per_work_item, &num_groups);
+    get_sum_work_sizes(variant, launch->partial_global_work_size, launch->partial_local_work_size);
+    launch->num_groups = (int)num_groups;
+}
+
+// the same with the launch saved by --tune for this device, driver, image size, histogram and reduction, if any
+//
+static void
+init_histogram_launch(histogram_launch *launch, histogram_variant *variant, int w, int h, int single_pass)
+{
+    histogram_tuning    *tuning = find_histogram_tuning(variant->device, &variant->config, w, h, single_pass, 0);
+
+    if (tuning && tuning->local_x > 0)
+        printf("Using tuned launch: %d x %d work-items per work-group, %d pixels per work-item\n",
+                    tuning->local_x, tuning->local_y, tuning->pixels_per_work_item);
+    else
+        tuning = NULL;
+    init_histogram_launch_tuned(launch, variant, w, h, single_pass, tuning);
+}
+
+// set the arguments of all the launch's kernels but the image
+//
+static void
+set_histogram_launch_buffers(const histogram_launch *launch, cl_mem *partial_histogram_buffer, cl_mem *histogram_buffer)
+{
+    histogram_variant   *variant = launch->variant;
+
+    clSetKernelArg(variant->histogram_image, 1, sizeof(int), &launch->pixels_per_work_item);
+    clSetKernelArg(variant->histogram_image, 2, sizeof(cl_mem), partial_histogram_buffer);
+
+    clSetKernelArg(variant->histogram_sum_partial_results, 0, sizeof(cl_mem), partial_histogram_buffer);
+    clSetKernelArg(variant->histogram_sum_partial_results, 1, sizeof(int), &launch->num_groups);
+    clSetKernelArg(variant->histogram_sum_partial_results, 2, sizeof(cl_mem), histogram_buffer);
+
+    if (variant->histogram_image_single_pass)
+    {
+        clSetKernelArg(variant->histogram_image_single_pass, 1, sizeof(int), &launch->pixels_per_work_item);
+        clSetKernelArg(variant->histogram_image_single_pass, 2, sizeof(cl_mem), histogram_buffer);
+    }
+    clSetKernelArg(variant->histogram_clear, 0, sizeof(cl_mem), histogram_buffer);
+}
+
+static void
+set_histogram_launch_image(const histogram_launch *launch, cl_mem *image)
+{
+    clSetKernelArg(launch->variant->histogram_image, 0, sizeof(cl_mem), image);
+    if (launch->variant->histogram_image_single_pass)
+        clSetKernelArg(launch->variant->histogram_image_single_pass, 0, sizeof(cl_mem), image);
+}
+
+// time the histogram of variant over image, w x h pixels, with each work-group shape and number of pixels per
+// work-item of a grid, and save the fastest launch for this device, driver, image size, histogram and reduction
+//
+static int
+tune_histogram(cl_context context, cl_command_queue queue, histogram_variant *variant, cl_mem *image, int w, int h, int single_pass)
+{
+    static const int    shapes_x[] = { 4, 8, 16, 32, 64, 128, 256 };
+    static const int    shapes_y[] = { 1, 2, 4, 8, 16, 32 };
+    static const int    pixels[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    histogram_tuning    candidate, *tuning;
+    histogram_launch    launch;
+    size_t              workgroup_size, min_size;
+    cl_mem              histogram_buffer;
+    cl_mem              partial_histogram_buffer;
+    cl_event            events[2];
+    cl_ulong            time_start, time_end, max_alloc_size, partial_bytes;
+    double              ms, best_ms = 0.0;
+    int                 best_x = 0, best_y = 0, best_pixels = 0, num_timed = 0, num_skipped = 0;
+    int                 size = histogram_size(&variant->config);
+    int                 x, y, p, i, err;
+
+    clGetKernelWorkGroupInfo(variant->histogram_image, variant->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    min_size = (workgroup_size < 64) ? workgroup_size : 64;
+    err = clGetDeviceInfo(variant->device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc_size), &max_alloc_size, NULL);
+    if (err)
+    {
+        printf("clGetDeviceInfo() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size*sizeof(unsigned int), NULL, &err);
+    if (!histogram_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    memset(&candidate, 0, sizeof(candidate));
+    for (x=0; x<(int)(sizeof(shapes_x)/sizeof(shapes_x[0])); x++)
+    for (y=0; y<(int)(sizeof(shapes_y)/sizeof(shapes_y[0])); y++)
+    for (p=0; p<(int)(sizeof(pixels)/sizeof(pixels[0])); p++)
+    {
+        if ((size_t)shapes_x[x] * shapes_y[y] > workgroup_size || (size_t)shapes_x[x] * shapes_y[y] < min_size)
+            continue;
+        candidate.local_x = shapes_x[x];
+        candidate.local_y = shapes_y[y];
+        candidate.pixels_per_work_item = pixels[p];
+        init_histogram_launch_tuned(&launch, variant, w, h, single_pass, &candidate);
+
+        // the single-pass reduction has no partial histograms.  a two-pass candidate with more work-groups
+        // than the device can hold partial histograms for is skipped, not the whole tuning
+        partial_histogram_buffer = NULL;
+        if (!single_pass)
+        {
+            partial_bytes = (cl_ulong)launch.num_groups * size * sizeof(unsigned int);
+            if (partial_bytes > max_alloc_size)
+            {
+                num_skipped++;
+                continue;
+            }
+            partial_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)partial_bytes, NULL, &err);
+            if (!partial_histogram_buffer || err)
+            {
+                num_skipped++;
+                continue;
+            }
+        }
+        set_histogram_launch_buffers(&launch, &partial_histogram_buffer, &histogram_buffer);
+        set_histogram_launch_image(&launch, image);
+
+        // a warmup launch, finished before the start marker so that it is not timed, then TUNE_ITERATIONS
+        // timed ones
+        if (enqueue_histogram(queue, &launch, 0, NULL, NULL, NULL) || clFinish(queue) || clEnqueueMarker(queue, &events[0]))
+            return EXIT_FAILURE;
+        for (i=0; i<TUNE_ITERATIONS; i++)
+        {
+            if (enqueue_histogram(queue, &launch, 0, NULL, NULL, NULL))
+                return EXIT_FAILURE;
+        }
+        err = clEnqueueMarker(queue, &events[1]);
+        err |= clWaitForEvents(1, &events[1]);
+        err |= clGetEventProfilingInfo(events[0], CL_PROFILING_COMMAND_QUEUED, sizeof(cl_long), &time_start, NULL);
+        err |= clGetEventProfilingInfo(events[1], CL_PROFILING_COMMAND_END, sizeof(cl_long), &time_end, NULL);
+        if (err)
+        {
+            printf("timing a tuning candidate failed. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+        clReleaseEvent(events[0]);
+        clReleaseEvent(events[1]);
+        if (partial_histogram_buffer)
+            clReleaseMemObject(partial_histogram_buffer);
+
+        ms = (double)(time_end - time_start) * 1e-9 * 1000.0 / (double)TUNE_ITERATIONS;
+        if (!num_timed++ || ms < best_ms)
+        {
+            best_ms = ms;
+            best_x = shapes_x[x];
+            best_y = shapes_y[y];
+            best_pixels = pixels[p];
+        }
+    }
+    clReleaseMemObject(histogram_buffer);
+
+    if (num_skipped)
+        printf("Skipped %d tuning candidates whose partial histograms could not be allocated\n", num_skipped);
+    if (!num_timed)
+    {
+        printf("No work-group shape to tune for a work-group size of %d\n", (int)workgroup_size);
+        return EXIT_SUCCESS;
+    }
+    printf("Tuned launch: %d x %d work-items per work-group, %d pixels per work-item, %g ms (best of %d)\n",
+                best_x, best_y, best_pixels, best_ms, num_timed);
+
+    tuning = find_histogram_tuning(variant->device, &variant->config, w, h, single_pass, 1);
+    if (tuning)
+    {
+        tuning->local_x = best_x;
+        tuning->local_y = best_y;
+        tuning->pixels_per_work_item = best_pixels;
+        tuning->ms = best_ms;
+        save_histogram_tunings();
+    }
+    return EXIT_SUCCESS;
+}
+
+
+// verify and time the histogram of a random image in the given input format, with each of the reductions
+// reduce_mode asks for
+//
+static int
+test_histogram_format(cl_context context, cl_command_queue queue, cl_device_id device, const input_format *format)
+{
+    static const char   *reduce_names[2] = { "two-pass", "single-pass" };
+    histogram_config    config;
+    histogram_variant   *variant;
+    histogram_launch    launch;
+    cl_image_format     image_format;
+    unsigned int        *ref_histogram_results, *histogram_results;
+    void                *image_data;
+    cl_mem              input_image;
+    cl_mem              histogram_buffer;
+    cl_mem              partial_histogram_buffer;
+    cl_event            events[2];
+    cl_ulong            time_start, time_end;
+    double              ms[2] = { 0.0, 0.0 };
+    char                str[128];
+    int                 size, single_pass, i, err;
+
+    histogram_config_for_input(&config, format);
+    variant = get_histogram_variant(context, device, &config);
+    if (!variant)
+        return EXIT_FAILURE;
+    size = histogram_size(&config);
+
+    histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size*sizeof(unsigned int), NULL, &err);
+    if (!histogram_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    image_format.image_channel_order = CL_RGBA;
+    image_format.image_channel_data_type = format->channel_type;
+    image_data = create_image_data(format, image_width, image_height);
+    input_image = clCreateImage2D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                            &image_format, image_width, image_height, 0, image_data, &err);
+    if (!input_image || err)
+    {
+        printf("clCreateImage2D() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    ref_histogram_results = generate_reference_histogram(&config, image_data, image_width, image_height);
+    histogram_results = (unsigned int *)malloc(size*sizeof(unsigned int));
+
+    printf("Image dimensions: %d x %d pixels, Image type = CL_RGBA, %s\n", image_width, image_height, format->name);
+    for (single_pass=0; single_pass<2; single_pass++)
+    {
+        if (!(reduce_mode & (single_pass ? REDUCE_SINGLE_PASS : REDUCE_TWO_PASS)))
+            continue;
+        if (single_pass && !has_global_atomics)
+        {
+            printf("Skipping single-pass histogram: requires global atomics support\n");
+            continue;
+        }
+
+        // each reduction has a tuning of its own
+        if (tune_mode &&
+            tune_histogram(context, queue, variant, &input_image, image_width, image_height, single_pass) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        init_histogram_launch(&launch, variant, image_width, image_height, single_pass);
+
+        partial_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, launch.num_groups*size*sizeof(unsigned int), NULL, &err);
+        if (!partial_histogram_buffer || err)
+        {
+            printf("clCreateBuffer() failed. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+        set_histogram_launch_buffers(&launch, &partial_histogram_buffer, &histogram_buffer);
+        set_histogram_launch_image(&launch, &input_image);
+
+        // verify that the kernels work correctly.  also acts as a warmup
+        if (enqueue_histogram(queue, &launch, 0, NULL, NULL, NULL))
+            return EXIT_FAILURE;
+        err = clEnqueueReadBuffer(queue, histogram_buffer, CL_TRUE, 0, size*sizeof(unsigned int), histogram_results, 0, NULL, NULL);
+        if (err)
+        {
+            printf("clEnqueueReadBuffer() failed. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+        sprintf(str, "Image Histogram for image type = CL_RGBA, %s, %s", format->name, reduce_names[single_pass]);
+        verify_histogram_results(str, histogram_results, ref_histogram_results, size, verify_bins_per_channel(variant));
+
+        // now measure performance
+        err = clEnqueueMarker(queue, &events[0]);
+        if (err)
+        {
+            printf("clEnqeueMarker() failed for histogram_image kernel. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+        for (i=0; i<num_iterations; i++)
+        {
+            if (enqueue_histogram(queue, &launch, 0, NULL, NULL, NULL))
+                return EXIT_FAILURE;
+        }
+        err = clEnqueueMarker(queue, &events[1]);
+        if (err)
+        {
+            printf("clEnqeueMarker() failed for histogram_image kernel. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+        err = clWaitForEvents(1, &events[1]);
+        if (err)
+        {
+            printf("clWaitForEvents() failed for histogram_image kernel. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+
+        err = clGetEventProfilingInfo(events[0], CL_PROFILING_COMMAND_QUEUED, sizeof(cl_long), &time_start, NULL);
+        err |= clGetEventProfilingInfo(events[1], CL_PROFILING_COMMAND_END, sizeof(cl_long), &time_end, NULL);
+        if (err)
+        {
+            printf("clGetEventProfilingInfo() failed for histogram_image kernel. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+
+        ms[single_pass] = (double)(time_end - time_start) * 1e-9 * 1000.0 / (double)num_iterations;
+        printf("Time to compute histogram = %g ms (%s)\n", ms[single_pass], reduce_names[single_pass]);
+
+        clReleaseEvent(events[0]);
+        clReleaseEvent(events[1]);
+        clReleaseMemObject(partial_histogram_buffer);
+    }
+    if (ms[0] > 0.0 && ms[1] > 0.0)
+        printf("Single-pass vs. two-pass: %.2fx\n", ms[0] / ms[1]);
+
+    free(ref_histogram_results);
+    free(histogram_results);
+    free(image_data);
+
+    clReleaseMemObject(histogram_buffer);
+    clReleaseMemObject(input_image);
+
+    return EXIT_SUCCESS;
+}
+
+// fill regions with the rectangles of the --tiles grid over a w x h image, tile-major (the tiles of the first
+// row of tiles left to right, then the second row ...), followed by the --roi rectangles clipped to the image.
+// returns the number of rectangles.
+//
+static int
+get_histogram_regions(int w, int h, int *regions)
+{
+    int     n = 0;
+    int     tx, ty, i;
+
+    for (ty=0; ty<tiles_y; ty++)
+    for (tx=0; tx<tiles_x; tx++, n++)
+    {
+        regions[n*4 + 0] = (int)((long long)w * tx / tiles_x);
+        regions[n*4 + 1] = (int)((long long)h * ty / tiles_y);
+        regions[n*4 + 2] = (int)((long long)w * (tx + 1) / tiles_x) - regions[n*4 + 0];
+        regions[n*4 + 3] = (int)((long long)h * (ty + 1) / tiles_y) - regions[n*4 + 1];
+    }
+
+    for (i=0; i<num_rois; i++, n++)
+    {
+        int     x0 = roi_list[i*4 + 0], y0 = roi_list[i*4 + 1];
+        int     x1 = x0 + roi_list[i*4 + 2], y1 = y0 + roi_list[i*4 + 3];
+
+        x0 = (x0 < 0) ? 0 : (x0 > w) ? w : x0;
+        y0 = (y0 < 0) ? 0 : (y0 > h) ? h : y0;
+        x1 = (x1 < x0) ? x0 : (x1 > w) ? w : x1;
+        y1 = (y1 < y0) ? y0 : (y1 > h) ? h : y1;
+        regions[n*4 + 0] = x0;
+        regions[n*4 + 1] = y0;
+        regions[n*4 + 2] = x1 - x0;
+        regions[n*4 + 3] = y1 - y0;
+    }
+
+    return n;
+}
+
+// verify and time the histograms of the --tiles and --roi rectangles of a random image in the given input
+// format, computed by histogram_image_regions in one launch
+//
+static int
+test_region_histograms_format(cl_context context, cl_command_queue queue, cl_device_id device, const input_format *format)
+{
+    histogram_config    config;
+    histogram_variant   *variant;
+    cl_image_format     image_format;
+    unsigned int        *ref_histogram_results, *histogram_results;
+    void                *image_data;
+    int                 *regions;
+    cl_mem              input_image;
+    cl_mem              regions_buffer;
+    cl_mem              histograms_buffer;
+    cl_event            events[2];
+    cl_ulong            time_start, time_end;
+    size_t              workgroup_size;
+    size_t              global_work_size[2];
+    size_t              local_work_size[2];
+    char                str[128];
+    int                 size, n, i, err;
+
+    histogram_config_for_input(&config, format);
+    variant = get_histogram_variant(context, device, &config);
+    if (!variant)
+        return EXIT_FAILURE;
+    size = histogram_size(&config);
+
+    regions = (int *)malloc(MAX_REGIONS * 4 * sizeof(int));
+    n = get_histogram_regions(image_width, image_height, regions);
+
+    image_format.image_channel_order = CL_RGBA;
+    image_format.image_channel_data_type = format->channel_type;
+    image_data = create_image_data(format, image_width, image_height);
+    input_image = clCreateImage2D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                            &image_format, image_width, image_height, 0, image_data, &err);
+    if (!input_image || err)
+    {
+        printf("clCreateImage2D() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    regions_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, n*4*sizeof(int), regions, &err);
+    if (!regions_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    histograms_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, (size_t)n*size*sizeof(unsigned int), NULL, &err);
+    if (!histograms_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    clSetKernelArg(variant->histogram_image_regions, 0, sizeof(cl_mem), &input_image);
+    clSetKernelArg(variant->histogram_image_regions, 1, sizeof(cl_mem), &regions_buffer);
+    clSetKernelArg(variant->histogram_image_regions, 2, sizeof(cl_mem), &histograms_buffer);
+
+    // a work-group of up to 16 x 16 per rectangle
+    clGetKernelWorkGroupInfo(variant->histogram_image_regions, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    if (workgroup_size > 256)
+        workgroup_size = 256;
+    local_work_size[0] = (workgroup_size < 16) ? workgroup_size : 16;
+    local_work_size[1] = workgroup_size / local_work_size[0];
+    global_work_size[0] = n * local_work_size[0];
+    global_work_size[1] = local_work_size[1];
+
+    // verify that the kernel works correctly.  also acts as a warmup
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_image_regions, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueNDRangeKernel() failed for histogram_image_regions kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    histogram_results = (unsigned int *)malloc((size_t)n*size*sizeof(unsigned int));
+    err = clEnqueueReadBuffer(queue, histograms_buffer, CL_TRUE, 0, (size_t)n*size*sizeof(unsigned int), histogram_results, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueReadBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    ref_histogram_results = (unsigned int *)calloc((size_t)n*size, sizeof(unsigned int));
+    for (i=0; i<n; i++)
+        add_reference_region(&config, image_data, image_width, regions[i*4 + 0], regions[i*4 + 1], regions[i*4 + 2], regions[i*4 + 3],
+                                ref_histogram_results + (size_t)i*size);
+    sprintf(str, "Region Histograms (%d tiles, %d ROIs) for image type = CL_RGBA, %s", tiles_x * tiles_y, num_rois, format->name);
+    verify_histogram_results(str, histogram_results, ref_histogram_results, n*size, verify_bins_per_channel(variant));
+
+    // now measure performance
+    err = clEnqueueMarker(queue, &events[0]);
+    if (err)
+    {
+        printf("clEnqeueMarker() failed for histogram_image_regions kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    for (i=0; i<num_iterations; i++)
+    {
+        err = clEnqueueNDRangeKernel(queue, variant->histogram_image_regions, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
+        if (err)
+        {
+            printf("clEnqueueNDRangeKernel() failed for histogram_image_regions kernel. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+    }
+    err = clEnqueueMarker(queue, &events[1]);
+    if (err)
+    {
+        printf("clEnqeueMarker() failed for histogram_image_regions kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    err = clWaitForEvents(1, &events[1]);
+    if (err)
+    {
+        printf("clWaitForEvents() failed for histogram_image_regions kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    err = clGetEventProfilingInfo(events[0], CL_PROFILING_COMMAND_QUEUED, sizeof(cl_long), &time_start, NULL);
+    err |= clGetEventProfilingInfo(events[1], CL_PROFILING_COMMAND_END, sizeof(cl_long), &time_end, NULL);
+    if (err)
+    {
+        printf("clGetEventProfilingInfo() failed for histogram_image_regions kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    printf("Time to compute %d region histograms = %g ms\n", n, (double)(time_end - time_start) * 1e-9 * 1000.0 / (double)num_iterations);
+
+    clReleaseEvent(events[0]);
+    clReleaseEvent(events[1]);
+
+    free(ref_histogram_results);
+    free(histogram_results);
+    free(image_data);
+    free(regions);
+
+    clReleaseMemObject(histograms_buffer);
+    clReleaseMemObject(regions_buffer);
+    clReleaseMemObject(input_image);
+
+    return EXIT_SUCCESS;
+}
+
+// verify and time the Y, U and V histograms of a random planar YUV 4:2:0 frame in the --yuv layout, read straight
+// from a buffer by histogram_yuv and summed by histogram_sum_partial_results
+//
+static int
+test_histogram_yuv(cl_context context, cl_command_queue queue, cl_device_id device)
+{
+    histogram_config    config;
+    histogram_variant   *variant;
+    unsigned int        *ref_histogram_results, *histogram_results;
+    unsigned char       *frame;
+    size_t              frame_size;
+    size_t              workgroup_size;
+    size_t              global_work_size[2];
+    size_t              local_work_size[2];
+    size_t              partial_global_work_size[1];
+    size_t              partial_local_work_size[1];
+    size_t              num_groups;
+    cl_mem              frame_buffer;
+    cl_mem              histogram_buffer;
+    cl_mem              partial_histogram_buffer;
+    cl_event            events[2];
+    cl_ulong            time_start, time_end;
+    char                str[128];
+    int                 chroma_width = (image_width + 1) / 2;
+    int                 chroma_height = (image_height + 1) / 2;
+    int                 nv12 = (yuv_layout == YUV_NV12);
+    int                 pixels_per_work_item;
+    int                 num_partial_histograms;
+    int                 size, i, err;
+
+    config.num_bins = num_bins;
+    config.channels = CHANNELS_YUV;
+    config.input_max = 255;
+    config.overflow_bin = 0;
+    variant = get_histogram_variant(context, device, &config);
+    if (!variant)
+        return EXIT_FAILURE;
+    size = histogram_size(&config);
+
+    srand(0);
+    frame_size = (size_t)image_width * image_height + 2 * (size_t)chroma_width * chroma_height;
+    frame = (unsigned char *)malloc(frame_size);
+    for (i=0; i<(int)frame_size; i++)
+        frame[i] = (unsigned char)(rand() & (skewed_data ? 0x07 : 0xFF));
+
+    frame_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, frame_size, frame, &err);
+    if (!frame_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size*sizeof(unsigned int), NULL, &err);
+    if (!histogram_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    // the work-items cover the chroma samples
+    clGetKernelWorkGroupInfo(variant->histogram_yuv, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    get_histogram_work_sizes(workgroup_size, NULL, chroma_width, chroma_height, global_work_size, local_work_size, &pixels_per_work_item, &num_groups);
+    get_sum_work_sizes(variant, partial_global_work_size, partial_local_work_size);
+
+    partial_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, num_groups*size*sizeof(unsigned int), NULL, &err);
+    if (!partial_histogram_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    clSetKernelArg(variant->histogram_yuv, 0, sizeof(cl_mem), &frame_buffer);
+    clSetKernelArg(variant->histogram_yuv, 1, sizeof(int), &image_width);
+    clSetKernelArg(variant->histogram_yuv, 2, sizeof(int), &image_height);
+    clSetKernelArg(variant->histogram_yuv, 3, sizeof(int), &nv12);
+    clSetKernelArg(variant->histogram_yuv, 4, sizeof(int), &pixels_per_work_item);
+    clSetKernelArg(variant->histogram_yuv, 5, sizeof(cl_mem), &partial_histogram_buffer);
+
+    // the kernel's num_groups is an int
+    num_partial_histograms = (int)num_groups;
+    clSetKernelArg(variant->histogram_sum_partial_results, 0, sizeof(cl_mem), &partial_histogram_buffer);
+    clSetKernelArg(variant->histogram_sum_partial_results, 1, sizeof(int), &num_partial_histograms);
+    clSetKernelArg(variant->histogram_sum_partial_results, 2, sizeof(cl_mem), &histogram_buffer);
+
+    // verify that the kernels work correctly.  also acts as a warmup
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_yuv, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueNDRangeKernel() failed for histogram_yuv kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_sum_partial_results, 1, NULL, partial_global_work_size, partial_local_work_size, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueNDRangeKernel() failed for histogram_sum_partial_results kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    ref_histogram_results = generate_reference_yuv_histogram(&config, frame, image_width, image_height, yuv_layout);
+    histogram_results = (unsigned int *)malloc(size*sizeof(unsigned int));
+    err = clEnqueueReadBuffer(queue, histogram_buffer, CL_TRUE, 0, size*sizeof(unsigned int), histogram_results, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueReadBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    sprintf(str, "YUV Histogram for %s frame", yuv_names[yuv_layout]);
+    verify_histogram_results(str, histogram_results, ref_histogram_results, size, 0);
+
+    // now measure performance
+    err = clEnqueueMarker(queue, &events[0]);
+    if (err)
+    {
+        printf("clEnqeueMarker() failed for histogram_yuv kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    for (i=0; i<num_iterations; i++)
+    {
+        err = clEnqueueNDRangeKernel(queue, variant->histogram_yuv, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
+        if (err)
+        {
+            printf("clEnqueueNDRangeKernel() failed for histogram_yuv kernel. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+        err = clEnqueueNDRangeKernel(queue, variant->histogram_sum_partial_results, 1, NULL, partial_global_work_size, partial_local_work_size, 0, NULL, NULL);
+        if (err)
+        {
+            printf("clEnqueueNDRangeKernel() failed for histogram_sum_partial_results kernel. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+    }
+    err = clEnqueueMarker(queue, &events[1]);
+    if (err)
+    {
+        printf("clEnqeueMarker() failed for histogram_yuv kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    err = clWaitForEvents(1, &events[1]);
+    if (err)
+    {
+        printf("clWaitForEvents() failed for histogram_yuv kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    err = clGetEventProfilingInfo(events[0], CL_PROFILING_COMMAND_QUEUED, sizeof(cl_long), &time_start, NULL);
+    err |= clGetEventProfilingInfo(events[1], CL_PROFILING_COMMAND_END, sizeof(cl_long), &time_end, NULL);
+    if (err)
+    {
+        printf("clGetEventProfilingInfo() failed for histogram_yuv kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    printf("Frame dimensions: %d x %d pixels, %s, %g bytes per pixel\n", image_width, image_height, yuv_names[yuv_layout],
+                (double)frame_size / ((double)image_width * image_height));
+    printf("Time to compute histogram = %g ms\n", (double)(time_end - time_start) * 1e-9 * 1000.0 / (double)num_iterations);
+
+    clReleaseEvent(events[0]);
+    clReleaseEvent(events[1]);
+
+    free(ref_histogram_results);
+    free(histogram_results);
+    free(frame);
+
+    clReleaseMemObject(partial_histogram_buffer);
+    clReleaseMemObject(histogram_buffer);
+    clReleaseMemObject(frame_buffer);
+
+    return EXIT_SUCCESS;
+}
+
+// the host side of histogram_cdf, histogram_percentiles and histogram_build_lut in histogram_image.cl: the
+// tone curve of each channel of config for the histogram ref_histogram_results, in a malloc'd array.  the bins
+// of the percentiles are returned in bins[c * 2 + k].
+//
+static float *
+generate_reference_lut(const histogram_config *config, const unsigned int *ref_histogram_results, int *bins)
+{
+    int             num_channels = histogram_num_channels(config);
+    int             bins_per_channel = config->num_bins + config->overflow_bin;
+    unsigned int    *cdf = (unsigned int *)malloc(histogram_size(config) * sizeof(unsigned int));
+    float           *lut = (float *)malloc(histogram_size(config) * sizeof(float));
+    int             c, b, k;
+
+    for (c=0; c<num_channels; c++)
+    {
+        unsigned int    *channel_cdf = cdf + c * bins_per_channel;
+        unsigned int    sum = 0, total, first, count;
+
+        for (b=0; b<bins_per_channel; b++)
+            channel_cdf[b] = sum += ref_histogram_results[c * bins_per_channel + b];
+        total = channel_cdf[bins_per_channel - 1];
+
+        for (k=0; k<2; k++)
+        {
+            float   f = ceilf(percentiles[k] * 0.01f * (float)total);
+
+            count = (f > 0.0f) ? (unsigned int)f : 0;
+            for (b=0; b<bins_per_channel-1 && channel_cdf[b] < (count ? count : 1); b++)
+                ;
+            bins[c * 2 + k] = b;
+        }
+
+        for (b=0; b<bins_per_channel-1 && channel_cdf[b] < 1; b++)
+            ;
+        first = channel_cdf[b];
+
+        for (b=0; b<bins_per_channel; b++)
+        {
+            float   *v = &lut[c * bins_per_channel + b];
+
+            if (post_mode == POST_AUTO_LEVELS)
+            {
+                float   lo = (float)bins[c * 2];
+                float   hi = (float)bins[c * 2 + 1] + 1.0f;
+
+                *v = ((float)b + 0.5f - lo) / (hi - lo);
+                *v = (*v < 0.0f) ? 0.0f : (*v > 1.0f) ? 1.0f : *v;
+            }
+            else if (total > first)
+                *v = (channel_cdf[b] > first) ? (float)(channel_cdf[b] - first) / (float)(total - first) : 0.0f;
+            else
+                *v = (float)b / (float)((bins_per_channel > 1) ? bins_per_channel - 1 : 1);
+        }
+    }
+
+    free(cdf);
+    return lut;
+}
+
+// compare out_data, the image histogram_apply_lut wrote, with image_data written through lut on the host.
+// a channel may differ by one level, or for floating-point by a relative 1e-5, for the rounding of the divisions.
+//
+static int
+verify_lut_image(const char *str, const histogram_config *config, const void *image_data, const float *lut, const void *out_data, int w, int h)
+{
+    int             bins_per_channel = config->num_bins + config->overflow_bin;
+    unsigned int    bins[4];
+    float           clr[4], expected[4], got[4];
+    int             i, c;
+
+    for (i=0; i<w*h; i++)
+    {
+        for (c=0; c<4; c++)
+        {
+            if (config->input_max == 255)
+            {
+                clr[c] = (float)((const unsigned char *)image_data)[i*4 + c] / 255.0f;
+                got[c] = (float)((const unsigned char *)out_data)[i*4 + c];
+            }
+            else if (config->input_max)
+            {
+                clr[c] = (float)((const unsigned short *)image_data)[i*4 + c] / 65535.0f;
+                got[c] = (float)((const unsigned short *)out_data)[i*4 + c];
+            }
+            else
+            {
+                clr[c] = ((const float *)image_data)[i*4 + c];
+                got[c] = ((const float *)out_data)[i*4 + c];
+            }
+        }
+        if (config->input_max == 255)
+        {
+            const unsigned char *img = (const unsigned char *)image_data + i*4;
+            histogram_pixel_bins_level(config, img[0], img[1], img[2], img[3], bins);
+        }
+        else if (config->input_max)
+        {
+            const unsigned short *img = (const unsigned short *)image_data + i*4;
+            histogram_pixel_bins_level(config, img[0], img[1], img[2], img[3], bins);
+        }
+        else
+            histogram_pixel_bins_float(config, clr[0], clr[1], clr[2], clr[3], bins);
+
+        if (config->channels == CHANNELS_LUMA || config->channels == CHANNELS_HSV)
+        {
+            float   intensity, target;
+
+            if (config->channels == CHANNELS_LUMA)
+            {
+                intensity = 0.299f * clr[0] + 0.587f * clr[1] + 0.114f * clr[2];
+                target = lut[bins[0]];
+            }
+            else
+            {
+                intensity = (clr[0] > clr[1]) ? ((clr[0] > clr[2]) ? clr[0] : clr[2]) : ((clr[1] > clr[2]) ? clr[1] : clr[2]);
+                target = lut[2 * bins_per_channel + bins[2]];
+            }
+            for (c=0; c<3; c++)
+                expected[c] = (intensity > 0.0f) ? clr[c] * (target / intensity) : target;
+            expected[3] = clr[3];
+        }
+        else
+        {
+            for (c=0; c<histogram_num_channels(config); c++)
+                expected[c] = lut[c * bins_per_channel + bins[c]];
+            if (config->channels == CHANNELS_RGB)
+                expected[3] = clr[3];
+        }
+
+        for (c=0; c<4; c++)
+        {
+            if (config->input_max)
+            {
+                float   v = (expected[c] < 0.0f) ? 0.0f : (expected[c] > 1.0f) ? 1.0f : expected[c];
+
+                if (fabsf(got[c] - floorf(v * (float)config->input_max + 0.5f)) <= 1.0f)
+                    continue;
+            }
+            else if (fabsf(got[c] - expected[c]) <= 1e-5f * (fabsf(expected[c]) > 1.0f ? fabsf(expected[c]) : 1.0f))
+                continue;
+
+            printf("%s: verify_lut_image failed for pixel = %d, channel = %d, gpu result = %g, expected result = %g\n",
+                                                            str, i, c, got[c], expected[c]);
+            return -1;
+        }
+    }
+
+    printf("%s: VERIFIED\n", str);
+    return 0;
+}
+
+// enqueue the stages after the histogram of launch, each waiting on the event of the one before: the cdf, the
+// bins of the percentiles, the tone curve, and image written through it to out_image.  the histogram waits on
+// wait_event if not NULL; the event of the last stage is returned in done_event.
+//
+static int
+enqueue_exposure_correction(cl_command_queue queue, const histogram_launch *launch, const cl_event *wait_event, cl_event *done_event)
+{
+    histogram_variant   *variant = launch->variant;
+    size_t              workgroup_size;
+    size_t              cdf_global_work_size[1], cdf_local_work_size[1];
+    size_t              percentile_work_size[1];
+    size_t              apply_global_work_size[2], apply_local_work_size[2];
+    cl_event            events[4];
+    int                 i, err;
+
+    clGetKernelWorkGroupInfo(variant->histogram_cdf, variant->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    cdf_local_work_size[0] = (workgroup_size > 256) ? 256 : workgroup_size;
+    cdf_global_work_size[0] = histogram_num_channels(&variant->config) * cdf_local_work_size[0];
+    percentile_work_size[0] = histogram_num_channels(&variant->config) * 2;
+    clGetKernelWorkGroupInfo(variant->histogram_apply_lut, variant->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    apply_local_work_size[0] = (workgroup_size < 16) ? workgroup_size : 16;
+    apply_local_work_size[1] = ((workgroup_size > 256) ? 256 : workgroup_size) / apply_local_work_size[0];
+    apply_global_work_size[0] = ((image_width + apply_local_work_size[0] - 1) / apply_local_work_size[0]) * apply_local_work_size[0];
+    apply_global_work_size[1] = ((image_height + apply_local_work_size[1] - 1) / apply_local_work_size[1]) * apply_local_work_size[1];
+
+    if (enqueue_histogram(queue, launch, wait_event ? 1 : 0, wait_event, NULL, &events[0]))
+        return -1;
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_cdf, 1, NULL, cdf_global_work_size, cdf_local_work_size, 1, &events[0], &events[1]);
+    if (err)
+    {
+        printf("clEnqueueNDRangeKernel() failed for histogram_cdf kernel. (%d)\n", err);
+        return -1;
+    }
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_percentiles, 1, NULL, percentile_work_size, NULL, 1, &events[1], &events[2]);
+    if (err)
+    {
+        printf("clEnqueueNDRangeKernel() failed for histogram_percentiles kernel. (%d)\n", err);
+        return -1;
+    }
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_build_lut, 1, NULL, launch->partial_global_work_size, launch->partial_local_work_size, 1, &events[2], &events[3]);
+    if (err)
+    {
+        printf("clEnqueueNDRangeKernel() failed for histogram_build_lut kernel. (%d)\n", err);
+        return -1;
+    }
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_apply_lut, 2, NULL, apply_global_work_size, apply_local_work_size, 1, &events[3], done_event);
+    if (err)
+    {
+        printf("clEnqueueNDRangeKernel() failed for histogram_apply_lut kernel. (%d)\n", err);
+        return -1;
+    }
+
+    for (i=0; i<4; i++)
+        clReleaseEvent(events[i]);
+    return 0;
+}
+
+// verify and time exposure correction of a random image in the given input format: its histogram followed by
+// the --equalize or --auto-levels stages, all on the device with nothing read back in between
+//
+static int
+test_exposure_correction_format(cl_context context, cl_command_queue queue, cl_device_id device, const input_format *format)
+{
+    static const char   *post_names[3] = { "", "equalize", "auto-levels" };
+    histogram_config    config;
+    histogram_variant   *variant;
+    histogram_launch    launch;
+    cl_image_format     image_format;
+    unsigned int        *ref_histogram_results;
+    float               *ref_lut;
+    int                 ref_bins[8], result_bins[8];
+    float               channel_percentiles[8];
+    void                *image_data, *out_data;
+    cl_mem              input_image, output_image;
+    cl_mem              histogram_buffer;
+    cl_mem              partial_histogram_buffer;
+    cl_mem              cdf_buffer, percentiles_buffer, bins_buffer, lut_buffer;
+    cl_event            events[2], done;
+    cl_ulong            time_start, time_end;
+    size_t              origin[3] = { 0, 0, 0 };
+    size_t              region[3];
+    char                str[128];
+    int                 num_percentiles = 2;
+    int                 size, num_channels, i, err;
+
+    histogram_config_for_input(&config, format);
+    variant = get_histogram_variant(context, device, &config);
+    if (!variant)
+        return EXIT_FAILURE;
+    size = histogram_size(&config);
+    num_channels = histogram_num_channels(&config);
+
+    image_format.image_channel_order = CL_RGBA;
+    image_format.image_channel_data_type = format->channel_type;
+    image_data = create_image_data(format, image_width, image_height);
+    input_image = clCreateImage2D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                            &image_format, image_width, image_height, 0, image_data, &err);
+    if (!input_image || err)
+    {
+        printf("clCreateImage2D() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    output_image = clCreateImage2D(context, CL_MEM_WRITE_ONLY, &image_format, image_width, image_height, 0, NULL, &err);
+    if (!output_image || err)
+    {
+        printf("clCreateImage2D() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    init_histogram_launch(&launch, variant, image_width, image_height, reduce_mode == REDUCE_SINGLE_PASS && has_global_atomics);
+
+    histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size*sizeof(unsigned int), NULL, &err);
+    partial_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, launch.num_groups*size*sizeof(unsigned int), NULL, &err);
+    cdf_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size*sizeof(unsigned int), NULL, &err);
+    // the percentiles of every channel
+    for (i=0; i<num_channels*2; i++)
+        channel_percentiles[i] = percentiles[i & 1];
+    percentiles_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, num_channels*2*sizeof(float), channel_percentiles, &err);
+    bins_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, num_channels*2*sizeof(int), NULL, &err);
+    lut_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size*sizeof(float), NULL, &err);
+    if (!histogram_buffer || !partial_histogram_buffer || !cdf_buffer || !percentiles_buffer || !bins_buffer || !lut_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    set_histogram_launch_buffers(&launch, &partial_histogram_buffer, &histogram_buffer);
+    set_histogram_launch_image(&launch, &input_image);
+
+    clSetKernelArg(variant->histogram_cdf, 0, sizeof(cl_mem), &histogram_buffer);
+    clSetKernelArg(variant->histogram_cdf, 1, sizeof(cl_mem), &cdf_buffer);
+    clSetKernelArg(variant->histogram_percentiles, 0, sizeof(cl_mem), &cdf_buffer);
+    clSetKernelArg(variant->histogram_percentiles, 1, sizeof(cl_mem), &percentiles_buffer);
+    clSetKernelArg(variant->histogram_percentiles, 2, sizeof(int), &num_percentiles);
+    clSetKernelArg(variant->histogram_percentiles, 3, sizeof(cl_mem), &bins_buffer);
+    i = (post_mode == POST_AUTO_LEVELS);
+    clSetKernelArg(variant->histogram_build_lut, 0, sizeof(cl_mem), &cdf_buffer);
+    clSetKernelArg(variant->histogram_build_lut, 1, sizeof(cl_mem), &bins_buffer);
+    clSetKernelArg(variant->histogram_build_lut, 2, sizeof(int), &i);
+    clSetKernelArg(variant->histogram_build_lut, 3, sizeof(cl_mem), &lut_buffer);
+    clSetKernelArg(variant->histogram_apply_lut, 0, sizeof(cl_mem), &input_image);
+    clSetKernelArg(variant->histogram_apply_lut, 1, sizeof(cl_mem), &lut_buffer);
+    clSetKernelArg(variant->histogram_apply_lut, 2, sizeof(cl_mem), &output_image);
+
+    // verify that the stages work correctly.  also acts as a warmup
+    if (enqueue_exposure_correction(queue, &launch, NULL, &done))
+        return EXIT_FAILURE;
+    out_data = malloc((size_t)image_width * image_height * 4 * format->channel_size);
+    region[0] = image_width;
+    region[1] = image_height;
+    region[2] = 1;
+    err = clEnqueueReadImage(queue, output_image, CL_TRUE, origin, region, 0, 0, out_data, 1, &done, NULL);
+    err |= clEnqueueReadBuffer(queue, bins_buffer, CL_TRUE, 0, num_channels*2*sizeof(int), result_bins, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueReadImage() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    clReleaseEvent(done);
+
+    ref_histogram_results = generate_reference_histogram(&config, image_data, image_width, image_height);
+    ref_lut = generate_reference_lut(&config, ref_histogram_results, ref_bins);
+    for (i=0; i<num_channels*2; i++)
+    {
+        if (result_bins[i] != ref_bins[i])
+        {
+            printf("percentile bins failed for channel = %d, gpu result = %d, expected result = %d\n", i / 2, result_bins[i], ref_bins[i]);
+            break;
+        }
+    }
+    printf("Percentiles %g / %g of channel 0 in bins %d / %d\n", percentiles[0], percentiles[1], result_bins[0], result_bins[1]);
+    sprintf(str, "Exposure correction (%s) for image type = CL_RGBA, %s", post_names[post_mode], format->name);
+    verify_lut_image(str, &config, image_data, ref_lut, out_data, image_width, image_height);
+
+    // now measure performance
+    err = clEnqueueMarker(queue, &events[0]);
+    if (err)
+    {
+        printf("clEnqeueMarker() failed for histogram_apply_lut kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    for (i=0; i<num_iterations; i++)
+    {
+        if (enqueue_exposure_correction(queue, &launch, NULL, &done))
+            return EXIT_FAILURE;
+        clReleaseEvent(done);
+    }
+    err = clEnqueueMarker(queue, &events[1]);
+    if (err)
+    {
+        printf("clEnqeueMarker() failed for histogram_apply_lut kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    err = clWaitForEvents(1, &events[1]);
+    if (err)
+    {
+        printf("clWaitForEvents() failed for histogram_apply_lut kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
     err = clGetEventProfilingInfo(events[0], CL_PROFILING_COMMAND_QUEUED, sizeof(cl_long), &time_start, NULL);
     err |= clGetEventProfilingInfo(events[1], CL_PROFILING_COMMAND_END, sizeof(cl_long), &time_end, NULL);
     if (err)
     {
-        printf("clGetEventProfilingInfo() failed for histogram_rgba_unorm8 kernel. (%d)\n", err);
+        printf("clGetEventProfilingInfo() failed for histogram_apply_lut kernel. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    printf("Time to compute histogram, cdf, percentiles, tone curve and corrected image = %g ms\n",
+                (double)(time_end - time_start) * 1e-9 * 1000.0 / (double)num_iterations);
+
+    clReleaseEvent(events[0]);
+    clReleaseEvent(events[1]);
+
+    free(ref_histogram_results);
+    free(ref_lut);
+    free(image_data);
+    free(out_data);
+
+    clReleaseMemObject(lut_buffer);
+    clReleaseMemObject(bins_buffer);
+    clReleaseMemObject(percentiles_buffer);
+    clReleaseMemObject(cdf_buffer);
+    clReleaseMemObject(partial_histogram_buffer);
+    clReleaseMemObject(histogram_buffer);
+    clReleaseMemObject(output_image);
+    clReleaseMemObject(input_image);
+
+    return EXIT_SUCCESS;
+}
+
+// the whole-image histogram of format, then the region histograms and the exposure correction if they were
+// asked for
+//
+static int
+test_histogram_input(cl_context context, cl_command_queue queue, cl_device_id device, const input_format *format)
+{
+    if (test_histogram_format(context, queue, device, format) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    if (tiles_x * tiles_y + num_rois > 0 &&
+        test_region_histograms_format(context, queue, device, format) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    if (post_mode != POST_NONE)
+        return test_exposure_correction_format(context, queue, device, format);
+    return EXIT_SUCCESS;
+}
+
+int
+test_histogram(cl_context context, cl_command_queue queue, cl_device_id device)
+{
+    srand(0);
+
+    if (input_selection >= 0)
+        return test_histogram_input(context, queue, device, &input_formats[input_selection]);
+
+    /************  Testing RGBA 8-bit histogram **********/
+    if (test_histogram_input(context, queue, device, &input_formats[INPUT_UNORM8]) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    /************  Testing RGBA 32-bit fp histogram **********/
+    return test_histogram_input(context, queue, device, &input_formats[INPUT_FLOAT]);
+}
+
+
+static double
+wall_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER   freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+    struct timeval  tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + (double)tv.tv_usec * 1e-6;
+#endif
+}
+
+// verify and time the native CPU histogram of a random image in the given input format
+//
+static int
+test_histogram_cpu_format(const input_format *format)
+{
+    histogram_config    config;
+    unsigned int        *ref_histogram_results, *histogram_results;
+    void                *image_data;
+    char                str[128];
+    double              t0, t1;
+    int                 size, threads, i;
+
+    histogram_config_for_input(&config, format);
+    size = histogram_size(&config);
+
+    image_data = create_image_data(format, image_width, image_height);
+    histogram_results = (unsigned int *)malloc(size*sizeof(unsigned int));
+
+    // verify against the scalar reference.  also acts as a warmup
+    threads = cpu_histogram(&config, image_data, image_width, image_height, cpu_threads, histogram_results);
+    ref_histogram_results = generate_reference_histogram(&config, image_data, image_width, image_height);
+    sprintf(str, "Native CPU Histogram for image type = CL_RGBA, %s", format->name);
+    verify_histogram_results(str, histogram_results, ref_histogram_results, size, 0);
+
+    // now measure performance
+    t0 = wall_time();
+    for (i=0; i<num_iterations; i++)
+        cpu_histogram(&config, image_data, image_width, image_height, cpu_threads, histogram_results);
+    t1 = wall_time();
+
+    printf("Image dimensions: %d x %d pixels, Image type = CL_RGBA, %s\n", image_width, image_height, format->name);
+    printf("Time to compute histogram = %g ms (native CPU, %d threads, %s)\n",
+           (t1 - t0) * 1000.0 / (double)num_iterations, threads, cpu_histogram_isa());
+
+    free(ref_histogram_results);
+    free(histogram_results);
+    free(image_data);
+
+    return EXIT_SUCCESS;
+}
+
+static int
+test_histogram_cpu(void)
+{
+    int     err;
+
+    srand(0);
+
+    if (input_selection >= 0)
+        err = test_histogram_cpu_format(&input_formats[input_selection]);
+    else
+    {
+        err = test_histogram_cpu_format(&input_formats[INPUT_UNORM8]);
+        if (err != EXIT_FAILURE)
+            err = test_histogram_cpu_format(&input_formats[INPUT_FLOAT]);
+    }
+
+    cpu_histogram_release();
+    return err;
+}
+
+// a batch of images packed in one buffer, and the pair of launches that histograms all of them
+typedef struct
+{
+    histogram_variant   *variant;
+    int                 num_images;
+    int                 groups_per_image;
+    size_t              global_work_size[2];
+    size_t              local_work_size[2];
+    size_t              sum_global_work_size[1];
+    size_t              sum_local_work_size[1];
+} histogram_batch_launch;
+
+// set up launch for num_images images of at most max_pixels pixels each: the work sizes, and the number of
+// work-groups per image, which sizes the partial histogram buffer.  each work-item of histogram_batch gets about
+// num_pixels_per_work_item pixels of the largest image.
+//
+static void
+init_histogram_batch_launch(histogram_batch_launch *launch, histogram_variant *variant, int num_images, int max_pixels)
+{
+    size_t  workgroup_size;
+    size_t  pixels_per_group;
+    size_t  size = (size_t)histogram_size(&variant->config);
+
+    launch->variant = variant;
+    launch->num_images = num_images;
+
+    clGetKernelWorkGroupInfo(variant->histogram_batch, variant->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    launch->local_work_size[0] = (workgroup_size > 256) ? 256 : workgroup_size;
+    launch->local_work_size[1] = 1;
+    pixels_per_group = launch->local_work_size[0] * num_pixels_per_work_item;
+    launch->groups_per_image = (int)((max_pixels + pixels_per_group - 1) / pixels_per_group);
+    if (launch->groups_per_image < 1)
+        launch->groups_per_image = 1;
+    launch->global_work_size[0] = launch->groups_per_image * launch->local_work_size[0];
+    launch->global_work_size[1] = num_images;
+
+    clGetKernelWorkGroupInfo(variant->histogram_batch_sum_partial_results, variant->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    launch->sum_local_work_size[0] = (workgroup_size > 256) ? 256 : workgroup_size;
+    launch->sum_global_work_size[0] = ((num_images * size + launch->sum_local_work_size[0] - 1) / launch->sum_local_work_size[0]) * launch->sum_local_work_size[0];
+}
+
+// set the arguments of the batch kernels: the packed pixels, the table of images, and the histograms
+//
+static void
+set_histogram_batch_launch_buffers(const histogram_batch_launch *launch, cl_mem *pixels_buffer, cl_mem *images_buffer, cl_mem *partial_histogram_buffer,
+                                   cl_mem *histograms_buffer)
+{
+    histogram_variant   *variant = launch->variant;
+
+    clSetKernelArg(variant->histogram_batch, 0, sizeof(cl_mem), pixels_buffer);
+    clSetKernelArg(variant->histogram_batch, 1, sizeof(cl_mem), images_buffer);
+    clSetKernelArg(variant->histogram_batch, 2, sizeof(cl_mem), partial_histogram_buffer);
+    clSetKernelArg(variant->histogram_batch_sum_partial_results, 0, sizeof(cl_mem), partial_histogram_buffer);
+    clSetKernelArg(variant->histogram_batch_sum_partial_results, 1, sizeof(int), &launch->groups_per_image);
+    clSetKernelArg(variant->histogram_batch_sum_partial_results, 2, sizeof(int), &launch->num_images);
+    clSetKernelArg(variant->histogram_batch_sum_partial_results, 3, sizeof(cl_mem), histograms_buffer);
+}
+
+// the histograms of a batch: upload the packed pixels, the pair of launches, and read all the histograms back
+//
+static int
+run_histogram_batch(cl_command_queue queue, const histogram_batch_launch *launch, cl_mem pixels_buffer, const void *pixels, size_t pixels_size,
+                    cl_mem histograms_buffer, unsigned int *histograms)
+{
+    histogram_variant   *variant = launch->variant;
+    size_t              size = (size_t)histogram_size(&variant->config);
+    int                 err;
+
+    err = clEnqueueWriteBuffer(queue, pixels_buffer, CL_FALSE, 0, pixels_size, pixels, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueWriteBuffer() failed. (%d)\n", err);
+        return -1;
+    }
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_batch, 2, NULL, launch->global_work_size, launch->local_work_size, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueNDRangeKernel() failed for histogram_batch kernel. (%d)\n", err);
+        return -1;
+    }
+    err = clEnqueueNDRangeKernel(queue, variant->histogram_batch_sum_partial_results, 1, NULL, launch->sum_global_work_size, launch->sum_local_work_size, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueNDRangeKernel() failed for histogram_batch_sum_partial_results kernel. (%d)\n", err);
+        return -1;
+    }
+    err = clEnqueueReadBuffer(queue, histograms_buffer, CL_TRUE, 0, launch->num_images * size * sizeof(unsigned int), histograms, 0, NULL, NULL);
+    if (err)
+    {
+        printf("clEnqueueReadBuffer() failed. (%d)\n", err);
+        return -1;
+    }
+    return 0;
+}
+
+// verify and time the histograms of batch_images random images in the given input format, batched and then
+// one image at a time, each way from the host images to the host histograms
+//
+static int
+test_histogram_batch_format(cl_context context, cl_command_queue queue, cl_device_id device, const input_format *format)
+{
+    histogram_config        config;
+    histogram_variant       *variant;
+    histogram_batch_launch  batch;
+    histogram_launch        launch;
+    cl_image_format         image_format;
+    unsigned int            *ref_histogram_results, *histogram_results;
+    unsigned char           *image_data;
+    int                     *images;
+    cl_mem                  pixels_buffer, images_buffer;
+    cl_mem                  partial_histogram_buffer, histograms_buffer;
+    cl_mem                  image_partial_histogram_buffer, image_histogram_buffer;
+    cl_mem                  input_image;
+    size_t                  image_size = (size_t)image_width * image_height * 4 * format->channel_size;
+    size_t                  pixels_size = image_size * batch_images;
+    double                  t0, batched_ms, single_ms;
+    char                    str[128];
+    int                     size, i, n, err;
+
+    histogram_config_for_input(&config, format);
+    variant = get_histogram_variant(context, device, &config);
+    if (!variant)
+        return EXIT_FAILURE;
+    size = histogram_size(&config);
+
+    // the images one after the other, and their offsets and sizes
+    image_data = (unsigned char *)create_image_data(format, image_width, image_height * batch_images);
+    images = (int *)malloc(batch_images * 4 * sizeof(int));
+    for (i=0; i<batch_images; i++)
+    {
+        images[i*4 + 0] = (int)((long long)i * image_width * image_height);
+        images[i*4 + 1] = image_width;
+        images[i*4 + 2] = image_height;
+        images[i*4 + 3] = 0;                // unused
+    }
+
+    pixels_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, pixels_size, NULL, &err);
+    if (!pixels_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
         return EXIT_FAILURE;
-    }    
-        
-    printf("Image dimensions: %d x %d pixels, Image type = CL_RGBA, CL_UNORM_INT8\n", image_width, image_height);
-    printf("Time to compute histogram = %g ms\n", (double)(time_end - time_start) * 1e-9 * 1000.0 / (double)num_iterations);
-    
-    clReleaseEvent(events[0]);
-    clReleaseEvent(events[1]);
+    }
+    images_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, batch_images * 4 * sizeof(int), images, &err);
+    if (!images_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    histograms_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, (size_t)batch_images * size * sizeof(unsigned int), NULL, &err);
+    if (!histograms_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
 
-    /************  Testing RGBA 32-bit fp histogram **********/
+    init_histogram_batch_launch(&batch, variant, batch_images, image_width * image_height);
+    partial_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t)batch_images * batch.groups_per_image * size * sizeof(unsigned int), NULL, &err);
+    if (!partial_histogram_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    set_histogram_batch_launch_buffers(&batch, &pixels_buffer, &images_buffer, &partial_histogram_buffer, &histograms_buffer);
+
+    // verify the batched histograms.  also acts as a warmup
+    histogram_results = (unsigned int *)malloc((size_t)batch_images * size * sizeof(unsigned int));
+    if (run_histogram_batch(queue, &batch, pixels_buffer, image_data, pixels_size, histograms_buffer, histogram_results))
+        return EXIT_FAILURE;
+    ref_histogram_results = (unsigned int *)calloc((size_t)batch_images * size, sizeof(unsigned int));
+    for (i=0; i<batch_images; i++)
+        add_reference_region(&config, image_data + i * image_size, image_width, 0, 0, image_width, image_height, ref_histogram_results + (size_t)i * size);
+    sprintf(str, "Batched Histograms of %d images for image type = CL_RGBA, %s", batch_images, format->name);
+    verify_histogram_results(str, histogram_results, ref_histogram_results, batch_images * size, verify_bins_per_channel(variant));
 
-    clGetKernelWorkGroupInfo(histogram_rgba_fp, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
+    t0 = wall_time();
+    for (n=0; n<BATCH_ITERATIONS; n++)
     {
-        size_t  gsize[2];
-        int     w;
-        
-        if (workgroup_size <= 256)
-        {
-            gsize[0] = 16;
-            gsize[1] = workgroup_size / 16;
-        }
-        else if (workgroup_size <= 1024)
+        if (run_histogram_batch(queue, &batch, pixels_buffer, image_data, pixels_size, histograms_buffer, histogram_results))
+            return EXIT_FAILURE;
+    }
+    batched_ms = (wall_time() - t0) * 1000.0 / BATCH_ITERATIONS;
+
+    // the same one image at a time: create the image, the two launches, and a blocking read of its histogram
+    image_format.image_channel_order = CL_RGBA;
+    image_format.image_channel_data_type = format->channel_type;
+    image_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size*sizeof(unsigned int), NULL, &err);
+    if (!image_histogram_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    init_histogram_launch(&launch, variant, image_width, image_height, 0);
+    image_partial_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, launch.num_groups*size*sizeof(unsigned int), NULL, &err);
+    if (!image_partial_histogram_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+    set_histogram_launch_buffers(&launch, &image_partial_histogram_buffer, &image_histogram_buffer);
+
+    t0 = wall_time();
+    for (i=0; i<batch_images; i++)
+    {
+        input_image = clCreateImage2D(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                                &image_format, image_width, image_height, 0, image_data + i * image_size, &err);
+        if (!input_image || err)
         {
-            gsize[0] = workgroup_size / 16;
-            gsize[1] = 16;
+            printf("clCreateImage2D() failed. (%d)\n", err);
+            return EXIT_FAILURE;
         }
-        else
+        set_histogram_launch_image(&launch, &input_image);
+        if (enqueue_histogram(queue, &launch, 0, NULL, NULL, NULL))
+            return EXIT_FAILURE;
+        err = clEnqueueReadBuffer(queue, image_histogram_buffer, CL_TRUE, 0, size*sizeof(unsigned int), histogram_results + (size_t)i * size, 0, NULL, NULL);
+        if (err)
         {
-            gsize[0] = workgroup_size / 32;
-            gsize[1] = 32;
+            printf("clEnqueueReadBuffer() failed. (%d)\n", err);
+            return EXIT_FAILURE;
         }
-        
-        local_work_size[0] = gsize[0];
-        local_work_size[1] = gsize[1];
-        
-        w = (image_width + num_pixels_per_work_item - 1) / num_pixels_per_work_item;
-        global_work_size[0] = ((w + gsize[0] - 1) / gsize[0]);
-        global_work_size[1] = ((image_height + gsize[1] - 1) / gsize[1]);
+        clReleaseMemObject(input_image);
+    }
+    single_ms = (wall_time() - t0) * 1000.0;
 
-        num_groups = global_work_size[0] * global_work_size[1];    
-        global_work_size[0] *= gsize[0];
-        global_work_size[1] *= gsize[1];
-    }    
+    printf("%d images of %d x %d pixels, Image type = CL_RGBA, %s, %d work-groups per image\n",
+                batch_images, image_width, image_height, format->name, batch.groups_per_image);
+    printf("Time to compute histograms = %g ms batched (upload, 2 launches, read), %g ms one image at a time\n", batched_ms, single_ms);
+    printf("Batched vs. one image at a time: %.2fx\n", single_ms / batched_ms);
 
-    partial_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, num_groups*257*3*sizeof(unsigned int), NULL, &err);
-    if (!partial_histogram_buffer || err)
+    free(ref_histogram_results);
+    free(histogram_results);
+    free(image_data);
+    free(images);
+
+    clReleaseMemObject(image_partial_histogram_buffer);
+    clReleaseMemObject(image_histogram_buffer);
+    clReleaseMemObject(partial_histogram_buffer);
+    clReleaseMemObject(histograms_buffer);
+    clReleaseMemObject(images_buffer);
+    clReleaseMemObject(pixels_buffer);
+
+    return EXIT_SUCCESS;
+}
+
+static int
+test_histogram_batch(cl_context context, cl_command_queue queue, cl_device_id device)
+{
+    // histogram_batch takes the offsets of the images, in pixels, as ints
+    if ((long long)batch_images * image_width * image_height > INT_MAX)
     {
-        printf("clCreateBuffer() failed. (%d)\n", err);
+        printf("A batch of %d images of %d x %d pixels is too large: at most %d pixels in all\n",
+                    batch_images, image_width, image_height, INT_MAX);
         return EXIT_FAILURE;
     }
 
-    clSetKernelArg(histogram_rgba_fp, 0, sizeof(cl_mem), &input_image_fp32);
-    clSetKernelArg(histogram_rgba_fp, 1, sizeof(int), &num_pixels_per_work_item);
-    clSetKernelArg(histogram_rgba_fp, 2, sizeof(cl_mem), &partial_histogram_buffer);
-    
-    clSetKernelArg(histogram_sum_partial_results_fp, 0, sizeof(cl_mem), &partial_histogram_buffer);
-    clSetKernelArg(histogram_sum_partial_results_fp, 1, sizeof(int), &num_groups);
-    clSetKernelArg(histogram_sum_partial_results_fp, 2, sizeof(cl_mem), &histogram_buffer);
+    srand(0);
+
+    if (input_selection >= 0)
+        return test_histogram_batch_format(context, queue, device, &input_formats[input_selection]);
+
+    if (test_histogram_batch_format(context, queue, device, &input_formats[INPUT_UNORM8]) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    return test_histogram_batch_format(context, queue, device, &input_formats[INPUT_FLOAT]);
+}
+
+// fill frame with frame number n of the stream: the next w x h RGBA 8-bit frame of fh, or if fh is NULL
+// a synthetic frame which differs from one frame to the next.  returns 0 at the end of fh.
+//
+static int
+read_frame_unorm8(FILE *fh, unsigned char *frame, int w, int h, int n)
+{
+    unsigned int    *p = (unsigned int *)frame;
+    unsigned int    x = 2463534242u ^ ((unsigned int)n * 0x9E3779B9u);
+    unsigned int    mask = skewed_data ? 0x07070707u : 0xFFFFFFFFu;
+    int             i;
     
-    // verify that the kernel works correctly.  also acts as a warmup
-    err = clEnqueueNDRangeKernel(queue, histogram_rgba_fp, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
+    if (fh)
+        return fread(frame, (size_t)w * h * 4, 1, fh) == 1;
+
+    for (i=0; i<w*h; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        p[i] = x & mask;
+    }
+    return 1;
+}
+
+// one slot of the streaming ring: the image a frame is uploaded to, the host copy of the frame (which must
+// stay untouched until the upload completes), and where its histogram is read back to.
+//
+typedef struct
+{
+    cl_mem          image;
+    unsigned char   *frame;
+    unsigned int    *histogram;
+    int             frame_number;
+    int             in_flight;
+    cl_event        upload_done;
+    cl_event        histogram_start;
+    cl_event        read_done;
+} stream_slot;
+
+// wait for the frame in slot to come back, verify it if asked to, and add its device times to the totals.
+//
+static int
+retire_stream_slot(stream_slot *slot, const histogram_config *config, int verify, double *upload_ms, double *histogram_ms)
+{
+    cl_ulong    t0, t1;
+    int         err;
+
+    err = clWaitForEvents(1, &slot->read_done);
     if (err)
     {
-        printf("clEnqueueNDRangeKernel() failed for histogram_rgba_fp kernel. (%d)\n", err);
-        return EXIT_FAILURE;
+        printf("clWaitForEvents() failed for frame %d. (%d)\n", slot->frame_number, err);
+        return -1;
     }
-    
-    // verify that the kernel works correctly.  also acts as a warmup
-    clGetKernelWorkGroupInfo(histogram_sum_partial_results_fp, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &workgroup_size, NULL);
-    if (workgroup_size < 256)
+
+    err = clGetEventProfilingInfo(slot->upload_done, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t0, NULL);
+    err |= clGetEventProfilingInfo(slot->upload_done, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t1, NULL);
+    *upload_ms += (double)(t1 - t0) * 1e-6;
+    err |= clGetEventProfilingInfo(slot->histogram_start, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t0, NULL);
+    err |= clGetEventProfilingInfo(slot->read_done, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t1, NULL);
+    *histogram_ms += (double)(t1 - t0) * 1e-6;
+    if (err)
+    {
+        printf("clGetEventProfilingInfo() failed for frame %d. (%d)\n", slot->frame_number, err);
+        return -1;
+    }
+
+    clReleaseEvent(slot->upload_done);
+    clReleaseEvent(slot->histogram_start);
+    clReleaseEvent(slot->read_done);
+    slot->in_flight = 0;
+
+    if (verify)
+    {
+        char            str[64];
+        unsigned int    *ref_histogram_results;
+        
+        ref_histogram_results = generate_reference_histogram(config, slot->frame, image_width, image_height);
+        sprintf(str, "Stream frame %d", slot->frame_number);
+        err = verify_histogram_results(str, slot->histogram, ref_histogram_results, histogram_size(config), 0);
+        free(ref_histogram_results);
+        if (err)
+            return -1;
+    }
+    return 0;
+}
+
+// streaming mode: histogram a sequence of RGBA 8-bit frames.  the frames go through a ring of ring_depth
+// images; each upload is a non-blocking clEnqueueWriteImage on a queue of its own, so that the next frames
+// are uploaded while the histogram kernels (which wait only on their own frame's upload) run on the
+// current one, and each result comes back with a non-blocking read.  reports the sustained frame rate.
+//
+static int
+stream_histogram(cl_context context, cl_command_queue queue, cl_device_id device)
+{
+    histogram_config    config;
+    histogram_variant   *variant;
+    histogram_launch    launch;
+    cl_command_queue    upload_queue;
+    cl_image_format     image_format;
+    size_t              origin[3] = { 0, 0, 0 };
+    size_t              region[3];
+    cl_mem              histogram_buffer;
+    cl_mem              partial_histogram_buffer;
+    stream_slot         *slots;
+    FILE                *fh = NULL;
+    double              upload_ms = 0.0, histogram_ms = 0.0, start, elapsed;
+    int                 size, frame, last_frame, i, err;
+
+    if (raw_file)
+    {
+        fh = fopen(raw_file, "rb");
+        if (!fh)
+        {
+            printf("Cannot open raw video file %s\n", raw_file);
+            return EXIT_FAILURE;
+        }
+    }
+    else if (stream_frames <= 0)
     {
-        printf("A min. of 256 work-items in work-group is needed for histogram_sum_partial_results_fp kernel. (%d)\n", (int)workgroup_size);
+        printf("--stream needs a number of frames unless the frames come from --raw\n");
         return EXIT_FAILURE;
     }
-    partial_global_work_size[0] = 256*3;
-    partial_local_work_size[0] = (workgroup_size > 256) ? 256 : workgroup_size;
-    err = clEnqueueNDRangeKernel(queue, histogram_sum_partial_results_fp, 1, NULL, partial_global_work_size, partial_local_work_size, 0, NULL, NULL);
-    if (err)
+
+    histogram_config_for_input(&config, &input_formats[INPUT_UNORM8]);
+    variant = get_histogram_variant(context, device, &config);
+    if (!variant)
+        return EXIT_FAILURE;
+    size = histogram_size(&config);
+
+    upload_queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    if(!upload_queue || err)
     {
-        printf("clEnqueueNDRangeKernel() failed for histogram_sum_partial_results_fp kernel. (%d)\n", err);
+        printf("clCreateCommandQueue() failed. (%d)\n", err);
         return EXIT_FAILURE;
     }
 
-    ref_histogram_results = (unsigned int *)generate_reference_histogram_results_fp32(image_data_fp32, image_width, image_height);
-    err = clEnqueueReadBuffer(queue, histogram_buffer, CL_TRUE, 0, 257*3*sizeof(unsigned int), histogram_results, 0, NULL, NULL);
-    if (err)
+    // the two-pass reduction unless only the single-pass one was asked for
+    if (reduce_mode == REDUCE_SINGLE_PASS && !has_global_atomics)
     {
-        printf("clEnqueueReadBuffer() failed. (%d)\n", err);
+        printf("Single-pass histogram requires global atomics support\n");
         return EXIT_FAILURE;
     }
-    verify_histogram_results("Image Histogram for image type = CL_RGBA, CL_FLOAT", histogram_results, ref_histogram_results, 257*3);
+    init_histogram_launch(&launch, variant, image_width, image_height, reduce_mode == REDUCE_SINGLE_PASS);
 
-    // now measure performance
-    err = clEnqueueMarker(queue, &events[0]);
-    if (err)
+    // the compute queue is in order, so one frame's kernels and read-back are done before the next frame's
+    // start: the partial and final histogram buffers can be shared by all the slots.  only the images, which
+    // the upload queue writes ahead of the kernels, need a ring.
+    partial_histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, launch.num_groups*size*sizeof(unsigned int), NULL, &err);
+    if (!partial_histogram_buffer || err)
     {
-        printf("clEnqeueMarker() failed for histogram_rgba_fp kernel. (%d)\n", err);
+        printf("clCreateBuffer() failed. (%d)\n", err);
         return EXIT_FAILURE;
     }
-    for (i=0; i<num_iterations; i++)
+    histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, size*sizeof(unsigned int), NULL, &err);
+    if (!histogram_buffer || err)
+    {
+        printf("clCreateBuffer() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
+
+    image_format.image_channel_order = CL_RGBA;
+    image_format.image_channel_data_type = CL_UNORM_INT8;
+    slots = (stream_slot *)calloc(ring_depth, sizeof(stream_slot));
+    for (i=0; i<ring_depth; i++)
+    {
+        slots[i].frame = (unsigned char *)malloc((size_t)image_width * image_height * 4);
+        slots[i].histogram = (unsigned int *)malloc(size*sizeof(unsigned int));
+        slots[i].image = clCreateImage2D(context, CL_MEM_READ_ONLY, &image_format, image_width, image_height, 0, NULL, &err);
+        if (!slots[i].image || err)
+        {
+            printf("clCreateImage2D() failed. (%d)\n", err);
+            return EXIT_FAILURE;
+        }
+    }
+
+    set_histogram_launch_buffers(&launch, &partial_histogram_buffer, &histogram_buffer);
+
+    region[0] = image_width;
+    region[1] = image_height;
+    region[2] = 1;
+    
+    start = wall_time();
+    for (frame=0; stream_frames == 0 || frame < stream_frames; frame++)
     {
-        err = clEnqueueNDRangeKernel(queue, histogram_rgba_fp, 2, NULL, global_work_size, local_work_size, 0, NULL, NULL);
+        stream_slot *slot = &slots[frame % ring_depth];
+
+        // the frame that last used this slot must be back before its image and host copy are reused
+        if (slot->in_flight)
+        {
+            if (retire_stream_slot(slot, &config, slot->frame_number == 0, &upload_ms, &histogram_ms))
+                return EXIT_FAILURE;
+        }
+
+        if (!read_frame_unorm8(fh, slot->frame, image_width, image_height, frame))
+            break;
+        slot->frame_number = frame;
+
+        err = clEnqueueWriteImage(upload_queue, slot->image, CL_FALSE, origin, region, 0, 0, slot->frame, 0, NULL, &slot->upload_done);
         if (err)
         {
-            printf("clEnqueueNDRangeKernel() failed for histogram_rgba_fp kernel. (%d)\n", err);
+            printf("clEnqueueWriteImage() failed for frame %d. (%d)\n", frame, err);
             return EXIT_FAILURE;
         }
-        
-        err = clEnqueueNDRangeKernel(queue, histogram_sum_partial_results_fp, 1, NULL, partial_global_work_size, partial_local_work_size, 0, NULL, NULL);
+        clFlush(upload_queue);
+
+        set_histogram_launch_image(&launch, &slot->image);
+        if (enqueue_histogram(queue, &launch, 1, &slot->upload_done, &slot->histogram_start, NULL))
+            return EXIT_FAILURE;
+        err = clEnqueueReadBuffer(queue, histogram_buffer, CL_FALSE, 0, size*sizeof(unsigned int), slot->histogram, 0, NULL, &slot->read_done);
         if (err)
         {
-            printf("clEnqueueNDRangeKernel() failed for histogram_sum_partial_results_fp kernel. (%d)\n", err);
+            printf("clEnqueueReadBuffer() failed. (%d)\n", err);
             return EXIT_FAILURE;
-        }        
+        }
+        clFlush(queue);
+        slot->in_flight = 1;
     }
-    err = clEnqueueMarker(queue, &events[1]);
-    if (err)
+    
+    // drain the ring, oldest frame first
+    last_frame = frame - 1;
+    for (frame=(last_frame + 1 > ring_depth) ? last_frame + 1 - ring_depth : 0; frame<=last_frame; frame++)
     {
-        printf("clEnqeueMarker() failed for histogram_rgba_fp kernel. (%d)\n", err);
-        return EXIT_FAILURE;
+        stream_slot *slot = &slots[frame % ring_depth];
+        if (slot->in_flight && retire_stream_slot(slot, &config, frame == 0 || frame == last_frame, &upload_ms, &histogram_ms))
+            return EXIT_FAILURE;
     }
-    err = clWaitForEvents(1, &events[1]);
-    if (err)
+    elapsed = wall_time() - start;
+
+    if (last_frame < 0)
     {
-        printf("clWaitForEvents() failed for histogram_rgba_fp kernel. (%d)\n", err);
-        return EXIT_FAILURE;
-    }    
-    
-    err = clGetEventProfilingInfo(events[0], CL_PROFILING_COMMAND_QUEUED, sizeof(cl_long), &time_start, NULL);
-    err |= clGetEventProfilingInfo(events[1], CL_PROFILING_COMMAND_END, sizeof(cl_long), &time_end, NULL);
-    if (err)
+        printf("No frames in %s\n", raw_file);
+    }
+    else
     {
-        printf("clGetEventProfilingInfo() failed for histogram_rgba_fp kernel. (%d)\n", err);
-        return EXIT_FAILURE;
-    }    
+        int num_frames = last_frame + 1;
         
-    printf("Image dimensions: %d x %d pixels, Image type = CL_RGBA, CL_FLOAT\n", image_width, image_height);
-    printf("Time to compute histogram = %g ms\n", (double)(time_end - time_start) * 1e-9 * 1000.0 / (double)num_iterations);
-    
-    clReleaseEvent(events[0]);
-    clReleaseEvent(events[1]);
+        printf("Streamed %d frames of %d x %d pixels, Image type = CL_RGBA, CL_UNORM_INT8, through a ring of %d images\n",
+                                                                num_frames, image_width, image_height, ring_depth);
+        printf("Sustained rate = %.1f frames/s (%g ms/frame)\n", (double)num_frames / elapsed, elapsed * 1000.0 / (double)num_frames);
+        printf("Device time per frame: upload = %g ms, histogram = %g ms\n", upload_ms / (double)num_frames, histogram_ms / (double)num_frames);
+    }
+
+    for (i=0; i<ring_depth; i++)
+    {
+        clReleaseMemObject(slots[i].image);
+        free(slots[i].frame);
+        free(slots[i].histogram);
+    }
+    free(slots);
+    if (fh)
+        fclose(fh);
 
-    free(ref_histogram_results);
-    free(histogram_results);
-    free(image_data_unorm8);
-    free(image_data_fp32);
-    
-    clReleaseKernel(histogram_rgba_unorm8);
-    clReleaseKernel(histogram_rgba_fp);
-    clReleaseKernel(histogram_sum_partial_results_unorm8);
-    clReleaseKernel(histogram_sum_partial_results_fp);
-    
-    clReleaseProgram(program);    
     clReleaseMemObject(partial_histogram_buffer);
     clReleaseMemObject(histogram_buffer);
-    clReleaseMemObject(input_image_unorm8);
-    clReleaseMemObject(input_image_fp32);
-    
+    clReleaseCommandQueue(upload_queue);
+
     return EXIT_SUCCESS;
 }
 
+static void
+print_usage(const char *name)
+{
+    printf("usage: %s [--size <w>x<h>] [--bins <n>] [--channels <set>] [--input <format>] [--reduce <mode>]\n"
+           "          [--sub-histograms <n>] [--skewed] [--stream <frames>] [--raw <file>] [--ring <n>]\n"
+           "          [--backend <name>] [--threads <n>] [--tiles <m>x<n>] [--roi <x>,<y>,<w>,<h> ...]\n"
+           "          [--tune] [--yuv <layout>] [--equalize | --auto-levels] [--percentiles <lo>,<hi>]\n"
+           "          [--batch <n>]\n", name);
+    printf("  --size <w>x<h>         image (frame) size, default 1920x1080\n");
+    printf("  --bins <n>             bins per channel, 1 to %d, default 256\n", MAX_BINS);
+    printf("  --channels <set>       rgb, rgba, luma or hsv, default rgb\n");
+    printf("  --input <format>       test only images of unorm8, unorm16 or float channels, default unorm8 and float\n");
+    printf("  --reduce <mode>        two-pass (partial histograms + sum kernel), single-pass (global atomics) or both,\n"
+           "                         default both; streaming mode uses two-pass unless single-pass is given\n");
+    printf("  --sub-histograms <n>   copies of the histogram per work-group, default 0 = pick from the local memory size\n");
+    printf("  --skewed               fill the images with 8 dark levels instead of noise\n");
+    printf("  --stream <frames>      streaming mode: histogram <frames> frames (0 = all the frames of --raw)\n");
+    printf("  --raw <file>           take the frames from a raw RGBA 8-bit video file instead of generating them\n");
+    printf("  --ring <n>             number of images in flight in streaming mode, default 3\n");
+    printf("  --backend <name>       opencl or cpu (native multithreaded histogram on the host), default opencl\n");
+    printf("  --threads <n>          threads of the cpu backend, default 0 = one per hardware thread\n");
+    printf("  --tiles <m>x<n>        also compute the histogram of each tile of an m x n grid over the image, in one launch\n");
+    printf("  --roi <x>,<y>,<w>,<h>  also compute the histogram of this rectangle, in the same launch; up to %d times\n", MAX_ROIS);
+    printf("  --tune                 time a grid of work-group shapes and pixels per work-item and save the fastest in %s;\n"
+           "                         later runs on the same device, driver, image size, histogram and reduction use it\n", tuning_filename);
+    printf("  --yuv <layout>         histogram the Y, U and V of planar YUV 4:2:0 frames, nv12 or i420, instead of RGBA images\n");
+    printf("  --equalize             also equalize the image on the device from the cdf of its histogram\n");
+    printf("  --auto-levels          also stretch the image on the device between two percentiles of its histogram\n");
+    printf("  --percentiles <lo>,<hi> percentiles extracted on the device for --auto-levels, default 1,99\n");
+    printf("  --batch <n>            histogram n images of --size packed in one buffer with one pair of launches, and\n"
+           "                         compare with one image at a time\n");
+}
+
 
 int 
 main(int argc, char **argv)
@@ -598,17 +2537,161 @@ main(int argc, char **argv)
     cl_command_queue    queue;
     int                 err;
     cl_device_type      device_type = CL_DEVICE_TYPE_GPU;
+    int                 i;
+
+    for (i=1; i<argc; i++)
+    {
+        if (!strcmp(argv[i], "--stream") && i+1 < argc)
+        {
+            stream_mode = 1;
+            stream_frames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--raw") && i+1 < argc)
+        {
+            stream_mode = 1;
+            raw_file = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--ring") && i+1 < argc)
+        {
+            ring_depth = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--sub-histograms") && i+1 < argc)
+        {
+            num_sub_histograms = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--skewed"))
+        {
+            skewed_data = 1;
+        }
+        else if (!strcmp(argv[i], "--reduce") && i+1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "two-pass"))
+                reduce_mode = REDUCE_TWO_PASS;
+            else if (!strcmp(argv[i], "single-pass"))
+                reduce_mode = REDUCE_SINGLE_PASS;
+            else if (!strcmp(argv[i], "both"))
+                reduce_mode = REDUCE_TWO_PASS | REDUCE_SINGLE_PASS;
+            else
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--bins") && i+1 < argc)
+        {
+            num_bins = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--channels") && i+1 < argc)
+        {
+            for (channels=CHANNELS_HSV; channels>=0 && strcmp(argv[i+1], channel_names[channels]); channels--)
+                ;
+            i++;
+        }
+        else if (!strcmp(argv[i], "--input") && i+1 < argc)
+        {
+            for (input_selection=INPUT_FLOAT; input_selection>=0 && strcmp(argv[i+1], input_formats[input_selection].option); input_selection--)
+                ;
+            if (input_selection < 0)
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            i++;
+        }
+        else if (!strcmp(argv[i], "--backend") && i+1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "opencl"))
+                backend = BACKEND_OPENCL;
+            else if (!strcmp(argv[i], "cpu"))
+                backend = BACKEND_CPU;
+            else
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (!strcmp(argv[i], "--threads") && i+1 < argc)
+        {
+            cpu_threads = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--yuv") && i+1 < argc)
+        {
+            for (yuv_layout=YUV_I420; yuv_layout>YUV_NONE && strcmp(argv[i+1], yuv_names[yuv_layout]); yuv_layout--)
+                ;
+            if (yuv_layout == YUV_NONE)
+            {
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            i++;
+        }
+        else if (!strcmp(argv[i], "--batch") && i+1 < argc)
+        {
+            batch_images = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--equalize"))
+        {
+            post_mode = POST_EQUALIZE;
+        }
+        else if (!strcmp(argv[i], "--auto-levels"))
+        {
+            post_mode = POST_AUTO_LEVELS;
+        }
+        else if (!strcmp(argv[i], "--percentiles") && i+1 < argc && sscanf(argv[i+1], "%f,%f", &percentiles[0], &percentiles[1]) == 2)
+        {
+            i++;
+        }
+        else if (!strcmp(argv[i], "--tune"))
+        {
+            tune_mode = 1;
+        }
+        else if (!strcmp(argv[i], "--tiles") && i+1 < argc && sscanf(argv[i+1], "%dx%d", &tiles_x, &tiles_y) == 2)
+        {
+            i++;
+        }
+        else if (!strcmp(argv[i], "--roi") && i+1 < argc && num_rois < MAX_ROIS &&
+                 sscanf(argv[i+1], "%d,%d,%d,%d", &roi_list[num_rois*4], &roi_list[num_rois*4 + 1], &roi_list[num_rois*4 + 2], &roi_list[num_rois*4 + 3]) == 4)
+        {
+            num_rois++;
+            i++;
+        }
+        else if (!strcmp(argv[i], "--size") && i+1 < argc && sscanf(argv[i+1], "%dx%d", &image_width, &image_height) == 2)
+        {
+            i++;
+        }
+        else
+        {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (image_width <= 0 || image_height <= 0 || ring_depth < 1 || num_sub_histograms < 0 ||
+        num_bins < 1 || num_bins > MAX_BINS || channels < 0 || cpu_threads < 0 || (stream_mode && backend == BACKEND_CPU) ||
+        tiles_x < 0 || tiles_y < 0 || tiles_x > MAX_REGIONS || tiles_y > MAX_REGIONS || tiles_x * tiles_y + num_rois > MAX_REGIONS ||
+        (yuv_layout && (stream_mode || backend == BACKEND_CPU)) ||
+        percentiles[0] < 0.0f || percentiles[0] > percentiles[1] || percentiles[1] > 100.0f ||
+        batch_images < 0 || (batch_images && (stream_mode || yuv_layout || backend == BACKEND_CPU)))
+    {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
 
-#if (__APPLE__) || defined(__MACOSX)
-    cl_platform_id platform = NULL;
-#else
-    cl_platform_id platform = NULL;
-    err = clGetPlatformIDs(1, &platform, NULL);
-    if(err != CL_SUCCESS)
-    {
-        printf("clGetPlatformIDs() failed. (%d)\n", err);
-        return EXIT_FAILURE;
-    }
+    // the cpu backend needs no OpenCL platform at all
+    if (backend == BACKEND_CPU)
+        return test_histogram_cpu();
+
+#if (__APPLE__) || defined(__MACOSX)
+    cl_platform_id platform = NULL;
+#else
+    cl_platform_id platform = NULL;
+    err = clGetPlatformIDs(1, &platform, NULL);
+    if(err != CL_SUCCESS)
+    {
+        printf("clGetPlatformIDs() failed. (%d)\n", err);
+        return EXIT_FAILURE;
+    }
 #endif
 
     err = clGetDeviceIDs(platform, device_type, 1, &device, NULL);
@@ -651,8 +2734,12 @@ main(int argc, char **argv)
         printf("Skipping: histogram requires local atomics support\n");
         return EXIT_SUCCESS;
     }
+    // needed by the single-pass reduction only
+    has_global_atomics = (strstr(ext_string, "cl_khr_global_int32_base_atomics") != NULL);
     free(ext_string);
 
+    load_histogram_tunings();
+
     context = clCreateContext( 0, 1, &device, NULL, NULL, &err);
     if (!context || err)
     {
@@ -667,9 +2754,25 @@ main(int argc, char **argv)
         return EXIT_FAILURE;
     }
     
-    if (test_histogram(context, queue, device) == EXIT_FAILURE)
+    if (stream_mode)
+    {
+        if (stream_histogram(context, queue, device) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+    else if (batch_images)
+    {
+        if (test_histogram_batch(context, queue, device) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+    else if (yuv_layout)
+    {
+        if (test_histogram_yuv(context, queue, device) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+    }
+    else if (test_histogram(context, queue, device) == EXIT_FAILURE)
         return EXIT_FAILURE;
     
+    release_histogram_variants();
     clReleaseCommandQueue(queue);
     clReleaseContext(context);
 
@@ -0,0 +1,60 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+// the channel sets of histogram_image.cl.  CHANNELS_YUV is the Y, U and V of a planar YUV 4:2:0 frame.
+#define CHANNELS_RGB    0
+#define CHANNELS_RGBA   1
+#define CHANNELS_LUMA   2
+#define CHANNELS_HSV    3
+#define CHANNELS_YUV    4
+
+// what a histogram is computed over: the -D options histogram_image.cl is built with, which the native CPU
+// backend (histogram_cpu.cpp) follows as well.  input_max is the largest channel value of a normalized integer
+// image (255 or 65535), or 0 for a floating-point image.
+typedef struct
+{
+    int     num_bins;
+    int     channels;
+    int     input_max;
+    int     overflow_bin;
+} histogram_config;
+
+static inline int
+histogram_num_channels(const histogram_config *config)
+{
+    return (config->channels == CHANNELS_LUMA) ? 1 : (config->channels == CHANNELS_RGBA) ? 4 : 3;
+}
+
+// number of 32-bit entries in the histogram: the bins of each channel one after the other
+//
+static inline int
+histogram_size(const histogram_config *config)
+{
+    return (config->num_bins + config->overflow_bin) * histogram_num_channels(config);
+}
+
+// the bin of each channel of one RGBA pixel, as pixel_bins() in histogram_image.cl computes it, for a pixel
+// of a normalized integer image (its stored levels) or of a floating-point image
+void histogram_pixel_bins_level(const histogram_config *config, unsigned int r, unsigned int g, unsigned int b, unsigned int a, unsigned int *bins);
+void histogram_pixel_bins_float(const histogram_config *config, float r, float g, float b, float a, unsigned int *bins);
+
+// native CPU backend: the histogram of a w x h RGBA image in host memory, computed by num_threads threads
+// (0 = one per hardware thread).  returns the number of threads used.  the threads and their private
+// histograms are kept for the next call, until cpu_histogram_release().  not to be called concurrently.
+int cpu_histogram(const histogram_config *config, const void *image_data, int w, int h, int num_threads, unsigned int *histogram);
+void cpu_histogram_release(void);
+
+// the instruction set of the backend's pixel unpacking, for the benchmark output
+const char *cpu_histogram_isa(void);
+
+#endif
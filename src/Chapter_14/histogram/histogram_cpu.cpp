@@ -0,0 +1,443 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define HISTOGRAM_SSE2  1
+    #include <emmintrin.h>
+#endif
+
+#include "histogram.h"
+
+// native CPU histogram, as a baseline for the OpenCL kernels and for hosts without an OpenCL device.
+//
+// the rows of the image are split between the threads, and each thread counts its rows into a private
+// histogram.  a private histogram keeps 4 interleaved copies of every entry (entry * 4 + lane), and the
+// pixels of a block of 4 go to the 4 lanes, so that runs of equal pixels -- the common case in real images --
+// do not serialize on one counter's store-to-load dependency.  once all threads are done, each thread sums
+// a slice of the entries over all threads and lanes into the final histogram.
+//
+// for 8-bit rgb, rgba and luma images the bins of a block of 4 pixels are computed with SSE2; everything else
+// maps one pixel at a time with the functions shared with the reference histogram.
+
+#define NUM_LANES   4
+
+// the bin of a channel value of a floating-point image, as bin_of_value() in histogram_image.cl computes it
+//
+static unsigned int
+histogram_bin_of_value(const histogram_config *config, float v)
+{
+    float   n = (float)config->num_bins;
+    float   f;
+
+    if (config->overflow_bin)
+    {
+        f = ((v > 1.0f) ? 1.0f : v) * n;
+        return (f > 0.0f) ? (unsigned int)f : 0;
+    }
+
+    f = v * n;
+    if (!(f > 0.0f))
+        return 0;
+    return (f >= n - 1.0f) ? (unsigned int)config->num_bins - 1 : (unsigned int)f;
+}
+
+void
+histogram_pixel_bins_level(const histogram_config *config, unsigned int r, unsigned int g, unsigned int b, unsigned int a, unsigned int *bins)
+{
+    unsigned int    n = (unsigned int)config->num_bins;
+    unsigned int    levels = (unsigned int)config->input_max + 1;
+
+    if (config->channels == CHANNELS_LUMA)
+    {
+        bins[0] = (((77 * r + 150 * g + 29 * b + 128) >> 8) * n) / levels;
+    }
+    else if (config->channels == CHANNELS_HSV)
+    {
+        unsigned int    mx = (r > g) ? ((r > b) ? r : b) : ((g > b) ? g : b);
+        unsigned int    mn = (r < g) ? ((r < b) ? r : b) : ((g < b) ? g : b);
+        unsigned int    delta = mx - mn;
+        unsigned int    hue = 0;
+
+        if (delta)
+        {
+            if (mx == r)
+                hue = (g >= b) ? g - b : 6 * delta - (b - g);
+            else if (mx == g)
+                hue = 2 * delta + b - r;
+            else
+                hue = 4 * delta + r - g;
+            hue = (hue * n) / (6 * delta);
+        }
+        bins[0] = hue;
+        bins[1] = mx ? (((delta * (levels - 1) + mx / 2) / mx) * n) / levels : 0;
+        bins[2] = (mx * n) / levels;
+    }
+    else
+    {
+        bins[0] = (r * n) / levels;
+        bins[1] = (g * n) / levels;
+        bins[2] = (b * n) / levels;
+        bins[3] = (a * n) / levels;
+    }
+}
+
+void
+histogram_pixel_bins_float(const histogram_config *config, float r, float g, float b, float a, unsigned int *bins)
+{
+    if (config->channels == CHANNELS_LUMA)
+    {
+        bins[0] = histogram_bin_of_value(config, 0.299f * r + 0.587f * g + 0.114f * b);
+    }
+    else if (config->channels == CHANNELS_HSV)
+    {
+        float   mx = (r > g) ? ((r > b) ? r : b) : ((g > b) ? g : b);
+        float   mn = (r < g) ? ((r < b) ? r : b) : ((g < b) ? g : b);
+        float   delta = mx - mn;
+        float   hue = 0.0f;
+
+        if (delta > 0.0f)
+        {
+            if (mx == r)
+                hue = (g - b) / delta + ((g < b) ? 6.0f : 0.0f);
+            else if (mx == g)
+                hue = (b - r) / delta + 2.0f;
+            else
+                hue = (r - g) / delta + 4.0f;
+        }
+        bins[0] = histogram_bin_of_value(config, hue / 6.0f);
+        bins[1] = histogram_bin_of_value(config, (mx > 0.0f) ? delta / mx : 0.0f);
+        bins[2] = histogram_bin_of_value(config, mx);
+    }
+    else
+    {
+        bins[0] = histogram_bin_of_value(config, r);
+        bins[1] = histogram_bin_of_value(config, g);
+        bins[2] = histogram_bin_of_value(config, b);
+        bins[3] = histogram_bin_of_value(config, a);
+    }
+}
+
+const char *
+cpu_histogram_isa(void)
+{
+#ifdef HISTOGRAM_SSE2
+    return "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+// a reusable barrier for the threads of the pool
+typedef struct
+{
+    std::mutex              mutex;
+    std::condition_variable cond;
+    int                     count, waiting, generation;
+} cpu_barrier;
+
+static void
+barrier_init(cpu_barrier *b, int count)
+{
+    b->count = count;
+    b->waiting = 0;
+    b->generation = 0;
+}
+
+static void
+barrier_wait(cpu_barrier *b)
+{
+    std::unique_lock<std::mutex>    lock(b->mutex);
+    int                             generation = b->generation;
+
+    if (++b->waiting == b->count)
+    {
+        b->waiting = 0;
+        b->generation++;
+        b->cond.notify_all();
+    }
+    else
+    {
+        while (generation == b->generation)
+            b->cond.wait(lock);
+    }
+}
+
+// what the threads of one cpu_histogram() call share
+typedef struct
+{
+    const histogram_config  *config;
+    const void              *image_data;
+    int                     w, h;
+    int                     num_threads;
+    int                     size;
+    unsigned int            *private_histograms;    // num_threads * size * NUM_LANES entries
+    unsigned int            *histogram;
+    cpu_barrier             barrier;
+} cpu_histogram_job;
+
+// the threads and private histograms, kept from one cpu_histogram() call to the next so that a call only
+// wakes the threads up: num_threads - 1 workers wait on start for a job, the calling thread working as
+// thread 0, and all meet on done once it is finished.  rebuilt when the number of threads changes.
+typedef struct
+{
+    std::vector<std::thread>    workers;
+    int                         num_threads;        // 0 until the first call
+    int                         quit;
+    cpu_barrier                 start, done;
+    size_t                      private_entries;    // allocated entries of job.private_histograms
+    cpu_histogram_job           job;
+} cpu_histogram_pool;
+
+static cpu_histogram_pool pool;
+
+// count one pixel of any format into lane of a private histogram
+//
+static inline void
+count_pixel(const histogram_config *config, const void *image_data, size_t i, int lane, int num_channels, int bins_per_channel, unsigned int *hist)
+{
+    unsigned int    bins[4];
+    int             c;
+
+    if (config->input_max == 255)
+    {
+        const unsigned char *img = (const unsigned char *)image_data + i * 4;
+        histogram_pixel_bins_level(config, img[0], img[1], img[2], img[3], bins);
+    }
+    else if (config->input_max)
+    {
+        const unsigned short *img = (const unsigned short *)image_data + i * 4;
+        histogram_pixel_bins_level(config, img[0], img[1], img[2], img[3], bins);
+    }
+    else
+    {
+        const float *img = (const float *)image_data + i * 4;
+        histogram_pixel_bins_float(config, img[0], img[1], img[2], img[3], bins);
+    }
+
+    for (c=0; c<num_channels; c++)
+        hist[(c * bins_per_channel + bins[c]) * NUM_LANES + lane]++;
+}
+
+#ifdef HISTOGRAM_SSE2
+// count the pixels [x0, x1) of an 8-bit rgb, rgba or luma row, 4 at a time.  returns the first pixel not counted.
+//
+// a bin is (level * num_bins) >> 8, computed as the high half of (level << 8) * num_bins.  the index into the
+// private histogram, ((channel * num_bins + bin) << 2) + lane, stays below 4 * 4 * 4096 and so fits 16 bits.
+//
+static int
+count_row_unorm8_sse2(const histogram_config *config, const unsigned char *row, int x0, int x1, unsigned int *hist)
+{
+    const __m128i   zero = _mm_setzero_si128();
+    const __m128i   n = _mm_set1_epi16((short)config->num_bins);
+    const __m128i   luma_weights = _mm_setr_epi16(77, 150, 29, 0, 77, 150, 29, 0);
+    const __m128i   luma_round = _mm_set1_epi32(128);
+    const __m128i   luma_lanes = _mm_setr_epi16(0, 1, 2, 3, 0, 0, 0, 0);
+    const int       b = config->num_bins;
+    const __m128i   rgba_offsets = _mm_setr_epi16(0, (short)(4 * b), (short)(8 * b), (short)(12 * b),
+                                                 0, (short)(4 * b), (short)(8 * b), (short)(12 * b));
+    const __m128i   rgba_lanes = _mm_setr_epi16(0, 0, 0, 0, 1, 1, 1, 1);
+    const __m128i   lane_step = _mm_set1_epi16(2);
+    const int       num_channels = histogram_num_channels(config);
+    unsigned short  idx[8] = { 0 };
+    int             x;
+
+    for (x=x0; x+4<=x1; x+=4)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i *)(row + x * 4));
+        __m128i lo = _mm_unpacklo_epi8(px, zero);       // pixels 0, 1 as 16-bit r, g, b, a
+        __m128i hi = _mm_unpackhi_epi8(px, zero);       // pixels 2, 3
+
+        if (config->channels == CHANNELS_LUMA)
+        {
+            // 77 * r + 150 * g and 29 * b of each pixel, then their sum in the low 32 bits of each 64
+            __m128i sl = _mm_madd_epi16(lo, luma_weights);
+            __m128i sh = _mm_madd_epi16(hi, luma_weights);
+            __m128i luma, bins;
+
+            sl = _mm_add_epi32(sl, _mm_srli_epi64(sl, 32));
+            sh = _mm_add_epi32(sh, _mm_srli_epi64(sh, 32));
+            luma = _mm_unpacklo_epi64(_mm_shuffle_epi32(sl, _MM_SHUFFLE(3, 3, 2, 0)), _mm_shuffle_epi32(sh, _MM_SHUFFLE(3, 3, 2, 0)));
+            luma = _mm_srli_epi32(_mm_add_epi32(luma, luma_round), 8);
+            luma = _mm_packs_epi32(luma, zero);
+            bins = _mm_mulhi_epu16(_mm_slli_epi16(luma, 8), n);
+            _mm_storeu_si128((__m128i *)idx, _mm_add_epi16(_mm_slli_epi16(bins, 2), luma_lanes));
+
+            hist[idx[0]]++;
+            hist[idx[1]]++;
+            hist[idx[2]]++;
+            hist[idx[3]]++;
+        }
+        else
+        {
+            // channel c of pixel p: ((c * num_bins + bin) << 2) + p
+            __m128i il = _mm_add_epi16(_mm_slli_epi16(_mm_mulhi_epu16(_mm_slli_epi16(lo, 8), n), 2), _mm_add_epi16(rgba_offsets, rgba_lanes));
+            __m128i ih = _mm_add_epi16(_mm_slli_epi16(_mm_mulhi_epu16(_mm_slli_epi16(hi, 8), n), 2), _mm_add_epi16(rgba_offsets, _mm_add_epi16(rgba_lanes, lane_step)));
+            unsigned short  idx_hi[8];
+
+            _mm_storeu_si128((__m128i *)idx, il);
+            _mm_storeu_si128((__m128i *)idx_hi, ih);
+
+            hist[idx[0]]++;  hist[idx[1]]++;  hist[idx[2]]++;
+            hist[idx[4]]++;  hist[idx[5]]++;  hist[idx[6]]++;
+            hist[idx_hi[0]]++;  hist[idx_hi[1]]++;  hist[idx_hi[2]]++;
+            hist[idx_hi[4]]++;  hist[idx_hi[5]]++;  hist[idx_hi[6]]++;
+            if (num_channels == 4)
+            {
+                hist[idx[3]]++;  hist[idx[7]]++;
+                hist[idx_hi[3]]++;  hist[idx_hi[7]]++;
+            }
+        }
+    }
+
+    return x;
+}
+#endif
+
+static void
+cpu_histogram_worker(cpu_histogram_job *job, int id)
+{
+    const histogram_config  *config = job->config;
+    int                     num_channels = histogram_num_channels(config);
+    int                     bins_per_channel = config->num_bins + config->overflow_bin;
+    int                     entries = job->size * NUM_LANES;
+    unsigned int            *hist = job->private_histograms + (size_t)id * entries;
+    int                     y0 = (int)((long long)job->h * id / job->num_threads);
+    int                     y1 = (int)((long long)job->h * (id + 1) / job->num_threads);
+    int                     e0, e1;
+    int                     x, y, t, e;
+
+    memset(hist, 0, entries * sizeof(unsigned int));
+
+    for (y=y0; y<y1; y++)
+    {
+        x = 0;
+#ifdef HISTOGRAM_SSE2
+        if (config->input_max == 255 && config->channels != CHANNELS_HSV)
+            x = count_row_unorm8_sse2(config, (const unsigned char *)job->image_data + (size_t)y * job->w * 4, 0, job->w, hist);
+#endif
+        for (; x<job->w; x++)
+            count_pixel(config, job->image_data, (size_t)y * job->w + x, x & (NUM_LANES - 1), num_channels, bins_per_channel, hist);
+    }
+
+    barrier_wait(&job->barrier);
+
+    // sum this thread's slice of the entries over all threads and lanes
+    e0 = (int)((long long)job->size * id / job->num_threads);
+    e1 = (int)((long long)job->size * (id + 1) / job->num_threads);
+    for (e=e0; e<e1; e++)
+    {
+        unsigned int    sum = 0;
+
+        for (t=0; t<job->num_threads; t++)
+        {
+            const unsigned int  *p = job->private_histograms + (size_t)t * entries + e * NUM_LANES;
+            sum += p[0] + p[1] + p[2] + p[3];
+        }
+        job->histogram[e] = sum;
+    }
+}
+
+// the loop of pool thread id: wait for a job, do its share, and wait for the others
+//
+static void
+cpu_histogram_thread(int id)
+{
+    for (;;)
+    {
+        barrier_wait(&pool.start);
+        if (pool.quit)
+            break;
+        cpu_histogram_worker(&pool.job, id);
+        barrier_wait(&pool.done);
+    }
+}
+
+static void
+start_pool(int num_threads)
+{
+    int     t;
+
+    pool.num_threads = num_threads;
+    pool.quit = 0;
+    barrier_init(&pool.start, num_threads);
+    barrier_init(&pool.done, num_threads);
+    barrier_init(&pool.job.barrier, num_threads);
+    for (t=1; t<num_threads; t++)
+        pool.workers.push_back(std::thread(cpu_histogram_thread, t));
+}
+
+void
+cpu_histogram_release(void)
+{
+    int     t;
+
+    if (pool.num_threads)
+    {
+        pool.quit = 1;
+        barrier_wait(&pool.start);
+        for (t=0; t<(int)pool.workers.size(); t++)
+            pool.workers[t].join();
+        pool.workers.clear();
+        pool.num_threads = 0;
+    }
+    free(pool.job.private_histograms);
+    pool.job.private_histograms = NULL;
+    pool.private_entries = 0;
+}
+
+int
+cpu_histogram(const histogram_config *config, const void *image_data, int w, int h, int num_threads, unsigned int *histogram)
+{
+    cpu_histogram_job   *job = &pool.job;
+    size_t              entries;
+
+    if (num_threads <= 0)
+        num_threads = (int)std::thread::hardware_concurrency();
+    if (num_threads <= 0)
+        num_threads = 1;
+    if (num_threads > h)
+        num_threads = (h > 0) ? h : 1;
+
+    if (pool.num_threads != num_threads)
+    {
+        cpu_histogram_release();
+        start_pool(num_threads);
+    }
+
+    entries = (size_t)num_threads * histogram_size(config) * NUM_LANES;
+    if (entries > pool.private_entries)
+    {
+        free(job->private_histograms);
+        job->private_histograms = (unsigned int *)malloc(entries * sizeof(unsigned int));
+        pool.private_entries = entries;
+    }
+
+    job->config = config;
+    job->image_data = image_data;
+    job->w = w;
+    job->h = h;
+    job->num_threads = num_threads;
+    job->size = histogram_size(config);
+    job->histogram = histogram;
+
+    barrier_wait(&pool.start);
+    cpu_histogram_worker(job, 0);
+    barrier_wait(&pool.done);
+
+    return num_threads;
+}
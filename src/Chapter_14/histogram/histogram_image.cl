@@ -1,71 +1,228 @@
 #pragma OPENCL EXTENSION cl_khr_local_int32_base_atomics : enable
+// global atomics are for histogram_image_single_pass alone, which is left out on a device without them
+#ifdef cl_khr_global_int32_base_atomics
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+#endif
+
+// the luma and HSV of a floating-point pixel must round as the host computes them (histogram_pixel_bins_float
+// in histogram_cpu.cpp), or a value on a bin edge lands in the next bin: no a * b + c is fused into an fma.
+// the host also builds the program with -cl-fp32-correctly-rounded-divide-sqrt when the device supports it.
+#pragma OPENCL FP_CONTRACT OFF
+
+//
+// the histogram program is specialized at build time.  the host builds one variant per histogram it needs,
+// passing with -D:
+//
+//   NUM_BINS       number of bins per channel
+//   CHANNELS       which values of a pixel are histogrammed: CHANNELS_RGB (R, G and B), CHANNELS_RGBA (R, G, B
+//                  and A), CHANNELS_LUMA (the BT.601 luma of R, G and B) or CHANNELS_HSV (hue, saturation, value),
+//                  or CHANNELS_YUV for the Y, U and V of a planar YUV 4:2:0 frame (histogram_yuv; the image kernels
+//                  treat it as CHANNELS_RGB)
+//   INPUT_MAX      the format of the input image: the largest channel value it stores for a normalized integer
+//                  image (255 for CL_UNORM_INT8, 65535 for CL_UNORM_INT16), or 0 for a floating-point image
+//   OVERFLOW_BIN   the bin mapping of floating-point values, which may be outside [0, 1]: 1 adds a bin after the
+//                  NUM_BINS of each channel which counts the values >= 1.0, 0 counts them in the last bin
+//
+// a normalized integer channel is mapped back to the integer level the image stores, and level l goes to bin
+// l * NUM_BINS / (INPUT_MAX + 1), so binning is exact whatever the bin count (10-bit video in the top bits of
+// a CL_UNORM_INT16 image, with 1024 bins, gets a bin per level).  a floating-point value v goes to bin
+// v * NUM_BINS.  the histogram of a work-group, and the final histogram, is NUM_CHANNELS runs of
+// BINS_PER_CHANNEL bins.  the defaults are the RGB 256 bin histogram of an 8-bit image.
+//
+#define CHANNELS_RGB    0
+#define CHANNELS_RGBA   1
+#define CHANNELS_LUMA   2
+#define CHANNELS_HSV    3
+#define CHANNELS_YUV    4
+
+#ifndef NUM_BINS
+#define NUM_BINS        256
+#endif
+#ifndef CHANNELS
+#define CHANNELS        CHANNELS_RGB
+#endif
+#ifndef INPUT_MAX
+#define INPUT_MAX       255
+#endif
+#ifndef OVERFLOW_BIN
+#define OVERFLOW_BIN    0
+#endif
+
+#if CHANNELS == CHANNELS_LUMA
+#define NUM_CHANNELS    1
+#elif CHANNELS == CHANNELS_RGBA
+#define NUM_CHANNELS    4
+#else
+#define NUM_CHANNELS    3
+#endif
+#define BINS_PER_CHANNEL    (NUM_BINS + OVERFLOW_BIN)
+#define HISTOGRAM_SIZE      (BINS_PER_CHANNEL * NUM_CHANNELS)
+
+//
+// NUM_SUB_HISTOGRAMS is the number of copies of the partial histogram each work-group keeps in local memory.
+// work-item i increments copy i % NUM_SUB_HISTOGRAMS, so work-items hitting the same bin (images with a few
+// dominant colors) contend on an atomic only with the other work-items that share their copy.  the copies are
+// interleaved, copy r of bin b being tmp_histogram[b * NUM_SUB_HISTOGRAMS + r], so that neighbouring work-items
+// incrementing the same bin go to different local memory banks.  the host picks the number of copies from the
+// local memory size and passes it with -D; the copies are summed when the partial histogram is written out.
+//
+#ifndef NUM_SUB_HISTOGRAMS
+#define NUM_SUB_HISTOGRAMS  1
+#endif
+
+
+#if INPUT_MAX
+
+uint
+bin_of_level(uint level)
+{
+    return (level * NUM_BINS) / (INPUT_MAX + 1);
+}
+
+//
+// the bin of each channel of a pixel of a normalized integer image given by its stored levels, in
+// bins[0 .. NUM_CHANNELS-1].  luma and HSV are computed in integers on the levels, so the host can reproduce
+// them exactly.
+//
+void
+level_bins(uint r, uint g, uint b, uint a, uint *bins)
+{
+#if CHANNELS == CHANNELS_LUMA
+    bins[0] = bin_of_level((77 * r + 150 * g + 29 * b + 128) >> 8);
+#elif CHANNELS == CHANNELS_HSV
+    uint    mx = max(max(r, g), b);
+    uint    delta = mx - min(min(r, g), b);
+    uint    hue = 0;
+
+    // hue as a fraction hue / (6 * delta) of the color wheel
+    if (delta)
+    {
+        if (mx == r)
+            hue = (g >= b) ? g - b : 6 * delta - (b - g);
+        else if (mx == g)
+            hue = 2 * delta + b - r;
+        else
+            hue = 4 * delta + r - g;
+        hue = (hue * NUM_BINS) / (6 * delta);
+    }
+    bins[0] = hue;
+    bins[1] = mx ? bin_of_level((delta * INPUT_MAX + mx / 2) / mx) : 0;
+    bins[2] = bin_of_level(mx);
+#else
+    bins[0] = bin_of_level(r);
+    bins[1] = bin_of_level(g);
+    bins[2] = bin_of_level(b);
+#if CHANNELS == CHANNELS_RGBA
+    bins[3] = bin_of_level(a);
+#endif
+#endif
+}
+
+//
+// the same for a pixel read from a normalized integer image, mapped back to its levels
+//
+void
+pixel_bins(float4 clr, uint *bins)
+{
+    level_bins(convert_uint_sat_rte(clr.x * (float)INPUT_MAX), convert_uint_sat_rte(clr.y * (float)INPUT_MAX),
+               convert_uint_sat_rte(clr.z * (float)INPUT_MAX), convert_uint_sat_rte(clr.w * (float)INPUT_MAX), bins);
+}
+
+#else
+
+uint
+bin_of_value(float v)
+{
+#if OVERFLOW_BIN
+    return convert_uint_sat(min(v, 1.0f) * (float)NUM_BINS);
+#else
+    return min(convert_uint_sat(v * (float)NUM_BINS), (uint)(NUM_BINS - 1));
+#endif
+}
+
+//
+// the bin of each channel of a pixel of a floating-point image, in bins[0 .. NUM_CHANNELS-1]
+//
+void
+pixel_bins(float4 clr, uint *bins)
+{
+#if CHANNELS == CHANNELS_LUMA
+    bins[0] = bin_of_value(0.299f * clr.x + 0.587f * clr.y + 0.114f * clr.z);
+#elif CHANNELS == CHANNELS_HSV
+    float   mx = max(max(clr.x, clr.y), clr.z);
+    float   delta = mx - min(min(clr.x, clr.y), clr.z);
+    float   hue = 0.0f;
+
+    if (delta > 0.0f)
+    {
+        if (mx == clr.x)
+            hue = (clr.y - clr.z) / delta + ((clr.y < clr.z) ? 6.0f : 0.0f);
+        else if (mx == clr.y)
+            hue = (clr.z - clr.x) / delta + 2.0f;
+        else
+            hue = (clr.x - clr.y) / delta + 4.0f;
+    }
+    bins[0] = bin_of_value(hue / 6.0f);
+    bins[1] = bin_of_value((mx > 0.0f) ? delta / mx : 0.0f);
+    bins[2] = bin_of_value(mx);
+#else
+    bins[0] = bin_of_value(clr.x);
+    bins[1] = bin_of_value(clr.y);
+    bins[2] = bin_of_value(clr.z);
+#if CHANNELS == CHANNELS_RGBA
+    bins[3] = bin_of_value(clr.w);
+#endif
+#endif
+}
+
+#endif
+
 
 //
 // sum partial histogram results into final histogram bins
 //
 // num_groups is the number of work-groups used to compute partial histograms.
-// partial_histogram is an array of num_groups * (257 * 3 * 32-bits/entry) entries
-// we store 257 Red bins, followed by 257 Green bins and then the 257 Blue bins.
+// partial_histogram is an array of num_groups * (HISTOGRAM_SIZE * 32-bits/entry) entries
+// we store the BINS_PER_CHANNEL bins of the first channel, followed by those of the second channel and so on.
+// the global work size is HISTOGRAM_SIZE rounded up to a multiple of the work-group size.
 //
 // final summed results are returned in histogram.
 //
 kernel
-void histogram_sum_partial_results_fp(global uint *partial_histogram, int num_groups, global uint *histogram)
+void histogram_sum_partial_results(global uint *partial_histogram, int num_groups, global uint *histogram)
 {
     int     tid = (int)get_global_id(0);
-    int     group_id = (int)get_group_id(0);
     int     group_indx;
     int     n = num_groups;
-    uint    tmp_histogram, tmp_histogram_first;
-
-    int     first_workitem_not_in_first_group = ((get_local_id(0) == 0) && group_id);
-    
-    tid += group_id;
-    int     tid_first = tid - 1;
-    if (first_workitem_not_in_first_group)
-        tmp_histogram_first = partial_histogram[tid_first];
-    
+    uint    tmp_histogram;
+
+    if (tid >= HISTOGRAM_SIZE)
+        return;
+
     tmp_histogram = partial_histogram[tid];
-    
-    group_indx = 257*3;
+
+    group_indx = HISTOGRAM_SIZE;
     while (--n > 0)
     {
-        if (first_workitem_not_in_first_group)
-            tmp_histogram_first += partial_histogram[tid_first];
-            
-        tmp_histogram += partial_histogram[group_indx+tid];
-        group_indx += 257*3;
+        tmp_histogram += partial_histogram[group_indx + tid];
+        group_indx += HISTOGRAM_SIZE;
     }
-    
-    if (first_workitem_not_in_first_group)
-        histogram[tid_first] = tmp_histogram_first;
+
     histogram[tid] = tmp_histogram;
 }
 
-
 //
-// this kernel takes a RGBA 32-bit or 16-bit FP / channel input image and produces a partial histogram.
-// the kernel is executed over multiple work-groups.  for each work-group a partial histogram is generated
-// partial_histogram is an array of num_groups * (257 * 3 * 32-bits/entry) entries
-// we store 257 Red bins, followed by 257 Green bins and then the 257 Blue bins.
+// clear the HISTOGRAM_SIZE * NUM_SUB_HISTOGRAMS entries of the work-group's local histogram.
+// all the work-items of the group must call it, and then wait on a barrier before counting pixels.
 //
-kernel
-void histogram_image_rgba_fp(image2d_t img, int num_pixels_per_workitem, global uint *histogram)
+void
+clear_local_histogram(local uint *tmp_histogram)
 {
     int     local_size = (int)get_local_size(0) * (int)get_local_size(1);
-    int     image_width = get_image_width(img);
-    int     image_height = get_image_height(img);
-    int     group_indx = mad24(get_group_id(1), get_num_groups(0), get_group_id(0)) * 257 * 3;
-    int     x = get_global_id(0);
-    int     y = get_global_id(1);
-    
-    local uint  tmp_histogram[257 * 3];
-        
     int     tid = mad24(get_local_id(1), get_local_size(0), get_local_id(0));
-    int     j = 257 * 3;
+    int     j = HISTOGRAM_SIZE * NUM_SUB_HISTOGRAMS;
     int     indx = 0;
-    
-    // clear the local buffer that will generate the partial histogram
+
     do
     {
         if (tid < j)
@@ -74,157 +231,501 @@ void histogram_image_rgba_fp(image2d_t img, int num_pixels_per_workitem, global
         j -= local_size;
         indx += local_size;
     } while (j > 0);
-    
+}
+
+//
+// count a pixel, given by the bin of each of its channels, in copy sub_histogram of the work-group's local histogram
+//
+void
+count_local_bins(const uint *bins, int sub_histogram, local uint *tmp_histogram)
+{
+    int     c;
+
+    for (c=0; c<NUM_CHANNELS; c++)
+        atom_inc(&tmp_histogram[(c * BINS_PER_CHANNEL + bins[c]) * NUM_SUB_HISTOGRAMS + sub_histogram]);
+}
+
+//
+// count the pixel at (x, y) in copy sub_histogram of the work-group's local histogram
+//
+void
+count_local_pixel(image2d_t img, int x, int y, int sub_histogram, local uint *tmp_histogram)
+{
+    float4  clr = read_imagef(img, CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST, (float2)(x, y));
+    uint    bins[4];
+
+    pixel_bins(clr, bins);
+    count_local_bins(bins, sub_histogram, tmp_histogram);
+}
+
+//
+// build the histogram of this work-group's pixels in tmp_histogram, HISTOGRAM_SIZE * NUM_SUB_HISTOGRAMS entries
+// of local memory.  all the work-items of the group must call it; the histogram is complete when it returns.
+//
+void
+build_local_histogram(image2d_t img, int num_pixels_per_workitem, local uint *tmp_histogram)
+{
+    int     image_width = get_image_width(img);
+    int     image_height = get_image_height(img);
+    int     x = get_global_id(0);
+    int     y = get_global_id(1);
+
+    int     tid = mad24(get_local_id(1), get_local_size(0), get_local_id(0));
+    int     sub_histogram = tid % NUM_SUB_HISTOGRAMS;
+
+    // clear the local buffer that will generate the partial histogram
+    clear_local_histogram(tmp_histogram);
+
     barrier(CLK_LOCAL_MEM_FENCE);
-    
+
     int     i, idx;
     for (i=0, idx=x; i<num_pixels_per_workitem; i++, idx+=get_global_size(0))
     {
         if ((idx < image_width) && (y < image_height))
-        {                
-            float4 clr = read_imagef(img, CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST, (float2)(idx, y));
-    
-            ushort   indx;
-            indx = convert_ushort_sat(min(clr.x, 1.0f) * 256.0f);
-            atom_inc(&tmp_histogram[indx]);
-
-            indx = convert_ushort_sat(min(clr.y, 1.0f) * 256.0f);
-            atom_inc(&tmp_histogram[257+indx]);
-
-            indx = convert_ushort_sat(min(clr.z, 1.0f) * 256.0f);
-            atom_inc(&tmp_histogram[514+indx]);
-        }
+            count_local_pixel(img, idx, y, sub_histogram, tmp_histogram);
     }
-    
-    barrier(CLK_LOCAL_MEM_FENCE);
 
-    // copy the partial histogram to appropriate location in histogram given by group_indx
-    if (local_size >= (257 * 3))
-    {
-        if (tid < (257 * 3))
-            histogram[group_indx + tid] = tmp_histogram[tid];
-    }
-    else
-    {
-        j = 257 * 3;
-        indx = 0;
-        do 
-        {
-            if (tid < j)
-                histogram[group_indx + indx + tid] = tmp_histogram[indx + tid];
-                
-            j -= local_size;
-            indx += local_size;
-        } while (j > 0);
-    }
+    barrier(CLK_LOCAL_MEM_FENCE);
 }
 
+//
+// entry i of the work-group's histogram: the sum of its sub-histograms
+//
+uint
+local_histogram_entry(local uint *tmp_histogram, int i)
+{
+    uint    bin = 0;
+    int     r;
 
-/***************************************************************************************************************/
+    for (r=0; r<NUM_SUB_HISTOGRAMS; r++)
+        bin += tmp_histogram[i * NUM_SUB_HISTOGRAMS + r];
+    return bin;
+}
 
 //
-// sum partial histogram results into final histogram bins
+// this kernel takes an RGBA input image and produces a partial histogram.
+// the kernel is executed over multiple work-groups.  for each work-group a partial histogram is generated
+// partial_histogram is an array of num_groups * (HISTOGRAM_SIZE * 32-bits/entry) entries
+// we store the BINS_PER_CHANNEL bins of the first channel, followed by those of the second channel and so on.
 //
-// num_groups is the number of work-groups used to compute partial histograms.
-// partial_histogram is an array of num_groups * (256 * 3 * 32-bits/entry) entries
-// we store 256 Red bins, followed by 256 Green bins and then the 256 Blue bins.
+kernel
+void histogram_image(image2d_t img, int num_pixels_per_workitem, global uint *histogram)
+{
+    int     local_size = (int)get_local_size(0) * (int)get_local_size(1);
+    int     group_indx = mad24(get_group_id(1), get_num_groups(0), get_group_id(0)) * HISTOGRAM_SIZE;
+    int     tid = mad24(get_local_id(1), get_local_size(0), get_local_id(0));
+    int     i;
+
+    local uint  tmp_histogram[HISTOGRAM_SIZE * NUM_SUB_HISTOGRAMS];
+
+    build_local_histogram(img, num_pixels_per_workitem, tmp_histogram);
+
+    // sum the sub-histograms and copy the partial histogram to appropriate location in histogram given by group_indx
+    for (i=tid; i<HISTOGRAM_SIZE; i+=local_size)
+        histogram[group_indx + i] = local_histogram_entry(tmp_histogram, i);
+}
+
 //
-// final summed results are returned in histogram.
+// single-pass alternative to histogram_image + histogram_sum_partial_results: each work-group adds its
+// histogram straight into the final histogram with global atomics, so there is no partial histogram buffer
+// to write and read back and no second pass over it.  only the non-zero entries are added, which for images
+// with a few dominant colors is a small fraction of them.  histogram must be cleared (histogram_clear) first.
 //
+#ifdef cl_khr_global_int32_base_atomics
 kernel
-void histogram_sum_partial_results_unorm8(global uint *partial_histogram, int num_groups, global uint *histogram)
+void histogram_image_single_pass(image2d_t img, int num_pixels_per_workitem, global uint *histogram)
 {
-    int     tid = (int)get_global_id(0);
-    int     group_indx;
-    int     n = num_groups;
-    uint    tmp_histogram;
+    int     local_size = (int)get_local_size(0) * (int)get_local_size(1);
+    int     tid = mad24(get_local_id(1), get_local_size(0), get_local_id(0));
+    int     i;
 
-    tmp_histogram = partial_histogram[tid];
-    
-    group_indx = 256*3;
-    while (--n > 0)
+    local uint  tmp_histogram[HISTOGRAM_SIZE * NUM_SUB_HISTOGRAMS];
+
+    build_local_histogram(img, num_pixels_per_workitem, tmp_histogram);
+
+    for (i=tid; i<HISTOGRAM_SIZE; i+=local_size)
     {
-        tmp_histogram += partial_histogram[group_indx + tid];
-        group_indx += 256*3;
+        uint    bin = local_histogram_entry(tmp_histogram, i);
+        if (bin)
+            atom_add(&histogram[i], bin);
     }
-    
-    histogram[tid] = tmp_histogram;
 }
+#endif
 
 //
-// this kernel takes a RGBA 8-bit / channel input image and produces a partial histogram.
-// the kernel is executed over multiple work-groups.  for each work-group a partial histogram is generated
-// partial_histogram is an array of num_groups * (256 * 3 * 32-bits/entry) entries
-// we store 256 Red bins, followed by 256 Green bins and then the 256 Blue bins.
+// the histograms of a list of rectangles of the image in one launch: the tiles of a grid for local contrast
+// (CLAHE-style equalization), or regions of interest for exposure metering.  regions[r] is (x, y, width,
+// height) of rectangle r, clipped to the image by the host; rectangles may overlap.  work-group r of
+// dimension 0 builds the histogram of rectangle r in local memory, its work-items stepping over the rectangle
+// in rows of get_local_size(0) pixels, and writes it to histograms[r * HISTOGRAM_SIZE], so the output is one
+// complete histogram per rectangle, in the order of regions, and needs no second pass.
 //
 kernel
-void histogram_image_rgba_unorm8(image2d_t img, int num_pixels_per_workitem, global uint *histogram)
+void histogram_image_regions(image2d_t img, global const int4 *regions, global uint *histograms)
 {
+    int4    region = regions[get_group_id(0)];
     int     local_size = (int)get_local_size(0) * (int)get_local_size(1);
-    int     image_width = get_image_width(img);
-    int     image_height = get_image_height(img);
-    int     group_indx = mad24(get_group_id(1), get_num_groups(0), get_group_id(0)) * 256 * 3;
-    int     x = get_global_id(0);
-    int     y = get_global_id(1);
-    
-    local uint  tmp_histogram[256 * 3];
-        
     int     tid = mad24(get_local_id(1), get_local_size(0), get_local_id(0));
-    int     j = 256 * 3;
-    int     indx = 0;
-    
-    // clear the local buffer that will generate the partial histogram
-    do
+    int     sub_histogram = tid % NUM_SUB_HISTOGRAMS;
+    int     group_indx = (int)get_group_id(0) * HISTOGRAM_SIZE;
+    int     x, y, i;
+
+    local uint  tmp_histogram[HISTOGRAM_SIZE * NUM_SUB_HISTOGRAMS];
+
+    clear_local_histogram(tmp_histogram);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (y=region.y+(int)get_local_id(1); y<region.y+region.w; y+=(int)get_local_size(1))
     {
-        if (tid < j)
-            tmp_histogram[indx+tid] = 0;
+        for (x=region.x+(int)get_local_id(0); x<region.x+region.z; x+=(int)get_local_size(0))
+            count_local_pixel(img, x, y, sub_histogram, tmp_histogram);
+    }
 
-        j -= local_size;
-        indx += local_size;
-    } while (j > 0);
-    
     barrier(CLK_LOCAL_MEM_FENCE);
-    
+
+    for (i=tid; i<HISTOGRAM_SIZE; i+=local_size)
+        histograms[group_indx + i] = local_histogram_entry(tmp_histogram, i);
+}
+
+//
+// batched histograms of many small images in one pair of launches, for thumbnails and the like, where creating
+// an image and launching the kernels for each would cost more than the histograms.  the images are packed one
+// after the other in a buffer of RGBA pixels in the input format (uchar, ushort or float channels);
+// images[i] = (offset, width, height, 0) gives the offset of image i, in pixels, and its size; the fourth
+// field is unused.  the offsets are ints, so the host keeps a batch below 2^31 pixels.
+//
+// work-group (g, i) histograms every get_num_groups(0)-th run of get_local_size(0) pixels of image i, starting
+// with run g, into partial_histogram[(i * get_num_groups(0) + g) * HISTOGRAM_SIZE]; the host picks the number of
+// work-groups per image from the largest image.  histogram_batch_sum_partial_results then sums each image's
+// partial histograms into histograms[i * HISTOGRAM_SIZE].
+//
+#if INPUT_MAX == 255
+typedef uchar   channel_t;
+#elif INPUT_MAX
+typedef ushort  channel_t;
+#else
+typedef float   channel_t;
+#endif
+
+kernel
+void histogram_batch(global const channel_t *pixels, global const int4 *images, global uint *partial_histogram)
+{
+    int4    image = images[get_group_id(1)];
+    int     local_size = (int)get_local_size(0);
+    int     tid = (int)get_local_id(0);
+    int     sub_histogram = tid % NUM_SUB_HISTOGRAMS;
+    int     num_pixels = image.y * image.z;
+    int     group_indx = mad24((int)get_group_id(1), (int)get_num_groups(0), (int)get_group_id(0)) * HISTOGRAM_SIZE;
     int     i, idx;
-    for (i=0, idx=x; i<num_pixels_per_workitem; i++, idx+=get_global_size(0))
+
+    local uint  tmp_histogram[HISTOGRAM_SIZE * NUM_SUB_HISTOGRAMS];
+
+    clear_local_histogram(tmp_histogram);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (idx=(int)get_global_id(0); idx<num_pixels; idx+=(int)get_global_size(0))
     {
-        if ((idx < image_width) && (y < image_height))
-        {                
-            float4 clr = read_imagef(img, CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST, (float2)(idx, y));
-    
-            uchar   indx_x, indx_y, indx_z;
-            indx_x = convert_uchar_sat(clr.x * 255.0f);
-            indx_y = convert_uchar_sat(clr.y * 255.0f);
-            indx_z = convert_uchar_sat(clr.z * 255.0f);
-            atom_inc(&tmp_histogram[indx_x]);
-            atom_inc(&tmp_histogram[256+(uint)indx_y]);
-            atom_inc(&tmp_histogram[512+(uint)indx_z]);
-        }
+        global const channel_t  *p = pixels + ((size_t)image.x + idx) * 4;
+        uint    bins[4];
+
+#if INPUT_MAX
+        level_bins(p[0], p[1], p[2], p[3], bins);
+#else
+        pixel_bins((float4)(p[0], p[1], p[2], p[3]), bins);
+#endif
+        count_local_bins(bins, sub_histogram, tmp_histogram);
     }
-    
+
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    // copy the partial histogram to appropriate location in histogram given by group_indx
-    if (local_size >= (256 * 3))
+    for (i=tid; i<HISTOGRAM_SIZE; i+=local_size)
+        partial_histogram[group_indx + i] = local_histogram_entry(tmp_histogram, i);
+}
+
+//
+// sum the groups_per_image partial histograms of each of the num_images images of histogram_batch into its
+// histogram.  a work-item per entry of the num_images histograms.
+//
+kernel
+void histogram_batch_sum_partial_results(global const uint *partial_histogram, int groups_per_image, int num_images, global uint *histograms)
+{
+    int     tid = (int)get_global_id(0);
+    int     image = tid / HISTOGRAM_SIZE;
+    int     entry = tid - image * HISTOGRAM_SIZE;
+    uint    sum = 0;
+    int     g;
+
+    if (image >= num_images)
+        return;
+
+    partial_histogram += image * groups_per_image * HISTOGRAM_SIZE + entry;
+    for (g=0; g<groups_per_image; g++)
+        sum += partial_histogram[g * HISTOGRAM_SIZE];
+    histograms[tid] = sum;
+}
+
+//
+// the stages that follow the histogram on the device, for exposure correction without reading the histogram back:
+// histogram_cdf, then histogram_percentiles and histogram_build_lut, then histogram_apply_lut.  each channel's
+// BINS_PER_CHANNEL entries are handled on their own.
+//
+
+//
+// the cumulative histogram of each channel: cdf[b] = histogram[0] + ... + histogram[b] within the channel.
+// work-group c scans channel c: each of its work-items sums a run of bins, the run sums are scanned in local
+// memory, and each work-item then writes the cdf of its run.  the work-group size must be 256 or less.
+//
+kernel
+void histogram_cdf(global const uint *histogram, global uint *cdf)
+{
+    local uint  sums[256];
+    int     lid = (int)get_local_id(0);
+    int     local_size = (int)get_local_size(0);
+    int     base = (int)get_group_id(0) * BINS_PER_CHANNEL;
+    int     run = (BINS_PER_CHANNEL + local_size - 1) / local_size;
+    int     b0 = min(lid * run, BINS_PER_CHANNEL);
+    int     b1 = min(b0 + run, BINS_PER_CHANNEL);
+    uint    sum = 0;
+    int     b, offset;
+
+    for (b=b0; b<b1; b++)
+        sum += histogram[base + b];
+    sums[lid] = sum;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // inclusive scan of the run sums
+    for (offset=1; offset<local_size; offset<<=1)
+    {
+        uint    v = (lid >= offset) ? sums[lid - offset] : 0;
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+        sums[lid] += v;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    sum = lid ? sums[lid - 1] : 0;
+    for (b=b0; b<b1; b++)
+    {
+        sum += histogram[base + b];
+        cdf[base + b] = sum;
+    }
+}
+
+//
+// the first bin of the channel starting at cdf whose cumulative count reaches count
+//
+int
+cdf_search(global const uint *cdf, uint count)
+{
+    int     lo = 0, hi = BINS_PER_CHANNEL - 1;
+
+    while (lo < hi)
     {
-        if (tid < (256 * 3))
-            histogram[group_indx + tid] = tmp_histogram[tid];
+        int     mid = (lo + hi) >> 1;
+
+        if (cdf[mid] >= count)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+//
+// the bin of percentile p (0 to 100) of a channel: the first bin at which the cdf reaches p% of the count,
+// and at least 1
+//
+int
+percentile_bin(global const uint *cdf, float p)
+{
+    uint    total = cdf[BINS_PER_CHANNEL - 1];
+    uint    count = convert_uint_sat(ceil(p * 0.01f * (float)total));
+
+    return cdf_search(cdf, max(count, 1u));
+}
+
+//
+// bins[c * num_percentiles + k] = the bin of percentiles[k] in channel c, e.g. p1 and p99 for auto-levels.
+// a work-item per channel and percentile.
+//
+kernel
+void histogram_percentiles(global const uint *cdf, global const float *percentiles, int num_percentiles, global int *bins)
+{
+    int     tid = (int)get_global_id(0);
+    int     c = tid / max(num_percentiles, 1);
+
+    if (tid >= NUM_CHANNELS * num_percentiles)
+        return;
+
+    bins[tid] = percentile_bin(cdf + c * BINS_PER_CHANNEL, percentiles[tid - c * num_percentiles]);
+}
+
+//
+// the tone curve of each channel, lut[c * BINS_PER_CHANNEL + b] = the output value in [0, 1] of bin b of channel
+// c.  with auto_levels, the bins from bins[c * 2] (the low percentile) to bins[c * 2 + 1] (the high one) are
+// stretched over [0, 1]; otherwise the curve is the channel's cdf rescaled to [0, 1] from its first non-empty
+// bin, which equalizes the histogram.  a work-item per entry.
+//
+kernel
+void histogram_build_lut(global const uint *cdf, global const int *bins, int auto_levels, global float *lut)
+{
+    int     tid = (int)get_global_id(0);
+    int     c = tid / BINS_PER_CHANNEL;
+    int     b = tid - c * BINS_PER_CHANNEL;
+
+    if (tid >= HISTOGRAM_SIZE)
+        return;
+
+    if (auto_levels)
+    {
+        float   lo = (float)bins[c * 2];
+        float   hi = (float)bins[c * 2 + 1] + 1.0f;
+
+        lut[tid] = clamp(((float)b + 0.5f - lo) / (hi - lo), 0.0f, 1.0f);
     }
     else
     {
-        j = 256 * 3;
-        indx = 0;
-        do 
-        {
-            if (tid < j)
-                histogram[group_indx + indx + tid] = tmp_histogram[indx + tid];
-                
-            j -= local_size;
-            indx += local_size;
-        } while (j > 0);
+        global const uint   *channel_cdf = cdf + c * BINS_PER_CHANNEL;
+        uint    total = channel_cdf[BINS_PER_CHANNEL - 1];
+        uint    first = channel_cdf[cdf_search(channel_cdf, 1)];
+
+        if (total > first)
+            lut[tid] = (channel_cdf[b] > first) ? (float)(channel_cdf[b] - first) / (float)(total - first) : 0.0f;
+        else
+            lut[tid] = (float)b / (float)max(BINS_PER_CHANNEL - 1, 1);
     }
 }
 
+//
+// write img through the tone curves of lut to out, an image of the same size.  rgb and rgba channels go through
+// their own curve.  for luma and hsv the pixel is scaled by the curve of its luma or value, which keeps its hue
+// and saturation.
+//
+kernel
+void histogram_apply_lut(image2d_t img, global const float *lut, write_only image2d_t out)
+{
+    int     x = get_global_id(0);
+    int     y = get_global_id(1);
+    float4  clr, result;
+    uint    bins[4];
+
+    if ((x >= get_image_width(img)) || (y >= get_image_height(img)))
+        return;
+
+    clr = read_imagef(img, CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST, (float2)(x, y));
+    pixel_bins(clr, bins);
+
+#if CHANNELS == CHANNELS_LUMA || CHANNELS == CHANNELS_HSV
+#if CHANNELS == CHANNELS_LUMA
+    float   intensity = 0.299f * clr.x + 0.587f * clr.y + 0.114f * clr.z;
+    float   target = lut[bins[0]];
+#else
+    float   intensity = max(max(clr.x, clr.y), clr.z);
+    float   target = lut[2 * BINS_PER_CHANNEL + bins[2]];
+#endif
+    if (intensity > 0.0f)
+    {
+        float   gain = target / intensity;
+        result = (float4)(clr.x * gain, clr.y * gain, clr.z * gain, clr.w);
+    }
+    else
+        result = (float4)(target, target, target, clr.w);
+#else
+    result.x = lut[bins[0]];
+    result.y = lut[BINS_PER_CHANNEL + bins[1]];
+    result.z = lut[2 * BINS_PER_CHANNEL + bins[2]];
+#if CHANNELS == CHANNELS_RGBA
+    result.w = lut[3 * BINS_PER_CHANNEL + bins[3]];
+#else
+    result.w = clr.w;
+#endif
+#endif
+
+    write_imagef(out, (int2)(x, y), result);
+}
+
+#if CHANNELS == CHANNELS_YUV && INPUT_MAX == 255
 
+//
+// the histogram of a planar 8-bit YUV 4:2:0 frame read straight from a buffer, 1.5 bytes per pixel instead of the
+// 4 of an RGBA image: the width x height Y plane, followed for NV12 by one plane of interleaved U and V samples
+// or for I420 by the U plane then the V plane, each chroma plane (width + 1) / 2 x (height + 1) / 2 samples with
+// no row padding.  the result is the Y histogram of the pixels followed by the U and V histograms of the chroma
+// samples, partial histograms per work-group as histogram_image writes them for histogram_sum_partial_results.
+//
+// the work-items cover the chroma sample grid: each counts num_pixels_per_workitem chroma samples along x, a
+// sample's U and V and the 2 x 2 Y pixels it covers.
+//
+void
+count_local_level(local uint *tmp_histogram, int c, uint level, int sub_histogram)
+{
+    atom_inc(&tmp_histogram[(c * BINS_PER_CHANNEL + bin_of_level(level)) * NUM_SUB_HISTOGRAMS + sub_histogram]);
+}
+
+kernel
+void histogram_yuv(global const uchar *frame, int width, int height, int nv12, int num_pixels_per_workitem, global uint *histogram)
+{
+    int     local_size = (int)get_local_size(0) * (int)get_local_size(1);
+    int     group_indx = mad24(get_group_id(1), get_num_groups(0), get_group_id(0)) * HISTOGRAM_SIZE;
+    int     tid = mad24(get_local_id(1), get_local_size(0), get_local_id(0));
+    int     sub_histogram = tid % NUM_SUB_HISTOGRAMS;
+    int     chroma_width = (width + 1) >> 1;
+    int     chroma_height = (height + 1) >> 1;
+    int     y = get_global_id(1);
+    int     i, x, lx, ly;
+
+    global const uchar  *chroma = frame + width * height;
+
+    local uint  tmp_histogram[HISTOGRAM_SIZE * NUM_SUB_HISTOGRAMS];
+
+    clear_local_histogram(tmp_histogram);
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (y < chroma_height)
+    {
+        for (i=0, x=get_global_id(0); i<num_pixels_per_workitem && x<chroma_width; i++, x+=get_global_size(0))
+        {
+            int     c = mad24(y, chroma_width, x);
+
+            if (nv12)
+            {
+                count_local_level(tmp_histogram, 1, chroma[2 * c], sub_histogram);
+                count_local_level(tmp_histogram, 2, chroma[2 * c + 1], sub_histogram);
+            }
+            else
+            {
+                count_local_level(tmp_histogram, 1, chroma[c], sub_histogram);
+                count_local_level(tmp_histogram, 2, chroma[chroma_width * chroma_height + c], sub_histogram);
+            }
 
+            for (ly=2*y; ly<min(2*y+2, height); ly++)
+            {
+                for (lx=2*x; lx<min(2*x+2, width); lx++)
+                    count_local_level(tmp_histogram, 0, frame[mad24(ly, width, lx)], sub_histogram);
+            }
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (i=tid; i<HISTOGRAM_SIZE; i+=local_size)
+        histogram[group_indx + i] = local_histogram_entry(tmp_histogram, i);
+}
 
+#endif
+
+//
+// zero the HISTOGRAM_SIZE entries of histogram, ahead of histogram_image_single_pass
+//
+kernel
+void histogram_clear(global uint *histogram)
+{
+    int     tid = (int)get_global_id(0);
+
+    if (tid < HISTOGRAM_SIZE)
+        histogram[tid] = 0;
+}
@@ -0,0 +1,132 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Timed repetitions of the SpMV kernel.                                             */
+/*                                                                                   */
+/* The kernel is launched "warmup" times untimed (first launches pay for lazy        */
+/* allocation, cache warming and clock ramp-up), and then "reps" times timed.  Each  */
+/* launch waits on the one before it, so that on an out-of-order queue they still    */
+/* run back to back and never overlap, and each one is timed from its own profiling  */
+/* event.  With a target time, "reps" is calibrated from the warmup runs.           */
+/* ================================================================================= */
+
+static int compare_double(const void *a, const void *b)
+{
+   double x = *(const double *) a;
+   double y = *(const double *) b;
+   return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Wait for the first n launches of a chain, and release their events. */
+static void bench_drain(cl_event *events, unsigned int n)
+{
+   unsigned int i;
+
+   if (n > 0) clWaitForEvents(1, &events[n-1]);
+   for (i=0; i<n; ++i) clReleaseEvent(events[i]);
+}
+
+/* Returns the error of a failed launch (reported here), for the caller to act on. */
+cl_int bench_kernel(cl_command_queue queue, cl_kernel kernel, cl_uint ndims, size_t *global_work_size, size_t *local_work_size,
+                    unsigned int warmup, unsigned int reps, double target_seconds, stats_struct *st)
+{
+   cl_int rc;
+   cl_event *events;
+   double *ms, total_ms, warm_ms = 0.0;
+   unsigned int i;
+
+   if (warmup == 0) warmup = 1;
+   events = (cl_event *) malloc((warmup > BENCH_MAX_REPS ? warmup : BENCH_MAX_REPS) * sizeof(cl_event));
+   ms = (double *) malloc(BENCH_MAX_REPS * sizeof(double));
+   if (events == NULL || ms == NULL) {
+      printf("Failed allocation of the benchmark's events and times\n");
+      free(events);
+      free(ms);
+      return CL_OUT_OF_HOST_MEMORY;
+   }
+
+   for (i=0; i<warmup; ++i) {
+      rc = clEnqueueNDRangeKernel(queue, kernel, ndims, NULL, global_work_size, local_work_size, (i > 0) ? 1 : 0, (i > 0) ? &events[i-1] : NULL, &events[i]);
+      if (rc != CL_SUCCESS) {
+         printf("clEnqueueNDRangeKernel(warmup) failed. rc = %d\n", rc);
+         bench_drain(events, i);
+         free(events);
+         free(ms);
+         return rc;
+      }
+   }
+   clWaitForEvents(1, &events[warmup-1]);
+   for (i=0; i<warmup; ++i) {
+      /* Calibrate from the fastest warmup run: the first one is often much slower. */
+      double t = stats_event_ms(events[i]);
+      if (i == 0 || t < warm_ms) warm_ms = t;
+      clReleaseEvent(events[i]);
+   }
+
+   if (target_seconds > 0.0) {
+      reps = (warm_ms > 0.0) ? (unsigned int) (1000.0 * target_seconds / warm_ms) : BENCH_MAX_REPS;
+   }
+   if (reps < BENCH_MIN_REPS) reps = BENCH_MIN_REPS;
+   if (reps > BENCH_MAX_REPS) reps = BENCH_MAX_REPS;
+
+   for (i=0; i<reps; ++i) {
+      rc = clEnqueueNDRangeKernel(queue, kernel, ndims, NULL, global_work_size, local_work_size, (i > 0) ? 1 : 0, (i > 0) ? &events[i-1] : NULL, &events[i]);
+      if (rc != CL_SUCCESS) {
+         printf("clEnqueueNDRangeKernel(bench) failed. rc = %d\n", rc);
+         bench_drain(events, i);
+         free(events);
+         free(ms);
+         return rc;
+      }
+   }
+   clWaitForEvents(1, &events[reps-1]);
+
+   total_ms = 0.0;
+   for (i=0; i<reps; ++i) {
+      ms[i] = stats_event_ms(events[i]);
+      total_ms += ms[i];
+      clReleaseEvent(events[i]);
+   }
+   bench_summarize(ms, reps, total_ms, st);
+
+   free(ms);
+   free(events);
+   return CL_SUCCESS;
+}
+
+/* Sort "reps" run times (in ms) and record their min, median, p95 and mean. */
+void bench_summarize(double *ms, unsigned int reps, double total_ms, stats_struct *st)
+{
+   qsort(ms, reps, sizeof(double), compare_double);
+
+   st->runs = reps;
+   st->kernel_ms_min = ms[0];
+   st->kernel_ms_median = (reps & 1) ? ms[reps/2] : 0.5 * (ms[reps/2 - 1] + ms[reps/2]);
+   st->kernel_ms_p95 = ms[(unsigned int) (0.95 * (reps - 1) + 0.5)];
+   st->kernel_ms_avg = total_ms / reps;
+}
+
+/* One CSV line per run, prefixed so it can be grepped out of the rest of the output. */
+/* Rates here are at the median time, which is the number to compare across runs.   */
+void bench_csv(stats_struct *st)
+{
+   double seconds = 1.0e-3 * st->kernel_ms_median;
+   double gflops = (seconds > 0.0) ? 1.0e-9 * 2.0 * (double) st->non_zero * st->nrhs / seconds : 0.0;
+   double gbs = (seconds > 0.0) ? 1.0e-9 * (double) st->bytes_per_call / seconds : 0.0;
+
+   printf("BENCH,matrix,device,format,kernel,nrhs,rows,cols,non_zero,reps,min_ms,median_ms,p95_ms,gflops,gbytes_per_sec\n");
+   printf("BENCH,%s,%s,%s,%s,%u,%u,%u,%u,%u,%.6f,%.6f,%.6f,%.4f,%.4f\n",
+          st->file_name, st->device_name, st->format, st->kernel, st->nrhs, st->ny, st->nx, st->non_zero, st->runs,
+          st->kernel_ms_min, st->kernel_ms_median, st->kernel_ms_p95, gflops, gbs);
+}
@@ -0,0 +1,459 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_SPMV_X86 1
+#include <immintrin.h>
+#endif
+
+/* ================================================================================= */
+/* Native multithreaded SpMV on the host CPU, as a baseline for the OpenCL kernels   */
+/* and as a fallback where the OpenCL CPU runtime is slow.                           */
+/*                                                                                   */
+/* The matrix is used either straight from the CSR arrays, or rebuilt as SELL-8-sigma */
+/* (slices of 8 rows, one AVX2 vector, stored column-major).  Rows (or slices) are   */
+/* split between the threads so that each thread gets about the same number of      */
+/* stored elements.  The inner loops gather the input vector with AVX-512 or AVX2    */
+/* when the CPU has them, chosen at run time, and fall back to plain C otherwise.    */
+/* The threads are started once, in cpu_spmv_setup(), and wait on a barrier between */
+/* multiplies, so that a multiply costs no thread creation.                          */
+/* ================================================================================= */
+
+#define ISA_SCALAR 0
+#define ISA_AVX2   1
+#define ISA_AVX512 2
+
+#define NO_ROW 0xffffffff
+
+/* A reusable barrier (pthread_barrier_t is not available everywhere). */
+typedef struct {
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+   unsigned int count, waiting, generation;
+} pool_barrier;
+
+typedef struct {
+   cpu_spmv_struct *cs;
+   pthread_t threads[CPU_MAX_THREADS];
+   pool_barrier start, done;
+   const float *x;
+   float *y;
+   int quit;
+} thread_pool;
+
+typedef struct {
+   thread_pool *pool;
+   unsigned int id;
+} worker_arg;
+
+static void barrier_init(pool_barrier *b, unsigned int count)
+{
+   pthread_mutex_init(&b->mutex, NULL);
+   pthread_cond_init(&b->cond, NULL);
+   b->count = count;
+   b->waiting = 0;
+   b->generation = 0;
+}
+
+static void barrier_wait(pool_barrier *b)
+{
+   unsigned int generation;
+
+   pthread_mutex_lock(&b->mutex);
+   generation = b->generation;
+   if (++b->waiting == b->count) {
+      b->waiting = 0;
+      ++b->generation;
+      pthread_cond_broadcast(&b->cond);
+   }
+   else {
+      while (generation == b->generation) pthread_cond_wait(&b->cond, &b->mutex);
+   }
+   pthread_mutex_unlock(&b->mutex);
+}
+
+static void barrier_destroy(pool_barrier *b)
+{
+   pthread_mutex_destroy(&b->mutex);
+   pthread_cond_destroy(&b->cond);
+}
+
+/* ================================================================================= */
+/* Inner loops.  Each one covers rows [r0, r1) of the CSR matrix, or slices          */
+/* [s0, s1) of the SELL matrix.                                                      */
+/* ================================================================================= */
+
+static void csr_rows_scalar(const cpu_spmv_struct *cs, unsigned int r0, unsigned int r1, const float *x, float *y)
+{
+   unsigned int i, j;
+
+   for (i=r0; i<r1; ++i) {
+      float t = 0.0f;
+      for (j=cs->row_index_array[i]; j<cs->row_index_array[i+1]; ++j) {
+         t += cs->data_array[j] * x[cs->x_index_array[j]];
+      }
+      y[i] = t;
+   }
+}
+
+static void sell_slices_scalar(const cpu_spmv_struct *cs, unsigned int s0, unsigned int s1, const float *x, float *y)
+{
+   unsigned int s, i, k;
+
+   for (s=s0; s<s1; ++s) {
+      float t[CPU_SELL_C];
+      unsigned int base = cs->slice_ptr[s];
+      unsigned int width = (cs->slice_ptr[s+1] - base) / CPU_SELL_C;
+      for (i=0; i<CPU_SELL_C; ++i) t[i] = 0.0f;
+      for (k=0; k<width; ++k) {
+         for (i=0; i<CPU_SELL_C; ++i) {
+            t[i] += cs->sell_val[base + k*CPU_SELL_C + i] * x[cs->sell_col[base + k*CPU_SELL_C + i]];
+         }
+      }
+      for (i=0; i<CPU_SELL_C; ++i) {
+         if (cs->sell_row[s*CPU_SELL_C + i] != NO_ROW) y[cs->sell_row[s*CPU_SELL_C + i]] = t[i];
+      }
+   }
+}
+
+#ifdef CPU_SPMV_X86
+
+__attribute__((target("avx2,fma")))
+static void csr_rows_avx2(const cpu_spmv_struct *cs, unsigned int r0, unsigned int r1, const float *x, float *y)
+{
+   unsigned int i, j, ub;
+
+   for (i=r0; i<r1; ++i) {
+      __m256 acc = _mm256_setzero_ps();
+      __m128 sum;
+      float t;
+
+      ub = cs->row_index_array[i+1];
+      for (j=cs->row_index_array[i]; j+8<=ub; j+=8) {
+         __m256i idx = _mm256_loadu_si256((const __m256i *) &cs->x_index_array[j]);
+         __m256 val = _mm256_loadu_ps(&cs->data_array[j]);
+         acc = _mm256_fmadd_ps(val, _mm256_i32gather_ps(x, idx, 4), acc);
+      }
+      sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+      sum = _mm_hadd_ps(sum, sum);
+      sum = _mm_hadd_ps(sum, sum);
+      t = _mm_cvtss_f32(sum);
+      for (; j<ub; ++j) {
+         t += cs->data_array[j] * x[cs->x_index_array[j]];
+      }
+      y[i] = t;
+   }
+}
+
+__attribute__((target("avx2,fma")))
+static void sell_slices_avx2(const cpu_spmv_struct *cs, unsigned int s0, unsigned int s1, const float *x, float *y)
+{
+   unsigned int s, i, k;
+
+   for (s=s0; s<s1; ++s) {
+      float t[CPU_SELL_C];
+      unsigned int base = cs->slice_ptr[s];
+      unsigned int width = (cs->slice_ptr[s+1] - base) / CPU_SELL_C;
+      __m256 acc = _mm256_setzero_ps();
+      for (k=0; k<width; ++k) {
+         __m256i idx = _mm256_loadu_si256((const __m256i *) &cs->sell_col[base + k*CPU_SELL_C]);
+         __m256 val = _mm256_loadu_ps(&cs->sell_val[base + k*CPU_SELL_C]);
+         acc = _mm256_fmadd_ps(val, _mm256_i32gather_ps(x, idx, 4), acc);
+      }
+      _mm256_storeu_ps(t, acc);
+      for (i=0; i<CPU_SELL_C; ++i) {
+         if (cs->sell_row[s*CPU_SELL_C + i] != NO_ROW) y[cs->sell_row[s*CPU_SELL_C + i]] = t[i];
+      }
+   }
+}
+
+__attribute__((target("avx512f")))
+static void csr_rows_avx512(const cpu_spmv_struct *cs, unsigned int r0, unsigned int r1, const float *x, float *y)
+{
+   unsigned int i, j, ub;
+
+   for (i=r0; i<r1; ++i) {
+      __m512 acc = _mm512_setzero_ps();
+
+      ub = cs->row_index_array[i+1];
+      for (j=cs->row_index_array[i]; j+16<=ub; j+=16) {
+         __m512i idx = _mm512_loadu_si512((const void *) &cs->x_index_array[j]);
+         __m512 val = _mm512_loadu_ps(&cs->data_array[j]);
+         acc = _mm512_fmadd_ps(val, _mm512_i32gather_ps(idx, x, 4), acc);
+      }
+      /* The tail of the row is a masked load and gather rather than a scalar loop. */
+      if (j < ub) {
+         __mmask16 m = (__mmask16) ((1u << (ub - j)) - 1);
+         __m512i idx = _mm512_maskz_loadu_epi32(m, (const void *) &cs->x_index_array[j]);
+         __m512 val = _mm512_maskz_loadu_ps(m, &cs->data_array[j]);
+         acc = _mm512_fmadd_ps(val, _mm512_mask_i32gather_ps(_mm512_setzero_ps(), m, idx, x, 4), acc);
+      }
+      y[i] = _mm512_reduce_add_ps(acc);
+   }
+}
+
+#endif
+
+/* Thread "id" does its share of the multiply. */
+static void cpu_spmv_part(cpu_spmv_struct *cs, unsigned int id, const float *x, float *y)
+{
+   unsigned int lo = cs->bounds[id], hi = cs->bounds[id+1];
+
+   if (cs->layout == CPU_LAYOUT_SELL) {
+#ifdef CPU_SPMV_X86
+      /* A slice is one AVX2 vector high, so AVX-512 machines run the AVX2 loop here. */
+      if (cs->isa != ISA_SCALAR) {
+         sell_slices_avx2(cs, lo, hi, x, y);
+         return;
+      }
+#endif
+      sell_slices_scalar(cs, lo, hi, x, y);
+      return;
+   }
+#ifdef CPU_SPMV_X86
+   if (cs->isa == ISA_AVX512) {
+      csr_rows_avx512(cs, lo, hi, x, y);
+      return;
+   }
+   if (cs->isa == ISA_AVX2) {
+      csr_rows_avx2(cs, lo, hi, x, y);
+      return;
+   }
+#endif
+   csr_rows_scalar(cs, lo, hi, x, y);
+}
+
+static void *cpu_spmv_worker(void *arg)
+{
+   worker_arg *wa = (worker_arg *) arg;
+   thread_pool *pool = wa->pool;
+   unsigned int id = wa->id;
+
+   free(wa);
+   while (1) {
+      barrier_wait(&pool->start);
+      if (pool->quit) break;
+      cpu_spmv_part(pool->cs, id, pool->x, pool->y);
+      barrier_wait(&pool->done);
+   }
+   return NULL;
+}
+
+/* Split [0, n) into "nparts" ranges holding about the same share of ptr[n] elements. */
+static void balance(const unsigned int *ptr, unsigned int n, unsigned int nparts, unsigned int *bounds)
+{
+   unsigned int t, lo, hi, mid;
+   unsigned long long target;
+
+   bounds[0] = 0;
+   for (t=1; t<nparts; ++t) {
+      target = ((unsigned long long) ptr[n] * t) / nparts;
+      lo = bounds[t-1];
+      hi = n;
+      while (lo < hi) {
+         mid = lo + (hi - lo) / 2;
+         if (ptr[mid] < target) lo = mid + 1;
+         else hi = mid;
+      }
+      bounds[t] = lo;
+   }
+   bounds[nparts] = n;
+}
+
+/* ================================================================================= */
+/* Build the chosen layout, split it between "nthreads" threads (0 for one per      */
+/* online processor), and start the threads.  Returns 0 on success.                  */
+/* ================================================================================= */
+
+int cpu_spmv_setup(cpu_spmv_struct *cs, unsigned int layout, unsigned int nthreads, unsigned int ny, unsigned int non_zero,
+                   unsigned int *row_index_array, unsigned int *x_index_array, float *data_array)
+{
+   unsigned int preferred_alignment = 64; // used by "MEMORY_ALLOC_CHECK" macro
+   unsigned int i, j, s, t;
+   thread_pool *pool;
+
+   if (nthreads == 0) nthreads = (unsigned int) sysconf(_SC_NPROCESSORS_ONLN);
+   if (nthreads < 1) nthreads = 1;
+   if (nthreads > CPU_MAX_THREADS) nthreads = CPU_MAX_THREADS;
+
+   cs->layout = layout;
+   cs->ny = ny;
+   cs->row_index_array = row_index_array;
+   cs->x_index_array = x_index_array;
+   cs->data_array = data_array;
+   cs->slice_ptr = cs->sell_col = cs->sell_row = NULL;
+   cs->sell_val = NULL;
+
+   cs->isa = ISA_SCALAR;
+#ifdef CPU_SPMV_X86
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx512f")) cs->isa = ISA_AVX512;
+   else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) cs->isa = ISA_AVX2;
+#endif
+   cs->isa_name = (cs->isa == ISA_AVX512) ? "avx512" : ((cs->isa == ISA_AVX2) ? "avx2" : "scalar");
+
+   if (layout == CPU_LAYOUT_SELL) {
+      /* The same construction as the OpenCL SELL format (see formats.c), with C fixed at 8. */
+      unsigned int sigma = CPU_SELL_C * 8;
+      unsigned int w;
+
+      cs->nslices = (ny + CPU_SELL_C - 1) / CPU_SELL_C;
+      MEMORY_ALLOC_CHECK(cs->sell_row, (size_t) cs->nslices * CPU_SELL_C * sizeof(unsigned int), "native sell_row")
+      MEMORY_ALLOC_CHECK(cs->slice_ptr, (cs->nslices + 1) * sizeof(unsigned int), "native slice_ptr")
+      for (i=0; i<cs->nslices*CPU_SELL_C; ++i) cs->sell_row[i] = (i < ny) ? i : NO_ROW;
+
+      for (w=0; w<ny; w+=sigma) {
+         unsigned int end = (w + sigma < ny) ? w + sigma : ny;
+         for (i=w+1; i<end; ++i) {
+            unsigned int r = cs->sell_row[i];
+            unsigned int len = row_index_array[r+1] - row_index_array[r];
+            j = i;
+            while (j > w && row_index_array[cs->sell_row[j-1]+1] - row_index_array[cs->sell_row[j-1]] < len) {
+               cs->sell_row[j] = cs->sell_row[j-1];
+               --j;
+            }
+            cs->sell_row[j] = r;
+         }
+      }
+
+      cs->slice_ptr[0] = 0;
+      for (s=0; s<cs->nslices; ++s) {
+         unsigned int width = 0;
+         for (i=s*CPU_SELL_C; i<(s+1)*CPU_SELL_C; ++i) {
+            if (cs->sell_row[i] != NO_ROW) {
+               unsigned int len = row_index_array[cs->sell_row[i]+1] - row_index_array[cs->sell_row[i]];
+               if (len > width) width = len;
+            }
+         }
+         cs->slice_ptr[s+1] = cs->slice_ptr[s] + width * CPU_SELL_C;
+      }
+
+      /* Padding points at column 0 with a zero value, so the gathers never need a mask. */
+      MEMORY_ALLOC_CHECK(cs->sell_col, (size_t) cs->slice_ptr[cs->nslices] * sizeof(unsigned int) + sizeof(unsigned int), "native sell_col")
+      MEMORY_ALLOC_CHECK(cs->sell_val, (size_t) cs->slice_ptr[cs->nslices] * sizeof(float) + sizeof(float), "native sell_val")
+      memset(cs->sell_col, 0, (size_t) cs->slice_ptr[cs->nslices] * sizeof(unsigned int));
+      memset(cs->sell_val, 0, (size_t) cs->slice_ptr[cs->nslices] * sizeof(float));
+      for (s=0; s<cs->nslices; ++s) {
+         for (i=0; i<CPU_SELL_C; ++i) {
+            unsigned int r = cs->sell_row[s*CPU_SELL_C + i];
+            if (r == NO_ROW) continue;
+            for (j=row_index_array[r]; j<row_index_array[r+1]; ++j) {
+               size_t k = cs->slice_ptr[s] + (size_t) (j - row_index_array[r]) * CPU_SELL_C + i;
+               cs->sell_col[k] = x_index_array[j];
+               cs->sell_val[k] = data_array[j];
+            }
+         }
+      }
+      cs->bytes = (cs->nslices + 1) * sizeof(unsigned int) + (unsigned long long) cs->slice_ptr[cs->nslices] * (sizeof(unsigned int) + sizeof(float))
+                + (unsigned long long) cs->nslices * CPU_SELL_C * sizeof(unsigned int);
+      if (nthreads > cs->nslices) nthreads = (cs->nslices > 0) ? cs->nslices : 1;
+      MEMORY_ALLOC_CHECK(cs->bounds, (nthreads + 1) * sizeof(unsigned int), "native bounds")
+      balance(cs->slice_ptr, cs->nslices, nthreads, cs->bounds);
+      printf("native sell-%d-%d: %d slices, fill %.2f\n", CPU_SELL_C, sigma, cs->nslices,
+             (cs->slice_ptr[cs->nslices] > 0) ? (double) non_zero / (double) cs->slice_ptr[cs->nslices] : 1.0);
+   }
+   else {
+      cs->bytes = (ny + 1) * sizeof(unsigned int) + (unsigned long long) non_zero * (sizeof(unsigned int) + sizeof(float));
+      if (nthreads > ny) nthreads = (ny > 0) ? ny : 1;
+      MEMORY_ALLOC_CHECK(cs->bounds, (nthreads + 1) * sizeof(unsigned int), "native bounds")
+      balance(row_index_array, ny, nthreads, cs->bounds);
+   }
+   cs->nthreads = nthreads;
+
+   /* The calling thread does share 0 itself; the others wait in the pool. */
+   MEMORY_ALLOC_CHECK(pool, sizeof(thread_pool), "native thread pool")
+   pool->cs = cs;
+   pool->quit = 0;
+   barrier_init(&pool->start, nthreads);
+   barrier_init(&pool->done, nthreads);
+   cs->pool = pool;
+   for (t=1; t<nthreads; ++t) {
+      worker_arg *wa;
+      MEMORY_ALLOC_CHECK(wa, sizeof(worker_arg), "native worker")
+      wa->pool = pool;
+      wa->id = t;
+      if (pthread_create(&pool->threads[t], NULL, cpu_spmv_worker, wa) != 0) {
+         printf("pthread_create failed for native thread %d\n", t);
+         return -1;
+      }
+   }
+   printf("native %s spmv: %d threads, %s\n", (layout == CPU_LAYOUT_SELL) ? "sell" : "csr", nthreads, cs->isa_name);
+   return 0;
+}
+
+/* y = A x, on all of the threads. */
+void cpu_spmv_run(cpu_spmv_struct *cs, const float *x, float *y)
+{
+   thread_pool *pool = (thread_pool *) cs->pool;
+
+   pool->x = x;
+   pool->y = y;
+   barrier_wait(&pool->start);
+   cpu_spmv_part(cs, 0, x, y);
+   barrier_wait(&pool->done);
+}
+
+/* Timed repetitions of cpu_spmv_run(), with the same warmup and calibration as bench_kernel(). */
+void cpu_spmv_bench(cpu_spmv_struct *cs, const float *x, float *y, unsigned int warmup, unsigned int reps, double target_seconds,
+                    stats_struct *st)
+{
+   unsigned int i, preferred_alignment = 16; // used by "MEMORY_ALLOC_CHECK" macro
+   double *ms, total_ms, warm_ms = 0.0, t0;
+
+   if (warmup == 0) warmup = 1;
+   for (i=0; i<warmup; ++i) {
+      t0 = wall_time();
+      cpu_spmv_run(cs, x, y);
+      t0 = 1000.0 * (wall_time() - t0);
+      if (i == 0 || t0 < warm_ms) warm_ms = t0;
+   }
+
+   if (target_seconds > 0.0) {
+      reps = (warm_ms > 0.0) ? (unsigned int) (1000.0 * target_seconds / warm_ms) : BENCH_MAX_REPS;
+   }
+   if (reps < BENCH_MIN_REPS) reps = BENCH_MIN_REPS;
+   if (reps > BENCH_MAX_REPS) reps = BENCH_MAX_REPS;
+
+   MEMORY_ALLOC_CHECK(ms, reps * sizeof(double), "ms")
+   total_ms = 0.0;
+   for (i=0; i<reps; ++i) {
+      t0 = wall_time();
+      cpu_spmv_run(cs, x, y);
+      ms[i] = 1000.0 * (wall_time() - t0);
+      total_ms += ms[i];
+   }
+   bench_summarize(ms, reps, total_ms, st);
+   free(ms);
+}
+
+void cpu_spmv_release(cpu_spmv_struct *cs)
+{
+   thread_pool *pool = (thread_pool *) cs->pool;
+   unsigned int t;
+
+   pool->quit = 1;
+   barrier_wait(&pool->start);
+   for (t=1; t<cs->nthreads; ++t) {
+      pthread_join(pool->threads[t], NULL);
+   }
+   barrier_destroy(&pool->start);
+   barrier_destroy(&pool->done);
+   free(pool);
+   free(cs->bounds);
+   free(cs->slice_ptr);
+   free(cs->sell_col);
+   free(cs->sell_row);
+   free(cs->sell_val);
+}
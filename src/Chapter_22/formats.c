@@ -0,0 +1,375 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Sparse formats other than the tiled/packetized one.                               */
+/*                                                                                   */
+/* All of these are built from the CSR arrays which matrix_gen leaves behind         */
+/* ("row_index_array", "x_index_array", "data_array").  Each format's kernel takes   */
+/* the input and output vectors as its first two arguments, exactly like the tiled  */
+/* kernels, so everything downstream of kernel setup is format independent.         */
+/* ================================================================================= */
+
+#define SELL_SIGMA_SLICES 8   /* rows are sorted by length within windows of this many slices */
+
+const char *format_name(unsigned int format)
+{
+   switch (format) {
+      case FORMAT_TILED: return "tiled";
+      case FORMAT_CSR:   return "csr";
+      case FORMAT_CSRV:  return "csrv";
+      case FORMAT_ELL:   return "ell";
+      case FORMAT_SELL:  return "sell";
+   }
+   return "auto";
+}
+
+unsigned int format_from_name(const char *str)
+{
+   if (strcmp(str, "tiled") == 0) return FORMAT_TILED;
+   if (strcmp(str, "csr") == 0)   return FORMAT_CSR;
+   if (strcmp(str, "csrv") == 0)  return FORMAT_CSRV;
+   if (strcmp(str, "ell") == 0)   return FORMAT_ELL;
+   if (strcmp(str, "sell") == 0)  return FORMAT_SELL;
+   if (strcmp(str, "auto") == 0)  return FORMAT_AUTO;
+   return FORMAT_INVALID;
+}
+
+const char *format_kernel_name(unsigned int format)
+{
+   switch (format) {
+      case FORMAT_CSR:  return "spmv_csr_scalar";
+      case FORMAT_CSRV: return "spmv_csr_vector";
+      case FORMAT_ELL:  return "spmv_ell";
+      case FORMAT_SELL: return "spmv_sell";
+   }
+   return NULL;
+}
+
+/* ================================================================================= */
+/* Pick a format from the row-length statistics of the CSR matrix: the mean row      */
+/* length, and its coefficient of variation (cv, the standard deviation over the     */
+/* mean), which measures how irregular the rows are.                                 */
+/*                                                                                   */
+/*  - long rows go to CSR-vector, where a group of work units shares each row, so    */
+/*    the row is read in contiguous runs and a few long rows do not serialize;       */
+/*  - regular rows (low cv, so that padding to the longest row costs little) go to   */
+/*    ELL, whose column-major layout gives every work unit the same trip count;      */
+/*  - irregular rows too short for any padding to pay off go to plain CSR;           */
+/*  - very irregular rows (cv above 1, e.g. power-law graphs) stay with the tiled    */
+/*    format on the ACCELERATOR device, whose AWGC kernel balances slabs by packets; */
+/*  - the other irregular rows go to SELL-C-sigma, which sorts rows by length so     */
+/*    that each slice of C rows is padded only to its own longest row.               */
+/* ================================================================================= */
+
+#define SELECT_LONG_ROWS   16.0  /* mean row length from which CSR-vector is chosen */
+#define SELECT_SHORT_ROWS   2.0  /* mean row length below which irregular rows get plain CSR */
+#define SELECT_REGULAR_CV   0.3  /* cv up to which rows are regular enough for ELL */
+#define SELECT_IRREGULAR_CV 1.0  /* cv above which rows are very irregular */
+
+unsigned int format_select(cl_device_type device_type, unsigned int ny, unsigned int non_zero, unsigned int *row_index_array)
+{
+   unsigned int i, max_len = 0;
+   double mean, var = 0.0, cv, ell_fill;
+   unsigned int format;
+   const char *reason;
+
+   mean = (ny > 0) ? (double) non_zero / (double) ny : 0.0;
+   for (i=0; i<ny; ++i) {
+      unsigned int len = row_index_array[i+1] - row_index_array[i];
+      double d = (double) len - mean;
+      var += d * d;
+      if (len > max_len) max_len = len;
+   }
+   var = (ny > 0) ? var / ny : 0.0;
+   cv = (mean > 0.0) ? sqrt(var) / mean : 0.0;
+   ell_fill = (max_len > 0) ? mean / (double) max_len : 1.0;
+
+   if (mean >= SELECT_LONG_ROWS) {
+      format = FORMAT_CSRV;
+      reason = "long rows";
+   }
+   else if (cv <= SELECT_REGULAR_CV && ell_fill >= 0.5) {
+      format = FORMAT_ELL;
+      reason = "regular row lengths";
+   }
+   else if (mean < SELECT_SHORT_ROWS) {
+      format = FORMAT_CSR;
+      reason = "short irregular rows";
+   }
+   else if (cv > SELECT_IRREGULAR_CV && device_type == CL_DEVICE_TYPE_ACCELERATOR) {
+      format = FORMAT_TILED;
+      reason = "very irregular rows, on the accelerator";
+   }
+   else {
+      format = FORMAT_SELL;
+      reason = (cv > SELECT_IRREGULAR_CV) ? "very irregular rows" : "irregular rows";
+   }
+
+   printf("row lengths: mean = %.2f, max = %d, cv = %.2f, ell fill = %.2f; selected format %s (%s)\n",
+          mean, max_len, cv, ell_fill, format_name(format), reason);
+   return format;
+}
+
+/* Report a failed OpenCL call and fail format_setup().  The buffers made so far are counted */
+/* in fs->nbuffers, so the caller's format_release() frees them.                            */
+#define FORMAT_CHECK(_string) {                     \
+   if (rc != CL_SUCCESS) {                          \
+      printf("%s failed. rc = %d\n", _string, rc);  \
+      return -1;                                    \
+   }                                                \
+}
+
+/* Copy "data" into a new read-only buffer, appended to the format's buffers. */
+static cl_int add_format_buffer(format_struct *fs, cl_context context, size_t size, void *data)
+{
+   cl_int rc;
+
+   if (size == 0) size = sizeof(cl_uint); /* OpenCL does not allow empty buffers */
+   fs->buffer[fs->nbuffers] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, data, &rc);
+   if (rc == CL_SUCCESS) ++fs->nbuffers;
+   return rc;
+}
+
+/* Aligned host staging for the format arrays.  Reports a failure and returns NULL. */
+static void *format_alloc(size_t size, const char *name)
+{
+   void *p = NULL;
+   if (posix_memalign(&p, 128, size) != 0 || p == NULL) {
+      printf("Failed allocation of %lld bytes for %s\n", (unsigned long long) size, name);
+      return NULL;
+   }
+   return p;
+}
+
+static size_t round_up(size_t value, size_t multiple)
+{
+   return ((value + multiple - 1) / multiple) * multiple;
+}
+
+/* ================================================================================= */
+/* Build the selected format's arrays on the device, set kernel arguments 2 and up,  */
+/* and fill in the launch geometry.  Arguments 0 and 1 (input and output) are left   */
+/* for the caller.  Returns -1 on failure, having said why; format_release() frees   */
+/* whatever buffers were made by then.                                               */
+/* ================================================================================= */
+
+int format_setup(format_struct *fs, cl_context context, cl_device_id device, cl_device_type device_type, cl_kernel kernel,
+                 unsigned int ny, unsigned int non_zero, unsigned int *row_index_array, unsigned int *x_index_array, float *data_array)
+{
+   cl_int rc;
+   size_t kernel_wg_size, lsize;
+   unsigned int i, j;
+   cl_uint nrows = ny;
+
+   rc = clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_wg_size, NULL);
+   FORMAT_CHECK("clGetKernelWorkGroupInfo(format kernel)")
+   lsize = (device_type == CL_DEVICE_TYPE_GPU) ? 128 : 16;
+   while (lsize > kernel_wg_size) lsize /= 2;
+
+   fs->nbuffers = 0;
+   fs->ndims = 1;
+   fs->bytes = 0;
+
+   switch (fs->format) {
+
+   case FORMAT_CSR:
+   case FORMAT_CSRV: {
+      rc = add_format_buffer(fs, context, (ny+1) * sizeof(cl_uint), row_index_array);
+      if (rc == CL_SUCCESS) rc = add_format_buffer(fs, context, non_zero * sizeof(cl_uint), x_index_array);
+      if (rc == CL_SUCCESS) rc = add_format_buffer(fs, context, non_zero * sizeof(float), data_array);
+      FORMAT_CHECK("clCreateBuffer(csr)")
+      fs->bytes = (ny+1) * sizeof(cl_uint) + (unsigned long long) non_zero * (sizeof(cl_uint) + sizeof(float));
+      rc  = clSetKernelArg(kernel, 2, sizeof(cl_mem), &fs->buffer[0]);
+      rc |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &fs->buffer[1]);
+      rc |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &fs->buffer[2]);
+      rc |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &nrows);
+      FORMAT_CHECK("clSetKernelArg(csr)")
+      if (fs->format == FORMAT_CSR) {
+         fs->local_work_size[0] = lsize;
+         fs->global_work_size[0] = round_up(ny, lsize);
+      }
+      else {
+         /* Size the group of work units sharing each row to the average row length. */
+         cl_uint lanes = (lsize >= 2) ? 2 : 1;
+         cl_uint mean_len = (ny > 0) ? (non_zero + ny - 1) / ny : 1;
+         while (lanes < 32 && lanes * 2 <= lsize && lanes < mean_len) lanes *= 2;
+         rc  = clSetKernelArg(kernel, 6, sizeof(cl_uint), &lanes);
+         rc |= clSetKernelArg(kernel, 7, lsize * sizeof(float), NULL);
+         FORMAT_CHECK("clSetKernelArg(csr vector)")
+         fs->local_work_size[0] = lsize;
+         fs->global_work_size[0] = round_up((size_t) ny * lanes, lsize);
+         printf("csr vector: %d work units per row\n", lanes);
+      }
+      break;
+   }
+
+   case FORMAT_ELL: {
+      /* Column-major ELLPACK: element k of row r is at [k * stride + r].  Padding entries point */
+      /* at column 0 with a zero value, so they do not change the result.                      */
+      cl_uint width = 0, stride;
+      cl_uint *ell_col;
+      float *ell_val;
+      for (i=0; i<ny; ++i) {
+         if (row_index_array[i+1] - row_index_array[i] > width) width = row_index_array[i+1] - row_index_array[i];
+      }
+      stride = (cl_uint) round_up(ny, 16);
+      if ((unsigned long long) width * stride > 4ULL * non_zero + 4096) {
+         printf("ell: padding every row to %d entries makes the matrix %.1fx larger than CSR\n", width,
+                (double) width * stride / (double) (non_zero ? non_zero : 1));
+      }
+      ell_col = (cl_uint *) format_alloc((size_t) width * stride * sizeof(cl_uint) + sizeof(cl_uint), "ell_col");
+      ell_val = (float *) format_alloc((size_t) width * stride * sizeof(float) + sizeof(float), "ell_val");
+      if (ell_col == NULL || ell_val == NULL) {
+         free(ell_col);
+         free(ell_val);
+         return -1;
+      }
+      memset(ell_col, 0, (size_t) width * stride * sizeof(cl_uint));
+      memset(ell_val, 0, (size_t) width * stride * sizeof(float));
+      for (i=0; i<ny; ++i) {
+         for (j=row_index_array[i]; j<row_index_array[i+1]; ++j) {
+            size_t k = j - row_index_array[i];
+            ell_col[k * stride + i] = x_index_array[j];
+            ell_val[k * stride + i] = data_array[j];
+         }
+      }
+      rc = add_format_buffer(fs, context, (size_t) width * stride * sizeof(cl_uint), ell_col);
+      if (rc == CL_SUCCESS) rc = add_format_buffer(fs, context, (size_t) width * stride * sizeof(float), ell_val);
+      fs->bytes = (unsigned long long) width * stride * (sizeof(cl_uint) + sizeof(float));
+      free(ell_col);
+      free(ell_val);
+      FORMAT_CHECK("clCreateBuffer(ell)")
+      rc  = clSetKernelArg(kernel, 2, sizeof(cl_mem), &fs->buffer[0]);
+      rc |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &fs->buffer[1]);
+      rc |= clSetKernelArg(kernel, 4, sizeof(cl_uint), &nrows);
+      rc |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &stride);
+      rc |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &width);
+      FORMAT_CHECK("clSetKernelArg(ell)")
+      fs->local_work_size[0] = lsize;
+      fs->global_work_size[0] = round_up(ny, lsize);
+      printf("ell: width %d, stride %d\n", width, stride);
+      break;
+   }
+
+   case FORMAT_SELL: {
+      /* SELL-C-sigma: rows are sorted by decreasing length inside windows of sigma rows, then */
+      /* cut into slices of C rows.  Each slice is stored column-major and padded only to the  */
+      /* length of its own longest row.  "sell_row" maps sorted position back to the row.     */
+      cl_uint C = (cl_uint) lsize;
+      cl_uint sigma = C * SELL_SIGMA_SLICES;
+      cl_uint nslices = (ny + C - 1) / C;
+      cl_uint *sell_row, *slice_ptr, *sell_col;
+      float *sell_val;
+      unsigned int w, s;
+
+      sell_row = (cl_uint *) format_alloc((size_t) nslices * C * sizeof(cl_uint) + sizeof(cl_uint), "sell_row");
+      slice_ptr = (cl_uint *) format_alloc((nslices + 1) * sizeof(cl_uint), "slice_ptr");
+      if (sell_row == NULL || slice_ptr == NULL) {
+         free(sell_row);
+         free(slice_ptr);
+         return -1;
+      }
+      for (i=0; i<nslices*C; ++i) sell_row[i] = (i < ny) ? i : 0xffffffff;
+
+      /* Sort each window by decreasing row length (insertion sort is fine: windows are small). */
+      for (w=0; w<ny; w+=sigma) {
+         unsigned int end = (w + sigma < ny) ? w + sigma : ny;
+         for (i=w+1; i<end; ++i) {
+            cl_uint r = sell_row[i];
+            cl_uint len = row_index_array[r+1] - row_index_array[r];
+            j = i;
+            while (j > w && row_index_array[sell_row[j-1]+1] - row_index_array[sell_row[j-1]] < len) {
+               sell_row[j] = sell_row[j-1];
+               --j;
+            }
+            sell_row[j] = r;
+         }
+      }
+
+      slice_ptr[0] = 0;
+      for (s=0; s<nslices; ++s) {
+         cl_uint width = 0;
+         for (i=s*C; i<(s+1)*C; ++i) {
+            if (sell_row[i] != 0xffffffff) {
+               cl_uint len = row_index_array[sell_row[i]+1] - row_index_array[sell_row[i]];
+               if (len > width) width = len;
+            }
+         }
+         slice_ptr[s+1] = slice_ptr[s] + width * C;
+      }
+
+      sell_col = (cl_uint *) format_alloc((size_t) slice_ptr[nslices] * sizeof(cl_uint) + sizeof(cl_uint), "sell_col");
+      sell_val = (float *) format_alloc((size_t) slice_ptr[nslices] * sizeof(float) + sizeof(float), "sell_val");
+      if (sell_col == NULL || sell_val == NULL) {
+         free(sell_row);
+         free(slice_ptr);
+         free(sell_col);
+         free(sell_val);
+         return -1;
+      }
+      memset(sell_col, 0, (size_t) slice_ptr[nslices] * sizeof(cl_uint));
+      memset(sell_val, 0, (size_t) slice_ptr[nslices] * sizeof(float));
+      for (s=0; s<nslices; ++s) {
+         for (i=0; i<C; ++i) {
+            cl_uint r = sell_row[s*C + i];
+            if (r == 0xffffffff) continue;
+            for (j=row_index_array[r]; j<row_index_array[r+1]; ++j) {
+               size_t k = slice_ptr[s] + (size_t) (j - row_index_array[r]) * C + i;
+               sell_col[k] = x_index_array[j];
+               sell_val[k] = data_array[j];
+            }
+         }
+      }
+
+      rc = add_format_buffer(fs, context, (nslices + 1) * sizeof(cl_uint), slice_ptr);
+      if (rc == CL_SUCCESS) rc = add_format_buffer(fs, context, (size_t) slice_ptr[nslices] * sizeof(cl_uint), sell_col);
+      if (rc == CL_SUCCESS) rc = add_format_buffer(fs, context, (size_t) slice_ptr[nslices] * sizeof(float), sell_val);
+      if (rc == CL_SUCCESS) rc = add_format_buffer(fs, context, (size_t) nslices * C * sizeof(cl_uint), sell_row);
+      fs->bytes = (nslices + 1) * sizeof(cl_uint) + (unsigned long long) slice_ptr[nslices] * (sizeof(cl_uint) + sizeof(float))
+                + (unsigned long long) nslices * C * sizeof(cl_uint);
+      printf("sell-%d-%d: %d slices, fill %.2f\n", C, sigma, nslices,
+             (slice_ptr[nslices] > 0) ? (double) non_zero / (double) slice_ptr[nslices] : 1.0);
+      free(sell_row);
+      free(slice_ptr);
+      free(sell_col);
+      free(sell_val);
+      FORMAT_CHECK("clCreateBuffer(sell)")
+
+      rc  = clSetKernelArg(kernel, 2, sizeof(cl_mem), &fs->buffer[0]);
+      rc |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &fs->buffer[1]);
+      rc |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &fs->buffer[2]);
+      rc |= clSetKernelArg(kernel, 5, sizeof(cl_mem), &fs->buffer[3]);
+      rc |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &C);
+      FORMAT_CHECK("clSetKernelArg(sell)")
+      fs->local_work_size[0] = C;
+      fs->global_work_size[0] = (size_t) nslices * C;
+      break;
+   }
+
+   default:
+      printf("format_setup: unsupported format %d\n", fs->format);
+      return -1;
+   }
+
+   return 0;
+}
+
+void format_release(format_struct *fs)
+{
+   unsigned int i;
+   for (i=0; i<fs->nbuffers; ++i) {
+      clReleaseMemObject(fs->buffer[i]);
+   }
+   fs->nbuffers = 0;
+}
@@ -11,11 +11,53 @@
 
 #include "spmv.h"
 
+/* ================================================================================= */
+/* Once nx, ny and non_zero are known, report them, round ny up to the alignment,    */
+/* and keep small matrices from being cut into more slabs than they have rows for.   */
+/* Shared by matrix_read and matrix_synth.                                           */
+/* ================================================================================= */
+
+void matrix_shape(matrix_gen_struct *mgs) {
+   unsigned int preferred_alignment_by_elements;
+
+   preferred_alignment_by_elements = mgs->preferred_alignment / sizeof(float);
+   if (preferred_alignment_by_elements < 16) preferred_alignment_by_elements = 16;
+
+   double density = ((double) *(mgs->non_zero)) / ((double) *(mgs->nx) * (double) *(mgs->ny));
+   printf("nx = %d, ny = %d, non_zero = %u, density = %f\n", *(mgs->nx), *(mgs->ny), *(mgs->non_zero), density);
+
+   *(mgs->nyround) = (*(mgs->ny) + (preferred_alignment_by_elements - 1)) & (~(preferred_alignment_by_elements - 1));
+
+   if (*(mgs->nyround) < preferred_alignment_by_elements) *(mgs->nyround) = preferred_alignment_by_elements;
+
+   /* now that we know the size, we can prevent excessive segmentation of small matrices */
+   unsigned int min_compute_units = (*(mgs->nyround) + preferred_alignment_by_elements - 1) / preferred_alignment_by_elements;
+   if (*(mgs->max_compute_units) > min_compute_units) *(mgs->max_compute_units) = min_compute_units;
+}
+
 /* ================================================================================= */
 /* Here is the routine which does the algorithm work in the host-based code.         */
+/* It is done in three steps: "matrix_read" parses the Matrix Market file into CSR   */
+/* arrays (or "matrix_synth" generates them), "matrix_reorder" picks an optional     */
+/* renumbering of the rows and columns, and "matrix_tile" builds the tiled format    */
+/* from them.  The tiling step can be repeated on its own, with different            */
+/* partitioning choices.                                                             */
 /* ================================================================================= */
 
 int matrix_gen(matrix_gen_struct *mgs) {
+   int rc;
+
+   rc = (mgs->synth != SYNTH_NONE) ? matrix_synth(mgs) : matrix_read(mgs);
+   if (rc == 0) {
+      rc = matrix_reorder(mgs);
+   }
+   if (rc == 0) {
+      rc = matrix_tile(mgs);
+   }
+   return rc;
+}
+
+int matrix_read(matrix_gen_struct *mgs) {
    unsigned int data_present, symmetric, preferred_alignment, preferred_alignment_by_elements;
    FILE *inputMTX;
    unsigned int i, j;
@@ -41,6 +83,8 @@ int matrix_gen(matrix_gen_struct *mgs) {
       }
       data_present = strcmp(pattern_flag, "pattern");
       symmetric = strcmp(symmetric_flag, "general");
+      /* The CSR arrays are always expanded to the full matrix; only the tiles can be one triangle. */
+      mgs->symmetric = (mgs->sym_storage && strcmp(symmetric_flag, "symmetric") == 0) ? 1 : 0;
       fscanf(inputMTX, "%d %d %d\n", (mgs->nx), (mgs->ny), (mgs->non_zero));
    }
 
@@ -49,17 +93,17 @@ int matrix_gen(matrix_gen_struct *mgs) {
    /* =============================================================== */
 
    unsigned int *count_array;
-   float **line_data_array;
+   double **line_data_array;
    unsigned int **line_x_index_array;
 
-   float *raw_data;
+   double *raw_data;
    unsigned int *raw_ix;
    unsigned int *raw_iy;
 
    MEMORY_ALLOC_CHECK(raw_ix, (*(mgs->non_zero) * sizeof (int)), "raw_ix") 
    MEMORY_ALLOC_CHECK(raw_iy, (*(mgs->non_zero) * sizeof (int)), "raw_iy") 
-   MEMORY_ALLOC_CHECK(raw_data, (*(mgs->non_zero) * sizeof (float)), "raw_data") 
-   MEMORY_ALLOC_CHECK(line_data_array, (*(mgs->ny) * sizeof (float *)), "line_data_array") 
+   MEMORY_ALLOC_CHECK(raw_data, (*(mgs->non_zero) * sizeof (double)), "raw_data") 
+   MEMORY_ALLOC_CHECK(line_data_array, (*(mgs->ny) * sizeof (double *)), "line_data_array") 
    MEMORY_ALLOC_CHECK(line_x_index_array, (*(mgs->ny) * sizeof (int *)), "line_x_index_array") 
    MEMORY_ALLOC_CHECK(count_array, (*(mgs->ny) * sizeof (int)), "count_array") 
    for (i=0; i<*(mgs->ny); ++i) {
@@ -76,17 +120,16 @@ int matrix_gen(matrix_gen_struct *mgs) {
    unsigned int explicit_zero_count = 0;
    for (i=0; i<*(mgs->non_zero); ++i) {
       unsigned int ix, iy;
-      float data; 
+      double data; 
       fscanf(inputMTX, "%d %d\n", &ix, &iy);
       if (i == 0) {
          curry = iy-1;
       }
+      /* The values stay in fp64 until the CSR arrays are filled, so fp64 tiles get them unrounded. */
       if (data_present) {
-         double double_data;
-         fscanf(inputMTX, "%lf\n", &double_data);
-         data = (float) double_data;
+         fscanf(inputMTX, "%lf\n", &data);
       }
-      else data = ((float) (rand() & 0x7fff)) * 0.001f - 15.0f;
+      else data = (double) (((float) (rand() & 0x7fff)) * 0.001f - 15.0f);
       if (data_present && data == 0.0) {
          ++explicit_zero_count;
       }
@@ -119,7 +162,7 @@ int matrix_gen(matrix_gen_struct *mgs) {
    /* =============================================================== */
 
    for (i=0; i<*(mgs->ny); ++i) {
-      MEMORY_ALLOC_CHECK(line_data_array[i], (count_array[i] * sizeof (float)), "line_data_array[i]") 
+      MEMORY_ALLOC_CHECK(line_data_array[i], (count_array[i] * sizeof (double)), "line_data_array[i]") 
       MEMORY_ALLOC_CHECK(line_x_index_array[i], (count_array[i] * sizeof (int)), "line_x_index_array[i]") 
       count_array[i] = 0;
    }
@@ -141,16 +184,7 @@ int matrix_gen(matrix_gen_struct *mgs) {
    for (i=0; i<*(mgs->ny); ++i) {
       *(mgs->non_zero) += count_array[i];
    }
-   double density = ((double) *(mgs->non_zero)) / ((double) *(mgs->nx) * (double) *(mgs->ny));
-   printf("nx = %d, ny = %d, non_zero = %d, density = %f\n", *(mgs->nx), *(mgs->ny), *(mgs->non_zero), density);
-
-   *(mgs->nyround) = (*(mgs->ny) + (preferred_alignment_by_elements - 1)) & (~(preferred_alignment_by_elements - 1));
-
-   if (*(mgs->nyround) < preferred_alignment_by_elements) *(mgs->nyround) = preferred_alignment_by_elements;
-
-   /* now that we know the size, we can prevent excessive segmentation of small matrices */
-   unsigned int min_compute_units = (*(mgs->nyround) + preferred_alignment_by_elements - 1) / preferred_alignment_by_elements;
-   if (*(mgs->max_compute_units) > min_compute_units) *(mgs->max_compute_units) = min_compute_units;
+   matrix_shape(mgs);
 
    /* Release no-longer-needed arrays. */
    free(raw_ix);
@@ -163,6 +197,10 @@ int matrix_gen(matrix_gen_struct *mgs) {
 
    MEMORY_ALLOC_CHECK(*(mgs->data_array), (*(mgs->non_zero) * sizeof (float)), "data_array") 
 
+   if (mgs->data_array_dp != NULL) {
+      MEMORY_ALLOC_CHECK(*(mgs->data_array_dp), (*(mgs->non_zero) * sizeof (double)), "data_array_dp") 
+   }
+
    MEMORY_ALLOC_CHECK(*(mgs->x_index_array), ((*(mgs->non_zero)+1) * sizeof (int)), "x_index_array") 
 
    MEMORY_ALLOC_CHECK(*(mgs->row_index_array), ((*(mgs->nyround)+1) * sizeof (int)), "row_index_array") 
@@ -172,7 +210,10 @@ int matrix_gen(matrix_gen_struct *mgs) {
    for (i=0; i<*(mgs->ny); ++i) {
       (*(mgs->row_index_array))[i] = index;
       for (j=0; j<count_array[i]; ++j) {
-         (*(mgs->data_array))[index] = line_data_array[i][j];
+         (*(mgs->data_array))[index] = (float) line_data_array[i][j];
+         if (mgs->data_array_dp != NULL) {
+            (*(mgs->data_array_dp))[index] = line_data_array[i][j];
+         }
          (*(mgs->x_index_array))[index] = line_x_index_array[i][j];
          ++index;
       }
@@ -191,6 +232,17 @@ int matrix_gen(matrix_gen_struct *mgs) {
    free(line_x_index_array);
    free(count_array);
 
+   return 0;
+}
+
+static int matrix_tile_csr(matrix_gen_struct *mgs) {
+   unsigned int preferred_alignment, preferred_alignment_by_elements;
+   unsigned int i, j;
+
+   preferred_alignment = mgs->preferred_alignment;
+   preferred_alignment_by_elements = preferred_alignment / sizeof(float);
+   if (preferred_alignment_by_elements < 16) preferred_alignment_by_elements = 16;
+
    /* ============================================================================= */
    /* Now that we have the CSR format of the matrix (in "row_index_array",          */
    /* "x_index_array", and "data_array", we begin to compute the best size and      */
@@ -239,6 +291,8 @@ int matrix_gen(matrix_gen_struct *mgs) {
       if (expected_nslabs < nslabs_base) {
          expected_nslabs = nslabs_base;
       }
+      expected_nslabs = (unsigned int) (expected_nslabs * mgs->slab_scale + 0.5f);
+      if (expected_nslabs < 1) expected_nslabs = 1;
       target_workpacket = *(mgs->non_zero) / expected_nslabs;
       /* Decide how big the local cache for packet data should be, based on local memory considerations. */
       /* (Typically we will read in 16 or 32 packets at a time.)                                          */
@@ -247,45 +301,50 @@ int matrix_gen(matrix_gen_struct *mgs) {
          ++(*(mgs->segcachesize)); /* raise up to a power of 2 */
       }
 
-      /* Scan matrix data to find best split of data for each contiguous group of rows ("slabs"). */
-      candidate_row = 0;
-      target_value = target_workpacket;
-      slabsize = 0;
-      while (candidate_row < *(mgs->nyround)) {
-         while ((*(mgs->row_index_array))[candidate_row] < target_value && (slabsize+preferred_alignment_by_elements) < slab_threshhold && candidate_row < *(mgs->nyround)) {
-            candidate_row += preferred_alignment_by_elements;
-            slabsize += preferred_alignment_by_elements;
-         }
-         ++nslabs;
-         slabsize = 0;
-         target_value = (*(mgs->row_index_array))[candidate_row] + target_workpacket;
+      if (mgs->partitioner == PARTITION_COST) {
+         nslabs = partition_cost(mgs, preferred_alignment_by_elements, slab_threshhold, expected_nslabs);
       }
-   
-      /* Allocate an array to hold row index of beginning of each of these "slabs". */
-      MEMORY_ALLOC_CHECK(*(mgs->slab_startrow), ((nslabs + 1) * sizeof (unsigned int)), "slab_startrow") 
-      (*(mgs->slab_startrow))[0] = 0;
-      (*(mgs->slab_startrow))[nslabs] = *(mgs->nyround);
-      candidate_row = 0;
-      target_value = target_workpacket;
-      slabsize = 0;
-      nslabs = 0;
-
-      /* Scan matrix data to implement previously computed split of data for each contiguous group of rows. */
-      while (candidate_row < *(mgs->nyround)) {
-         while ((*(mgs->row_index_array))[candidate_row] < target_value && slabsize < slab_threshhold && candidate_row < *(mgs->nyround)) {
-            candidate_row += preferred_alignment_by_elements;
-            slabsize += preferred_alignment_by_elements;
+      else {
+         /* Scan matrix data to find best split of data for each contiguous group of rows ("slabs"). */
+         candidate_row = 0;
+         target_value = target_workpacket;
+         slabsize = 0;
+         while (candidate_row < *(mgs->nyround)) {
+            while ((*(mgs->row_index_array))[candidate_row] < target_value && (slabsize+preferred_alignment_by_elements) < slab_threshhold && candidate_row < *(mgs->nyround)) {
+               candidate_row += preferred_alignment_by_elements;
+               slabsize += preferred_alignment_by_elements;
+            }
+            ++nslabs;
+            slabsize = 0;
+            target_value = (*(mgs->row_index_array))[candidate_row] + target_workpacket;
          }
-         ++nslabs;
+      
+         /* Allocate an array to hold row index of beginning of each of these "slabs". */
+         MEMORY_ALLOC_CHECK(*(mgs->slab_startrow), ((nslabs + 1) * sizeof (unsigned int)), "slab_startrow") 
+         (*(mgs->slab_startrow))[0] = 0;
+         (*(mgs->slab_startrow))[nslabs] = *(mgs->nyround);
+         candidate_row = 0;
+         target_value = target_workpacket;
          slabsize = 0;
-         (*(mgs->slab_startrow))[nslabs] = candidate_row;
-         target_value = (*(mgs->row_index_array))[candidate_row] + target_workpacket;
-      }
-   
-      *(mgs->max_slabheight) = 0;
-      for (i=0; i<nslabs; ++i) {
-         if ((*(mgs->slab_startrow))[i+1] - (*(mgs->slab_startrow))[i] > *(mgs->max_slabheight)) {
-            *(mgs->max_slabheight) = (*(mgs->slab_startrow))[i+1] - (*(mgs->slab_startrow))[i];
+         nslabs = 0;
+
+         /* Scan matrix data to implement previously computed split of data for each contiguous group of rows. */
+         while (candidate_row < *(mgs->nyround)) {
+            while ((*(mgs->row_index_array))[candidate_row] < target_value && slabsize < slab_threshhold && candidate_row < *(mgs->nyround)) {
+               candidate_row += preferred_alignment_by_elements;
+               slabsize += preferred_alignment_by_elements;
+            }
+            ++nslabs;
+            slabsize = 0;
+            (*(mgs->slab_startrow))[nslabs] = candidate_row;
+            target_value = (*(mgs->row_index_array))[candidate_row] + target_workpacket;
+         }
+      
+         *(mgs->max_slabheight) = 0;
+         for (i=0; i<nslabs; ++i) {
+            if ((*(mgs->slab_startrow))[i+1] - (*(mgs->slab_startrow))[i] > *(mgs->max_slabheight)) {
+               *(mgs->max_slabheight) = (*(mgs->slab_startrow))[i+1] - (*(mgs->slab_startrow))[i];
+            }
          }
       }
    }
@@ -323,16 +382,23 @@ int matrix_gen(matrix_gen_struct *mgs) {
          *(mgs->max_slabheight) = *(mgs->gpu_wgsz);
       }
       else {
-         nslabs = *(mgs->max_compute_units);
+         nslabs = (unsigned int) (*(mgs->max_compute_units) * mgs->slab_scale + 0.5f);
+         if (nslabs < 1) nslabs = 1;
          while (*(mgs->nyround) / nslabs >= ((mgs->local_mem_size)/sizeof(float))) nslabs *= 2;
-         MEMORY_ALLOC_CHECK((*(mgs->slab_startrow)), ((nslabs + 1) * sizeof (unsigned int)), "(mgs->slab_startrow)") 
-         for (i=0; i<=nslabs; ++i) {
-            (*(mgs->slab_startrow))[i] = (((*(mgs->nyround)/preferred_alignment_by_elements) * i) / nslabs) * preferred_alignment_by_elements;
+         if (mgs->partitioner == PARTITION_COST) {
+            slab_threshhold = ((mgs->local_mem_size)/sizeof(float) - 1) & ~(preferred_alignment_by_elements - 1);
+            nslabs = partition_cost(mgs, preferred_alignment_by_elements, slab_threshhold, nslabs);
          }
-         *(mgs->max_slabheight) = 0;
-         for (i=0; i<nslabs; ++i) {
-            unsigned int temp = (*(mgs->slab_startrow))[i+1] - (*(mgs->slab_startrow))[i];
-            if (*(mgs->max_slabheight) < temp) *(mgs->max_slabheight) = temp;
+         else {
+            MEMORY_ALLOC_CHECK((*(mgs->slab_startrow)), ((nslabs + 1) * sizeof (unsigned int)), "(mgs->slab_startrow)") 
+            for (i=0; i<=nslabs; ++i) {
+               (*(mgs->slab_startrow))[i] = (((*(mgs->nyround)/preferred_alignment_by_elements) * i) / nslabs) * preferred_alignment_by_elements;
+            }
+            *(mgs->max_slabheight) = 0;
+            for (i=0; i<nslabs; ++i) {
+               unsigned int temp = (*(mgs->slab_startrow))[i+1] - (*(mgs->slab_startrow))[i];
+               if (*(mgs->max_slabheight) < temp) *(mgs->max_slabheight) = temp;
+            }
          }
       }
    }
@@ -381,6 +447,11 @@ int matrix_gen(matrix_gen_struct *mgs) {
          (*(mgs->seg_workspace))[i].matdata[j] = 0.0f;
       }
    }
+   /* For fp64 tiles, the fp64 value of every packet slot is kept alongside, for matrix_widen(). */
+   if (mgs->data_array_dp != NULL) {
+      MEMORY_ALLOC_CHECK(*(mgs->matdata_dp), (temp_count/2) * 16 * sizeof(double), "*matdata_dp") 
+      memset(*(mgs->matdata_dp), 0, (temp_count/2) * 16 * sizeof(double));
+   }
    /* The entire matrix is split across the multiple devices, and as such, */
    /* We need to know, for each device, where do the slabs start and stop. */
    *(mgs->nslabs_round) = nslabs;
@@ -457,6 +528,10 @@ int matrix_gen(matrix_gen_struct *mgs) {
                            slab_ptr[seg_index].input_offset_short[kk] = 
                                (unsigned short) ((*(mgs->x_index_array))[row_start[k+kk]+countdex] & (*(mgs->column_span)-1));
                            slab_ptr[seg_index].matdata[kk] = (*(mgs->data_array))[row_start[k+kk]+countdex];
+                           if (mgs->data_array_dp != NULL) {
+                              (*(mgs->matdata_dp))[16 * (&slab_ptr[seg_index] - *(mgs->seg_workspace)) + kk] =
+                                  (*(mgs->data_array_dp))[row_start[k+kk]+countdex];
+                           }
                         }
                      }
                      ++seg_index;
@@ -510,6 +585,10 @@ int matrix_gen(matrix_gen_struct *mgs) {
                            slab_ptr[seg_index].input_offset_short[kk] = 
                                (unsigned short) ((*(mgs->x_index_array))[row_start[k+kk]+countdex] & (*(mgs->column_span)-1));
                            slab_ptr[seg_index].matdata[kk] = (*(mgs->data_array))[row_start[k+kk]+countdex];
+                           if (mgs->data_array_dp != NULL) {
+                              (*(mgs->matdata_dp))[16 * (&slab_ptr[seg_index] - *(mgs->seg_workspace)) + kk] =
+                                  (*(mgs->data_array_dp))[row_start[k+kk]+countdex];
+                           }
                         }
                      }
                      ++seg_index;
@@ -590,3 +669,196 @@ int matrix_gen(matrix_gen_struct *mgs) {
 
    return 0;
 }
+
+/* ================================================================================= */
+/* With symmetric storage only the upper triangle (x >= row) is tiled, and           */
+/* tiled_spmv_kernel_LS_SYM adds the transposed contribution of each off-diagonal    */
+/* element itself.  The full CSR arrays stay in place for verification, so the       */
+/* triangle is tiled through a temporary CSR copy swapped in around the call.        */
+/* ================================================================================= */
+
+static int matrix_tile_triangle(matrix_gen_struct *mgs) {
+   unsigned int *full_row_index_array, *full_x_index_array, full_non_zero;
+   unsigned int *row_index_array, *x_index_array;
+   float *full_data_array, *data_array;
+   double *full_data_array_dp = NULL, *data_array_dp = NULL;
+   unsigned int preferred_alignment, i, j, n;
+   int rc;
+
+   if (!mgs->symmetric) {
+      return matrix_tile_csr(mgs);
+   }
+
+   preferred_alignment = mgs->preferred_alignment;
+   full_row_index_array = *(mgs->row_index_array);
+   full_x_index_array = *(mgs->x_index_array);
+   full_data_array = *(mgs->data_array);
+   full_non_zero = *(mgs->non_zero);
+
+   MEMORY_ALLOC_CHECK(row_index_array, ((*(mgs->nyround)+1) * sizeof (int)), "triangle row_index_array")
+   MEMORY_ALLOC_CHECK(x_index_array, ((full_non_zero+1) * sizeof (int)), "triangle x_index_array")
+   MEMORY_ALLOC_CHECK(data_array, ((full_non_zero+1) * sizeof (float)), "triangle data_array")
+   if (mgs->data_array_dp != NULL) {
+      full_data_array_dp = *(mgs->data_array_dp);
+      MEMORY_ALLOC_CHECK(data_array_dp, ((full_non_zero+1) * sizeof (double)), "triangle data_array_dp")
+   }
+   n = 0;
+   for (i=0; i<*(mgs->ny); ++i) {
+      row_index_array[i] = n;
+      for (j=full_row_index_array[i]; j<full_row_index_array[i+1]; ++j) {
+         if (full_x_index_array[j] >= i) {
+            x_index_array[n] = full_x_index_array[j];
+            data_array[n] = full_data_array[j];
+            if (data_array_dp != NULL) data_array_dp[n] = full_data_array_dp[j];
+            ++n;
+         }
+      }
+   }
+   for (i=*(mgs->ny); i<=*(mgs->nyround); ++i) {
+      row_index_array[i] = n;
+   }
+   x_index_array[n] = 0;
+   printf("symmetric storage: tiling %d of %d non-zeros\n", n, full_non_zero);
+
+   *(mgs->row_index_array) = row_index_array;
+   *(mgs->x_index_array) = x_index_array;
+   *(mgs->data_array) = data_array;
+   if (data_array_dp != NULL) *(mgs->data_array_dp) = data_array_dp;
+   *(mgs->non_zero) = n;
+   rc = matrix_tile_csr(mgs);
+   *(mgs->row_index_array) = full_row_index_array;
+   *(mgs->x_index_array) = full_x_index_array;
+   *(mgs->data_array) = full_data_array;
+   if (data_array_dp != NULL) *(mgs->data_array_dp) = full_data_array_dp;
+   *(mgs->non_zero) = full_non_zero;
+
+   free(row_index_array);
+   free(x_index_array);
+   free(data_array);
+   free(data_array_dp);
+   return rc;
+}
+
+/* ================================================================================= */
+/* Tile the CSR arrays.  When matrix_reorder() has chosen a permutation, the matrix  */
+/* is tiled in the reordered numbering, through another temporary CSR copy (row k    */
+/* of the copy is row perm[k] of the file, with its columns renumbered to match and  */
+/* sorted), and the CSR arrays stay in file order like they do for the triangle.     */
+/* ================================================================================= */
+
+int matrix_tile(matrix_gen_struct *mgs) {
+   unsigned int *full_row_index_array, *full_x_index_array;
+   unsigned int *row_index_array, *x_index_array, *perm, *inv;
+   float *full_data_array, *data_array;
+   double *full_data_array_dp = NULL, *data_array_dp = NULL;
+   unsigned int preferred_alignment, i, j, k, n;
+   int rc;
+
+   if (mgs->perm == NULL || *(mgs->perm) == NULL) {
+      return matrix_tile_triangle(mgs);
+   }
+
+   preferred_alignment = mgs->preferred_alignment;
+   perm = *(mgs->perm);
+   full_row_index_array = *(mgs->row_index_array);
+   full_x_index_array = *(mgs->x_index_array);
+   full_data_array = *(mgs->data_array);
+
+   MEMORY_ALLOC_CHECK(inv, (*(mgs->ny) * sizeof (int)), "reorder inv")
+   for (i=0; i<*(mgs->ny); ++i) {
+      inv[perm[i]] = i;
+   }
+   MEMORY_ALLOC_CHECK(row_index_array, ((*(mgs->nyround)+1) * sizeof (int)), "reordered row_index_array")
+   MEMORY_ALLOC_CHECK(x_index_array, ((*(mgs->non_zero)+1) * sizeof (int)), "reordered x_index_array")
+   MEMORY_ALLOC_CHECK(data_array, ((*(mgs->non_zero)+1) * sizeof (float)), "reordered data_array")
+   if (mgs->data_array_dp != NULL) {
+      full_data_array_dp = *(mgs->data_array_dp);
+      MEMORY_ALLOC_CHECK(data_array_dp, ((*(mgs->non_zero)+1) * sizeof (double)), "reordered data_array_dp")
+   }
+   n = 0;
+   for (i=0; i<*(mgs->ny); ++i) {
+      row_index_array[i] = n;
+      for (j=full_row_index_array[perm[i]]; j<full_row_index_array[perm[i]+1]; ++j) {
+         /* Insertion sort by new column; rows are short. */
+         unsigned int x = inv[full_x_index_array[j]];
+         float d = full_data_array[j];
+         for (k=n; k>row_index_array[i] && x_index_array[k-1] > x; --k) {
+            x_index_array[k] = x_index_array[k-1];
+            data_array[k] = data_array[k-1];
+            if (data_array_dp != NULL) data_array_dp[k] = data_array_dp[k-1];
+         }
+         x_index_array[k] = x;
+         data_array[k] = d;
+         if (data_array_dp != NULL) data_array_dp[k] = full_data_array_dp[j];
+         ++n;
+      }
+   }
+   for (i=*(mgs->ny); i<=*(mgs->nyround); ++i) {
+      row_index_array[i] = n;
+   }
+   x_index_array[n] = 0;
+
+   *(mgs->row_index_array) = row_index_array;
+   *(mgs->x_index_array) = x_index_array;
+   *(mgs->data_array) = data_array;
+   if (data_array_dp != NULL) *(mgs->data_array_dp) = data_array_dp;
+   rc = matrix_tile_triangle(mgs);
+   *(mgs->row_index_array) = full_row_index_array;
+   *(mgs->x_index_array) = full_x_index_array;
+   *(mgs->data_array) = full_data_array;
+   if (data_array_dp != NULL) *(mgs->data_array_dp) = full_data_array_dp;
+
+   free(inv);
+   free(row_index_array);
+   free(x_index_array);
+   free(data_array);
+   free(data_array_dp);
+   return rc;
+}
+
+/* ================================================================================= */
+/* Widen a finished tiled matrix into fp64 packets, for a program built -DDOUBLE.    */
+/* The slab headers are rebased onto the larger packets, the team header packets at  */
+/* the front of each slab are carried over word for word (the kernel reads them as   */
+/* one array of words), and every other packet takes its sixteen values from         */
+/* "matdata_dp" (the fp64 values matrix_tile kept for it), or converts its own fp32  */
+/* values if that is NULL.                                                           */
+/* Returns the new matrix, headers first, and its size in bytes through "memsize",   */
+/* with the same room for reading past the end as matrix_tile() leaves.              */
+/* ================================================================================= */
+
+packet_dp *matrix_widen(slab_header *matrix_header, unsigned int nslabs_round, unsigned int num_header_packets, const double *matdata_dp,
+                        unsigned int *memsize)
+{
+   unsigned int i, j, k, first, nheader, nteam;
+   unsigned int preferred_alignment = 128; // used by "MEMORY_ALLOC_CHECK" macro
+   packet *src = (packet *) matrix_header;
+   packet_dp *dst, *p;
+   slab_header *header_dp;
+
+   first = matrix_header[0].offset;
+   nheader = (3 * 4 * (nslabs_round+1) + sizeof(packet_dp) - 1) / sizeof(packet_dp);
+   *memsize = (nheader + (matrix_header[nslabs_round].offset - first) + 32) * sizeof(packet_dp);
+   MEMORY_ALLOC_CHECK(dst, *memsize, "matrix_widen")
+   memset((void *) dst, 0, *memsize);
+
+   header_dp = (slab_header *) dst;
+   for (i=0; i<=nslabs_round; ++i) {
+      header_dp[i] = matrix_header[i];
+      header_dp[i].offset = matrix_header[i].offset - first + nheader;
+   }
+
+   for (i=0; i<nslabs_round; ++i) {
+      nteam = matrix_header[i+1].offset - matrix_header[i].offset;
+      if (nteam > num_header_packets) nteam = num_header_packets;
+      memcpy((void *) &dst[header_dp[i].offset], (void *) &src[matrix_header[i].offset], nteam * sizeof(packet));
+      for (j=matrix_header[i].offset+nteam; j<matrix_header[i+1].offset; ++j) {
+         p = &dst[j - first + nheader];
+         memcpy((void *) p, (void *) &src[j], offsetof(packet, matdata));
+         for (k=0; k<16; ++k) {
+            p->matdata[k] = (matdata_dp != NULL) ? matdata_dp[16 * j + k] : (double) src[j].matdata[k];
+         }
+      }
+   }
+   return dst;
+}
@@ -0,0 +1,282 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Built-in test matrices, generated straight into the CSR arrays that matrix_read   */
+/* would otherwise fill from a Matrix Market file.  The spec on the command line is  */
+/* "kind:size[:param[:seed]]":                                                       */
+/*                                                                                   */
+/*    poisson2d:n        5-point Laplacian on an n x n grid (n^2 rows, 4 / -1)       */
+/*    poisson3d:n        7-point Laplacian on an n x n x n grid (n^3 rows, 6 / -1)   */
+/*    banded:N:b         symmetric band, b diagonals either side (default 8)         */
+/*    random:N:k         k uniformly scattered columns per row (default 16)          */
+/*    powerlaw:N:k       scattered columns, row lengths Pareto distributed (alpha 2) */
+/*                       around a mean of k (default 16), capped at 64 times that    */
+/*    blockdiag:N:b      dense symmetric b x b blocks down the diagonal (default 32) */
+/*                                                                                   */
+/* Every matrix is square, has its diagonal, and is diagonally dominant (strictly,   */
+/* apart from the interior rows of the Laplacians), so the symmetric kinds are       */
+/* positive definite and suit the CG solver as well.                                 */
+/* Off-diagonal values are a hash of (seed, min(i,j), max(i,j)), so the symmetric    */
+/* kinds are symmetric in value and not only in pattern.  The scattered columns come */
+/* from a generator seeded by (seed, row), so a spec gives the same matrix on every  */
+/* run and every machine, whatever order the rows are generated in.                 */
+/* ================================================================================= */
+
+#define SYNTH_DEFAULT_PARAM 16
+#define SYNTH_POWERLAW_CAP  64    /* longest power-law row, as a multiple of the mean */
+
+static const char *synth_names[] = { "", "poisson2d", "poisson3d", "banded", "random", "powerlaw", "blockdiag" };
+
+static cl_ulong splitmix64(cl_ulong *state)
+{
+   cl_ulong z = (*state += 0x9e3779b97f4a7c15ULL);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+   return z ^ (z >> 31);
+}
+
+/* An off-diagonal value in (-1, 1), never zero, the same for (i,j) and (j,i). */
+static double synth_value(unsigned int seed, unsigned int i, unsigned int j)
+{
+   cl_ulong state = ((cl_ulong) seed << 32) ^ ((cl_ulong) (i < j ? i : j) * 0x100000001b3ULL) ^ (cl_ulong) (i < j ? j : i);
+   cl_ulong r = splitmix64(&state);
+   return ((double) (int) (r >> 40) - 8388608.0 + 0.5) / 8388608.0;
+}
+
+static unsigned int synth_default_param(unsigned int synth)
+{
+   return (synth == SYNTH_BANDED) ? 8 : (synth == SYNTH_BLOCKDIAG) ? 32 : SYNTH_DEFAULT_PARAM;
+}
+
+static int compare_uint(const void *a, const void *b)
+{
+   unsigned int x = *(const unsigned int *) a;
+   unsigned int y = *(const unsigned int *) b;
+   return (x > y) - (x < y);
+}
+
+/* Longest row the generator can produce for this kind, for sizing the scratch row. */
+static unsigned int synth_max_row(const matrix_gen_struct *mgs, unsigned int n)
+{
+   size_t len;
+   unsigned int p = mgs->synth_param;
+
+   switch (mgs->synth) {
+   case SYNTH_POISSON2D: len = 5; break;
+   case SYNTH_POISSON3D: len = 7; break;
+   case SYNTH_BANDED:    len = 2 * (size_t) p + 1; break;
+   case SYNTH_RANDOM:    len = (size_t) p + 1; break;
+   case SYNTH_POWERLAW:  len = SYNTH_POWERLAW_CAP * (size_t) p + 1; break;
+   default:              len = p; break;
+   }
+   return (len > n) ? n : (unsigned int) len;
+}
+
+/* ================================================================================= */
+/* Generate row "row" of an n x n matrix into cols[] (ascending, no repeats) and,    */
+/* if vals is not NULL, vals[] (in fp64; the caller rounds them for the fp32 copy).  */
+/* Returns the number of non-zeros in the row.                                       */
+/* ================================================================================= */
+
+static unsigned int synth_row(const matrix_gen_struct *mgs, unsigned int n, unsigned int max_row,
+                              unsigned int row, unsigned int *cols, double *vals)
+{
+   unsigned int p = mgs->synth_param;
+   unsigned int g = mgs->synth_size;
+   unsigned int count = 0;
+   unsigned int i, lo, hi;
+
+   switch (mgs->synth) {
+   case SYNTH_POISSON3D:
+      if (row >= g*g) cols[count++] = row - g*g;
+      /* fall through */
+   case SYNTH_POISSON2D:
+      if ((row % (g*g)) >= g) cols[count++] = row - g;
+      if ((row % g) != 0) cols[count++] = row - 1;
+      cols[count++] = row;
+      if ((row % g) != g-1) cols[count++] = row + 1;
+      if ((row % (g*g)) < g*g - g) cols[count++] = row + g;
+      if ((mgs->synth == SYNTH_POISSON3D) && (row < n - g*g)) cols[count++] = row + g*g;
+      if (vals != NULL) {
+         for (i=0; i<count; ++i) {
+            vals[i] = (cols[i] == row) ? ((mgs->synth == SYNTH_POISSON3D) ? 6.0 : 4.0) : -1.0;
+         }
+      }
+      return count;
+
+   case SYNTH_BANDED:
+   case SYNTH_BLOCKDIAG:
+      if (mgs->synth == SYNTH_BANDED) {
+         lo = (row > p) ? row - p : 0;
+         hi = (n - 1 - row > p) ? row + p : n - 1;
+      }
+      else {
+         lo = row - row % p;
+         hi = (n - lo > p) ? lo + p - 1 : n - 1;
+      }
+      for (i=lo; i<=hi; ++i) cols[count++] = i;
+      break;
+
+   case SYNTH_RANDOM:
+   case SYNTH_POWERLAW: {
+      cl_ulong state = ((cl_ulong) mgs->synth_seed << 32) ^ (cl_ulong) row;
+      unsigned int len = p + 1;
+      if (mgs->synth == SYNTH_POWERLAW) {
+         /* Pareto with alpha = 2 has mean 2 * xm, so xm = p / 2. */
+         double u = ((double) (splitmix64(&state) >> 11) + 1.0) * (1.0 / 9007199254740992.0);
+         double draw = ceil(0.5 * (double) p / sqrt(u));
+         len = (draw < (double) max_row) ? (unsigned int) draw : max_row;
+         if (len < 1) len = 1;
+      }
+      if (len > max_row) len = max_row;
+      cols[count++] = row;
+      for (i=1; i<len; ++i) {
+         cols[count++] = (unsigned int) (((splitmix64(&state) >> 32) * (cl_ulong) n) >> 32);
+      }
+      qsort(cols, count, sizeof(unsigned int), compare_uint);
+      unsigned int unique = 1;
+      for (i=1; i<count; ++i) {
+         if (cols[i] != cols[unique-1]) cols[unique++] = cols[i];
+      }
+      count = unique;
+      break;
+   }
+   }
+
+   if (vals != NULL) {
+      double offsum = 0.0;
+      unsigned int diag = 0;
+      for (i=0; i<count; ++i) {
+         if (cols[i] == row) {
+            diag = i;
+         }
+         else {
+            vals[i] = synth_value(mgs->synth_seed, row, cols[i]);
+            offsum += fabs(vals[i]);
+         }
+      }
+      vals[diag] = offsum + 1.0;
+   }
+   return count;
+}
+
+/* ================================================================================= */
+/* Parse a "kind:size[:param[:seed]]" spec into mgs.  Returns 0, or -1 if it is not  */
+/* one of the kinds above.                                                           */
+/* ================================================================================= */
+
+int matrix_synth_parse(const char *spec, matrix_gen_struct *mgs)
+{
+   char kind[32];
+   const char *colon = strchr(spec, ':');
+   unsigned int k;
+
+   if (colon == NULL || (size_t) (colon - spec) >= sizeof(kind)) return -1;
+   memcpy(kind, spec, colon - spec);
+   kind[colon - spec] = '\0';
+
+   mgs->synth = SYNTH_NONE;
+   for (k=SYNTH_POISSON2D; k<=SYNTH_BLOCKDIAG; ++k) {
+      if (strcmp(kind, synth_names[k]) == 0) mgs->synth = k;
+   }
+   if (mgs->synth == SYNTH_NONE) return -1;
+
+   mgs->synth_param = 0;
+   mgs->synth_seed = 1;
+   if (sscanf(colon+1, "%u:%u:%u", &mgs->synth_size, &mgs->synth_param, &mgs->synth_seed) < 1 || mgs->synth_size == 0) {
+      return -1;
+   }
+   if (mgs->synth_param == 0) mgs->synth_param = synth_default_param(mgs->synth);
+   return 0;
+}
+
+/* ================================================================================= */
+/* matrix_read's counterpart for a generated matrix: fills nx, ny, non_zero and the  */
+/* CSR arrays, and sets "symmetric" for the symmetric kinds under sym_storage.       */
+/* ================================================================================= */
+
+int matrix_synth(matrix_gen_struct *mgs) {
+   unsigned int preferred_alignment;
+   unsigned int i, n, max_row;
+   size_t rows, total;
+
+   preferred_alignment = mgs->preferred_alignment;
+
+   if (mgs->synth_param == 0) mgs->synth_param = synth_default_param(mgs->synth);
+   rows = mgs->synth_size;
+   if (mgs->synth == SYNTH_POISSON2D) rows *= mgs->synth_size;
+   if (mgs->synth == SYNTH_POISSON3D) rows *= (size_t) mgs->synth_size * mgs->synth_size;
+   if (rows >= 0xffffffffULL) {
+      printf("%s:%u makes %zu rows; the limit is %u\n", synth_names[mgs->synth], mgs->synth_size, rows, 0xfffffffeU);
+      return -1;
+   }
+   n = (unsigned int) rows;
+   max_row = synth_max_row(mgs, n);
+
+   unsigned int *cols;
+   double *vals;
+   MEMORY_ALLOC_CHECK(cols, (max_row * sizeof (int)), "cols")
+   MEMORY_ALLOC_CHECK(vals, (max_row * sizeof (double)), "vals")
+
+   /* First pass: size the matrix.  The row index and column arrays are 32 bits wide. */
+   total = 0;
+   for (i=0; i<n; ++i) {
+      total += synth_row(mgs, n, max_row, i, cols, NULL);
+   }
+   if (total >= 0xffffffffULL) {
+      printf("%s matrix would have %zu non-zeros; the limit is %u\n", synth_names[mgs->synth], total, 0xfffffffeU);
+      free(cols);
+      free(vals);
+      return -1;
+   }
+
+   *(mgs->nx) = n;
+   *(mgs->ny) = n;
+   *(mgs->non_zero) = (unsigned int) total;
+   mgs->symmetric = (mgs->sym_storage && mgs->synth != SYNTH_RANDOM && mgs->synth != SYNTH_POWERLAW) ? 1 : 0;
+   printf("generated %s matrix, size %u, param %u, seed %u\n", synth_names[mgs->synth], mgs->synth_size, mgs->synth_param, mgs->synth_seed);
+   matrix_shape(mgs);
+
+   MEMORY_ALLOC_CHECK(*(mgs->data_array), (*(mgs->non_zero) * sizeof (float)), "data_array")
+
+   if (mgs->data_array_dp != NULL) {
+      MEMORY_ALLOC_CHECK(*(mgs->data_array_dp), (*(mgs->non_zero) * sizeof (double)), "data_array_dp")
+   }
+
+   MEMORY_ALLOC_CHECK(*(mgs->x_index_array), ((*(mgs->non_zero)+1) * sizeof (int)), "x_index_array")
+
+   MEMORY_ALLOC_CHECK(*(mgs->row_index_array), ((*(mgs->nyround)+1) * sizeof (int)), "row_index_array")
+
+   /* Second pass: the same rows again, into place. */
+   unsigned int index = 0, k;
+   for (i=0; i<n; ++i) {
+      unsigned int count = synth_row(mgs, n, max_row, i, cols, vals);
+      (*(mgs->row_index_array))[i] = index;
+      memcpy(&(*(mgs->x_index_array))[index], cols, count * sizeof(unsigned int));
+      for (k=0; k<count; ++k) {
+         (*(mgs->data_array))[index+k] = (float) vals[k];
+      }
+      if (mgs->data_array_dp != NULL) {
+         memcpy(&(*(mgs->data_array_dp))[index], vals, count * sizeof(double));
+      }
+      index += count;
+   }
+   for (i=n; i<=*(mgs->nyround); ++i) {
+      (*(mgs->row_index_array))[i] = *(mgs->non_zero);
+   }
+
+   free(cols);
+   free(vals);
+   return 0;
+}
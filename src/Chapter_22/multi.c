@@ -0,0 +1,363 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Multi-device SpMV.                                                                */
+/*                                                                                   */
+/* The tiled matrix is a list of independent slabs, each writing its own range of    */
+/* output rows, so it splits naturally: each device gets a contiguous run of slabs,  */
+/* packed into a tiled matrix of its own with rebased slab headers.  The input       */
+/* vector is replicated on every device (a slab may read any part of it), and each   */
+/* device's output rows are gathered back into place on the host.                   */
+/*                                                                                   */
+/* The first split gives every device the same number of packets.  Each later pass   */
+/* times every device, and re-splits the packets in proportion to the throughput     */
+/* (packets per millisecond) each one achieved.                                      */
+/* ================================================================================= */
+
+typedef struct {
+   cl_command_queue ComQ;
+   cl_kernel kernel;
+   cl_mem matrix_buffer;
+   cl_mem input_buffer;
+   cl_mem output_buffer;
+   unsigned int s0, s1;              /* slabs [s0, s1) run on this device */
+   unsigned int packets;
+   double ms;                        /* fastest kernel time in the last pass */
+} multi_part;
+
+/* ================================================================================= */
+/* Collect the devices for the multi-device run: every device of "device_type" on    */
+/* the platform (at most "requested" of them, if "requested" is non-zero).  When      */
+/* only a single CPU device is present, split it into "requested" sub-devices.       */
+/* ================================================================================= */
+
+cl_uint multi_select_devices(cl_platform_id platform_id, cl_device_type device_type, unsigned int requested,
+                             cl_device_id **devices, unsigned int *subdevices)
+{
+   cl_int rc;
+   cl_uint ndevices;
+   unsigned int preferred_alignment = 16; // used by "MEMORY_ALLOC_CHECK" macro
+
+   *subdevices = 0;
+   rc = clGetDeviceIDs(platform_id, device_type, 0, NULL, &ndevices);
+   CHECK_RESULT("clGetDeviceIDs(multi)")
+   MEMORY_ALLOC_CHECK(*devices, ((ndevices > requested) ? ndevices : requested) * sizeof(cl_device_id), "multi devices")
+   rc = clGetDeviceIDs(platform_id, device_type, ndevices, *devices, NULL);
+   CHECK_RESULT("clGetDeviceIDs(multi list)")
+   if (requested > 0 && ndevices > requested) ndevices = requested;
+
+#ifdef CL_VERSION_1_2
+   if (ndevices == 1 && requested > 1 && device_type == CL_DEVICE_TYPE_CPU) {
+      cl_uint max_compute_units, nsub = 0, k;
+      cl_device_id parent = (*devices)[0];
+      clGetDeviceInfo(parent, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &max_compute_units, NULL);
+      if (max_compute_units < requested) {
+         printf("multi: the cpu device has only %d compute units, too few for %d sub-devices; running on the whole device\n",
+                max_compute_units, requested);
+         return ndevices;
+      }
+      /* An equal split makes as many sub-devices as the compute units allow, which is more than */
+      /* "requested" when they do not divide evenly; the extra ones are released again.          */
+      cl_uint per_sub = max_compute_units / requested;
+      cl_uint nentries = max_compute_units / per_sub;
+      cl_device_id *sub;
+      cl_device_partition_property properties[3];
+      MEMORY_ALLOC_CHECK(sub, nentries * sizeof(cl_device_id), "sub-devices")
+      properties[0] = CL_DEVICE_PARTITION_EQUALLY;
+      properties[1] = (cl_device_partition_property) per_sub;
+      properties[2] = 0;
+      rc = clCreateSubDevices(parent, properties, nentries, sub, &nsub);
+      if (rc == CL_SUCCESS && nsub >= requested) {
+         for (k=0; k<nsub; ++k) {
+            if (k < requested) (*devices)[k] = sub[k];
+            else clReleaseDevice(sub[k]);
+         }
+         free(sub);
+         printf("split the cpu device into %d sub-devices of %d compute units\n", requested, per_sub);
+         *subdevices = requested;
+         return requested;
+      }
+      for (k=0; rc == CL_SUCCESS && k<nsub; ++k) clReleaseDevice(sub[k]);
+      free(sub);
+      printf("multi: could not split the cpu device into %d sub-devices (rc = %d); running on the whole device\n", requested, rc);
+   }
+#endif
+
+   return ndevices;
+}
+
+void multi_release_devices(cl_device_id *devices, unsigned int subdevices)
+{
+#ifdef CL_VERSION_1_2
+   unsigned int i;
+   for (i=0; i<subdevices; ++i) {
+      clReleaseDevice(devices[i]);
+   }
+#endif
+   free(devices);
+}
+
+/* Split the slabs so that device d gets about weight[d] / sum(weight) of the packets. */
+static void multi_partition(multi_struct *ms, multi_part *part, double *weight)
+{
+   unsigned int d, s = 0;
+   double total_weight = 0.0, cum_weight = 0.0;
+   slab_header *h = ms->matrix_header;
+   unsigned int base = h[0].offset;
+   double total_packets = (double) (h[ms->nslabs_round].offset - base);
+
+   for (d=0; d<ms->ndevices; ++d) total_weight += weight[d];
+   for (d=0; d<ms->ndevices; ++d) {
+      unsigned int remaining_devices = ms->ndevices - d - 1;
+      cum_weight += weight[d];
+      part[d].s0 = s;
+      if (remaining_devices == 0) {
+         s = ms->nslabs_round;
+      }
+      else {
+         double target = total_packets * cum_weight / total_weight;
+         while (s < ms->nslabs_round - remaining_devices && (double) (h[s].offset - base) < target) ++s;
+         if (s == part[d].s0 && s < ms->nslabs_round - remaining_devices) ++s;   /* at least one slab each */
+      }
+      part[d].s1 = s;
+      part[d].packets = h[part[d].s1].offset - h[part[d].s0].offset;
+   }
+}
+
+/* Pack slabs [s0, s1) into a tiled matrix of their own, and load it and the input onto the device. */
+static void multi_load(multi_struct *ms, cl_context context, multi_part *part)
+{
+   cl_int rc;
+   unsigned int k, n = part->s1 - part->s0;
+   unsigned int preferred_alignment = 128; // used by "MEMORY_ALLOC_CHECK" macro
+   slab_header *h = ms->matrix_header;
+   packet *tiles;
+   slab_header *local_header;
+   unsigned int header_packets, output_rows;
+   size_t size;
+
+   /* Same header sizing as matrix_gen, plus its 32 packets of room for reading past the end. */
+   header_packets = (3 * 4 * (n + 1) + sizeof(packet)) / sizeof(packet);
+   size = (size_t) (header_packets + part->packets + 32) * sizeof(packet);
+   MEMORY_ALLOC_CHECK(tiles, size, "multi tiles")
+   memset(tiles, 0, size);
+   local_header = (slab_header *) tiles;
+   for (k=0; k<=n; ++k) {
+      local_header[k].offset = h[part->s0 + k].offset - h[part->s0].offset + header_packets;
+      local_header[k].outindex = h[part->s0 + k].outindex - h[part->s0].outindex;
+      local_header[k].outspan = (k < n) ? h[part->s0 + k].outspan : 0;
+   }
+   memcpy(&tiles[header_packets], &((packet *) h)[h[part->s0].offset], (size_t) part->packets * sizeof(packet));
+
+   part->matrix_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, tiles, &rc);
+   CHECK_RESULT("clCreateBuffer(multi matrix)")
+   free(tiles);
+
+   part->input_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                       (size_t) ms->nx_pad * ms->nrhs * sizeof(float), (void *) ms->input, &rc);
+   CHECK_RESULT("clCreateBuffer(multi input)")
+
+   /* Zero the output: rows of empty slabs are never written by the kernel. */
+   output_rows = ms->slab_startrow[part->s1] - ms->slab_startrow[part->s0];
+   size = (size_t) (output_rows ? output_rows : 1) * ms->nrhs * sizeof(float);
+   float *zero;
+   MEMORY_ALLOC_CHECK(zero, size, "multi zero")
+   memset(zero, 0, size);
+   part->output_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, zero, &rc);
+   CHECK_RESULT("clCreateBuffer(multi output)")
+   free(zero);
+
+   rc = tiled_kernel_args(part->kernel, ms->kernel_type, part->input_buffer, part->output_buffer, part->matrix_buffer,
+                          ms->column_span, ms->max_slabheight, ms->team_size, ms->segcachesize, ms->num_header_packets, ms->nrhs,
+                          PRECISION_SINGLE);
+   CHECK_RESULT("clSetKernelArg(tiled)")
+}
+
+/* Set every argument of a tiled LS or AWGC kernel (SpMV or SpMM), built for "precision". */
+/* Returns CL_SUCCESS, or a failure code for the caller to report.                          */
+cl_int tiled_kernel_args(cl_kernel kernel, unsigned int kernel_type, cl_mem input_buffer, cl_mem output_buffer, cl_mem matrix_buffer,
+                         unsigned int column_span, unsigned int max_slabheight, unsigned int team_size, unsigned int segcachesize,
+                         unsigned int num_header_packets, unsigned int nrhs, unsigned int precision)
+{
+   cl_int rc;
+   size_t value_size = (precision == PRECISION_SINGLE) ? sizeof(float) : sizeof(double);
+   size_t packet_size = (precision == PRECISION_DOUBLE) ? sizeof(packet_dp) : sizeof(packet);
+
+   rc  = clSetKernelArg(kernel, 0, sizeof(cl_mem), &input_buffer);
+   rc |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &output_buffer);
+   rc |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &matrix_buffer);
+   rc |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &column_span);
+   rc |= clSetKernelArg(kernel, 4, sizeof(cl_uint), &max_slabheight);
+   if (kernel_type == KERNEL_LS) {
+      rc |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &team_size);
+      rc |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &num_header_packets);
+      rc |= clSetKernelArg(kernel, 7, max_slabheight * nrhs * value_size, NULL);
+   }
+   else {
+      rc |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &segcachesize);
+      rc |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &num_header_packets);
+      rc |= clSetKernelArg(kernel, 7, 2 * column_span * nrhs * value_size, NULL);
+      rc |= clSetKernelArg(kernel, 8, max_slabheight * nrhs * value_size, NULL);
+      rc |= clSetKernelArg(kernel, 9, segcachesize * packet_size, NULL);
+   }
+   return rc;
+}
+
+static void multi_unload(multi_part *part)
+{
+   clReleaseMemObject(part->matrix_buffer);
+   clReleaseMemObject(part->input_buffer);
+   clReleaseMemObject(part->output_buffer);
+}
+
+/* Run every device's share MULTI_REPS times, all devices concurrently, keeping each device's fastest time. */
+static double multi_run(multi_struct *ms, multi_part *part)
+{
+   cl_int rc;
+   unsigned int d, r;
+   cl_event *events;
+   unsigned int preferred_alignment = 16; // used by "MEMORY_ALLOC_CHECK" macro
+   double start, best_wall = 0.0;
+
+   MEMORY_ALLOC_CHECK(events, ms->ndevices * sizeof(cl_event), "multi events")
+   for (d=0; d<ms->ndevices; ++d) part[d].ms = 0.0;
+
+   for (r=0; r<MULTI_REPS; ++r) {
+      start = wall_time();
+      for (d=0; d<ms->ndevices; ++d) {
+         size_t global_work_size[2], local_work_size[2];
+         cl_uint ndims;
+         if (ms->kernel_type == KERNEL_AWGC) {
+            ndims = 1;
+            global_work_size[0] = part[d].s1 - part[d].s0;
+            local_work_size[0] = 1;
+         }
+         else {
+            ndims = 2;
+            global_work_size[0] = local_work_size[0] = ms->local_work_size0;
+            global_work_size[1] = part[d].s1 - part[d].s0;
+            local_work_size[1] = 1;
+         }
+         rc = clEnqueueNDRangeKernel(part[d].ComQ, part[d].kernel, ndims, NULL, global_work_size, local_work_size, 0, NULL, &events[d]);
+         CHECK_RESULT("clEnqueueNDRangeKernel(multi)")
+         clFlush(part[d].ComQ);
+      }
+      clWaitForEvents(ms->ndevices, events);
+      double wall = 1000.0 * (wall_time() - start);
+      if (r == 0 || wall < best_wall) best_wall = wall;
+      for (d=0; d<ms->ndevices; ++d) {
+         double t = stats_event_ms(events[d]);
+         if (r == 0 || t < part[d].ms) part[d].ms = t;
+         clReleaseEvent(events[d]);
+      }
+   }
+   free(events);
+   return best_wall;
+}
+
+int spmv_multi(multi_struct *ms)
+{
+   cl_int rc;
+   unsigned int d, pass, i;
+   unsigned int preferred_alignment = 16; // used by "MEMORY_ALLOC_CHECK" macro
+   multi_part *part;
+   double *weight, wall_ms = 0.0;
+
+   if (ms->nslabs_round < ms->ndevices) {
+      printf("multi: only %d slabs for %d devices\n", ms->nslabs_round, ms->ndevices);
+      return -1;
+   }
+
+   /* One context and program over all the devices, apart from the single-device handle's. */
+   cl_context context;
+   cl_program program;
+   cl_context_properties properties[3];
+   char *source;
+   properties[0] = CL_CONTEXT_PLATFORM;
+   properties[1] = (cl_context_properties) ms->platform;
+   properties[2] = 0;
+   context = clCreateContext(properties, ms->ndevices, ms->devices, NULL, NULL, &rc);
+   CHECK_RESULT("clCreateContext(multi)")
+   source = load_program_source(ms->kernel_source);
+   if (source == NULL) {
+      exit(EXIT_FAILURE);
+   }
+   program = clCreateProgramWithSource(context, 1, (const char **) &source, NULL, &rc);
+   CHECK_RESULT("clCreateProgramWithSource(multi)")
+   free(source);
+   rc = clBuildProgram(program, ms->ndevices, ms->devices, ms->build_options, NULL, NULL);
+   CHECK_RESULT("clBuildProgram(multi)")
+
+   MEMORY_ALLOC_CHECK(part, ms->ndevices * sizeof(multi_part), "multi parts")
+   MEMORY_ALLOC_CHECK(weight, ms->ndevices * sizeof(double), "multi weights")
+   for (d=0; d<ms->ndevices; ++d) {
+      part[d].ComQ = clCreateCommandQueue(context, ms->devices[d], CL_QUEUE_PROFILING_ENABLE, &rc);
+      CHECK_RESULT("clCreateCommandQueue(multi)")
+      part[d].kernel = clCreateKernel(program, ms->kernel_name, &rc);
+      CHECK_RESULT("clCreateKernel(multi)")
+      weight[d] = 1.0;
+   }
+
+   for (pass=0; pass<ms->passes; ++pass) {
+      multi_partition(ms, part, weight);
+      for (d=0; d<ms->ndevices; ++d) multi_load(ms, context, &part[d]);
+      wall_ms = multi_run(ms, part);
+
+      printf("multi pass %d: %.4f ms on %d devices\n", pass, wall_ms, ms->ndevices);
+      for (d=0; d<ms->ndevices; ++d) {
+         printf("   device %d: slabs %d-%d, %d packets, %.4f ms\n", d, part[d].s0, part[d].s1 - 1, part[d].packets, part[d].ms);
+         /* Packets per millisecond; the next pass hands out packets in these proportions. */
+         weight[d] = (part[d].ms > 0.0) ? (double) part[d].packets / part[d].ms : weight[d];
+      }
+      if (pass + 1 < ms->passes) {
+         for (d=0; d<ms->ndevices; ++d) multi_unload(&part[d]);
+      }
+   }
+
+   /* Gather each device's output rows into place, and check them against the reference. */
+   float *output;
+   unsigned int rows = ms->slab_startrow[ms->nslabs_round] - ms->slab_startrow[0];
+   MEMORY_ALLOC_CHECK(output, (size_t) rows * ms->nrhs * sizeof(float), "multi output")
+   for (d=0; d<ms->ndevices; ++d) {
+      unsigned int first = ms->slab_startrow[part[d].s0] - ms->slab_startrow[0];
+      unsigned int count = ms->slab_startrow[part[d].s1] - ms->slab_startrow[part[d].s0];
+      if (count == 0) continue;
+      rc = clEnqueueReadBuffer(part[d].ComQ, part[d].output_buffer, CL_TRUE, 0, (size_t) count * ms->nrhs * sizeof(float),
+                               &output[(size_t) first * ms->nrhs], 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueReadBuffer(multi output)")
+   }
+
+   double sum = 0.0, diffsum = 0.0;
+   for (i=0; i<ms->ny*ms->nrhs; ++i) {
+      double a = (double) ms->reference[i];
+      double delta = a - (double) output[i];
+      sum += (a < 0.0) ? -a : a;
+      diffsum += (delta < 0.0) ? -delta : delta;
+   }
+   printf("multi: avg error = %le over %d devices\n", (sum > 0.0) ? diffsum / sum : diffsum, ms->ndevices);
+   ms->wall_ms = wall_ms;
+
+   for (d=0; d<ms->ndevices; ++d) {
+      multi_unload(&part[d]);
+      clReleaseKernel(part[d].kernel);
+      clReleaseCommandQueue(part[d].ComQ);
+   }
+   clReleaseProgram(program);
+   clReleaseContext(context);
+   free(output);
+   free(part);
+   free(weight);
+
+   return (sum > 0.0 && diffsum / sum > 0.0001) ? -1 : 0;
+}
@@ -0,0 +1,300 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Cost-model slab partitioner.                                                      */
+/*                                                                                   */
+/* The default partitioners give each slab the same number of non-zeros (AWGC) or    */
+/* the same number of rows (LS on the CPU).  Neither accounts for how well a slab's  */
+/* rows fill their packets, nor for how many input segments a slab touches, and a    */
+/* slab of short scattered rows can cost several times what its non-zero count      */
+/* suggests.  Here, each candidate slab is costed in bytes moved:                    */
+/*                                                                                   */
+/*    packets * (packet size + input gathered per packet, for the LS kernel)         */
+/*  + distinct input segments * segment size  (the AWGC kernel copies each one in)   */
+/*  + output rows * sizeof(float)                                                    */
+/*                                                                                   */
+/* where the packet count is exactly the one matrix_tile will produce: for every     */
+/* 16-row group and input segment, the longest of the 16 row pieces.  The split then */
+/* minimizes the cost of the heaviest slab, for the requested number of slabs.       */
+/* ================================================================================= */
+
+/* Split the blocks of rows greedily into slabs costing at most "limit" each (a single  */
+/* block may exceed it), and return the number of slabs.  With "startrow" non-NULL, the  */
+/* slab boundaries are recorded there.  "slab_stamp" and "block_stamp" are scratch.      */
+static unsigned int partition_greedy(matrix_gen_struct *mgs, unsigned int align, unsigned int max_height, unsigned int nblocks,
+                                     unsigned int *block_packets, double packet_bytes, double segment_bytes, double limit,
+                                     unsigned int *slab_stamp, unsigned int *block_stamp, unsigned int nseg,
+                                     unsigned int *startrow, double *max_cost, unsigned int *max_height_used)
+{
+   unsigned int *row_index = *(mgs->row_index_array);
+   unsigned int *x_index = *(mgs->x_index_array);
+   unsigned int column_span = *(mgs->column_span);
+   unsigned int b, r, k, nslabs = 0, height = 0;
+   double slab_cost = 0.0;
+
+   for (k=0; k<nseg; ++k) slab_stamp[k] = block_stamp[k] = 0xffffffff;
+   *max_cost = 0.0;
+   *max_height_used = 0;
+   if (startrow != NULL) startrow[0] = 0;
+
+   for (b=0; b<nblocks; ++b) {
+      /* Cost of adding this block to the current slab: its packets and rows, plus any */
+      /* input segments the slab does not already touch.                              */
+      double block_cost = block_packets[b] * packet_bytes + align * sizeof(float);
+      for (r=b*align; r<(b+1)*align; ++r) {
+         for (k=row_index[r]; k<row_index[r+1]; ++k) {
+            unsigned int seg = x_index[k] / column_span;
+            if (slab_stamp[seg] != nslabs && block_stamp[seg] != b) {
+               block_stamp[seg] = b;
+               block_cost += segment_bytes;
+            }
+         }
+      }
+      if (height > 0 && (slab_cost + block_cost > limit || height + align > max_height)) {
+         /* Close the slab, and cost the block again as the first of a new one. */
+         if (slab_cost > *max_cost) *max_cost = slab_cost;
+         if (height > *max_height_used) *max_height_used = height;
+         ++nslabs;
+         if (startrow != NULL) startrow[nslabs] = b * align;
+         slab_cost = 0.0;
+         height = 0;
+         --b;
+         continue;
+      }
+      for (r=b*align; r<(b+1)*align; ++r) {
+         for (k=row_index[r]; k<row_index[r+1]; ++k) {
+            slab_stamp[x_index[k] / column_span] = nslabs;
+         }
+      }
+      slab_cost += block_cost;
+      height += align;
+   }
+   if (height > 0) {
+      if (slab_cost > *max_cost) *max_cost = slab_cost;
+      if (height > *max_height_used) *max_height_used = height;
+      ++nslabs;
+   }
+   if (startrow != NULL) startrow[nslabs] = *(mgs->nyround);
+   return nslabs;
+}
+
+unsigned int partition_cost(matrix_gen_struct *mgs, unsigned int align, unsigned int max_height, unsigned int expected_nslabs)
+{
+   unsigned int preferred_alignment = mgs->preferred_alignment; // used by "MEMORY_ALLOC_CHECK" macro
+   unsigned int *row_index = *(mgs->row_index_array);
+   unsigned int *x_index = *(mgs->x_index_array);
+   unsigned int column_span = *(mgs->column_span);
+   unsigned int nyround = *(mgs->nyround);
+   unsigned int nblocks = nyround / align;
+   unsigned int nseg = (*(mgs->nx_pad) + column_span - 1) / column_span;
+   unsigned int *seg_stamp, *seg_max, *touched, *block_packets;
+   unsigned int b, r, k, g, nslabs, iter;
+   double packet_bytes, segment_bytes, lo, hi, max_cost, total = 0.0;
+
+   if (max_height < align) max_height = align;
+   if (expected_nslabs < 1) expected_nslabs = 1;
+
+   packet_bytes = (double) sizeof(packet);
+   segment_bytes = 0.0;
+   if (mgs->kernel_type == KERNEL_AWGC) {
+      segment_bytes = (double) column_span * sizeof(float);
+   }
+   else {
+      packet_bytes += 16.0 * sizeof(float);
+   }
+
+   MEMORY_ALLOC_CHECK(seg_stamp, nseg * sizeof(unsigned int), "seg_stamp")
+   MEMORY_ALLOC_CHECK(seg_max, nseg * sizeof(unsigned int), "seg_max")
+   MEMORY_ALLOC_CHECK(touched, nseg * sizeof(unsigned int), "touched")
+   MEMORY_ALLOC_CHECK(block_packets, nblocks * sizeof(unsigned int), "block_packets")
+   for (k=0; k<nseg; ++k) seg_stamp[k] = 0xffffffff;
+
+   /* Packets per block of rows, counted per 16-row group exactly as matrix_tile will build them. */
+   for (b=0; b<nblocks; ++b) {
+      block_packets[b] = 0;
+      for (g=b*align; g<(b+1)*align; g+=16) {
+         unsigned int ntouched = 0;
+         for (r=g; r<g+16; ++r) {
+            unsigned int j = row_index[r];
+            while (j < row_index[r+1]) {
+               unsigned int seg = x_index[j] / column_span;
+               unsigned int count = 0;
+               while (j < row_index[r+1] && x_index[j] / column_span == seg) {
+                  ++count;
+                  ++j;
+               }
+               if (seg_stamp[seg] != g) {
+                  seg_stamp[seg] = g;
+                  seg_max[seg] = 0;
+                  touched[ntouched++] = seg;
+               }
+               if (count > seg_max[seg]) seg_max[seg] = count;
+            }
+         }
+         for (k=0; k<ntouched; ++k) block_packets[b] += seg_max[touched[k]];
+      }
+   }
+
+   /* Find the smallest per-slab cost limit that still fits the matrix in "expected_nslabs" */
+   /* slabs, by bisection between the largest single block and the whole matrix.           */
+   partition_greedy(mgs, align, max_height, nblocks, block_packets, packet_bytes, segment_bytes, 0.0,
+                    seg_stamp, seg_max, nseg, NULL, &lo, &k);
+   partition_greedy(mgs, align, max_height, nblocks, block_packets, packet_bytes, segment_bytes, 1.0e300,
+                    seg_stamp, seg_max, nseg, NULL, &hi, &k);
+   for (iter=0; iter<40 && hi - lo > 0.001 * hi; ++iter) {
+      double mid = 0.5 * (lo + hi);
+      if (partition_greedy(mgs, align, max_height, nblocks, block_packets, packet_bytes, segment_bytes, mid,
+                           seg_stamp, seg_max, nseg, NULL, &max_cost, &k) <= expected_nslabs) {
+         hi = mid;
+      }
+      else {
+         lo = mid;
+      }
+   }
+
+   MEMORY_ALLOC_CHECK(*(mgs->slab_startrow), ((nblocks + 1) * sizeof(unsigned int)), "slab_startrow")
+   nslabs = partition_greedy(mgs, align, max_height, nblocks, block_packets, packet_bytes, segment_bytes, hi,
+                             seg_stamp, seg_max, nseg, *(mgs->slab_startrow), &max_cost, mgs->max_slabheight);
+   for (b=0; b<nblocks; ++b) total += block_packets[b];
+
+   printf("cost partitioner: %d slabs (%d expected), %.0f packets, heaviest slab %.0f bytes\n",
+          nslabs, expected_nslabs, total, max_cost);
+
+   free(seg_stamp);
+   free(seg_max);
+   free(touched);
+   free(block_packets);
+   return nslabs;
+}
+
+/* ================================================================================= */
+/* Autotune: tile the matrix with each candidate partitioning, time the kernel on    */
+/* it, and keep the fastest.  The candidates are both partitioners, each with the    */
+/* number of slabs scaled by 1/2, 1, 2 and 4.  Only the CSR arrays are reused; each  */
+/* candidate is tiled from scratch by matrix_tile.                                   */
+/* ================================================================================= */
+
+/* Report a failed OpenCL call, release whatever the autotuner holds, and fail. */
+#define AUTOTUNE_CHECK(_string) {                                                   \
+   if (rc != CL_SUCCESS) {                                                          \
+      printf("%s failed. rc = %d\n", _string, rc);                                  \
+      autotune_release(queue, input, matrix_buffer, input_buffer, output_buffer);   \
+      return -1;                                                                    \
+   }                                                                                \
+}
+
+static void autotune_release(cl_command_queue queue, float *input, cl_mem matrix_buffer, cl_mem input_buffer, cl_mem output_buffer)
+{
+   if (matrix_buffer != NULL) clReleaseMemObject(matrix_buffer);
+   if (input_buffer != NULL) clReleaseMemObject(input_buffer);
+   if (output_buffer != NULL) clReleaseMemObject(output_buffer);
+   if (queue != NULL) clReleaseCommandQueue(queue);
+   free(input);
+}
+
+int partition_autotune(matrix_gen_struct *mgs, cl_context context, cl_device_id device, cl_kernel kernel, unsigned int nrhs)
+{
+   static const float scales[] = { 0.5f, 1.0f, 2.0f, 4.0f };
+   unsigned int nscales = sizeof(scales) / sizeof(scales[0]);
+   unsigned int partitioner, c, i, best = 0, ncandidates = 2 * nscales;
+   double best_ms = 0.0;
+   cl_int rc;
+   cl_command_queue queue;
+   cl_mem input_buffer = NULL, output_buffer = NULL, matrix_buffer = NULL;
+   float *input = NULL;
+   stats_struct st;
+
+   queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &rc);
+   if (rc != CL_SUCCESS) queue = NULL;
+   AUTOTUNE_CHECK("clCreateCommandQueue(autotune)")
+
+   if (posix_memalign((void **) &input, mgs->preferred_alignment, *(mgs->nx_pad) * nrhs * sizeof(float)) != 0 || input == NULL) {
+      printf("Failed allocation of %lld bytes for %s\n", (unsigned long long) *(mgs->nx_pad) * nrhs * sizeof(float), "autotune input");
+      input = NULL;
+      autotune_release(queue, input, NULL, NULL, NULL);
+      return -1;
+   }
+   for (i=0; i<*(mgs->nx_pad) * nrhs; ++i) {
+      input[i] = ((float) (rand() & 0x7fff)) * 0.001f - 15.0f;
+   }
+
+   printf("autotune: partitioner, slab scale, slabs, median ms\n");
+   for (c=0; c<=ncandidates; ++c) {
+      /* The extra, last round rebuilds the winner, and is not timed. */
+      unsigned int cand = (c < ncandidates) ? c : best;
+      partitioner = (cand < nscales) ? PARTITION_ROWS : PARTITION_COST;
+      mgs->partitioner = partitioner;
+      mgs->slab_scale = scales[cand % nscales];
+
+      /* Cleared, so that a failed tiling leaves nothing behind for the caller to free twice. */
+      free(*(mgs->slab_startrow));
+      free(*(mgs->seg_workspace));
+      *(mgs->slab_startrow) = NULL;
+      *(mgs->seg_workspace) = NULL;
+      if (matrix_tile(mgs) != 0) {
+         printf("autotune: tiling failed\n");
+         autotune_release(queue, input, NULL, NULL, NULL);
+         return -1;
+      }
+      if (c == ncandidates) break;
+
+      unsigned int nslabs = *(mgs->nslabs_round);
+      size_t output_size = (size_t) ((*(mgs->slab_startrow))[nslabs] - (*(mgs->slab_startrow))[0]) * nrhs * sizeof(float);
+      matrix_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, *(mgs->memsize), NULL, &rc);
+      AUTOTUNE_CHECK("clCreateBuffer(autotune matrix)")
+      rc = clEnqueueWriteBuffer(queue, matrix_buffer, CL_TRUE, 0, sizeof(packet) * (*(mgs->matrix_header))[nslabs].offset,
+                                *(mgs->matrix_header), 0, NULL, NULL);
+      AUTOTUNE_CHECK("clEnqueueWriteBuffer(autotune matrix)")
+      input_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, *(mgs->nx_pad) * nrhs * sizeof(float), input, &rc);
+      AUTOTUNE_CHECK("clCreateBuffer(autotune input)")
+      output_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, output_size, NULL, &rc);
+      AUTOTUNE_CHECK("clCreateBuffer(autotune output)")
+      rc = tiled_kernel_args(kernel, mgs->kernel_type, input_buffer, output_buffer, matrix_buffer, *(mgs->column_span),
+                             *(mgs->max_slabheight), 1, *(mgs->segcachesize), *(mgs->num_header_packets), nrhs, PRECISION_SINGLE);
+      AUTOTUNE_CHECK("clSetKernelArg(autotune)")
+
+      size_t global_work_size[2], local_work_size[2];
+      cl_uint ndims;
+      if (mgs->kernel_type == KERNEL_AWGC) {
+         ndims = 1;
+         global_work_size[0] = nslabs;
+         local_work_size[0] = 1;
+      }
+      else {
+         ndims = 2;
+         global_work_size[0] = local_work_size[0] = CPU_WGSZ;
+         global_work_size[1] = nslabs;
+         local_work_size[1] = 1;
+      }
+      memset(&st, 0, sizeof(st));
+      rc = bench_kernel(queue, kernel, ndims, global_work_size, local_work_size, BENCH_WARMUP, BENCH_MIN_REPS, 0.0, &st);
+      if (rc != CL_SUCCESS) {
+         autotune_release(queue, input, matrix_buffer, input_buffer, output_buffer);
+         return -1;
+      }
+      printf("autotune: %-5s %4.1f %6d %10.4f\n", (partitioner == PARTITION_COST) ? "cost" : "rows", mgs->slab_scale, nslabs, st.kernel_ms_median);
+      if (c == 0 || st.kernel_ms_median < best_ms) {
+         best_ms = st.kernel_ms_median;
+         best = c;
+      }
+
+      autotune_release(NULL, NULL, matrix_buffer, input_buffer, output_buffer);
+      matrix_buffer = input_buffer = output_buffer = NULL;
+   }
+
+   printf("autotune: chose the %s partitioner with slab scale %.1f (%.4f ms)\n",
+          (mgs->partitioner == PARTITION_COST) ? "cost" : "rows", mgs->slab_scale, best_ms);
+   autotune_release(queue, input, NULL, NULL, NULL);
+   return 0;
+}
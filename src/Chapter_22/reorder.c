@@ -0,0 +1,388 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Bandwidth-reducing reordering of a square matrix, applied before it is tiled.     */
+/*                                                                                   */
+/* The packets of a slab pull their input values from whichever column segments      */
+/* their non-zeros fall in.  In a matrix whose rows are numbered arbitrarily, each   */
+/* slab's columns are scattered over all of nx, so every slab touches many segments  */
+/* and the AWGC kernel's segment cache does little.  Renumbering rows and columns    */
+/* together (the same permutation on both sides, so the matrix keeps its symmetry)  */
+/* pulls the non-zeros of each slab towards the diagonal, into fewer segments.       */
+/*                                                                                   */
+/* Two orderings are offered, both computed on the pattern of A + A^T:               */
+/*                                                                                   */
+/*    REORDER_RCM  reverse Cuthill-McKee: a breadth-first numbering from a           */
+/*                 pseudo-peripheral node, neighbours taken in order of degree,      */
+/*                 then reversed.                                                    */
+/*    REORDER_ND   a light nested dissection: each connected piece is split at the   */
+/*                 middle level of a breadth-first search, the two halves are        */
+/*                 numbered first and the separating level last, recursively, and    */
+/*                 pieces of REORDER_ND_LEAF nodes or fewer are numbered by RCM.     */
+/*                                                                                   */
+/* The result is "perm", where row k of the reordered matrix is row perm[k] of the   */
+/* file.  The CSR arrays themselves are left in file order; matrix_tile() tiles a    */
+/* permuted copy, and the host moves vectors in and out of the reordered numbering  */
+/* with reorder_vector().                                                            */
+/* ================================================================================= */
+
+#define REORDER_ND_LEAF 256
+#define REORDER_DONE    0xffffffff   /* "owner" of a node which has its final number */
+#define REORDER_PPN_ITERATIONS 8
+
+typedef struct _reorder_state {
+   unsigned int n;
+   unsigned int *adj_start;          /* adjacency of A + A^T, without the diagonal, in CSR form */
+   unsigned int *adj;
+   unsigned int *owner;              /* the segment each node belongs to, by its first position */
+   unsigned int *mark;               /* visited stamps, so the searches never clear it */
+   unsigned int stamp;
+   unsigned int *queue;              /* breadth-first order of the last search */
+   unsigned int *level_start;        /* where each level of the last search begins in "queue" */
+   unsigned int *nodes;              /* the ordering being built */
+   unsigned int *scratch;
+   unsigned long long *keys;         /* degree << 32 | node, for sorting neighbours */
+} reorder_state;
+
+static int compare_uint(const void *a, const void *b)
+{
+   unsigned int x = *(const unsigned int *) a;
+   unsigned int y = *(const unsigned int *) b;
+   return (x > y) - (x < y);
+}
+
+static int compare_ull(const void *a, const void *b)
+{
+   unsigned long long x = *(const unsigned long long *) a;
+   unsigned long long y = *(const unsigned long long *) b;
+   return (x > y) - (x < y);
+}
+
+static unsigned int degree(reorder_state *rs, unsigned int v)
+{
+   return rs->adj_start[v+1] - rs->adj_start[v];
+}
+
+/* Build the symmetric adjacency structure of the pattern of A + A^T. */
+static void reorder_graph(reorder_state *rs, unsigned int preferred_alignment, const unsigned int *row_index, const unsigned int *x_index)
+{
+   unsigned int n = rs->n;
+   unsigned int i, j, k;
+   unsigned int *fill;
+
+   MEMORY_ALLOC_CHECK(rs->adj_start, ((n+1) * sizeof(unsigned int)), "reorder adj_start")
+   MEMORY_ALLOC_CHECK(fill, ((n+1) * sizeof(unsigned int)), "reorder fill")
+   memset(fill, 0, (n+1) * sizeof(unsigned int));
+   for (i=0; i<n; ++i) {
+      for (j=row_index[i]; j<row_index[i+1]; ++j) {
+         if (x_index[j] != i) {
+            ++fill[i];
+            ++fill[x_index[j]];
+         }
+      }
+   }
+   rs->adj_start[0] = 0;
+   for (i=0; i<n; ++i) {
+      rs->adj_start[i+1] = rs->adj_start[i] + fill[i];
+      fill[i] = rs->adj_start[i];
+   }
+   MEMORY_ALLOC_CHECK(rs->adj, ((rs->adj_start[n]+1) * sizeof(unsigned int)), "reorder adj")
+   for (i=0; i<n; ++i) {
+      for (j=row_index[i]; j<row_index[i+1]; ++j) {
+         if (x_index[j] != i) {
+            rs->adj[fill[i]++] = x_index[j];
+            rs->adj[fill[x_index[j]]++] = i;
+         }
+      }
+   }
+
+   /* Sort each list and squeeze out the duplicates of entries present in both A and A^T. */
+   k = 0;
+   for (i=0; i<n; ++i) {
+      unsigned int lb = rs->adj_start[i];
+      unsigned int ub = rs->adj_start[i+1];
+      qsort(&rs->adj[lb], ub - lb, sizeof(unsigned int), compare_uint);
+      rs->adj_start[i] = k;
+      for (j=lb; j<ub; ++j) {
+         if (j == lb || rs->adj[j] != rs->adj[j-1]) {
+            rs->adj[k++] = rs->adj[j];
+         }
+      }
+   }
+   rs->adj_start[n] = k;
+   free(fill);
+}
+
+/* Breadth-first search from "root" over the nodes owned by "tag".  Leaves the nodes  */
+/* reached in rs->queue, level by level, and returns the number of levels and nodes.  */
+/* With "by_degree" set, the new neighbours of each node are queued lowest degree     */
+/* first, as Cuthill-McKee requires.                                                  */
+static unsigned int reorder_bfs(reorder_state *rs, unsigned int root, unsigned int tag, int by_degree, unsigned int *count)
+{
+   unsigned int head, tail, nlevels, j;
+
+   ++rs->stamp;
+   rs->mark[root] = rs->stamp;
+   rs->queue[0] = root;
+   head = 0;
+   tail = 1;
+   nlevels = 0;
+   while (head < tail) {
+      unsigned int level_end = tail;
+      rs->level_start[nlevels++] = head;
+      while (head < level_end) {
+         unsigned int v = rs->queue[head++];
+         unsigned int first = tail;
+         for (j=rs->adj_start[v]; j<rs->adj_start[v+1]; ++j) {
+            unsigned int w = rs->adj[j];
+            if (rs->owner[w] == tag && rs->mark[w] != rs->stamp) {
+               rs->mark[w] = rs->stamp;
+               rs->queue[tail++] = w;
+            }
+         }
+         if (by_degree && tail - first > 1) {
+            unsigned int k;
+            for (k=first; k<tail; ++k) {
+               rs->keys[k-first] = ((unsigned long long) degree(rs, rs->queue[k]) << 32) | rs->queue[k];
+            }
+            qsort(rs->keys, tail - first, sizeof(unsigned long long), compare_ull);
+            for (k=first; k<tail; ++k) {
+               rs->queue[k] = (unsigned int) rs->keys[k-first];
+            }
+         }
+      }
+   }
+   rs->level_start[nlevels] = tail;
+   *count = tail;
+   return nlevels;
+}
+
+/* Find a node near the edge of the connected piece holding "start" (George and Liu): */
+/* restart from the lowest-degree node of the last level until the depth stops growing. */
+static unsigned int reorder_peripheral(reorder_state *rs, unsigned int start, unsigned int tag)
+{
+   unsigned int root, nlevels, count, iter, j;
+
+   /* Start from the lowest-degree node of the piece. */
+   root = start;
+   reorder_bfs(rs, start, tag, 0, &count);
+   for (j=0; j<count; ++j) {
+      if (degree(rs, rs->queue[j]) < degree(rs, root)) root = rs->queue[j];
+   }
+   nlevels = reorder_bfs(rs, root, tag, 0, &count);
+   for (iter=0; iter<REORDER_PPN_ITERATIONS; ++iter) {
+      unsigned int candidate = rs->queue[rs->level_start[nlevels-1]];
+      unsigned int candidate_levels;
+      for (j=rs->level_start[nlevels-1]; j<count; ++j) {
+         if (degree(rs, rs->queue[j]) < degree(rs, candidate)) candidate = rs->queue[j];
+      }
+      candidate_levels = reorder_bfs(rs, candidate, tag, 0, &count);
+      if (candidate_levels <= nlevels) break;
+      root = candidate;
+      nlevels = candidate_levels;
+   }
+   return root;
+}
+
+/* Number the segment nodes[lo..hi), whose nodes are owned by "tag", by reverse Cuthill-McKee, */
+/* one connected piece after another.                                                         */
+static void reorder_rcm_segment(reorder_state *rs, unsigned int lo, unsigned int hi, unsigned int tag)
+{
+   unsigned int pos, i, j, count;
+
+   memcpy(&rs->scratch[lo], &rs->nodes[lo], (hi - lo) * sizeof(unsigned int));
+   pos = hi;
+   for (i=lo; i<hi; ++i) {
+      unsigned int v = rs->scratch[i];
+      if (rs->owner[v] != tag) continue;
+      unsigned int root = reorder_peripheral(rs, v, tag);
+      reorder_bfs(rs, root, tag, 1, &count);
+      for (j=0; j<count; ++j) {
+         rs->nodes[--pos] = rs->queue[j];
+         rs->owner[rs->queue[j]] = REORDER_DONE;
+      }
+   }
+}
+
+/* Nested dissection of the whole graph, with an explicit stack of segments. */
+static void reorder_nd(reorder_state *rs, unsigned int preferred_alignment)
+{
+   unsigned int *stack;
+   unsigned int depth, count, nlevels, i;
+
+   MEMORY_ALLOC_CHECK(stack, ((2*rs->n+2) * sizeof(unsigned int)), "reorder stack")
+   depth = 0;
+   stack[depth++] = 0;
+   stack[depth++] = rs->n;
+   while (depth > 0) {
+      unsigned int hi = stack[--depth];
+      unsigned int lo = stack[--depth];
+      unsigned int tag = lo;
+
+      if (hi - lo <= REORDER_ND_LEAF) {
+         reorder_rcm_segment(rs, lo, hi, tag);
+         continue;
+      }
+
+      /* A segment in several pieces is split into the first piece and the rest. */
+      reorder_bfs(rs, rs->nodes[lo], tag, 0, &count);
+      if (count < hi - lo) {
+         unsigned int a = lo, b = lo + count;
+         memcpy(&rs->scratch[lo], &rs->nodes[lo], (hi - lo) * sizeof(unsigned int));
+         for (i=lo; i<hi; ++i) {
+            unsigned int v = rs->scratch[i];
+            if (rs->mark[v] == rs->stamp) {
+               rs->nodes[a++] = v;
+            }
+            else {
+               rs->nodes[b++] = v;
+               rs->owner[v] = lo + count;
+            }
+         }
+         stack[depth++] = lo;
+         stack[depth++] = lo + count;
+         stack[depth++] = lo + count;
+         stack[depth++] = hi;
+         continue;
+      }
+
+      /* One connected piece: cut it at its middle level.  A piece too shallow to cut is a leaf. */
+      nlevels = reorder_bfs(rs, reorder_peripheral(rs, rs->nodes[lo], tag), tag, 0, &count);
+      if (nlevels < 3) {
+         reorder_rcm_segment(rs, lo, hi, tag);
+         continue;
+      }
+      unsigned int mid = nlevels / 2;
+      unsigned int nleft = rs->level_start[mid];
+      unsigned int nsep = rs->level_start[mid+1] - rs->level_start[mid];
+      unsigned int nright = count - nleft - nsep;
+      memcpy(&rs->nodes[lo], &rs->queue[0], nleft * sizeof(unsigned int));
+      memcpy(&rs->nodes[lo+nleft], &rs->queue[nleft+nsep], nright * sizeof(unsigned int));
+      memcpy(&rs->nodes[lo+nleft+nright], &rs->queue[nleft], nsep * sizeof(unsigned int));
+      for (i=lo+nleft; i<lo+nleft+nright; ++i) rs->owner[rs->nodes[i]] = lo + nleft;
+      for (i=lo+nleft+nright; i<hi; ++i) rs->owner[rs->nodes[i]] = REORDER_DONE;
+      stack[depth++] = lo;
+      stack[depth++] = lo + nleft;
+      stack[depth++] = lo + nleft;
+      stack[depth++] = lo + nleft + nright;
+   }
+   free(stack);
+}
+
+/* Largest distance of a non-zero from the diagonal, with rows and columns renumbered by "inv" (or not at all). */
+static unsigned int reorder_bandwidth(unsigned int n, const unsigned int *row_index, const unsigned int *x_index, const unsigned int *inv)
+{
+   unsigned int i, j, bw = 0;
+
+   for (i=0; i<n; ++i) {
+      for (j=row_index[i]; j<row_index[i+1]; ++j) {
+         unsigned int r = (inv != NULL) ? inv[i] : i;
+         unsigned int c = (inv != NULL) ? inv[x_index[j]] : x_index[j];
+         unsigned int d = (r > c) ? r - c : c - r;
+         if (d > bw) bw = d;
+      }
+   }
+   return bw;
+}
+
+/* ================================================================================= */
+/* Compute *(mgs->perm) from the CSR arrays, as mgs->reorder asks.  Leaves it NULL   */
+/* for REORDER_NONE, or for a matrix that is not square.                            */
+/* ================================================================================= */
+
+int matrix_reorder(matrix_gen_struct *mgs)
+{
+   unsigned int preferred_alignment = mgs->preferred_alignment; // used by "MEMORY_ALLOC_CHECK" macro
+   unsigned int n = *(mgs->ny);
+   unsigned int *row_index = *(mgs->row_index_array);
+   unsigned int *x_index = *(mgs->x_index_array);
+   unsigned int *inv;
+   reorder_state rs;
+   unsigned int i;
+
+   *(mgs->perm) = NULL;
+   if (mgs->reorder == REORDER_NONE) {
+      return 0;
+   }
+   if (*(mgs->nx) != n) {
+      printf("reorder: skipped, the matrix is not square (nx = %d, ny = %d)\n", *(mgs->nx), n);
+      return 0;
+   }
+
+   rs.n = n;
+   rs.stamp = 0;
+   reorder_graph(&rs, preferred_alignment, row_index, x_index);
+   MEMORY_ALLOC_CHECK(rs.owner, ((n+1) * sizeof(unsigned int)), "reorder owner")
+   MEMORY_ALLOC_CHECK(rs.mark, ((n+1) * sizeof(unsigned int)), "reorder mark")
+   MEMORY_ALLOC_CHECK(rs.queue, ((n+1) * sizeof(unsigned int)), "reorder queue")
+   MEMORY_ALLOC_CHECK(rs.level_start, ((n+2) * sizeof(unsigned int)), "reorder level_start")
+   MEMORY_ALLOC_CHECK(rs.nodes, ((n+1) * sizeof(unsigned int)), "reorder nodes")
+   MEMORY_ALLOC_CHECK(rs.scratch, ((n+1) * sizeof(unsigned int)), "reorder scratch")
+   MEMORY_ALLOC_CHECK(rs.keys, ((n+1) * sizeof(unsigned long long)), "reorder keys")
+   for (i=0; i<n; ++i) {
+      rs.owner[i] = 0;
+      rs.mark[i] = 0;
+      rs.nodes[i] = i;
+   }
+
+   if (mgs->reorder == REORDER_ND) {
+      reorder_nd(&rs, preferred_alignment);
+   }
+   else {
+      reorder_rcm_segment(&rs, 0, n, 0);
+   }
+
+   MEMORY_ALLOC_CHECK(inv, ((n+1) * sizeof(unsigned int)), "reorder inv")
+   for (i=0; i<n; ++i) {
+      inv[rs.nodes[i]] = i;
+   }
+   printf("reorder: %s, bandwidth %d -> %d\n", (mgs->reorder == REORDER_ND) ? "nested dissection" : "reverse Cuthill-McKee",
+          reorder_bandwidth(n, row_index, x_index, NULL), reorder_bandwidth(n, row_index, x_index, inv));
+
+   free(inv);
+   free(rs.adj_start);
+   free(rs.adj);
+   free(rs.owner);
+   free(rs.mark);
+   free(rs.queue);
+   free(rs.level_start);
+   free(rs.scratch);
+   free(rs.keys);
+   *(mgs->perm) = rs.nodes;
+   return 0;
+}
+
+/* ================================================================================= */
+/* Move a vector of n elements, each "width" bytes (nrhs values), into the reordered */
+/* numbering (to_reordered != 0: v'[k] = v[perm[k]]) or back out of it.             */
+/* ================================================================================= */
+
+void reorder_vector(const unsigned int *perm, unsigned int n, size_t width, void *v, int to_reordered)
+{
+   unsigned char *p = (unsigned char *) v;
+   unsigned char *tmp;
+   unsigned int k;
+
+   tmp = (unsigned char *) malloc((size_t) n * width);
+   if (tmp == NULL) {
+      printf("Failed allocation of %lld bytes for %s\n", (unsigned long long) n * width, "reorder_vector");
+      exit(EXIT_FAILURE);
+   }
+   memcpy(tmp, p, (size_t) n * width);
+   for (k=0; k<n; ++k) {
+      if (to_reordered) memcpy(&p[(size_t) k * width], &tmp[(size_t) perm[k] * width], width);
+      else memcpy(&p[(size_t) perm[k] * width], &tmp[(size_t) k * width], width);
+   }
+   free(tmp);
+}
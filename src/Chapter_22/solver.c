@@ -0,0 +1,352 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Iterative solvers built on the tiled SpMV kernels.                                */
+/*                                                                                   */
+/* The tiled matrix stays resident in "matrix_buffer" for the whole solve, and all   */
+/* vectors (and the scalars derived from them) live on the device.  The only data    */
+/* that comes back to the host inside the iteration loop is a single scalar, read    */
+/* every "SOLVER_CHECK_INTERVAL" iterations to test for convergence.                 */
+/* ================================================================================= */
+
+#define SOLVER_CHECK_INTERVAL 10
+#define SOLVER_MAX_GROUPS     256   /* upper bound on work groups used by the dot product kernel */
+
+/* Slots in the device-resident "scalars" buffer. */
+#define SLOT_RR0   0                /* CG: r.r, even iterations; power: x.Ax (Rayleigh quotient) */
+#define SLOT_RR1   1                /* CG: r.r, odd iterations;  power: Ax.Ax */
+#define SLOT_PAP   2                /* CG: p.Ap */
+#define NUM_SLOTS  4
+
+typedef struct {
+   cl_command_queue ComQ;
+   cl_kernel dot_partial, dot_finish, axpy, xpay, scale, zero;
+   cl_mem partial, scalars;
+   size_t lsize, gsize, dot_gsize;
+   cl_uint n, ngroups;
+} vector_ops;
+
+static cl_kernel create_vector_kernel(cl_program program, const char *name)
+{
+   cl_int rc;
+   cl_kernel kernel = clCreateKernel(program, name, &rc);
+   if (rc != CL_SUCCESS) {
+      printf("clCreateKernel(%s) failed. rc = %d\n", name, rc);
+      exit(EXIT_FAILURE);
+   }
+   return kernel;
+}
+
+/* scalars[slot] = a . b */
+static void enqueue_dot(vector_ops *ops, cl_mem a, cl_mem b, cl_uint slot)
+{
+   cl_int rc;
+   rc  = clSetKernelArg(ops->dot_partial, 0, sizeof(cl_mem), &a);
+   rc |= clSetKernelArg(ops->dot_partial, 1, sizeof(cl_mem), &b);
+   CHECK_RESULT("clSetKernelArg(vector_dot_partial)")
+   rc = clEnqueueNDRangeKernel(ops->ComQ, ops->dot_partial, 1, NULL, &ops->dot_gsize, &ops->lsize, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueNDRangeKernel(vector_dot_partial)")
+   rc = clSetKernelArg(ops->dot_finish, 3, sizeof(cl_uint), &slot);
+   CHECK_RESULT("clSetKernelArg(vector_dot_finish)")
+   size_t one = 1;
+   rc = clEnqueueNDRangeKernel(ops->ComQ, ops->dot_finish, 1, NULL, &one, &one, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueNDRangeKernel(vector_dot_finish)")
+}
+
+/* y += sign * (scalars[num] / scalars[den]) * x */
+static void enqueue_axpy(vector_ops *ops, cl_mem y, cl_mem x, cl_uint num, cl_uint den, float sign)
+{
+   cl_int rc;
+   rc  = clSetKernelArg(ops->axpy, 0, sizeof(cl_mem), &y);
+   rc |= clSetKernelArg(ops->axpy, 1, sizeof(cl_mem), &x);
+   rc |= clSetKernelArg(ops->axpy, 3, sizeof(cl_uint), &num);
+   rc |= clSetKernelArg(ops->axpy, 4, sizeof(cl_uint), &den);
+   rc |= clSetKernelArg(ops->axpy, 5, sizeof(float), &sign);
+   CHECK_RESULT("clSetKernelArg(vector_axpy)")
+   rc = clEnqueueNDRangeKernel(ops->ComQ, ops->axpy, 1, NULL, &ops->gsize, &ops->lsize, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueNDRangeKernel(vector_axpy)")
+}
+
+/* y = x + (scalars[num] / scalars[den]) * y */
+static void enqueue_xpay(vector_ops *ops, cl_mem y, cl_mem x, cl_uint num, cl_uint den)
+{
+   cl_int rc;
+   rc  = clSetKernelArg(ops->xpay, 0, sizeof(cl_mem), &y);
+   rc |= clSetKernelArg(ops->xpay, 1, sizeof(cl_mem), &x);
+   rc |= clSetKernelArg(ops->xpay, 3, sizeof(cl_uint), &num);
+   rc |= clSetKernelArg(ops->xpay, 4, sizeof(cl_uint), &den);
+   CHECK_RESULT("clSetKernelArg(vector_xpay)")
+   rc = clEnqueueNDRangeKernel(ops->ComQ, ops->xpay, 1, NULL, &ops->gsize, &ops->lsize, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueNDRangeKernel(vector_xpay)")
+}
+
+/* y = x / sqrt(scalars[slot]) */
+static void enqueue_scale(vector_ops *ops, cl_mem y, cl_mem x, cl_uint slot)
+{
+   cl_int rc;
+   rc  = clSetKernelArg(ops->scale, 0, sizeof(cl_mem), &y);
+   rc |= clSetKernelArg(ops->scale, 1, sizeof(cl_mem), &x);
+   rc |= clSetKernelArg(ops->scale, 3, sizeof(cl_uint), &slot);
+   CHECK_RESULT("clSetKernelArg(vector_scale)")
+   rc = clEnqueueNDRangeKernel(ops->ComQ, ops->scale, 1, NULL, &ops->gsize, &ops->lsize, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueNDRangeKernel(vector_scale)")
+}
+
+/* y = A x, using the tiled kernel prepared by the caller. */
+static void enqueue_spmv(solver_struct *ss, vector_ops *ops, cl_mem x, cl_mem y)
+{
+   cl_int rc;
+   if (ss->accumulate) {
+      rc = clSetKernelArg(ops->zero, 0, sizeof(cl_mem), &y);
+      CHECK_RESULT("clSetKernelArg(vector_zero)")
+      rc = clEnqueueNDRangeKernel(ops->ComQ, ops->zero, 1, NULL, &ops->gsize, &ops->lsize, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueNDRangeKernel(vector_zero)")
+   }
+   rc  = clSetKernelArg(ss->kernel, 0, sizeof(cl_mem), &x);
+   rc |= clSetKernelArg(ss->kernel, 1, sizeof(cl_mem), &y);
+   CHECK_RESULT("clSetKernelArg(spmv input/output)")
+   rc = clEnqueueNDRangeKernel(ops->ComQ, ss->kernel, ss->ndims, NULL, ss->global_work_size, ss->local_work_size, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueNDRangeKernel(spmv)")
+}
+
+static float read_scalar(vector_ops *ops, cl_uint slot)
+{
+   cl_int rc;
+   float value;
+   rc = clEnqueueReadBuffer(ops->ComQ, ops->scalars, CL_TRUE, slot * sizeof(float), sizeof(float), &value, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueReadBuffer(scalars)")
+   return value;
+}
+
+/* With "host" set (zero-copy), the vector is the caller's page-aligned array, used in place. */
+static cl_mem create_vector(solver_struct *ss, cl_command_queue ComQ, const float *init, float *host)
+{
+   cl_int rc;
+   cl_mem buffer;
+   float *zero;
+   unsigned int preferred_alignment = 16; // used by "MEMORY_ALLOC_CHECK" macro
+
+   if (host != NULL) {
+      memset(host, 0, ss->vector_length * sizeof(float));
+      if (init != NULL) memcpy(host, init, ss->n * sizeof(float));
+      buffer = clCreateBuffer(ss->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, ss->vector_length * sizeof(float), host, &rc);
+      CHECK_RESULT("clCreateBuffer(solver vector)")
+      return buffer;
+   }
+
+   buffer = clCreateBuffer(ss->context, CL_MEM_READ_WRITE, ss->vector_length * sizeof(float), NULL, &rc);
+   CHECK_RESULT("clCreateBuffer(solver vector)")
+
+   /* Everything past "n" is padding, which must stay zero so that it never pollutes the dot products. */
+   MEMORY_ALLOC_CHECK(zero, ss->vector_length * sizeof(float), "solver vector")
+   memset(zero, 0, ss->vector_length * sizeof(float));
+   if (init != NULL) memcpy(zero, init, ss->n * sizeof(float));
+   rc = clEnqueueWriteBuffer(ComQ, buffer, CL_TRUE, 0, ss->vector_length * sizeof(float), zero, 0, NULL, NULL);
+   CHECK_RESULT("clEnqueueWriteBuffer(solver vector)")
+   free(zero);
+   return buffer;
+}
+
+/* Bring the result back to ss->solution.  A zero-copy vector is already there, and */
+/* mapping it only makes that official; otherwise it is copied.                     */
+static void read_solution(solver_struct *ss, cl_command_queue ComQ, cl_mem x)
+{
+   cl_int rc;
+   if (ss->zero_copy) {
+      void *p = clEnqueueMapBuffer(ComQ, x, CL_TRUE, CL_MAP_READ, 0, ss->n * sizeof(float), 0, NULL, NULL, &rc);
+      CHECK_RESULT("clEnqueueMapBuffer(x)")
+      rc = clEnqueueUnmapMemObject(ComQ, x, p, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueUnmapMemObject(x)")
+      rc = clFinish(ComQ);
+      CHECK_RESULT("clFinish(x)")
+   }
+   else {
+      rc = clEnqueueReadBuffer(ComQ, x, CL_TRUE, 0, ss->n * sizeof(float), ss->solution, 0, NULL, NULL);
+      CHECK_RESULT("clEnqueueReadBuffer(x)")
+   }
+}
+
+/* ================================================================================= */
+/* Run the requested solver.  Returns 0 if it converged within max_iterations.       */
+/* ================================================================================= */
+
+int spmv_solve(solver_struct *ss)
+{
+   cl_int rc;
+   vector_ops ops;
+   size_t kernel_wg_size;
+   unsigned int i, iterations = 0;
+   int converged = 0;
+   double flops_per_iteration;
+
+   /* The solver chains a long dependent sequence of kernels, so it uses its own in-order queue */
+   /* rather than the out-of-order queue used for the single verification multiply.             */
+   ops.ComQ = clCreateCommandQueue(ss->context, ss->device, 0, &rc);
+   CHECK_RESULT("clCreateCommandQueue(solver)")
+
+   ops.dot_partial = create_vector_kernel(ss->program, "vector_dot_partial");
+   ops.dot_finish = create_vector_kernel(ss->program, "vector_dot_finish");
+   ops.axpy = create_vector_kernel(ss->program, "vector_axpy");
+   ops.xpay = create_vector_kernel(ss->program, "vector_xpay");
+   ops.scale = create_vector_kernel(ss->program, "vector_scale");
+   ops.zero = create_vector_kernel(ss->program, "vector_zero");
+
+   /* Pick a power-of-2 work group size for the vector kernels, and round the global size up to it. */
+   rc = clGetKernelWorkGroupInfo(ops.dot_partial, ss->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_wg_size, NULL);
+   CHECK_RESULT("clGetKernelWorkGroupInfo(vector_dot_partial)")
+   ops.lsize = (ss->device_type == CL_DEVICE_TYPE_GPU) ? 256 : 16;
+   while (ops.lsize > kernel_wg_size) ops.lsize /= 2;
+   ops.n = ss->n;
+   ops.gsize = ((ss->n + ops.lsize - 1) / ops.lsize) * ops.lsize;
+   ops.ngroups = (cl_uint) (ops.gsize / ops.lsize);
+   if (ops.ngroups > SOLVER_MAX_GROUPS) ops.ngroups = SOLVER_MAX_GROUPS;
+   ops.dot_gsize = ops.ngroups * ops.lsize;
+
+   ops.partial = clCreateBuffer(ss->context, CL_MEM_READ_WRITE, ops.ngroups * sizeof(float), NULL, &rc);
+   CHECK_RESULT("clCreateBuffer(partial)")
+   ops.scalars = clCreateBuffer(ss->context, CL_MEM_READ_WRITE, NUM_SLOTS * sizeof(float), NULL, &rc);
+   CHECK_RESULT("clCreateBuffer(scalars)")
+
+   /* Arguments which never change over the course of the solve. */
+   rc  = clSetKernelArg(ops.dot_partial, 2, sizeof(cl_uint), &ops.n);
+   rc |= clSetKernelArg(ops.dot_partial, 3, sizeof(cl_mem), &ops.partial);
+   rc |= clSetKernelArg(ops.dot_partial, 4, ops.lsize * sizeof(float), NULL);
+   rc |= clSetKernelArg(ops.dot_finish, 0, sizeof(cl_mem), &ops.partial);
+   rc |= clSetKernelArg(ops.dot_finish, 1, sizeof(cl_uint), &ops.ngroups);
+   rc |= clSetKernelArg(ops.dot_finish, 2, sizeof(cl_mem), &ops.scalars);
+   rc |= clSetKernelArg(ops.axpy, 2, sizeof(cl_mem), &ops.scalars);
+   rc |= clSetKernelArg(ops.axpy, 6, sizeof(cl_uint), &ops.n);
+   rc |= clSetKernelArg(ops.xpay, 2, sizeof(cl_mem), &ops.scalars);
+   rc |= clSetKernelArg(ops.xpay, 5, sizeof(cl_uint), &ops.n);
+   rc |= clSetKernelArg(ops.scale, 2, sizeof(cl_mem), &ops.scalars);
+   rc |= clSetKernelArg(ops.scale, 4, sizeof(cl_uint), &ops.n);
+   rc |= clSetKernelArg(ops.zero, 1, sizeof(cl_uint), &ops.n);
+   CHECK_RESULT("clSetKernelArg(vector kernels)")
+
+   double start, elapsed;
+
+   if (ss->solver_type == SOLVER_CG) {
+      /* ============================================================== */
+      /* Conjugate Gradient, starting from x = 0, so r = p = b.          */
+      /* ============================================================== */
+      cl_mem x, r, p, Ap;
+      cl_uint cur = SLOT_RR0;
+      float rr0;
+
+      x = create_vector(ss, ops.ComQ, NULL, ss->zero_copy ? ss->solution : NULL);
+      r = create_vector(ss, ops.ComQ, ss->rhs, NULL);
+      p = create_vector(ss, ops.ComQ, ss->rhs, NULL);
+      Ap = create_vector(ss, ops.ComQ, NULL, NULL);
+      flops_per_iteration = 2.0 * ss->non_zero + 10.0 * ss->n;
+
+      enqueue_dot(&ops, r, r, cur);
+      rr0 = read_scalar(&ops, cur);
+
+      start = wall_time();
+      if (rr0 > 0.0f) {
+         for (i=0; i<ss->max_iterations; ++i) {
+            enqueue_spmv(ss, &ops, p, Ap);
+            enqueue_dot(&ops, p, Ap, SLOT_PAP);
+            enqueue_axpy(&ops, x, p, cur, SLOT_PAP, 1.0f);     /* x += alpha p,  alpha = r.r / p.Ap */
+            enqueue_axpy(&ops, r, Ap, cur, SLOT_PAP, -1.0f);   /* r -= alpha Ap */
+            enqueue_dot(&ops, r, r, 1-cur);
+            enqueue_xpay(&ops, p, r, 1-cur, cur);              /* p = r + beta p, beta = r'.r' / r.r */
+            cur = 1 - cur;
+            ++iterations;
+            if ((iterations % SOLVER_CHECK_INTERVAL) == 0 || iterations == ss->max_iterations) {
+               float rr = read_scalar(&ops, cur);
+               if (sqrtf(rr / rr0) < ss->tolerance) {
+                  converged = 1;
+                  break;
+               }
+            }
+         }
+      }
+      else converged = 1;
+      rc = clFinish(ops.ComQ);
+      CHECK_RESULT("clFinish(solver)")
+      elapsed = wall_time() - start;
+
+      printf("cg: %d iterations, relative residual (recurrence) = %e\n", iterations, sqrt(read_scalar(&ops, cur) / rr0));
+      read_solution(ss, ops.ComQ, x);
+
+      clReleaseMemObject(x);
+      clReleaseMemObject(r);
+      clReleaseMemObject(p);
+      clReleaseMemObject(Ap);
+   }
+   else {
+      /* ============================================================== */
+      /* Power iteration, starting from b / |b|.                         */
+      /* ============================================================== */
+      cl_mem x, y;
+      float lambda = 0.0f, lambda_prev = 0.0f;
+      double norm = 0.0;
+      float *x0;
+      unsigned int preferred_alignment = 16; // used by "MEMORY_ALLOC_CHECK" macro
+
+      MEMORY_ALLOC_CHECK(x0, ss->n * sizeof(float), "x0")
+      for (i=0; i<ss->n; ++i) norm += (double) ss->rhs[i] * (double) ss->rhs[i];
+      norm = (norm > 0.0) ? 1.0 / sqrt(norm) : 0.0;
+      for (i=0; i<ss->n; ++i) x0[i] = (float) (ss->rhs[i] * norm);
+      x = create_vector(ss, ops.ComQ, x0, ss->zero_copy ? ss->solution : NULL);
+      y = create_vector(ss, ops.ComQ, NULL, NULL);
+      free(x0);
+      flops_per_iteration = 2.0 * ss->non_zero + 5.0 * ss->n;
+
+      start = wall_time();
+      for (i=0; i<ss->max_iterations; ++i) {
+         enqueue_spmv(ss, &ops, x, y);
+         enqueue_dot(&ops, x, y, SLOT_RR0);                    /* lambda = x.Ax, since |x| = 1 */
+         enqueue_dot(&ops, y, y, SLOT_RR1);
+         enqueue_scale(&ops, x, y, SLOT_RR1);                  /* x = Ax / |Ax| */
+         ++iterations;
+         if ((iterations % SOLVER_CHECK_INTERVAL) == 0 || iterations == ss->max_iterations) {
+            lambda = read_scalar(&ops, SLOT_RR0);
+            if (fabsf(lambda - lambda_prev) <= ss->tolerance * fabsf(lambda)) {
+               converged = 1;
+               break;
+            }
+            lambda_prev = lambda;
+         }
+      }
+      rc = clFinish(ops.ComQ);
+      CHECK_RESULT("clFinish(solver)")
+      elapsed = wall_time() - start;
+
+      ss->eigenvalue = lambda;
+      printf("power iteration: %d iterations, dominant eigenvalue = %e\n", iterations, lambda);
+      read_solution(ss, ops.ComQ, x);
+
+      clReleaseMemObject(x);
+      clReleaseMemObject(y);
+   }
+
+   if (iterations > 0 && elapsed > 0.0) {
+      printf("%s per iteration: %.3f us, %.3f GFLOP/s\n", (ss->solver_type == SOLVER_CG) ? "cg" : "power iteration",
+             1.0e6 * elapsed / iterations, 1.0e-9 * flops_per_iteration * iterations / elapsed);
+   }
+
+   clReleaseMemObject(ops.partial);
+   clReleaseMemObject(ops.scalars);
+   clReleaseKernel(ops.dot_partial);
+   clReleaseKernel(ops.dot_finish);
+   clReleaseKernel(ops.axpy);
+   clReleaseKernel(ops.xpay);
+   clReleaseKernel(ops.scale);
+   clReleaseKernel(ops.zero);
+   clReleaseCommandQueue(ops.ComQ);
+
+   return converged ? 0 : -1;
+}
@@ -10,6 +10,7 @@
 
 
 #include "spmv.h"
+#include "spmv_lib.h"
 
 /* ===================================================================== */
 /* Procedure to print command and command line argument usage.           */
@@ -19,9 +20,20 @@ void usage()
 {
    printf("\n");
    printf("Usage: spmv -f <matrixfile> [device_type] [kernel_type] [options]\n");
+   printf("       spmv -G <kind>:<size>[:<param>[:<seed>]] [device_type] [kernel_type] [options]\n");
    printf("\n");
    printf("Note: <matrixfile> should include the relative path from this executable.\n");
    printf("\n");
+   printf(" Generated Matrix (in place of a Matrix Market file; every kind has a dominant diagonal):\n");
+   printf("\n");
+   printf("  -G, --generate [g] poisson2d:n     5-point Laplacian on an n x n grid\n");
+   printf("                     poisson3d:n     7-point Laplacian on an n x n x n grid\n");
+   printf("                     banded:N:b      symmetric band, b diagonals either side of the main one (default 8)\n");
+   printf("                     random:N:k      k uniformly scattered columns per row (default 16)\n");
+   printf("                     powerlaw:N:k    scattered columns, Pareto distributed row lengths averaging k (default 16)\n");
+   printf("                     blockdiag:N:b   dense symmetric b x b blocks down the diagonal (default 32)\n");
+   printf("                     The optional seed (default 1) picks the values and scattered columns.\n");
+   printf("\n");
    printf(" Device Type:\n");
    printf("\n");
    printf("  -c, --cpu          Use CPU device for kernel computations.\n");
@@ -33,61 +45,138 @@ void usage()
    printf("  -L, --ls           Use 'load-store' kernel to solve problem.\n");
    printf("  -A, --awgc         Use 'async-work-group-copy' kernel to solve problem.\n");
    printf("\n");
+   printf(" Matrix Format (default is tiled; auto picks one from the row lengths, or tiled whenever -L or -A is given):\n");
+   printf("\n");
+   printf("  -F, --format [f]   Use format <f>: tiled, csr, csrv, ell, sell or auto.\n");
+   printf("\n");
    printf(" Options (all options default to 'not selected'):\n");
    printf("\n");
    printf("  -l, --lwgsize [n]  Specify local work group size for GPU use (coerced to power of 2).\n");
+   printf("  -C, --cache [dir]  Keep the tiled matrix in a binary cache in <dir>, and reuse it on later runs.\n");
+   printf("  -k, --nrhs [k]     Multiply by a block of k right-hand sides at once (k = 1, 4, 8 or 16).\n");
+   printf("  -Y, --symmetric    Tile only the upper triangle of a symmetric matrix, and run the LS kernel on it.\n");
+   printf("  -Z, --zero-copy    On a CPU device, keep the vectors in page-aligned host arrays which the kernels use in place\n");
+   printf("                     (CL_MEM_USE_HOST_PTR); a multiply moves no data, only unmapping and mapping them again.\n");
+   printf("  -R, --reorder [r]  Renumber a square matrix before tiling it, by 'rcm' (reverse Cuthill-McKee) or 'nd'\n");
+   printf("                     (nested dissection); vectors are permuted to match on the way in and out.\n");
+   printf("  -p, --precision [p] Run the tiled kernels in 'single', 'double' or 'mixed' (fp32 matrix, fp64 vectors) precision.\n");
+   printf("  -P, --partition [p] Split the tiled matrix into slabs by 'rows' (the default) or by a 'cost' model.\n");
+   printf("  -T, --autotune     Time both partitioners at several slab counts, and keep the fastest.\n");
+   printf("  -s, --stats [file] Report packet fill, bytes per non-zero, GB/s and GFLOP/s, and write them to <file> as JSON.\n");
+   printf("  -b, --bench [sec]  Benchmark: repeat the kernel for about <sec> seconds and report min/median/p95 times as CSV.\n");
+   printf("  -n, --native [l]   Run the native multithreaded CPU SpMV instead, on layout <l>: 'csr' or 'sell', with no OpenCL\n");
+   printf("                     at all; it is verified against the host reference, and timed like the OpenCL kernel (see -s and -b).\n");
+   printf("  -j, --threads [n]  Number of threads for --native (default: one per online processor).\n");
+   printf("  -M, --multi [n]    Also split the tiled matrix across n devices of the chosen type (0 = all of them);\n");
+   printf("                     a single CPU device is split into n sub-devices.\n");
+   printf("\n");
+   printf(" Solver (runs after the verification multiply, with the tiled matrix kept resident):\n");
+   printf("\n");
+   printf("  -S, --solver [s]   Run an iterative solver, where <s> is 'cg' (symmetric matrices) or 'power'.\n");
+   printf("  -i, --iterations [n] Maximum number of solver iterations (default 500).\n");
+   printf("  -t, --tolerance [x]  Solver convergence tolerance (default 1e-5).\n");
    printf("\n");
    printf("  -h, --help         Print this usage message.\n");
    printf("\n");
 }
 
-/* ===================================================================== */
-/* Structures to help us determine available platforms and devices.      */
-/* ===================================================================== */
-
-typedef struct {
-   cl_device_id id;
-   cl_device_type type;
-   cl_command_queue ComQ;
-   char *name;
-} device_struct;
-
-typedef struct {
-   char *name;
-   cl_platform_id id;
-   unsigned int num_devices;
-   device_struct *device;
-   cl_context context;
-   cl_program program;
-   cl_kernel kernel;
-} platform_struct;
-
 /* ================================================================================================== */
-/* Load_program_source.                                                                              */
-/* Read in the kernel source from an external file.                                                   */
+/* Host-only run of the native CPU backend (-n).  The CSR arrays, random input and reference loop are */
+/* those of the OpenCL path; the native multiply is checked against them and timed.  No OpenCL call   */
+/* is made, so this runs on a machine without an OpenCL platform.                                     */
 /* ================================================================================================== */
 
-static char *load_program_source(const char *filename)
+static int native_run(char *file_name, unsigned int layout, unsigned int threads, char *stats_file, double bench_seconds)
 {
-  struct stat statbuf;
+   matrix_gen_struct mgs;
+   cl_uint max_compute_units = 1;
+   unsigned int nx, ny, non_zero, nyround;
+   unsigned int *row_index_array = NULL, *x_index_array = NULL;
+   float *data_array = NULL;
+   float *input_array, *native_output, *output_array_verify;
+   unsigned int preferred_alignment = 128; // used by "MEMORY_ALLOC_CHECK" macro
+   unsigned int i, j;
+   cpu_spmv_struct cs;
+   stats_struct st;
+   char native_kernel[32];
+   double sum, diffsum;
+   int retval = 0;
+
+   memset(&mgs, 0, sizeof(mgs));
+   mgs.row_index_array = &row_index_array;
+   mgs.x_index_array = &x_index_array;
+   mgs.data_array = &data_array;
+   mgs.nx = &nx;
+   mgs.ny = &ny;
+   mgs.non_zero = &non_zero;
+   mgs.nyround = &nyround;
+   mgs.max_compute_units = &max_compute_units;
+   mgs.file_name = file_name;
+   mgs.preferred_alignment = preferred_alignment;
+   if (matrix_synth_parse(file_name, &mgs) != 0) mgs.synth = SYNTH_NONE;
+   if (((mgs.synth != SYNTH_NONE) ? matrix_synth(&mgs) : matrix_read(&mgs)) != 0) {
+      printf("could not read or generate matrix %s\n", file_name);
+      return -1;
+   }
+
+   MEMORY_ALLOC_CHECK(input_array, nx * sizeof(float), "input_array")
+   MEMORY_ALLOC_CHECK(native_output, nyround * sizeof(float), "native_output")
+   MEMORY_ALLOC_CHECK(output_array_verify, nyround * sizeof(float), "output_array_verify")
+   for (i=0; i<nx; ++i) {
+      input_array[i] = ((float) (rand() & 0x7fff)) * 0.001f - 15.0f;
+   }
+   for (i=0; i<ny; ++i) {
+      float t = 0;
+      for (j=row_index_array[i]; j<row_index_array[i+1]; ++j) {
+         t += data_array[j] * input_array[x_index_array[j]];
+      }
+      output_array_verify[i] = t;
+   }
 
-  FILE *fh = fopen(filename, "r");
-  if (fh == 0) {
-    fprintf(stderr, "Couldn't open %s\n", filename);
-    return NULL;
-  }
+   if (cpu_spmv_setup(&cs, layout, threads, ny, non_zero, row_index_array, x_index_array, data_array) != 0) {
+      exit(EXIT_FAILURE);
+   }
+   cpu_spmv_run(&cs, input_array, native_output);
 
-  stat(filename, &statbuf);
-  char *source = (char *) malloc(statbuf.st_size + 1);
-  if (source == NULL) {
-    fprintf(stderr, "malloc failed\n");
-    return NULL;
-  }
+   sum = 0.0;
+   diffsum = 0.0;
+   for (i=0; i<ny; ++i) {
+      sum += fabs((double) output_array_verify[i]);
+      diffsum += fabs((double) output_array_verify[i] - (double) native_output[i]);
+   }
+   printf("native avg error = %le\n", diffsum / sum);
+   if (diffsum / sum > 0.0001) {
+      retval = -1;
+   }
 
-  fread(source, statbuf.st_size, 1, fh);
-  source[statbuf.st_size] = '\0';
+   memset(&st, 0, sizeof(st));
+   sprintf(native_kernel, "native_%s_%s", (layout == CPU_LAYOUT_SELL) ? "sell" : "csr", cs.isa_name);
+   st.file_name = file_name;
+   st.device_name = "host";
+   st.format = (layout == CPU_LAYOUT_SELL) ? "sell" : "csr";
+   st.kernel = native_kernel;
+   st.precision = precision_name(PRECISION_SINGLE);
+   st.nx = nx;
+   st.ny = ny;
+   st.non_zero = non_zero;
+   st.stored_non_zero = non_zero;
+   st.nrhs = 1;
+   st.value_bytes = sizeof(float);
+   st.matrix_bytes = cs.bytes;
+   cpu_spmv_bench(&cs, input_array, native_output, BENCH_WARMUP, STATS_RUNS, bench_seconds, &st);
+   stats_report(&st, stats_file);
+   if (bench_seconds > 0.0) {
+      bench_csv(&st);
+   }
 
-  return source;
+   cpu_spmv_release(&cs);
+   free(input_array);
+   free(native_output);
+   free(output_array_verify);
+   free(row_index_array);
+   free(x_index_array);
+   free(data_array);
+   return retval;
 }
 
 /* ================================================================================================== */
@@ -96,36 +185,64 @@ static char *load_program_source(const char *filename)
 
 int main(int argc, char *argv[]) {
 
-   /* Variables used to manage the OpenCL environment. */
    cl_int rc;
-   size_t return_size[1];
-   unsigned int column_span = 0;
    static cl_device_type device_type = CL_DEVICE_TYPE_DEFAULT;
    static cl_uint kernel_type = KERNEL_DEFAULT;
    static int gpu_wgsz = MAX_WGSZ;
 
    /* The external file containing the matrix data in Matrix Market format */
    static char *file_name;
-   
-   /* These variables deal with the source file for the kernel, and the names of the kernels contained therein. */
+
+   /* Or the spec of a generated matrix (synth_spec.synth is SYNTH_NONE for a file). */
+   static matrix_gen_struct synth_spec;
+
+   /* Directory holding cached tiled matrices (NULL if caching is not requested). */
+   static char *cache_dir = NULL;
+
+   /* JSON file for the statistics report (NULL if statistics are not requested). */
+   static char *stats_file = NULL;
+
+   /* Slab partitioning of the tiled matrix, and whether to autotune it. */
+   static unsigned int partitioner = PARTITION_ROWS;
+   static int autotune = 0;
+
+   /* Number of devices for the multi-device run (-1 if not requested, 0 for all). */
+   static int multi_requested = -1;
+
+   /* Target duration of the benchmark loop, in seconds (0 if benchmarking is not requested). */
+   static double bench_seconds = 0.0;
+
+   /* Iterative solver controls. */
+   static unsigned int solver_type = SOLVER_NONE;
+   static unsigned int max_iterations = 500;
+   static float tolerance = 1.0e-5f;
+
+   /* The source file for the kernels. */
    char kernel_source_file[8] = "spmv.cl";
-   char kernel_name_LS[21]   = "tiled_spmv_kernel_LS";
-   char kernel_name_AWGC[23] = "tiled_spmv_kernel_AWGC";
-   char kernel_name[32];
-   
-   /* Basic "size of problem" variables. */
-   unsigned int nx; /* Number of elements in the X direction (length of the "input" vector. */
-   unsigned int ny; /* Number of elements in the Y direction (length of the "answer" vector. */
-   unsigned int non_zero; /* Number of non_zero elements in the matrix. */
-   unsigned int nx_pad, nyround; /* Rounded versions of nx and ny. */
-   
-   /* Variables used to hold user-specified overrides and intermediate control values derived from them. */
-   unsigned int *slab_startrow = NULL;
-   
-   unsigned int segcachesize;
-   unsigned int max_slabheight; /* Maximum matrix chunksize. */
-   unsigned int i, j, pdex = 0, ddex = 0;
-   size_t param_value_size_ret;
+
+   /* Number of right-hand sides multiplied at once (1 for plain SpMV). */
+   static unsigned int nrhs = 1;
+
+   /* Precision of the tiled kernels, fixed when the program is built. */
+   static unsigned int precision = PRECISION_SINGLE;
+
+   /* Store only one triangle of a symmetric matrix (the matrix file must say "symmetric"). */
+   static unsigned int sym_storage = 0;
+
+   /* Bandwidth-reducing reordering of the matrix before it is tiled. */
+   static unsigned int reorder = REORDER_NONE;
+
+   /* Share the vectors with a CPU device in place, instead of mapping them around each phase. */
+   static int zero_copy = 0;
+
+   /* Native CPU backend: layout (CPU_LAYOUT_NONE if not requested) and thread count (0 for all processors). */
+   static unsigned int native_layout = CPU_LAYOUT_NONE;
+   static unsigned int native_threads = 0;
+
+   /* Sparse format used on the device. */
+   static unsigned int format = FORMAT_TILED;
+
+   unsigned int i, j;
 
    /* ================================================================================== */
    /* Read in command line arguments.                                                    */
@@ -144,6 +261,24 @@ int main(int argc, char *argv[]) {
       {"verify", no_argument, NULL, 'v'},
       {"lwgsize", required_argument, NULL, 'l'},
       {"filename", required_argument, NULL, 'f'},
+      {"generate", required_argument, NULL, 'G'},
+      {"cache", required_argument, NULL, 'C'},
+      {"solver", required_argument, NULL, 'S'},
+      {"iterations", required_argument, NULL, 'i'},
+      {"tolerance", required_argument, NULL, 't'},
+      {"nrhs", required_argument, NULL, 'k'},
+      {"format", required_argument, NULL, 'F'},
+      {"stats", required_argument, NULL, 's'},
+      {"bench", required_argument, NULL, 'b'},
+      {"multi", required_argument, NULL, 'M'},
+      {"partition", required_argument, NULL, 'P'},
+      {"autotune", no_argument, NULL, 'T'},
+      {"precision", required_argument, NULL, 'p'},
+      {"symmetric", no_argument, NULL, 'Y'},
+      {"native", required_argument, NULL, 'n'},
+      {"threads", required_argument, NULL, 'j'},
+      {"reorder", required_argument, NULL, 'R'},
+      {"zero-copy", no_argument, NULL, 'Z'},
       {NULL, 0, NULL, 0}
    };
    char *name;
@@ -157,7 +292,7 @@ int main(int argc, char *argv[]) {
    (void)chdir(dirname(argv[0]));
 
    while (1) {
-      opt = getopt_long(argc, argv, "hacgLAl:f:", long_options, &option_index);
+      opt = getopt_long(argc, argv, "hacgLATYZl:f:G:C:S:i:t:k:F:s:b:M:P:p:n:j:R:", long_options, &option_index);
 
       if (opt == -1) break;
 
@@ -188,487 +323,287 @@ int main(int argc, char *argv[]) {
       case 'f':
          posix_memalign((void **) &file_name, 128, 1+strlen(optarg));
          strcpy(file_name, optarg);
+         synth_spec.synth = SYNTH_NONE;
          break;
 
-      case '?':
-         printf("Try '%s --help' for more information.\n", name);
-         exit(EXIT_FAILURE);
-      }
-   }
+      /* -G, --generate */
+      case 'G':
+         if (matrix_synth_parse(optarg, &synth_spec) != 0) {
+            printf("%s: unknown matrix generator '%s'.\n", name, optarg);
+            exit(EXIT_FAILURE);
+         }
+         posix_memalign((void **) &file_name, 128, 1+strlen(optarg));
+         strcpy(file_name, optarg);
+         break;
 
-   if (optind != argc) {
-      printf("%s: unrecognized option '%s'.\n", name, argv[optind]);
-      printf("Try '%s --help' for more information.\n", name);
-      exit(EXIT_FAILURE);
-   }
+      /* -C, --cache */
+      case 'C': cache_dir = optarg; break;
 
-   /* ================================================================================== */
-   /* Start up OpenCL.                                                                   */
-   /* ================================================================================== */
+      /* -s, --stats */
+      case 's': stats_file = optarg; break;
 
-   cl_uint preferred_alignment = 16; // used by "MEMORY_ALLOC_CHECK" macro   
-   cl_uint num_platforms;
-   rc = clGetPlatformIDs(0, (cl_platform_id *) NULL, &num_platforms);
-   CHECK_RESULT("clGetPlatformIDs(num_platforms)")
+      /* -b, --bench */
+      case 'b':
+         bench_seconds = atof(optarg);
+         if (bench_seconds <= 0.0) {
+            printf("%s: the benchmark duration must be positive.\n", name);
+            exit(EXIT_FAILURE);
+         }
+         break;
 
-   platform_struct *platform;
-   MEMORY_ALLOC_CHECK(platform, num_platforms * sizeof(platform_struct), "platform");
+      /* -P, --partition */
+      case 'P':
+         if (strcmp(optarg, "rows") == 0) partitioner = PARTITION_ROWS;
+         else if (strcmp(optarg, "cost") == 0) partitioner = PARTITION_COST;
+         else {
+            printf("%s: unknown partitioner '%s'.\n", name, optarg);
+            exit(EXIT_FAILURE);
+         }
+         break;
 
-   cl_mem *buffer;
-   MEMORY_ALLOC_CHECK(buffer, num_platforms * sizeof(cl_mem), "buffer");
+      /* -T, --autotune */
+      case 'T': autotune = 1; break;
 
-   cl_platform_id *temp_platform_id_array;
-   MEMORY_ALLOC_CHECK(temp_platform_id_array, num_platforms * sizeof(cl_platform_id), "temp_platform_id_array");
-   rc = clGetPlatformIDs(num_platforms, temp_platform_id_array, (cl_uint *) NULL);
-   CHECK_RESULT("clGetPlatform IDs(Platform IDs)")
-   for (i=0; i<num_platforms; ++i) {
-      platform[i].id = temp_platform_id_array[i];
-   }
-   free(temp_platform_id_array);
+      /* -n, --native */
+      case 'n':
+         if (strcmp(optarg, "csr") == 0) native_layout = CPU_LAYOUT_CSR;
+         else if (strcmp(optarg, "sell") == 0) native_layout = CPU_LAYOUT_SELL;
+         else {
+            printf("%s: unknown native layout '%s'.\n", name, optarg);
+            exit(EXIT_FAILURE);
+         }
+         break;
 
-   printf("[START RUN]\n");
-   printf("command line: "); 
-   for (i=0; i<(unsigned int) argc; ++i) {
-      printf("%s ", argv[i]);
-   }
-   printf("\n");
-   //printf("num_platforms = %d\n\n", num_platforms);
-
-   for (i=0; i<num_platforms; ++i) {
-      rc = clGetPlatformInfo(platform[i].id, CL_PLATFORM_NAME, (size_t) 0, NULL, (size_t *) &param_value_size_ret);
-      CHECK_RESULT("clGetPlatformInfo(size of platform name)")
-      MEMORY_ALLOC_CHECK(platform[i].name, param_value_size_ret, "platform name");
-      rc = clGetPlatformInfo(platform[i].id, CL_PLATFORM_NAME, param_value_size_ret, platform[i].name, (size_t *) NULL);
-      CHECK_RESULT("clGetPlatformInfo(platform name)")
-
-      rc = clGetDeviceIDs(platform[i].id, CL_DEVICE_TYPE_ALL, 0, NULL, (cl_uint *) &(platform[i].num_devices));
-      CHECK_RESULT("clGetDeviceIDs(number of devices)")
-
-      MEMORY_ALLOC_CHECK(platform[i].device, platform[i].num_devices * sizeof(device_struct), "device structure");
-
-      cl_device_id *tmpdevices;
-      MEMORY_ALLOC_CHECK(tmpdevices, platform[i].num_devices * sizeof(cl_device_id), "tmpdevices");
-      rc = clGetDeviceIDs(platform[i].id, CL_DEVICE_TYPE_ALL, platform[i].num_devices, tmpdevices, NULL);
-      CHECK_RESULT("clGetDeviceIDs(list of device IDs)")
-      for (j=0; j<platform[i].num_devices; ++j) {
-         platform[i].device[j].id = tmpdevices[j];
-         rc = clGetDeviceInfo(platform[i].device[j].id, CL_DEVICE_TYPE, sizeof(cl_device_type), &platform[i].device[j].type, NULL);
-         CHECK_RESULT("clGetDeviceInfo(device type)")
-      }
-      free(tmpdevices);
-   }
+      /* -j, --threads */
+      case 'j': native_threads = (unsigned int) atoi(optarg); break;
 
-   /* ================================================================================== */
-   /* Choose the best device to use, if one is not explicitly called for.                */
-   /* If a device is specified, ensure that device is present on this hardware.          */
-   /* ================================================================================== */
+      /* -Y, --symmetric */
+      case 'Y': sym_storage = 1; break;
 
-   if (device_type == CL_DEVICE_TYPE_DEFAULT) {
-      int accel_found = 0;
-      for (i=0; i<num_platforms; ++i) {
-         for (j=0; j<platform[i].num_devices; ++j) {
-            if (platform[i].device[j].type == CL_DEVICE_TYPE_ACCELERATOR) {
-               accel_found = 1;
-               pdex = i;
-               ddex = j;
-            }
-         }
-      }
-      if (!accel_found) {
-         int gpu_found = 0; 
-         for (i=0; i<num_platforms; ++i) {
-            for (j=0; j<platform[i].num_devices; ++j) {
-               if ((gpu_found == 0) && (platform[i].device[j].type == CL_DEVICE_TYPE_GPU)) {
-                  gpu_found = 1;
-                  pdex = i;
-                  ddex = j;
-               }
-            }
-         }
-         if (!gpu_found) {
-            int cpu_found = 0; 
-            for (i=0; i<num_platforms; ++i) {
-               for (j=0; j<platform[i].num_devices; ++j) {
-                  if (platform[i].device[j].type == CL_DEVICE_TYPE_CPU) {
-                     cpu_found = 1;
-                     pdex = i;
-                     ddex = j;
-                  }
-               }
-            }
-            if (!cpu_found) {
-               fprintf(stderr, "no devices of any kind were found on this system.  Leaving...\n"); 
-               fflush(stderr);
-               exit(EXIT_FAILURE);
-            }
+      /* -Z, --zero-copy */
+      case 'Z': zero_copy = 1; break;
+
+      /* -R, --reorder */
+      case 'R':
+         if (strcmp(optarg, "rcm") == 0) reorder = REORDER_RCM;
+         else if (strcmp(optarg, "nd") == 0) reorder = REORDER_ND;
+         else {
+            printf("%s: unknown reordering '%s'.\n", name, optarg);
+            exit(EXIT_FAILURE);
          }
-      }
-   }
-   else {
-      int device_found = 0;
-      for (i=0; i<num_platforms; ++i) for (j=0; j<platform[i].num_devices; ++j) {
-         if (platform[i].device[j].type == device_type) {
-            device_found = 1;
-            pdex = i;
-            ddex = j;
+         break;
+
+      /* -p, --precision */
+      case 'p':
+         if (strcmp(optarg, "single") == 0) precision = PRECISION_SINGLE;
+         else if (strcmp(optarg, "double") == 0) precision = PRECISION_DOUBLE;
+         else if (strcmp(optarg, "mixed") == 0) precision = PRECISION_MIXED;
+         else {
+            printf("%s: unknown precision '%s'.\n", name, optarg);
+            exit(EXIT_FAILURE);
          }
-      }
-      if (device_found == 0) {
-         fprintf(stderr, "no devices of the requested type were found on this system.  Leaving...\n"); 
-         fflush(stderr);
-         exit(EXIT_FAILURE);
-      }
-   }
+         break;
 
-   /* ================================================================================== */
-   /* Choose the best kernel to use, if one is not explicitly called for.                */
-   /* ================================================================================== */
+      /* -M, --multi */
+      case 'M': multi_requested = atoi(optarg); break;
 
-   if (kernel_type == KERNEL_DEFAULT) {
-      kernel_type = (platform[pdex].device[ddex].type == CL_DEVICE_TYPE_ACCELERATOR) ? KERNEL_AWGC : KERNEL_LS;
-   }
+      /* -S, --solver */
+      case 'S':
+         if (strcmp(optarg, "cg") == 0) solver_type = SOLVER_CG;
+         else if (strcmp(optarg, "power") == 0) solver_type = SOLVER_POWER;
+         else {
+            printf("%s: unknown solver '%s'.\n", name, optarg);
+            exit(EXIT_FAILURE);
+         }
+         break;
 
-   /* ================================================================================== */
-   /* Create a context.                                                                  */
-   /* ================================================================================== */
+      /* -i, --iterations */
+      case 'i': max_iterations = (unsigned int) atoi(optarg); break;
 
-   cl_context_properties properties[3];
-   properties[0] = CL_CONTEXT_PLATFORM;
-   properties[1] = (const cl_context_properties) platform[pdex].id;
-   properties[2] = 0;
-   platform[pdex].context = clCreateContext((const cl_context_properties *) properties, 1, &(platform[pdex].device[ddex].id), NULL, NULL, &rc);
-   CHECK_RESULT("clCreateContext")
+      /* -t, --tolerance */
+      case 't': tolerance = (float) atof(optarg); break;
 
-   /* ================================================================================== */
-   /* Build the kernel, create the Command Queue, and print kernel/device info.          */
-   /* ================================================================================== */
+      /* -F, --format */
+      case 'F':
+         format = format_from_name(optarg);
+         if (format == FORMAT_INVALID) {
+            printf("%s: unknown format '%s'.\n", name, optarg);
+            exit(EXIT_FAILURE);
+         }
+         break;
 
-   switch (kernel_type) {
-      case KERNEL_LS:
-      strcpy(kernel_name, kernel_name_LS);
-      break;
-      case KERNEL_AWGC: 
-      strcpy(kernel_name, kernel_name_AWGC);
-      break;
+      /* -k, --nrhs */
+      case 'k':
+         nrhs = (unsigned int) atoi(optarg);
+         if (nrhs != 1 && nrhs != 4 && nrhs != 8 && nrhs != 16) {
+            printf("%s: the number of right-hand sides must be 1, 4, 8 or 16.\n", name);
+            exit(EXIT_FAILURE);
+         }
+         break;
+
+      case '?':
+         printf("Try '%s --help' for more information.\n", name);
+         exit(EXIT_FAILURE);
+      }
    }
 
-   char *kernel_source;
-   kernel_source = load_program_source(kernel_source_file);
-   if (kernel_source == NULL) {
-      fprintf(stderr, "Error: Failed to load compute program from file!\n");
+   if (file_name == NULL) {
+      printf("%s: no matrix given; use -f <matrixfile> or -G <generator>.\n", name);
+      printf("Try '%s --help' for more information.\n", name);
       exit(EXIT_FAILURE);
    }
 
-   platform[pdex].program = clCreateProgramWithSource(platform[pdex].context, 1, (const char **) &kernel_source, NULL, &rc);
-   CHECK_RESULT("clCreateProgramWithSource")
-   free(kernel_source);
-
-   rc = clBuildProgram(platform[pdex].program, 1, &(platform[pdex].device[ddex].id), "", NULL, NULL);
-   CHECK_RESULT("clBuildProgram")
-
-   platform[pdex].kernel = clCreateKernel(platform[pdex].program, kernel_name, &rc);
-   CHECK_RESULT("clCreateKernel")
-
-   platform[pdex].device[ddex].ComQ = clCreateCommandQueue(platform[pdex].context, platform[pdex].device[ddex].id, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &rc);
-   CHECK_RESULT("clCreateCommandQueue")
-
-   rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_NAME, (size_t) 0, NULL, (size_t *) &param_value_size_ret);
-   CHECK_RESULT("clGetDeviceInfo(size of CL_DEVICE_NAME)")
-   MEMORY_ALLOC_CHECK(platform[pdex].device[ddex].name, param_value_size_ret, "device name");
-   rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_NAME, (size_t) param_value_size_ret, platform[pdex].device[ddex].name, (size_t *) NULL);
-   CHECK_RESULT("clGetDeviceInfo(CL_DEVICE_NAME)")
+   if (nrhs > 1 && format != FORMAT_AUTO && format != FORMAT_TILED) {
+      printf("%s: --nrhs is only supported by the tiled format.\n", name);
+      exit(EXIT_FAILURE);
+   }
 
-   printf("We'll run kernel %s on device %s\n", ((kernel_type == KERNEL_LS) ? "kernel_ls" : "kernel_awgc"), platform[pdex].device[ddex].name); 
+   if (multi_requested >= 0 && format != FORMAT_AUTO && format != FORMAT_TILED) {
+      printf("%s: --multi is only supported by the tiled format.\n", name);
+      exit(EXIT_FAILURE);
+   }
 
-   /* ================================================================================== */
-   /* Determine device alignment, and whether "out-of-order" processing is supported.    */
-   /* ================================================================================== */
+   if (nrhs > 1 && solver_type != SOLVER_NONE) {
+      printf("%s: the solvers work on a single right-hand side, and cannot be combined with --nrhs.\n", name);
+      exit(EXIT_FAILURE);
+   }
 
-   rc = clGetDeviceInfo(platform[pdex].device[ddex].id, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &preferred_alignment, NULL);
-   CHECK_RESULT("clGetDeviceInfo(CL_DEVICE_MEM_BASE_ADDR_ALIGN)")
-   if (preferred_alignment > 1024) preferred_alignment = 1024;
-   preferred_alignment /= 8;  /* Convert from units of bits to units of bytes. */
+   /* Only the single-vector tiled kernels are built in fp64; everything else stays fp32. */
+   if (precision != PRECISION_SINGLE &&
+       ((format != FORMAT_AUTO && format != FORMAT_TILED) || nrhs > 1 || multi_requested >= 0 || autotune || solver_type != SOLVER_NONE)) {
+      printf("%s: --precision %s is only supported by the single-device tiled format, without --nrhs, --autotune or --solver.\n",
+             name, precision_name(precision));
+      exit(EXIT_FAILURE);
+   }
 
-   cl_command_queue_properties command_queue_properties;
-   clGetDeviceInfo (platform[pdex].device[ddex].id, CL_DEVICE_QUEUE_PROPERTIES, sizeof(cl_command_queue_properties), &command_queue_properties, NULL); 
-   command_queue_properties &= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+   if (sym_storage && ((format != FORMAT_AUTO && format != FORMAT_TILED) || kernel_type == KERNEL_AWGC || nrhs > 1 ||
+                       multi_requested >= 0 || precision != PRECISION_SINGLE)) {
+      printf("%s: --symmetric is only supported by the single-device, single precision LS kernel, without --nrhs.\n", name);
+      exit(EXIT_FAILURE);
+   }
 
-   /* ================================================================================== */
-   /* Determine local memory size and maximum compute units.                             */
-   /* ================================================================================== */
+   if (reorder != REORDER_NONE && format != FORMAT_AUTO && format != FORMAT_TILED) {
+      printf("%s: --reorder is only supported by the tiled format.\n", name);
+      exit(EXIT_FAILURE);
+   }
 
-   size_t kernel_wg_size;
-   rc = clGetKernelWorkGroupInfo (platform[pdex].kernel, platform[pdex].device[ddex].id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), (void *) &kernel_wg_size, return_size);
-   CHECK_RESULT("clGetKernelWorkGroupInfo(CL_KERNEL_WORK_GROUP_SIZE)")
+   if (native_layout != CPU_LAYOUT_NONE && (nrhs > 1 || precision != PRECISION_SINGLE)) {
+      printf("%s: --native multiplies a single right-hand side in single precision.\n", name);
+      exit(EXIT_FAILURE);
+   }
 
-   cl_ulong total_local_mem;
-   rc = clGetDeviceInfo (platform[pdex].device[ddex].id, CL_DEVICE_LOCAL_MEM_SIZE, sizeof (cl_ulong), (void *) &total_local_mem, NULL);
-   CHECK_RESULT("clGetDeviceInfo(CL_DEVICE_LOCAL_MEM_SIZE)")
+   /* --native runs on the host alone, so none of the OpenCL device, kernel or matrix options apply. */
+   if (native_layout != CPU_LAYOUT_NONE &&
+       (device_type != CL_DEVICE_TYPE_DEFAULT || kernel_type != KERNEL_DEFAULT || format != FORMAT_TILED || multi_requested >= 0 ||
+        solver_type != SOLVER_NONE || autotune || sym_storage || reorder != REORDER_NONE || zero_copy || cache_dir != NULL ||
+        partitioner != PARTITION_ROWS)) {
+      printf("%s: --native runs without OpenCL, and takes none of the device, kernel, format, tiling or solver options.\n", name);
+      exit(EXIT_FAILURE);
+   }
 
-   cl_ulong used_local_mem;
-   rc = clGetKernelWorkGroupInfo (platform[pdex].kernel, platform[pdex].device[ddex].id, CL_KERNEL_LOCAL_MEM_SIZE, sizeof (cl_ulong), &used_local_mem, NULL);
-   CHECK_RESULT("clGetKernelWorkGroupInfo(CL_KERNEL_LOCAL_MEM_SIZE)")
+   if (optind != argc) {
+      printf("%s: unrecognized option '%s'.\n", name, argv[optind]);
+      printf("Try '%s --help' for more information.\n", name);
+      exit(EXIT_FAILURE);
+   }
 
-   cl_ulong local_mem_size;
-   local_mem_size = total_local_mem - used_local_mem;
+   printf("[START RUN]\n");
+   printf("command line: "); 
+   for (i=0; i<(unsigned int) argc; ++i) {
+      printf("%s ", argv[i]);
+   }
+   printf("\n");
 
-   cl_uint max_compute_units;
-   clGetDeviceInfo (platform[pdex].device[ddex].id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &max_compute_units, NULL); 
+   if (native_layout != CPU_LAYOUT_NONE) {
+      return native_run(file_name, native_layout, native_threads, stats_file, bench_seconds);
+   }
 
    /* ================================================================================== */
-   /* Set up parameter structure and call the function that builds the tiled matrix.     */
+   /* Build the SpMV handle: the device, the program, the tiled matrix (or the chosen   */
+   /* format's arrays) and the resident buffers (see spmv_lib.c).  The host copy of the */
+   /* matrix is kept, for the verification, statistics, solvers and multi-device run.  */
    /* ================================================================================== */
 
-   matrix_gen_struct mgs;
-   unsigned int nslabs_round, memsize;
-   packet *seg_workspace;
-   slab_header *matrix_header;
-   unsigned int num_header_packets;
-   unsigned int *row_index_array = NULL;
-   unsigned int *x_index_array = NULL;
-   float *data_array = NULL;
-
-   mgs.matrix_header = &matrix_header;
-   mgs.seg_workspace = &seg_workspace;
-   mgs.num_header_packets = &num_header_packets;
-   mgs.row_index_array = &row_index_array;
-   mgs.x_index_array = &x_index_array;
-   mgs.data_array = &data_array;
-   mgs.nx_pad = &nx_pad;
-   mgs.nyround = &nyround;
-   mgs.slab_startrow = &slab_startrow;
-   mgs.nx = &nx;
-   mgs.ny = &ny;
-   mgs.non_zero = &non_zero;
-   mgs.file_name = (char *) file_name;
-   mgs.preferred_alignment = preferred_alignment;
-   mgs.max_compute_units = &max_compute_units;
-   mgs.kernel_type = kernel_type;
-   mgs.column_span = &column_span;
-   mgs.local_mem_size = (unsigned int) local_mem_size;
-   mgs.segcachesize = &segcachesize;
-   mgs.max_slabheight = &max_slabheight;
-   mgs.device_type = platform[pdex].device[ddex].type,
-   mgs.gpu_wgsz = &gpu_wgsz,
-   mgs.kernel_wg_size = kernel_wg_size;
-   mgs.nslabs_round = &nslabs_round;
-   mgs.memsize = &memsize;
-
-   rc = matrix_gen(&mgs);
-
-   /* =============================================================================================== */
-   /* Compute the local and global work group sizes.                                                  */
-   /* =============================================================================================== */
-
-   unsigned int ndims;
-   unsigned int team_size;
-
-   size_t global_work_size[3];
-   size_t local_work_size[3];
-   if (kernel_type == KERNEL_AWGC) {
-      ndims = 1;
-      global_work_size[0] = nslabs_round;
-      local_work_size[0] = 1;
-   }
-   else {
-      ndims = 2;
-      team_size = (platform[pdex].device[ddex].type == CL_DEVICE_TYPE_GPU) ? 16 : 1;
-      global_work_size[1] = nslabs_round;
-      local_work_size[1] = 1;
-      global_work_size[0] = local_work_size[0] = (platform[pdex].device[ddex].type == CL_DEVICE_TYPE_GPU) ? gpu_wgsz : CPU_WGSZ;
-      int max_aggregate_local_work_group_size = 0;
-      int aggregate_local_work_group_size = 1;
-      for (i=0; i<ndims; ++i) {
-         aggregate_local_work_group_size *= local_work_size[i];
-      }
-      max_aggregate_local_work_group_size = aggregate_local_work_group_size;
-      if (max_aggregate_local_work_group_size > (int) kernel_wg_size) {
-         while (max_aggregate_local_work_group_size > (int) kernel_wg_size) {
-            local_work_size[0] /= 2;
-            gpu_wgsz /= 2;
-            max_aggregate_local_work_group_size /= 2;
-         }
-         printf("coercing work group size to fit within hardware limits.  New size is %d\n", gpu_wgsz);
-      }
+   /* The multi-device run splits the tiles, so it implies the tiled format. */
+   if (format == FORMAT_AUTO && multi_requested >= 0) {
+      format = FORMAT_TILED;
    }
 
-   /* =============================================================================================== */
-   /* Our Tiled format is now complete, but still in "working storage".  We cannot allocate its       */
-   /* buffer in OpenCL until we know how big it is, and now, we finally know how big it is.  So, we   */
-   /* create the Input and Output arrays, and the final array to hold the Tiled Format of the Matrix. */
-   /* =============================================================================================== */
-
-   /* Arrays to hold input and output data, and the finished tiled matrix data. */
-   float *input_array, *output_array, *output_array_verify;
-   unsigned int *tilebuffer;
-   
-   MEMORY_ALLOC_CHECK(output_array_verify, (nyround * sizeof(float)), "output_array_verify") 
-   if (output_array_verify == NULL) {
-      fprintf(stderr, "insufficient memory to perform this workload.\n"); fflush(stderr);
+   spmv_options opts;
+   spmv_default_options(&opts);
+   opts.device_type = device_type;
+   opts.kernel_type = kernel_type;
+   opts.partitioner = partitioner;
+   opts.reorder = reorder;
+   opts.sym_storage = sym_storage;
+   opts.gpu_wgsz = gpu_wgsz;
+   opts.cache_dir = cache_dir;
+   opts.kernel_source = kernel_source_file;
+   opts.format = format;
+   opts.nrhs = nrhs;
+   opts.precision = precision;
+   opts.zero_copy = zero_copy;
+   opts.autotune = autotune;
+   opts.profiling = (stats_file != NULL || bench_seconds > 0.0);
+   opts.keep_matrix = 1;
+   /* A multi-device run with nothing else for the single device checks the devices against the host */
+   /* reference by itself, so the whole matrix need not go to the single device as well.             */
+   opts.tiles_only = (multi_requested >= 0 && stats_file == NULL && bench_seconds == 0.0 && solver_type == SOLVER_NONE);
+
+   spmv_handle *h = spmv_create(file_name, &opts);
+   if (h == NULL) {
       exit(EXIT_FAILURE);
    }
 
-   cl_mem input_buffer;
-   cl_mem matrix_buffer;
-   cl_mem output_buffer;
-   unsigned int input_buffer_size;
-   unsigned int matrix_buffer_size;
-   /* Create the input and matrix buffer memory objects. */
-   input_buffer_size = (nx_pad * sizeof(float));
-   input_buffer = clCreateBuffer(platform[pdex].context, CL_MEM_ALLOC_HOST_PTR, input_buffer_size, NULL, &rc);
-   CHECK_RESULT("clCreateBuffer(input_buffer)")
-
-   matrix_buffer_size = memsize;
-   matrix_buffer = clCreateBuffer(platform[pdex].context, CL_MEM_ALLOC_HOST_PTR, matrix_buffer_size, NULL, &rc);
-   CHECK_RESULT("clCreateBuffer(matrix_buffer)")
-
-   cl_event events[2];
-
-   unsigned int output_buffer_size;
-   output_buffer_size = (slab_startrow[nslabs_round] - slab_startrow[0]) * sizeof(float);
-   output_buffer = clCreateBuffer(platform[pdex].context, CL_MEM_ALLOC_HOST_PTR, output_buffer_size, NULL, &rc);
-   CHECK_RESULT("clCreateBuffer(output_buffer)")
+   unsigned int nx = h->nx, ny = h->ny, non_zero = h->non_zero;
+   unsigned int *row_index_array = h->row_index_array;
+   unsigned int *x_index_array = h->x_index_array;
+   float *data_array = h->data_array;
+   double *data_array_dp = h->data_array_dp;
+   size_t value_size = h->value_size;
+   cl_uint preferred_alignment = 128; // used by "MEMORY_ALLOC_CHECK" macro
 
    /* =============================================================================================== */
-   /* Map these buffers to allocate pointers into these buffers that we can use to load them.         */
+   /* Execution: Multiplication of the input array times the matrix.                                  */
    /* =============================================================================================== */
 
-   input_array =       (float *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
-                                                       input_buffer, 
-                                                       CL_TRUE, 
-                                                       CL_MAP_WRITE, 
-                                                       0, 
-                                                       (size_t) input_buffer_size, 
-                                                       0, 
-                                                       NULL, 
-                                                       NULL, 
-                                                       &rc);
-   CHECK_RESULT("clEnqueueMapBuffer(input_array)")
-
-   tilebuffer = (unsigned int *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
-                                                       matrix_buffer, 
-                                                       CL_TRUE, 
-                                                       CL_MAP_WRITE, 
-                                                       0, 
-                                                       (size_t) matrix_buffer_size, 
-                                                       0, 
-                                                       NULL, 
-                                                       NULL, 
-                                                       &rc);
-   CHECK_RESULT("clEnqueueMapBuffer(tilebuffer)")
-
-   output_array =     (float *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
-                                                      output_buffer, 
-                                                      CL_TRUE, 
-                                                      CL_MAP_WRITE, 
-                                                      0, 
-                                                      (size_t) output_buffer_size, 
-                                                      0, 
-                                                      NULL, 
-                                                      NULL, 
-                                                      &rc);
-   CHECK_RESULT("clEnqueueMapBuffer(output_array)")
-
-   /* =============================================================================================== */
-   /* Copy the tiled matrix into the memory buffer, and then unmap it.                                */
-   /* =============================================================================================== */
+   /* Arrays to hold input and output data, in the file's numbering.                 */
+   /* In double and mixed precision the vectors hold doubles, and are used through the */
+   /* "_dp" views of the same arrays.                                                 */
+   /* With zero copy they are the handle's own arrays, which the device multiplies in place.      */
+   float *input_array, *output_array, *output_array_verify;
+   double *input_array_dp, *output_array_dp, *output_array_verify_dp;
+   void *zero_copy_x, *zero_copy_y;
+   int in_place = (spmv_vectors(h, &zero_copy_x, &zero_copy_y) == CL_SUCCESS);
 
-   memcpy(tilebuffer, seg_workspace, sizeof(packet) * (matrix_header[nslabs_round].offset));
-   rc = clEnqueueUnmapMemObject(platform[pdex].device[ddex].ComQ, matrix_buffer, tilebuffer, 0, NULL, &events[0]);
-   CHECK_RESULT("clEnqueueUnmapMemObject(tilebuffer)")
-   clWaitForEvents(1, events);
+   if (in_place) {
+      input_array = (float *) zero_copy_x;
+      output_array = (float *) zero_copy_y;
+   }
+   else {
+      MEMORY_ALLOC_CHECK(input_array, (h->nx_pad * nrhs * value_size), "input_array")
+      MEMORY_ALLOC_CHECK(output_array, (h->nyround * nrhs * value_size), "output_array")
+   }
+   MEMORY_ALLOC_CHECK(output_array_verify, (h->nyround * nrhs * value_size), "output_array_verify")
+   memset(input_array, 0, h->nx_pad * nrhs * value_size);
+   input_array_dp = (double *) input_array;
+   output_array_dp = (double *) output_array;
+   output_array_verify_dp = (double *) output_array_verify;
 
    /* Load random data into the input array.                                         */
    /* The user can substitute initialization of real data at this point in the code. */
-   for (i=0; i<nx; ++i) {
+   for (i=0; i<nx*nrhs; ++i) {
       float rval;
       rval = ((float) (rand() & 0x7fff)) * 0.001f - 15.0f;
-      input_array[i] = rval;
+      if (precision == PRECISION_SINGLE) input_array[i] = rval;
+      else input_array_dp[i] = (double) rval;
    }
 
-   /* Zero out the output array.                                                             */
-   /* Note that this is only needed because some matrices are singular and have whole rows   */
-   /* that are all zero, which is detected, and no work is done on those rows, so that they  */
-   /* will never get written by the kernel, so to be safe, we zero it all out here, as well. */
-
-   memset((void *) output_array, 0, output_buffer_size);
-
-   /* =============================================================================================== */
-   /* Unmap the input and output memory buffers, to prepare for kernel execution.                     */
-   /* =============================================================================================== */
-
-   rc = clEnqueueUnmapMemObject(platform[pdex].device[ddex].ComQ, input_buffer, input_array,   0, NULL, &events[0]);
-   CHECK_RESULT("clEnqueueUnmapMemObject(input_array)")
-   rc = clEnqueueUnmapMemObject(platform[pdex].device[ddex].ComQ, output_buffer, output_array, 0, NULL, &events[1]);
-   CHECK_RESULT("clEnqueueUnmapMemObject(output_array)")
-   clWaitForEvents(2, events);
-
-   /* =============================================================================================== */
-   /* Execution: Multiplication of the input array times the Tiled Format of the Matrix.              */
-   /* =============================================================================================== */
-
-   /* Run once to verifying correct answer, and computing a baseline number of repetitions for later performance measurements. */
-
-   rc = clSetKernelArg(platform[pdex].kernel, 0, sizeof(cl_mem), (const void *) &input_buffer);
-   CHECK_RESULT("clSetKernelArg(0)")
-   rc = clSetKernelArg(platform[pdex].kernel, 1, sizeof(cl_mem), (const void *) &output_buffer);
-   CHECK_RESULT("clSetKernelArg(1)")
-   rc = clSetKernelArg(platform[pdex].kernel, 2, sizeof(cl_mem), (const void *) &matrix_buffer);
-   CHECK_RESULT("clSetKernelArg(2)")
-   rc = clSetKernelArg(platform[pdex].kernel, 3, sizeof(cl_uint), &column_span);
-   CHECK_RESULT("clSetKernelArg(3)")
-   rc = clSetKernelArg(platform[pdex].kernel, 4, sizeof(cl_uint), &max_slabheight);
-   CHECK_RESULT("clSetKernelArg(4)")
-
-   if (kernel_type == KERNEL_LS) {
-      rc = clSetKernelArg(platform[pdex].kernel, 5, sizeof(cl_uint), &team_size);
-      CHECK_RESULT("clSetKernelArg(5)")
-      rc = clSetKernelArg(platform[pdex].kernel, 6, sizeof(cl_uint), &num_header_packets);
-      CHECK_RESULT("clSetKernelArg(6)")
-      rc = clSetKernelArg(platform[pdex].kernel, 7, (size_t) (max_slabheight * sizeof(float)), (void *) NULL);
-      CHECK_RESULT("clSetKernelArg(7)")
+   /* Run once to verify the correct answer.  The statistics and benchmark modes repeat it, timed, further below. */
+   if (!opts.tiles_only) {
+      rc = spmv_apply(h, input_array, output_array);
+      CHECK_RESULT("spmv_apply")
    }
-   else {
-      rc = clSetKernelArg(platform[pdex].kernel, 5, sizeof(cl_uint), &segcachesize);
-      CHECK_RESULT("clSetKernelArg(5)")
-      rc = clSetKernelArg(platform[pdex].kernel, 6, sizeof(cl_uint), &num_header_packets);
-      CHECK_RESULT("clSetKernelArg(6)")
-      rc = clSetKernelArg(platform[pdex].kernel, 7, (size_t) (2 * column_span * sizeof(float)), (void *) NULL);
-      CHECK_RESULT("clSetKernelArg(7)")
-      rc = clSetKernelArg(platform[pdex].kernel, 8, (size_t) (max_slabheight * sizeof(float)), (void *) NULL);
-      CHECK_RESULT("clSetKernelArg(8)")
-      rc = clSetKernelArg(platform[pdex].kernel, 9, (size_t) (segcachesize * sizeof(packet)), (void *) NULL);
-      CHECK_RESULT("clSetKernelArg(9)")
-   }
-
-   rc = clEnqueueNDRangeKernel(platform[pdex].device[ddex].ComQ, platform[pdex].kernel, ndims, NULL, global_work_size, local_work_size, 0, NULL, &events[0]);
-   CHECK_RESULT("clEnqueueNDRangeKernel")
-
-   clWaitForEvents(1, events);
-
-   output_array = (float *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
-                                                  output_buffer, 
-                                                  CL_TRUE, 
-                                                  (CL_MAP_READ|CL_MAP_WRITE), 
-                                                  0, 
-                                                  (size_t) output_buffer_size, 
-                                                  0, 
-                                                  NULL, 
-                                                  NULL, 
-                                                  &rc);
-   CHECK_RESULT("clEnqueueMapBuffer(output_array)")
-
-   input_array   = (float *) clEnqueueMapBuffer(platform[pdex].device[ddex].ComQ, 
-                                                   input_buffer, 
-                                                   CL_TRUE, 
-                                                   (CL_MAP_READ|CL_MAP_WRITE), 
-                                                   0, 
-                                                   (size_t) input_buffer_size, 
-                                                   0, 
-                                                   NULL, 
-                                                   NULL, 
-                                                   &rc);
-   CHECK_RESULT("clEnqueueMapBuffer(input_array)")
 
    /* =============================================================== */
    /* Data Verification.                                              */
@@ -676,87 +611,251 @@ int main(int argc, char *argv[]) {
 
    rc = 0;
    /* Run the trivial (reference) spmv calculation, using the data previously loaded into CSR format. */
+   /* With a block of right-hand sides, column v of the block is at stride nrhs, starting at v.      */
+   unsigned int v;
    for (i=0; i<ny; ++i) {
-      float t = 0;
       unsigned int lb = row_index_array[i];
       unsigned int ub = row_index_array[i+1];
-      for (j=lb; j<ub; ++j) {
-         t += data_array[j] * input_array[x_index_array[j]];
+      if (precision != PRECISION_SINGLE) {
+         double t = 0.0;
+         for (j=lb; j<ub; ++j) {
+            t += ((precision == PRECISION_DOUBLE) ? data_array_dp[j] : (double) data_array[j]) * input_array_dp[x_index_array[j]];
+         }
+         output_array_verify_dp[i] = t;
+         continue;
+      }
+      for (v=0; v<nrhs; ++v) {
+         float t = 0;
+         for (j=lb; j<ub; ++j) {
+            t += data_array[j] * input_array[x_index_array[j]*nrhs + v];
+         }
+         output_array_verify[i*nrhs + v] = t;
       }
-      output_array_verify[i] = t;
    }
 
    /* Compare results of kernel computations against trivial calculation results. */
    double sum;
    double diffsum;
-   sum = 0.0;
-   diffsum = 0.0;
-   for (i=0; i<ny; ++i) {
-      float a, b;
-      double abs_a, delta;
-      a = output_array_verify[i];
-      b = output_array[i];
-      abs_a = ((double) a);
-      delta = (((double) a) - ((double) b));
-      abs_a = (abs_a < 0.0) ? -abs_a : abs_a;
-      delta = (delta < 0.0) ? -delta : delta;
-      sum += abs_a;
-      diffsum += delta;
-   }
-   printf("avg error = %le, ", diffsum / sum);
-   if (diffsum / sum > 0.0001) {
-      rc = -1;
-   }
+   if (!opts.tiles_only) {
+      sum = 0.0;
+      diffsum = 0.0;
+      for (i=0; i<ny*nrhs; ++i) {
+         double a, b;
+         double abs_a, delta;
+         a = (precision == PRECISION_SINGLE) ? output_array_verify[i] : output_array_verify_dp[i];
+         b = (precision == PRECISION_SINGLE) ? output_array[i] : output_array_dp[i];
+         abs_a = ((double) a);
+         delta = (((double) a) - ((double) b));
+         abs_a = (abs_a < 0.0) ? -abs_a : abs_a;
+         delta = (delta < 0.0) ? -delta : delta;
+         sum += abs_a;
+         diffsum += delta;
+      }
+      /* With fp64 accumulation the kernel and the reference differ only in summation order. */
+      printf("avg error = %le, ", diffsum / sum);
+      if (diffsum / sum > ((precision == PRECISION_SINGLE) ? 0.0001 : 1.0e-10)) {
+         rc = -1;
+      }
 
-   printf("(matrix %s)\n", file_name);
+      printf("(matrix %s)\n", file_name);
+   }
    int retval = rc;
 
-   /* ================= */
-   /* Shut Down OpenCL. */
-   /* ================= */
-
-   rc = clEnqueueUnmapMemObject(platform[pdex].device[ddex].ComQ, input_buffer, input_array, 0, NULL, NULL);
-   CHECK_RESULT("clEnqueueUnmapMemObject(input)")
-   rc = clEnqueueUnmapMemObject(platform[pdex].device[ddex].ComQ, output_buffer, output_array, 0, NULL, NULL);
-   CHECK_RESULT("clEnqueueUnmapMemObject(output)")
-
-   rc = clFinish(platform[pdex].device[ddex].ComQ);
-   CHECK_RESULT("clFinish")
-
-   rc = clReleaseEvent(events[0]);
-   CHECK_RESULT("clReleaseEvent(0)")
-   rc = clReleaseEvent(events[1]);
-   CHECK_RESULT("clReleaseEvent(1)")
-   rc = clReleaseMemObject(input_buffer);
-   CHECK_RESULT("clReleaseMemObject(input)")
-   rc = clReleaseMemObject(matrix_buffer);
-   CHECK_RESULT("clReleaseMemObject(matrix)")
-   rc = clReleaseMemObject(output_buffer);
-   CHECK_RESULT("clReleaseMemObject(output)")
-   rc = clReleaseCommandQueue(platform[pdex].device[ddex].ComQ);
-   CHECK_RESULT("clReleaseCommandQueue")
-   rc = clReleaseKernel(platform[pdex].kernel);
-   CHECK_RESULT("clReleaseKernel")
-   rc = clReleaseProgram(platform[pdex].program);
-   CHECK_RESULT("clReleaseProgram")
-   rc = clReleaseContext(platform[pdex].context);
-   CHECK_RESULT("clReleaseContext")
-
-   /* ============================= */
-   /* Free up all allocated memory. */
-   /* ============================= */
+   /* =============================================================== */
+   /* Multi-device run, checked against the same reference result.    */
+   /* The devices get a context and program of their own; the        */
+   /* handle's device stays as it is for everything else.            */
+   /* =============================================================== */
 
-   free(data_array);
-   free(x_index_array);
-   free(row_index_array);
-   free(slab_startrow);
-   free(seg_workspace);
+   if (multi_requested >= 0) {
+      multi_struct ms;
+      cl_device_id *multi_devices;
+      unsigned int multi_subdevices;
+
+      ms.ndevices = multi_select_devices(h->platform, h->device_type, (unsigned int) multi_requested, &multi_devices, &multi_subdevices);
+      printf("multi-device run over %d devices\n", ms.ndevices);
+      ms.platform = h->platform;
+      ms.kernel_source = kernel_source_file;
+      ms.build_options = h->build_options;
+      ms.kernel_name = h->kernel_name;
+      ms.kernel_type = h->kernel_type;
+      ms.devices = multi_devices;
+      ms.matrix_header = h->matrix_header;
+      ms.nslabs_round = h->nslabs_round;
+      ms.num_header_packets = h->num_header_packets;
+      ms.slab_startrow = h->slab_startrow;
+      ms.column_span = h->column_span;
+      ms.max_slabheight = h->max_slabheight;
+      ms.segcachesize = h->segcachesize;
+      ms.team_size = (h->kernel_type == KERNEL_LS) ? h->team_size : 0;
+      ms.local_work_size0 = h->local_work_size[0];
+      ms.nrhs = nrhs;
+      ms.nx_pad = h->nx_pad;
+      ms.ny = ny;
+      ms.input = input_array;
+      ms.reference = output_array_verify;
+      ms.passes = MULTI_PASSES;
+
+      /* The devices see the reordered tiles, so hand them reordered copies of the vectors. */
+      float *multi_input = NULL, *multi_reference = NULL;
+      if (h->perm != NULL) {
+         MEMORY_ALLOC_CHECK(multi_input, (h->nx_pad * nrhs * sizeof(float)), "multi_input")
+         MEMORY_ALLOC_CHECK(multi_reference, (h->nyround * nrhs * sizeof(float)), "multi_reference")
+         memcpy(multi_input, input_array, h->nx_pad * nrhs * sizeof(float));
+         memcpy(multi_reference, output_array_verify, h->nyround * nrhs * sizeof(float));
+         reorder_vector(h->perm, nx, nrhs * sizeof(float), multi_input, 1);
+         reorder_vector(h->perm, ny, nrhs * sizeof(float), multi_reference, 1);
+         ms.input = multi_input;
+         ms.reference = multi_reference;
+      }
+      if (spmv_multi(&ms) != 0) {
+         retval = -1;
+      }
+      free(multi_input);
+      free(multi_reference);
+      multi_release_devices(multi_devices, multi_subdevices);
+   }
+
+   /* =============================================================== */
+   /* Statistics and benchmark: format shape, and kernel times from   */
+   /* profiling events.                                               */
+   /* =============================================================== */
+
+   if (stats_file != NULL || bench_seconds > 0.0) {
+      stats_struct st;
+      memset(&st, 0, sizeof(st));
+      st.file_name = file_name;
+      st.device_name = h->device_name;
+      st.format = format_name(h->format);
+      st.kernel = h->kernel_name;
+      st.precision = precision_name(precision);
+      st.value_bytes = (unsigned int) value_size;
+      st.packet_bytes = (unsigned int) h->packet_size;
+      st.nx = nx;
+      st.ny = ny;
+      st.non_zero = non_zero;
+      /* The symmetric tiles hold only the upper triangle, which is what the fill and bytes per non-zero are */
+      /* measured against; the GFLOP/s still count the full matrix, whose every product the kernel forms.  */
+      st.stored_non_zero = non_zero;
+      if (h->symmetric) {
+         st.stored_non_zero = 0;
+         for (i=0; i<ny; ++i) {
+            for (j=row_index_array[i]; j<row_index_array[i+1]; ++j) {
+               if (x_index_array[j] >= i) ++st.stored_non_zero;
+            }
+         }
+      }
+      st.nrhs = nrhs;
+      if (h->format == FORMAT_TILED) {
+         stats_tiled(&st, h->tiles, h->nslabs_round, h->num_header_packets, h->slab_startrow, row_index_array, h->perm);
+      }
+      else {
+         st.matrix_bytes = h->fs.bytes;
+      }
+
+      /* The kernel reruns on the handle's resident vectors, still holding the verified multiply. */
+      rc = clFinish(h->queue);
+      CHECK_RESULT("clFinish")
+      if (bench_kernel(h->queue, h->kernel, h->ndims, h->global_work_size, h->local_work_size,
+                       BENCH_WARMUP, STATS_RUNS, bench_seconds, &st) != CL_SUCCESS) {
+         exit(EXIT_FAILURE);
+      }
+      stats_report(&st, stats_file);
+      if (bench_seconds > 0.0) {
+         bench_csv(&st);
+      }
+   }
+
+   /* =============================================================== */
+   /* Iterative solver, reusing the resident matrix.  It binds the    */
+   /* kernel's vector arguments to its own buffers, so it runs last.  */
+   /* =============================================================== */
+
+   if (solver_type != SOLVER_NONE) {
+      if (nx != ny) {
+         printf("the %s solver needs a square matrix (nx = %d, ny = %d)\n", (solver_type == SOLVER_CG) ? "cg" : "power", nx, ny);
+         retval = -1;
+      }
+      else {
+         solver_struct ss;
+         float *rhs, *solution, *solver_rhs;
+         unsigned int vector_length = (h->nx_pad > h->nyround) ? h->nx_pad : h->nyround;
+
+         /* The right-hand side (or starting vector) is the random input vector generated above. */
+         MEMORY_ALLOC_CHECK(rhs, nx * sizeof(float), "rhs")
+         if (h->zero_copy) {
+            solution = (float *) zero_copy_alloc(vector_length * sizeof(float));
+            if (solution == NULL) exit(EXIT_FAILURE);
+         }
+         else MEMORY_ALLOC_CHECK(solution, nx * sizeof(float), "solution")
+         memcpy(rhs, input_array, nx * sizeof(float));
+
+         /* The solver iterates on the resident tiles, so with a reordered matrix it solves */
+         /* the reordered system, and the solution is put back in the file's numbering.     */
+         solver_rhs = rhs;
+         if (h->perm != NULL) {
+            MEMORY_ALLOC_CHECK(solver_rhs, nx * sizeof(float), "solver_rhs")
+            memcpy(solver_rhs, rhs, nx * sizeof(float));
+            reorder_vector(h->perm, nx, sizeof(float), solver_rhs, 1);
+         }
+
+         ss.context = h->context;
+         ss.device = h->device;
+         ss.device_type = h->device_type;
+         ss.program = h->program;
+         ss.kernel = h->kernel;
+         ss.accumulate = h->symmetric;
+         ss.zero_copy = h->zero_copy;
+         ss.ndims = h->ndims;
+         ss.global_work_size = h->global_work_size;
+         ss.local_work_size = h->local_work_size;
+         ss.n = nx;
+         ss.vector_length = vector_length;
+         ss.non_zero = non_zero;
+         ss.solver_type = solver_type;
+         ss.max_iterations = max_iterations;
+         ss.tolerance = tolerance;
+         ss.rhs = solver_rhs;
+         ss.solution = solution;
+
+         if (spmv_solve(&ss) != 0) {
+            printf("solver did not converge in %d iterations\n", max_iterations);
+         }
+         if (h->perm != NULL) {
+            reorder_vector(h->perm, nx, sizeof(float), solution, 0);
+            free(solver_rhs);
+         }
+
+         /* Check the answer on the host: |b - Ax| / |b| for CG, |Ax - lambda x| / |lambda| for power iteration. */
+         double resid = 0.0, scale = 0.0;
+         for (i=0; i<ny; ++i) {
+            double t = 0.0;
+            for (j=row_index_array[i]; j<row_index_array[i+1]; ++j) {
+               t += (double) data_array[j] * (double) solution[x_index_array[j]];
+            }
+            t = (solver_type == SOLVER_CG) ? (rhs[i] - t) : (t - (double) ss.eigenvalue * solution[i]);
+            resid += t * t;
+            scale += (solver_type == SOLVER_CG) ? (double) rhs[i] * rhs[i] : 0.0;
+         }
+         if (solver_type == SOLVER_POWER) scale = (double) ss.eigenvalue * ss.eigenvalue;
+         printf("%s: host-checked relative residual = %e\n", (solver_type == SOLVER_CG) ? "cg" : "power iteration",
+                (scale > 0.0) ? sqrt(resid / scale) : sqrt(resid));
+
+         free(rhs);
+         free(solution);
+      }
+   }
+
+   /* ========================================= */
+   /* Shut down OpenCL, and free up all memory. */
+   /* ========================================= */
+
+   spmv_destroy(h);
+   if (!in_place) {
+      free(input_array);
+      free(output_array);
+   }
    free(output_array_verify);
-   free(platform[pdex].device[ddex].name);
-   for (i=0; i<num_platforms; ++i) free(platform[i].device);
-   for (i=0; i<num_platforms; ++i) free(platform[i].name);
-   free(buffer);
-   free(platform);
 
    return retval;
 }
@@ -54,6 +54,39 @@
 /* developerWorks group. See https://www.ibm.com/developerworks/mydeveloperworks/groups               */
 /* ================================================================================================== */
 
+/* ================================================================================================== */
+/* Precision.  The program is built in one of three precisions, chosen by a define at build time so   */
+/* that the kernels carry no runtime branching on it:                                                 */
+/*    (neither)   fp32 matrix values, fp32 input and output vectors, fp32 accumulation                */
+/*    -DMIXED     fp32 matrix values, fp64 input and output vectors, fp64 accumulation                */
+/*    -DDOUBLE    fp64 matrix values, fp64 input and output vectors, fp64 accumulation                */
+/* "matval" is the type of the values stored in the packets, and "real" the type of everything else.  */
+/* Under DOUBLE the packet grows to 192 bytes (see "packet_dp" in spmv.h); MIXED leaves it unchanged. */
+/* ================================================================================================== */
+
+#if defined(DOUBLE) && defined(MIXED)
+#error "DOUBLE and MIXED are mutually exclusive"
+#endif
+
+#if defined(DOUBLE) || defined(MIXED)
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double  real;
+typedef double8 real8;
+#define convert_real8 convert_double8
+#else
+typedef float  real;
+typedef float8 real8;
+#define convert_real8 convert_float8
+#endif
+
+#ifdef DOUBLE
+typedef double  matval;
+typedef double8 matval8;
+#else
+typedef float  matval;
+typedef float8 matval8;
+#endif
+
 /* These two structures are defined both in spmv.c and spmv.cl (using different variable types). */
 /* If you change something here, change it in the other file as well. */
 typedef struct _slab_header {
@@ -73,8 +106,8 @@ typedef struct _packet {
    uint pad4;
    ushort input_offset_short[16];
    union {
-      float8 matdataV8[2];
-      float matdata[16];
+      matval8 matdataV8[2];
+      matval matdata[16];
    } uf;
 } packet;
 
@@ -82,22 +115,22 @@ typedef struct _packet {
 /* Kernel using basic load/store mechanisms and local vars. This version is optimized for the GPU and CPU devices    */
 /* ================================================================================================================= */
 
-__kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to input memory object in global memory */
-                                   __global float *output,        /* pointer to output memory object in global memory */
+__kernel void tiled_spmv_kernel_LS(__global real *input,          /* pointer to input memory object in global memory */
+                                   __global real *output,         /* pointer to output memory object in global memory */
                                    __global uint *matbuffer,      /* pointer to tiled matrix memory object in global memory */
                                    __private uint column_span,    /* size of fixed chunks of the input vector */
                                    __private uint slabspace,      /* size of the variable chunk of output vector to be computed */
                                    __private uint team_size,      /* size of each "team" of local work units */
                                    __private uint num_header_packets,
-                                   __local float *outputspace)    /* local buffer to hold computed output, to be written out at the end */
+                                   __local real *outputspace)     /* local buffer to hold computed output, to be written out at the end */
 {
    uint i, gunit, lunit, start, span, npackets, teamnum, n_teams, outindex, outspan; 
    __global slab_header *headptr;
-   __global float *work_input;
+   __global real *work_input;
    __global packet *gsegptr;      /* This is a "global pointer."  Compare to variable in other kernel called "lsegptr." */
    __global packet *gsegptr_stop; /* Computed to hold the address of the end of the work for this work unit.            */
-   __global float *outptr;
-   __local float *outptr16;
+   __global real *outptr;
+   __local real *outptr16;
 
    /* The local workgroup is interpreted as a set of "teams," each consisting of 1 or 16 work units. */
    /* This construction is frequently very useful on the GPU device.                                 */
@@ -114,7 +147,7 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
    /* Zero out the output buffer */
    /* Each team has its own separate output buffer.  At the end, these are accumulated. */
    for (i = start; i < slabspace; i += span) {
-#ifdef DOUBLE
+#if defined(DOUBLE) || defined(MIXED)
       outputspace[i] = 0.0;     
 #else
       outputspace[i] = 0.0f;     
@@ -141,7 +174,7 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
       for (i=0; i<temp_packetcount; ++i) {
          outptr16 = &outputspace[gsegptr->seg_output_offset];
          work_input = &input[gsegptr->seg_input_offset];
-         outptr16[lunit] += gsegptr->uf.matdata[lunit] * work_input[gsegptr->input_offset_short[lunit]];
+         outptr16[lunit] += (real) gsegptr->uf.matdata[lunit] * work_input[gsegptr->input_offset_short[lunit]];
          ++gsegptr;
       }
    }
@@ -156,7 +189,7 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
          outptr16 = &outputspace[gsegptr->seg_output_offset];
          work_input = &input[gsegptr->seg_input_offset];
          for (lunit=0; lunit<16; ++lunit) {
-            outptr16[lunit] += gsegptr->uf.matdata[lunit] * work_input[gsegptr->input_offset_short[lunit]];
+            outptr16[lunit] += (real) gsegptr->uf.matdata[lunit] * work_input[gsegptr->input_offset_short[lunit]];
          }
          ++gsegptr;
       }
@@ -170,6 +203,110 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
    }
 }
 
+/* ================================================================================================== */
+/* Symmetric variant of the LS kernel.  The tiled matrix holds only the upper triangle (x >= row),    */
+/* and each off-diagonal element a(r,c) is applied twice: to output row r as usual, and transposed,   */
+/* as a(r,c) * input[r], to output row c.  The transposed updates land in other slabs' rows, so both  */
+/* halves are accumulated into "output" with atomic adds, and the host zeroes "output" before each    */
+/* launch.  The matrix streamed from global memory is about half the size of the full matrix.         */
+/* ================================================================================================== */
+
+#if !defined(DOUBLE) && !defined(MIXED)
+
+/* OpenCL 1.x has no atomic float add, so it is built from a compare-and-swap on the bits. */
+void atomic_add_float(volatile __global float *addr, float value)
+{
+   union {
+      uint u;
+      float f;
+   } old_val, new_val;
+
+   do {
+      old_val.f = *addr;
+      new_val.f = old_val.f + value;
+   } while (atomic_cmpxchg((volatile __global uint *) addr, old_val.u, new_val.u) != old_val.u);
+}
+
+/* One element of a packet: the row contribution goes to local memory, the transposed one straight */
+/* to global memory.  Unused slots hold zero, and the diagonal has no transposed twin.              */
+#define PROCESS_SYM_ELEMENT(_lunit) {                                                        \
+   float a = gsegptr->uf.matdata[_lunit];                                                    \
+   uint col = gsegptr->seg_input_offset + gsegptr->input_offset_short[_lunit];               \
+   uint row = outindex + gsegptr->seg_output_offset + (_lunit);                              \
+   outptr16[_lunit] += a * input[col];                                                       \
+   if (a != 0.0f && col != row) atomic_add_float(&output[col], a * input[row]);              \
+}
+
+__kernel void tiled_spmv_kernel_LS_SYM(__global float *input,     /* pointer to input memory object in global memory */
+                                       __global float *output,    /* pointer to output memory object, zeroed by the host */
+                                       __global uint *matbuffer,  /* pointer to the tiled upper triangle in global memory */
+                                       __private uint column_span,
+                                       __private uint slabspace,
+                                       __private uint team_size,
+                                       __private uint num_header_packets,
+                                       __local float *outputspace)
+{
+   uint i, gunit, lunit, start, span, npackets, teamnum, n_teams, outindex, outspan;
+   __global slab_header *headptr;
+   __global packet *gsegptr;
+   __global packet *gsegptr_stop;
+   __local float *outptr16;
+
+   headptr = ((__global slab_header *) matbuffer) + get_global_id(1);
+   outspan = headptr->outspan;
+   outindex = headptr->outindex;
+   n_teams = get_local_size(0)/team_size;
+   gunit = get_local_id(0);
+   teamnum = gunit/team_size;
+   start = get_global_id(0);
+   span = get_global_size(0);
+
+   for (i = start; i < slabspace; i += span) {
+      outputspace[i] = 0.0f;
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   gsegptr = &(((__global packet *) matbuffer)[headptr->offset]);
+
+   if (team_size == 16) {
+      lunit = gunit % team_size;
+      __global uint *first_team_offset;
+      first_team_offset = (__global uint *) gsegptr;
+      int temp_offset, temp_packetcount;
+      temp_offset = first_team_offset[teamnum] / 65536;
+      temp_packetcount = first_team_offset[teamnum] % 65536;
+      gsegptr += num_header_packets + temp_offset;
+      for (i=0; i<temp_packetcount; ++i) {
+         outptr16 = &outputspace[gsegptr->seg_output_offset];
+         PROCESS_SYM_ELEMENT(lunit)
+         ++gsegptr;
+      }
+   }
+   else {
+      gsegptr += num_header_packets;
+      npackets = gsegptr->npackets_remaining;
+      int stopdex  = ((teamnum + 1) * npackets) / n_teams;
+      int startdex = ((teamnum    ) * npackets) / n_teams;
+      gsegptr_stop = &gsegptr[stopdex];
+      gsegptr = &gsegptr[startdex];
+      while (gsegptr < gsegptr_stop) {
+         outptr16 = &outputspace[gsegptr->seg_output_offset];
+         for (lunit=0; lunit<16; ++lunit) {
+            PROCESS_SYM_ELEMENT(lunit)
+         }
+         ++gsegptr;
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Other slabs may already have added transposed contributions to these rows. */
+   for (i=start; i<outspan; i+=span) {
+      atomic_add_float(&output[outindex + i], outputspace[i]);
+   }
+}
+
+#endif
+
 /* ================================================================================================== */
 /* Kernel using "async_work_group_copy".  This version is optimized for the ACCELERATOR device        */
 /* ================================================================================================== */
@@ -181,8 +318,8 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
 /* =========================================================== */
 
 #define GET_INPUT(_inputspace_index, _input_offset) {                                                                 \
-   eventI[_inputspace_index] = async_work_group_copy((__local float8 *) &inputspace[column_span * _inputspace_index], \
-                                                     (const __global float8 *) &input[_input_offset],                 \
+   eventI[_inputspace_index] = async_work_group_copy((__local real8 *) &inputspace[column_span * _inputspace_index],  \
+                                                     (const __global real8 *) &input[_input_offset],                  \
                                                      (size_t) (column_span>>3),                                       \
                                                      (event_t) 0);                                                    \
 }
@@ -215,7 +352,7 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
 /* ========================================================= */
 
 #define PROCESS_LOCAL_PACKET {                                                   \
-   float8 inV[2];                                                                \
+   real8 inV[2];                                                                 \
    lsegptr = (__local struct _packet *) &lsegspace[lsegspace_index];             \
    if (lsegptr->seg_input_offset != curr_input_offset) {                         \
        curr_input_offset = lsegptr->seg_input_offset;                            \
@@ -225,7 +362,7 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
        wait_group_events(1, &eventI[inputspace_index]);                          \
    }                                                                             \
    work_input = &inputspace[column_span * inputspace_index];                     \
-   outputspaceV8 = (__local float8 *) &outputspace[lsegptr->seg_output_offset];  \
+   outputspaceV8 = (__local real8 *) &outputspace[lsegptr->seg_output_offset];   \
    inV[0].s0 = work_input[lsegptr->input_offset_short[ 0]];                      \
    inV[0].s1 = work_input[lsegptr->input_offset_short[ 1]];                      \
    inV[0].s2 = work_input[lsegptr->input_offset_short[ 2]];                      \
@@ -242,26 +379,26 @@ __kernel void tiled_spmv_kernel_LS(__global float *input,         /* pointer to
    inV[1].s5 = work_input[lsegptr->input_offset_short[13]];                      \
    inV[1].s6 = work_input[lsegptr->input_offset_short[14]];                      \
    inV[1].s7 = work_input[lsegptr->input_offset_short[15]];                      \
-   outputspaceV8[0] = fma(lsegptr->uf.matdataV8[0], inV[0], outputspaceV8[0]);   \
-   outputspaceV8[1] = fma(lsegptr->uf.matdataV8[1], inV[1], outputspaceV8[1]);   \
+   outputspaceV8[0] = fma(convert_real8(lsegptr->uf.matdataV8[0]), inV[0], outputspaceV8[0]); \
+   outputspaceV8[1] = fma(convert_real8(lsegptr->uf.matdataV8[1]), inV[1], outputspaceV8[1]); \
    ++lsegspace_index;                                                            \
 }
 
 __kernel __attribute__ ((reqd_work_group_size(1, 1, 1)))
-   void tiled_spmv_kernel_AWGC(__global float *input,         /* pointer to input memory object in global memory */
-                               __global float *output,        /* pointer to output memory object in global memory */
+   void tiled_spmv_kernel_AWGC(__global real *input,          /* pointer to input memory object in global memory */
+                               __global real *output,         /* pointer to output memory object in global memory */
                                __global uint *matbuffer,      /* pointer to tiled matrix memory object in global memory */
                                __private uint column_span,    /* size of fixed chunks of the input vector */
                                __private uint slabspace,      /* size of the variable chunk of output vector to be computed */
                                __private uint segcachesize,   /* number of tiled matrix packets which will fit in "outputspace" */
                                __private uint num_header_packets,
-                               __local float *inputspace,     /* local buffer to hold staged input vector data */
-                               __local float *outputspace,    /* local buffer to hold computed output, to be written out at the end */
+                               __local real *inputspace,      /* local buffer to hold staged input vector data */
+                               __local real *outputspace,     /* local buffer to hold computed output, to be written out at the end */
                                __local packet *lsegspace)     /* local buffer to hold staged tiled matrix packet data */
 {
    __global slab_header *headptr;
-   __local float *work_input;
-   __local float8 *outputspaceV8;
+   __local real *work_input;
+   __local real8 *outputspaceV8;
    int i, tempmax;
    event_t eventS[2], eventI[2], eventO;
 
@@ -291,7 +428,7 @@ __kernel __attribute__ ((reqd_work_group_size(1, 1, 1)))
    GET_PACKET(segcachesize/2)
    tempmax = (segcachesize < npackets) ? segcachesize : npackets;
    for (i=0; i<slabspace; ++i) {
-      outputspace[i] = 0.0f; /* zero out the output buffer */
+      outputspace[i] = (real) 0; /* zero out the output buffer */
    }
 
    uint curr_input_offset = lsegptr->seg_input_offset;
@@ -331,8 +468,403 @@ __kernel __attribute__ ((reqd_work_group_size(1, 1, 1)))
 
    /* Now that processing is done, it's time to write out the final results for this slab. */
 
-   eventO = async_work_group_copy((__global float *) &output[headptr->outindex], (__const local float *) outputspace, (size_t) (headptr->outspan), (event_t) 0);
+   eventO = async_work_group_copy((__global real *) &output[headptr->outindex], (__const local real *) outputspace, (size_t) (headptr->outspan), (event_t) 0);
    wait_group_events(1, &eventO);
    wait_group_events(1, &eventI[1-inputspace_index]);
    wait_group_events(2, eventS);
 }
+
+/* ================================================================================================== */
+/* Multi-vector (SpMM) variants of the two kernels above.                                             */
+/*                                                                                                    */
+/* These multiply the tiled matrix by a block of NRHS right-hand sides at once.  NRHS is fixed when   */
+/* the program is built ("-DNRHS=4", 8 or 16), so that each block row is a single floatN vector.      */
+/* The input and output blocks are stored row-major: element (row, v) lives at [row * NRHS + v].      */
+/* Each packet's indices and matrix values are then decoded once and applied to all NRHS vectors,     */
+/* raising the arithmetic intensity of the kernel by up to a factor of NRHS.                          */
+/* ================================================================================================== */
+
+#ifdef NRHS
+#if defined(DOUBLE) || defined(MIXED)
+#error "the SpMM kernels are single precision only"
+#endif
+#if NRHS == 4
+#define floatK float4
+#elif NRHS == 8
+#define floatK float8
+#elif NRHS == 16
+#define floatK float16
+#else
+#error "NRHS must be 4, 8 or 16"
+#endif
+
+__kernel void tiled_spmm_kernel_LS(__global floatK *input,        /* pointer to input block in global memory */
+                                   __global floatK *output,       /* pointer to output block in global memory */
+                                   __global uint *matbuffer,      /* pointer to tiled matrix memory object in global memory */
+                                   __private uint column_span,    /* size of fixed chunks of the input vector */
+                                   __private uint slabspace,      /* size of the variable chunk of output vector to be computed */
+                                   __private uint team_size,      /* size of each "team" of local work units */
+                                   __private uint num_header_packets,
+                                   __local floatK *outputspace)   /* local buffer to hold computed output block rows */
+{
+   uint i, gunit, lunit, start, span, npackets, teamnum, n_teams, outindex, outspan;
+   __global slab_header *headptr;
+   __global floatK *work_input;
+   __global packet *gsegptr;
+   __global packet *gsegptr_stop;
+   __global floatK *outptr;
+   __local floatK *outptr16;
+
+   headptr = ((__global slab_header *) matbuffer) + get_global_id(1);
+   outspan = headptr->outspan;
+   outindex = headptr->outindex;
+   n_teams = get_local_size(0)/team_size;
+   gunit = get_local_id(0);
+   teamnum = gunit/team_size;
+   start = get_global_id(0);
+   span = get_global_size(0);
+
+   for (i = start; i < slabspace; i += span) {
+      outputspace[i] = (floatK) 0.0f;
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   gsegptr = &(((__global packet *) matbuffer)[headptr->offset]);
+   outptr = &output[outindex];
+
+   if (team_size == 16) {
+      lunit = gunit % team_size;
+      __global uint *first_team_offset;
+      first_team_offset = (__global uint *) gsegptr;
+      int temp_offset, temp_packetcount;
+      temp_offset = first_team_offset[teamnum] / 65536;
+      temp_packetcount = first_team_offset[teamnum] % 65536;
+      gsegptr += num_header_packets + temp_offset;
+      for (i=0; i<temp_packetcount; ++i) {
+         outptr16 = &outputspace[gsegptr->seg_output_offset];
+         work_input = &input[gsegptr->seg_input_offset];
+         outptr16[lunit] += gsegptr->uf.matdata[lunit] * work_input[gsegptr->input_offset_short[lunit]];
+         ++gsegptr;
+      }
+   }
+   else {
+      gsegptr += num_header_packets;
+      npackets = gsegptr->npackets_remaining;
+      int stopdex  = ((teamnum + 1) * npackets) / n_teams;
+      int startdex = ((teamnum    ) * npackets) / n_teams;
+      gsegptr_stop = &gsegptr[stopdex];
+      gsegptr = &gsegptr[startdex];
+      while (gsegptr < gsegptr_stop) {
+         outptr16 = &outputspace[gsegptr->seg_output_offset];
+         work_input = &input[gsegptr->seg_input_offset];
+         for (lunit=0; lunit<16; ++lunit) {
+            outptr16[lunit] += gsegptr->uf.matdata[lunit] * work_input[gsegptr->input_offset_short[lunit]];
+         }
+         ++gsegptr;
+      }
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for (i=start; i<outspan; i+=span) {
+      outptr[i] = outputspace[i];
+   }
+}
+
+#define GET_INPUT_K(_inputspace_index, _input_offset) {                                                       \
+   eventI[_inputspace_index] = async_work_group_copy(&inputspace[column_span * _inputspace_index],           \
+                                                     (const __global floatK *) &input[_input_offset],         \
+                                                     (size_t) column_span,                                    \
+                                                     (event_t) 0);                                            \
+}
+
+#define PROCESS_LOCAL_PACKET_K {                                                 \
+   lsegptr = (__local struct _packet *) &lsegspace[lsegspace_index];             \
+   if (lsegptr->seg_input_offset != curr_input_offset) {                         \
+       curr_input_offset = lsegptr->seg_input_offset;                            \
+       next_input_offset = lsegptr->future_seg_input_offset;                     \
+       GET_INPUT_K(inputspace_index, next_input_offset)                          \
+       inputspace_index = 1 - inputspace_index;                                  \
+       wait_group_events(1, &eventI[inputspace_index]);                          \
+   }                                                                             \
+   work_input = &inputspace[column_span * inputspace_index];                     \
+   outputspaceK = &outputspace[lsegptr->seg_output_offset];                      \
+   for (k=0; k<16; ++k) {                                                        \
+      outputspaceK[k] += lsegptr->uf.matdata[k] * work_input[lsegptr->input_offset_short[k]]; \
+   }                                                                             \
+   ++lsegspace_index;                                                            \
+}
+
+__kernel __attribute__ ((reqd_work_group_size(1, 1, 1)))
+   void tiled_spmm_kernel_AWGC(__global floatK *input,        /* pointer to input block in global memory */
+                               __global floatK *output,       /* pointer to output block in global memory */
+                               __global uint *matbuffer,      /* pointer to tiled matrix memory object in global memory */
+                               __private uint column_span,    /* size of fixed chunks of the input vector */
+                               __private uint slabspace,      /* size of the variable chunk of output vector to be computed */
+                               __private uint segcachesize,   /* number of tiled matrix packets which will fit in "outputspace" */
+                               __private uint num_header_packets,
+                               __local floatK *inputspace,    /* local buffer to hold staged input block rows */
+                               __local floatK *outputspace,   /* local buffer to hold computed output block rows */
+                               __local packet *lsegspace)     /* local buffer to hold staged tiled matrix packet data */
+{
+   __global slab_header *headptr;
+   __local floatK *work_input;
+   __local floatK *outputspaceK;
+   int i, k, tempmax;
+   event_t eventS[2], eventI[2], eventO;
+
+   __global packet *gsegptr;
+   __local  packet *lsegptr;
+
+   headptr = ((__global slab_header *) matbuffer) + get_global_id(0);
+   gsegptr = &(((__global packet *) matbuffer)[headptr->offset]);
+   gsegptr += num_header_packets;
+   lsegptr = &lsegspace[0];
+
+   int gseg_index = 0;
+   int inputspace_index = 0;
+   int lsegspace_index = 0;
+   int lsegspace_tag = 0;
+   GET_PACKET(0)
+   wait_group_events(1, &eventS[0]);
+   uint npackets = lsegptr->npackets_remaining;
+   if (npackets == 0) return;
+   GET_PACKET(segcachesize/2)
+   tempmax = (segcachesize < npackets) ? segcachesize : npackets;
+   for (i=0; i<slabspace; ++i) {
+      outputspace[i] = (floatK) 0.0f;
+   }
+
+   uint curr_input_offset = lsegptr->seg_input_offset;
+   uint next_input_offset = lsegptr->future_seg_input_offset;
+   GET_INPUT_K(0, curr_input_offset)
+   GET_INPUT_K(1, next_input_offset)
+   wait_group_events(1, &eventI[inputspace_index]);
+
+   while (npackets > tempmax) {
+      for (i=0; i<segcachesize/2; ++i) {
+         PROCESS_LOCAL_PACKET_K
+      }
+      lsegspace_index &= (segcachesize-1);
+      lsegspace_tag = (lsegspace_index == (segcachesize/2)) ? 1 : 0;
+      npackets -= segcachesize/2;
+      GET_PACKET((segcachesize/2)-lsegspace_index);
+      wait_group_events(1, &eventS[lsegspace_tag]);
+   }
+
+   while (npackets) {
+      PROCESS_LOCAL_PACKET_K
+      lsegspace_index &= (segcachesize-1);
+      lsegspace_tag = (lsegspace_index == (segcachesize/2)) ? 1 : 0;
+      --npackets;
+      if ((lsegspace_index & ((segcachesize/2)-1)) == 0) {
+         if (npackets > segcachesize/2) {
+            GET_PACKET((segcachesize/2)-lsegspace_index);
+         }
+         if (npackets > 0) {
+            wait_group_events(1, &eventS[lsegspace_tag]);
+         }
+      }
+   }
+
+   eventO = async_work_group_copy(&output[headptr->outindex], (__local const floatK *) outputspace, (size_t) (headptr->outspan), (event_t) 0);
+   wait_group_events(1, &eventO);
+   wait_group_events(1, &eventI[1-inputspace_index]);
+   wait_group_events(2, eventS);
+}
+#endif /* NRHS */
+
+/* ================================================================================================== */
+/* Vector kernels used by the iterative solvers.  The scalar coefficients (alpha, beta, norms) are    */
+/* never read back to the host; they are left in the small "scalars" buffer by vector_dot_finish      */
+/* and picked up from there by the update kernels, so the solver loop has no host round trips.        */
+/* ================================================================================================== */
+
+/* Per-work-group partial sums of a . b.  The local size must be a power of 2. */
+__kernel void vector_dot_partial(__global const float *a,
+                                 __global const float *b,
+                                 __private uint n,
+                                 __global float *partial,
+                                 __local float *scratch)
+{
+   uint i, lid, s;
+   float sum = 0.0f;
+
+   lid = get_local_id(0);
+   for (i = get_global_id(0); i < n; i += get_global_size(0)) {
+      sum = fma(a[i], b[i], sum);
+   }
+   scratch[lid] = sum;
+   barrier(CLK_LOCAL_MEM_FENCE);
+   for (s = get_local_size(0)/2; s > 0; s >>= 1) {
+      if (lid < s) scratch[lid] += scratch[lid + s];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   if (lid == 0) partial[get_group_id(0)] = scratch[0];
+}
+
+/* Single work unit: fold the partial sums into scalars[slot]. */
+__kernel void vector_dot_finish(__global const float *partial,
+                                __private uint ngroups,
+                                __global float *scalars,
+                                __private uint slot)
+{
+   uint i;
+   float sum = 0.0f;
+
+   for (i=0; i<ngroups; ++i) sum += partial[i];
+   scalars[slot] = sum;
+}
+
+/* y += sign * (scalars[num] / scalars[den]) * x */
+__kernel void vector_axpy(__global float *y,
+                          __global const float *x,
+                          __global const float *scalars,
+                          __private uint num,
+                          __private uint den,
+                          __private float sign,
+                          __private uint n)
+{
+   uint i = get_global_id(0);
+   float d = scalars[den];
+   float alpha = (d != 0.0f) ? sign * scalars[num] / d : 0.0f;
+
+   if (i < n) y[i] = fma(alpha, x[i], y[i]);
+}
+
+/* y = x + (scalars[num] / scalars[den]) * y */
+__kernel void vector_xpay(__global float *y,
+                          __global const float *x,
+                          __global const float *scalars,
+                          __private uint num,
+                          __private uint den,
+                          __private uint n)
+{
+   uint i = get_global_id(0);
+   float d = scalars[den];
+   float beta = (d != 0.0f) ? scalars[num] / d : 0.0f;
+
+   if (i < n) y[i] = fma(beta, y[i], x[i]);
+}
+
+/* y = x / sqrt(scalars[slot]) */
+__kernel void vector_scale(__global float *y,
+                           __global const float *x,
+                           __global const float *scalars,
+                           __private uint slot,
+                           __private uint n)
+{
+   uint i = get_global_id(0);
+   float nrm2 = scalars[slot];
+   float scale = (nrm2 > 0.0f) ? rsqrt(nrm2) : 0.0f;
+
+   if (i < n) y[i] = x[i] * scale;
+}
+
+/* y = 0, ahead of an SpMV kernel which accumulates into its output (tiled_spmv_kernel_LS_SYM). */
+__kernel void vector_zero(__global float *y,
+                          __private uint n)
+{
+   uint i = get_global_id(0);
+
+   if (i < n) y[i] = 0.0f;
+}
+
+/* ================================================================================================== */
+/* Kernels for the alternative sparse formats (see formats.c).  Like the tiled kernels, they take     */
+/* the input and output vectors as their first two arguments.                                         */
+/* ================================================================================================== */
+
+/* CSR-scalar: one work unit per row. */
+__kernel void spmv_csr_scalar(__global const float *input,
+                              __global float *output,
+                              __global const uint *row_ptr,
+                              __global const uint *col,
+                              __global const float *val,
+                              __private uint nrows)
+{
+   uint row = get_global_id(0);
+   uint j;
+   float sum = 0.0f;
+
+   if (row >= nrows) return;
+   for (j = row_ptr[row]; j < row_ptr[row+1]; ++j) {
+      sum = fma(val[j], input[col[j]], sum);
+   }
+   output[row] = sum;
+}
+
+/* CSR-vector: "lanes" consecutive work units (a power of 2 dividing the work group size) share a */
+/* row, striding through it together, and then reduce their partial sums in local memory.         */
+__kernel void spmv_csr_vector(__global const float *input,
+                              __global float *output,
+                              __global const uint *row_ptr,
+                              __global const uint *col,
+                              __global const float *val,
+                              __private uint nrows,
+                              __private uint lanes,
+                              __local float *scratch)
+{
+   uint lid = get_local_id(0);
+   uint lane = lid & (lanes - 1);
+   uint row = get_global_id(0) / lanes;
+   uint j, s;
+   float sum = 0.0f;
+
+   if (row < nrows) {
+      for (j = row_ptr[row] + lane; j < row_ptr[row+1]; j += lanes) {
+         sum = fma(val[j], input[col[j]], sum);
+      }
+   }
+   scratch[lid] = sum;
+   barrier(CLK_LOCAL_MEM_FENCE);
+   for (s = lanes/2; s > 0; s >>= 1) {
+      if (lane < s) scratch[lid] += scratch[lid + s];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   if (lane == 0 && row < nrows) output[row] = scratch[lid];
+}
+
+/* ELLPACK, column-major with the given stride; padding entries carry a zero value. */
+__kernel void spmv_ell(__global const float *input,
+                       __global float *output,
+                       __global const uint *col,
+                       __global const float *val,
+                       __private uint nrows,
+                       __private uint stride,
+                       __private uint width)
+{
+   uint row = get_global_id(0);
+   uint k, idx;
+   float sum = 0.0f;
+
+   if (row >= nrows) return;
+   for (k = 0, idx = row; k < width; ++k, idx += stride) {
+      sum = fma(val[idx], input[col[idx]], sum);
+   }
+   output[row] = sum;
+}
+
+/* SELL-C-sigma: work unit p handles the row in sorted position p.  Slices of C rows are stored */
+/* column-major starting at slice_ptr[slice], padded to the slice's longest row.                */
+__kernel void spmv_sell(__global const float *input,
+                        __global float *output,
+                        __global const uint *slice_ptr,
+                        __global const uint *col,
+                        __global const float *val,
+                        __global const uint *sell_row,
+                        __private uint C)
+{
+   uint p = get_global_id(0);
+   uint slice = p / C;
+   uint lane = p % C;
+   uint row = sell_row[p];
+   uint idx, end;
+   float sum = 0.0f;
+
+   if (row == 0xffffffff) return;
+   end = slice_ptr[slice+1];
+   for (idx = slice_ptr[slice] + lane; idx < end; idx += C) {
+      sum = fma(val[idx], input[col[idx]], sum);
+   }
+   output[row] = sum;
+}
@@ -12,10 +12,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <getopt.h>
 #include <libgen.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <math.h>
 
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
@@ -27,9 +30,43 @@
 #define KERNEL_LS      1    /* The "load/store" kernel. */
 #define KERNEL_AWGC    2    /* The "async work group copy" kernel. */
 
+#define FORMAT_AUTO    0    /* Choose a format from the row-length statistics of the matrix. */
+#define FORMAT_TILED   1    /* The tiled/packetized format, run by the LS or AWGC kernel. */
+#define FORMAT_CSR     2    /* CSR-scalar: one work unit per row. */
+#define FORMAT_CSRV    3    /* CSR-vector: a group of work units per row. */
+#define FORMAT_ELL     4    /* ELLPACK, column-major. */
+#define FORMAT_SELL    5    /* SELL-C-sigma: sorted, sliced ELLPACK. */
+#define FORMAT_INVALID 0xff
+
+#define PARTITION_ROWS 0    /* Split slabs by non-zero count (AWGC) or row count (LS on the CPU). */
+#define PARTITION_COST 1    /* Split slabs by a cost model of the bytes each one moves (see partition.c). */
+
+#define REORDER_NONE   0
+#define REORDER_RCM    1    /* Reverse Cuthill-McKee (see reorder.c). */
+#define REORDER_ND     2    /* Nested dissection by level-set bisection, RCM within the pieces. */
+
+#define SYNTH_NONE      0   /* Read the matrix from a Matrix Market file. */
+#define SYNTH_POISSON2D 1   /* 5-point Laplacian on an n x n grid (see matrix_synth.c). */
+#define SYNTH_POISSON3D 2   /* 7-point Laplacian on an n x n x n grid. */
+#define SYNTH_BANDED    3   /* Symmetric band, "param" diagonals either side of the main one. */
+#define SYNTH_RANDOM    4   /* "param" uniformly scattered columns per row. */
+#define SYNTH_POWERLAW  5   /* Scattered columns, Pareto distributed row lengths averaging "param". */
+#define SYNTH_BLOCKDIAG 6   /* Dense symmetric "param" x "param" blocks down the diagonal. */
+
+#define PRECISION_SINGLE 0  /* fp32 matrix, vectors and accumulation. */
+#define PRECISION_DOUBLE 1  /* fp64 matrix ("packet_dp"), vectors and accumulation. */
+#define PRECISION_MIXED  2  /* fp32 matrix, fp64 vectors and accumulation. */
+
+#define SOLVER_NONE    0
+#define SOLVER_CG      1    /* Conjugate Gradient (symmetric positive definite matrices). */
+#define SOLVER_POWER   2    /* Power iteration for the dominant eigenvalue. */
+
 #define MAX_WGSZ 1024       /* This constant should be a multiple of 512 */
 #define CPU_WGSZ 1          /* Work group size when running on a CPU (or an ACCELERATOR). */
 
+#define ZERO_COPY_ALIGN 4096 /* Host vectors shared with a CPU device start on a page boundary... */
+#define ZERO_COPY_ROUND 64   /* ...and are a whole number of cache lines long. */
+
 /* ============================================================================ */
 /* Macro to check success of each memory allocation.                            */
 /* ============================================================================ */
@@ -76,6 +113,20 @@ typedef struct _packet {
    float matdata[16];                /* the sixteen floating point matrix values encoded into this packet */
 } packet;
 
+/* The packet of a program built with -DDOUBLE: the same first 64 bytes, then fp64 matrix values. */
+typedef struct _packet_dp {
+   cl_uint seg_input_offset;
+   cl_uint future_seg_input_offset;
+   cl_uint npackets_remaining;
+   cl_uint seg_output_offset;
+   cl_uint pad1;
+   cl_uint pad2;
+   cl_uint pad3;
+   cl_uint pad4;
+   cl_ushort input_offset_short[16];
+   double matdata[16];
+} packet_dp;
+
 /* ============================================================================ */
 /* Communication structure between tiled matrix algorithm code and OpenCL code. */
 /* ============================================================================ */
@@ -87,6 +138,8 @@ typedef struct _matrix_gen_struct {
    unsigned int **row_index_array;
    unsigned int **x_index_array;
    float **data_array;
+   double **data_array_dp;           /* fp64 copy of data_array, as read or generated, for fp64 tiles; NULL otherwise */
+   double **matdata_dp;              /* out, with data_array_dp: the fp64 values of every packet in *seg_workspace, 16 each */
    unsigned int *nx_pad;
    unsigned int *nyround;
    unsigned int **slab_startrow; 
@@ -106,6 +159,16 @@ typedef struct _matrix_gen_struct {
    size_t kernel_wg_size;
    unsigned int *nslabs_round;
    unsigned int *memsize;
+   unsigned int partitioner;         /* PARTITION_ROWS or PARTITION_COST (AWGC and CPU LS only) */
+   float slab_scale;                 /* multiplier on the number of slabs the partitioner aims for */
+   unsigned int sym_storage;         /* tile only the upper triangle of a symmetric matrix (LS kernel only) */
+   unsigned int symmetric;           /* set by matrix_read: the tiles hold only the upper triangle */
+   unsigned int reorder;             /* REORDER_NONE, REORDER_RCM or REORDER_ND */
+   unsigned int **perm;              /* out: row k of the tiled matrix is row (*perm)[k] of the file, or NULL */
+   unsigned int synth;               /* SYNTH_NONE, or generate the matrix in place of reading file_name */
+   unsigned int synth_size;          /* grid edge (poisson) or number of rows (the others) */
+   unsigned int synth_param;         /* band width, row length, block size; 0 for the default */
+   unsigned int synth_seed;
 } matrix_gen_struct;
 
 /* ============================================================================ */
@@ -113,3 +176,264 @@ typedef struct _matrix_gen_struct {
 /* ============================================================================ */
 
 int matrix_gen(matrix_gen_struct *);
+int matrix_read(matrix_gen_struct *);
+int matrix_synth(matrix_gen_struct *);
+int matrix_synth_parse(const char *, matrix_gen_struct *);
+void matrix_shape(matrix_gen_struct *);
+int matrix_tile(matrix_gen_struct *);
+packet_dp *matrix_widen(slab_header *, unsigned int, unsigned int, const double *, unsigned int *);
+int matrix_reorder(matrix_gen_struct *);
+void reorder_vector(const unsigned int *, unsigned int, size_t, void *, int);
+
+unsigned int partition_cost(matrix_gen_struct *, unsigned int, unsigned int, unsigned int);
+int partition_autotune(matrix_gen_struct *, cl_context, cl_device_id, cl_kernel, unsigned int);
+
+/* ============================================================================ */
+/* Binary cache of the tiled matrix, so that reruns can skip matrix_gen.        */
+/* ============================================================================ */
+
+typedef struct _tile_cache_struct {
+   void *map;                        /* mapping of the cache file, or NULL */
+   size_t map_size;
+} tile_cache_struct;
+
+int tile_cache_key(matrix_gen_struct *, cl_ulong *);
+int tile_cache_load(const char *, cl_ulong, matrix_gen_struct *, tile_cache_struct *);
+int tile_cache_store(const char *, cl_ulong, matrix_gen_struct *);
+void tile_cache_release(tile_cache_struct *);
+
+/* ============================================================================ */
+/* Device-side state for the non-tiled formats (see formats.c).                 */
+/* ============================================================================ */
+
+typedef struct _format_struct {
+   unsigned int format;
+   cl_mem buffer[4];                 /* format arrays, in kernel argument order starting at argument 2 */
+   unsigned int nbuffers;
+   cl_uint ndims;
+   size_t global_work_size[3];
+   size_t local_work_size[3];
+   unsigned long long bytes;         /* size of the format arrays on the device */
+} format_struct;
+
+const char *format_name(unsigned int);
+unsigned int format_from_name(const char *);
+const char *format_kernel_name(unsigned int);
+unsigned int format_select(cl_device_type, unsigned int, unsigned int, unsigned int *);
+int format_setup(format_struct *, cl_context, cl_device_id, cl_device_type, cl_kernel,
+                 unsigned int, unsigned int, unsigned int *, unsigned int *, float *);
+void format_release(format_struct *);
+
+/* ============================================================================ */
+/* Format and kernel statistics (see stats.c).                                  */
+/* ============================================================================ */
+
+#define STATS_RUNS 20       /* Number of timed kernel runs in statistics mode. */
+#define BENCH_WARMUP 3      /* Untimed kernel runs before any timing. */
+#define BENCH_MIN_REPS 10
+#define BENCH_MAX_REPS 10000
+
+typedef struct _stats_struct {
+   const char *file_name;
+   const char *device_name;
+   const char *format;
+   const char *kernel;
+   const char *precision;
+   unsigned int nx, ny, non_zero, nrhs;
+   unsigned int stored_non_zero;     /* non-zeros the matrix data holds: only the upper triangle with symmetric storage */
+   unsigned int value_bytes;         /* size of one input or output vector element */
+   unsigned int packet_bytes;        /* size of one packet of the tiled format */
+   unsigned int nslabs;              /* tiled format only, zero otherwise */
+   unsigned int empty_slabs;
+   unsigned int data_packets;
+   unsigned int header_packets;
+   unsigned int pad_packets;
+   unsigned int min_slab_packets;
+   unsigned int max_slab_packets;
+   double fill;                      /* fraction of the data packet slots holding a non-zero */
+   unsigned long long matrix_bytes;
+   unsigned long long bytes_per_call;
+   double bytes_per_nnz;
+   unsigned int runs;
+   double kernel_ms_min;
+   double kernel_ms_avg;
+   double kernel_ms_median;
+   double kernel_ms_p95;
+   double gbs;
+   double gflops;
+} stats_struct;
+
+void stats_tiled(stats_struct *, slab_header *, unsigned int, unsigned int, unsigned int *, unsigned int *, const unsigned int *);
+double stats_event_ms(cl_event);
+void stats_report(stats_struct *, const char *);
+
+cl_int bench_kernel(cl_command_queue, cl_kernel, cl_uint, size_t *, size_t *, unsigned int, unsigned int, double, stats_struct *);
+void bench_summarize(double *, unsigned int, double, stats_struct *);
+void bench_csv(stats_struct *);
+
+/* ============================================================================ */
+/* Native multithreaded SpMV on the host CPU (see cpu_spmv.c).                  */
+/* ============================================================================ */
+
+#define CPU_LAYOUT_NONE 0
+#define CPU_LAYOUT_CSR  1   /* straight from the CSR arrays */
+#define CPU_LAYOUT_SELL 2   /* SELL-C-sigma, C = CPU_SELL_C */
+#define CPU_SELL_C      8   /* slice height: one AVX2 vector of rows */
+#define CPU_MAX_THREADS 256
+
+typedef struct _cpu_spmv_struct {
+   unsigned int layout;
+   unsigned int nthreads;
+   unsigned int ny;
+   unsigned int isa;                 /* instruction set picked at setup */
+   const char *isa_name;             /* "avx512", "avx2" or "scalar" */
+   const unsigned int *row_index_array;
+   const unsigned int *x_index_array;
+   const float *data_array;
+   unsigned int nslices;             /* SELL only */
+   unsigned int *slice_ptr;
+   unsigned int *sell_col;
+   unsigned int *sell_row;
+   float *sell_val;
+   unsigned int *bounds;             /* nthreads+1 row (CSR) or slice (SELL) boundaries, balanced by stored elements */
+   unsigned long long bytes;         /* matrix bytes read per multiply */
+   void *pool;                       /* the worker threads (see cpu_spmv.c) */
+} cpu_spmv_struct;
+
+int cpu_spmv_setup(cpu_spmv_struct *, unsigned int, unsigned int, unsigned int, unsigned int, unsigned int *, unsigned int *, float *);
+void cpu_spmv_run(cpu_spmv_struct *, const float *, float *);
+void cpu_spmv_bench(cpu_spmv_struct *, const float *, float *, unsigned int, unsigned int, double, stats_struct *);
+void cpu_spmv_release(cpu_spmv_struct *);
+
+/* ============================================================================ */
+/* Communication structure for the multi-device run (see multi.c).              */
+/* ============================================================================ */
+
+#define MULTI_PASSES 3      /* Partitioning passes: an even split, then re-splits by measured throughput. */
+#define MULTI_REPS   5      /* Timed kernel runs per pass. */
+
+typedef struct _multi_struct {
+   cl_platform_id platform;          /* platform of every device in "devices" */
+   const char *kernel_source;        /* spmv.cl, built for every device in "devices" */
+   const char *build_options;
+   const char *kernel_name;
+   unsigned int kernel_type;
+   cl_uint ndevices;
+   cl_device_id *devices;
+   slab_header *matrix_header;       /* host copy of the whole tiled matrix */
+   unsigned int nslabs_round;
+   unsigned int num_header_packets;
+   unsigned int *slab_startrow;
+   unsigned int column_span;
+   unsigned int max_slabheight;
+   unsigned int segcachesize;
+   unsigned int team_size;
+   size_t local_work_size0;          /* LS kernel only: work group size in dimension 0 */
+   unsigned int nrhs;
+   unsigned int nx_pad;
+   unsigned int ny;
+   const float *input;               /* nx_pad * nrhs, replicated on every device */
+   const float *reference;           /* host result to check the gathered output against, ny * nrhs */
+   unsigned int passes;
+   double wall_ms;                   /* out: fastest wall time of the last pass */
+} multi_struct;
+
+cl_uint multi_select_devices(cl_platform_id, cl_device_type, unsigned int, cl_device_id **, unsigned int *);
+void multi_release_devices(cl_device_id *, unsigned int);
+int spmv_multi(multi_struct *);
+cl_int tiled_kernel_args(cl_kernel, unsigned int, cl_mem, cl_mem, cl_mem, unsigned int, unsigned int, unsigned int, unsigned int,
+                         unsigned int, unsigned int, unsigned int);
+
+/* ============================================================================ */
+/* Communication structure between the OpenCL setup code and the solvers.       */
+/* ============================================================================ */
+
+typedef struct _solver_struct {
+   cl_context context;
+   cl_device_id device;
+   cl_device_type device_type;
+   cl_program program;               /* built from spmv.cl, so it also holds the vector kernels */
+   cl_kernel kernel;                 /* SpMV kernel, with every argument except input and output already set */
+   unsigned int accumulate;          /* the SpMV kernel adds into its output, which must be zeroed first */
+   unsigned int zero_copy;           /* "solution" is page-aligned and vector_length long; the device uses it in place */
+   cl_uint ndims;
+   size_t *global_work_size;
+   size_t *local_work_size;
+   unsigned int n;                   /* matrix dimension (the matrix must be square) */
+   unsigned int vector_length;       /* padded length of the device vectors */
+   unsigned int non_zero;
+   unsigned int solver_type;
+   unsigned int max_iterations;
+   float tolerance;
+   const float *rhs;                 /* right-hand side (CG) or starting vector (power iteration), length n */
+   float *solution;                  /* solution (CG) or eigenvector (power iteration), length n (see zero_copy) */
+   float eigenvalue;                 /* power iteration only */
+} solver_struct;
+
+int spmv_solve(solver_struct *);
+
+/* ============================================================================ */
+/* The SpMV library handle (see spmv_lib.c).  Opaque to users of spmv_lib.h;    */
+/* the spmv program reaches into it for its statistics, the solvers and the     */
+/* multi-device run.                                                            */
+/* ============================================================================ */
+
+struct _spmv_handle {
+   cl_platform_id platform;
+   cl_context context;
+   cl_device_id device;
+   cl_device_type device_type;
+   char *device_name;
+   cl_command_queue queue;
+   cl_program program;
+   cl_kernel kernel;
+   cl_kernel zero;                   /* vector_zero, for the accumulating symmetric kernel */
+   char kernel_name[32];
+   char build_options[64];
+   unsigned int kernel_type;
+   unsigned int format;              /* never FORMAT_AUTO once the handle is built */
+   format_struct fs;                 /* the device arrays of a format other than tiled */
+   unsigned int nrhs;
+   unsigned int precision;
+   size_t value_size;                /* bytes per vector element */
+   size_t packet_size;               /* bytes per packet of the tiles on the device */
+   unsigned int symmetric;           /* the kernel adds into its output, which is zeroed first */
+   unsigned int zero_copy;           /* the device works on host_input and host_output in place */
+   cl_mem matrix_buffer;
+   cl_mem input_buffer;
+   cl_mem output_buffer;
+   void *host_input, *host_output;   /* zero copy only: the page-aligned arrays behind the vector buffers */
+   unsigned int vectors_mapped;      /* zero copy only: host_input and host_output are mapped for the host */
+   unsigned int nx, ny, non_zero;
+   unsigned int nx_pad, nyround;
+   unsigned int output_rows;         /* rows covered by the slabs (at least ny) */
+   cl_uint ndims;
+   size_t global_work_size[3];
+   size_t local_work_size[3];
+   unsigned int *perm;               /* row k of the tiles is row perm[k] of the file, or NULL */
+   void *staging_x, *staging_y;      /* x and y in the reordered numbering */
+
+   /* The host copy of the matrix, kept only with spmv_options.keep_matrix. */
+   unsigned int *row_index_array;    /* CSR, in the file's numbering */
+   unsigned int *x_index_array;
+   float *data_array;
+   double *data_array_dp;            /* double precision only */
+   slab_header *matrix_header;       /* fp32 tiles, in seg_workspace or the tile cache mapping */
+   slab_header *tiles;               /* the tiles as uploaded: matrix_header, or tiles_dp */
+   packet_dp *tiles_dp;
+   packet *seg_workspace;
+   double *matdata_dp;
+   tile_cache_struct tcs;
+   unsigned int *slab_startrow;
+   unsigned int nslabs_round;
+   unsigned int num_header_packets;
+   unsigned int column_span;
+   unsigned int max_slabheight;
+   unsigned int segcachesize;
+   unsigned int team_size;
+};
+
+double wall_time(void);
+char *load_program_source(const char *);
+void *zero_copy_alloc(size_t);
+const char *precision_name(unsigned int);
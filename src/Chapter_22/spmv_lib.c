@@ -0,0 +1,710 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+#include "spmv_lib.h"
+
+/* ================================================================================= */
+/* The SpMV library: the single-device path of the spmv program, behind a handle,    */
+/* so that an iterative method can multiply by the same matrix many times.  The      */
+/* spmv program runs its own single-device multiply through here as well.            */
+/*                                                                                   */
+/* spmv_create() does everything the program does once per run: device selection,    */
+/* the program build, matrix_gen (or a tile cache hit), the choice of format, and    */
+/* the upload of the matrix.  The handle then owns the context, an in-order queue,   */
+/* the kernel with its matrix arguments already set, and resident input and output   */
+/* buffers, so each spmv_apply() is one write, one kernel and one read.              */
+/*                                                                                   */
+/* Every host array the matrix modules hand back is owned by the handle from the     */
+/* moment it is made, so spmv_destroy() frees it on any failure path as well.        */
+/* Failures here, in the format setup, the autotuner and the kernel arguments are    */
+/* reported and returned.  Only the matrix reader and tiler underneath (matrix_gen)  */
+/* still exit when they run out of memory, as they do in the program.                */
+/* ================================================================================= */
+
+#define LIB_CHECK(_string) {                        \
+   if (rc != CL_SUCCESS) {                          \
+      printf("%s failed. rc = %d\n", _string, rc);  \
+      spmv_destroy(h);                              \
+      return NULL;                                  \
+   }                                                \
+}
+
+/* As MEMORY_ALLOC_CHECK, but failing the handle rather than the program. */
+#define LIB_ALLOC_CHECK(_addr, _len, _addrstr) {                                                      \
+   (_addr) = NULL;                                                                                   \
+   if (posix_memalign((void **) &(_addr), preferred_alignment, _len) != 0 || (_addr) == NULL) {      \
+      printf("Failed allocation of %lld bytes for %s\n", (unsigned long long) (_len), _addrstr);     \
+      (_addr) = NULL;                                                                                \
+      spmv_destroy(h);                                                                               \
+      return NULL;                                                                                   \
+   }                                                                                                 \
+}
+
+/* ================================================================================================== */
+/* Load_program_source.                                                                              */
+/* Read in the kernel source from an external file.                                                   */
+/* ================================================================================================== */
+
+char *load_program_source(const char *filename)
+{
+  struct stat statbuf;
+
+  FILE *fh = fopen(filename, "r");
+  if (fh == 0) {
+    fprintf(stderr, "Couldn't open %s\n", filename);
+    return NULL;
+  }
+
+  stat(filename, &statbuf);
+  char *source = (char *) malloc(statbuf.st_size + 1);
+  if (source == NULL) {
+    fprintf(stderr, "malloc failed\n");
+    fclose(fh);
+    return NULL;
+  }
+
+  fread(source, statbuf.st_size, 1, fh);
+  source[statbuf.st_size] = '\0';
+  fclose(fh);
+
+  return source;
+}
+
+/* ================================================================================================== */
+/* Wall clock time in seconds, used to report host-side setup times.                                 */
+/* ================================================================================================== */
+
+double wall_time(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (double) tv.tv_sec + 1.0e-6 * (double) tv.tv_usec;
+}
+
+/* ================================================================================================== */
+/* Page-aligned host allocation, rounded up to whole cache lines, for CL_MEM_USE_HOST_PTR buffers.    */
+/* CPU implementations generally only work on a host array in place when it is aligned like this.     */
+/* Returns NULL, having said so, on failure.                                                          */
+/* ================================================================================================== */
+
+void *zero_copy_alloc(size_t size)
+{
+   void *p = NULL;
+   size = (size + ZERO_COPY_ROUND - 1) & ~((size_t) ZERO_COPY_ROUND - 1);
+   if (posix_memalign(&p, ZERO_COPY_ALIGN, size) != 0 || p == NULL) {
+      printf("Failed allocation of %lld bytes for %s\n", (unsigned long long) size, "zero-copy vector");
+      return NULL;
+   }
+   memset(p, 0, size);
+   return p;
+}
+
+const char *precision_name(unsigned int precision)
+{
+   static const char *names[3] = {"single", "double", "mixed"};
+   return (precision <= PRECISION_MIXED) ? names[precision] : "unknown";
+}
+
+void spmv_default_options(spmv_options *opts)
+{
+   memset(opts, 0, sizeof(*opts));
+   opts->device_type = CL_DEVICE_TYPE_DEFAULT;
+   opts->kernel_type = KERNEL_DEFAULT;
+   opts->partitioner = PARTITION_ROWS;
+   opts->reorder = REORDER_NONE;
+   opts->format = FORMAT_TILED;
+   opts->nrhs = 1;
+   opts->precision = PRECISION_SINGLE;
+}
+
+/* Find a device of the requested type (the last one).  For CL_DEVICE_TYPE_DEFAULT, make the */
+/* program's choice: the last accelerator, else the first GPU, else the last CPU.            */
+static int find_device(cl_device_type device_type, cl_platform_id *platform_id, cl_device_id *device_id, cl_device_type *found_type)
+{
+   cl_platform_id platforms[16];
+   cl_device_id devices[64];
+   cl_uint num_platforms, num_devices, i, j;
+   int rank, best = 0;
+
+   if (clGetPlatformIDs(16, platforms, &num_platforms) != CL_SUCCESS) return -1;
+   if (num_platforms > 16) num_platforms = 16;
+   for (i=0; i<num_platforms; ++i) {
+      if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 64, devices, &num_devices) != CL_SUCCESS) continue;
+      if (num_devices > 64) num_devices = 64;
+      for (j=0; j<num_devices; ++j) {
+         cl_device_type type;
+         clGetDeviceInfo(devices[j], CL_DEVICE_TYPE, sizeof(cl_device_type), &type, NULL);
+         /* A later device replaces an earlier one of equal rank, except among the GPUs, where the first is kept. */
+         if (device_type != CL_DEVICE_TYPE_DEFAULT) rank = (type == device_type);
+         else if (type == CL_DEVICE_TYPE_ACCELERATOR) rank = 3;
+         else if (type == CL_DEVICE_TYPE_GPU) rank = (best == 2) ? 0 : 2;
+         else if (type == CL_DEVICE_TYPE_CPU) rank = 1;
+         else rank = 0;
+         if (rank > 0 && rank >= best) {
+            best = rank;
+            *platform_id = platforms[i];
+            *device_id = devices[j];
+            *found_type = type;
+         }
+      }
+   }
+   return (best > 0) ? 0 : -1;
+}
+
+/* Free the host copy of the matrix.  The permutation stays, since every multiply needs it. */
+static void release_host_matrix(spmv_handle *h)
+{
+   free(h->row_index_array);
+   free(h->x_index_array);
+   free(h->data_array);
+   free(h->data_array_dp);
+   free(h->seg_workspace);
+   free(h->matdata_dp);
+   free(h->tiles_dp);
+   free(h->slab_startrow);
+   tile_cache_release(&h->tcs);
+   h->row_index_array = h->x_index_array = h->slab_startrow = NULL;
+   h->data_array = NULL;
+   h->data_array_dp = h->matdata_dp = NULL;
+   h->seg_workspace = NULL;
+   h->tiles_dp = NULL;
+   h->matrix_header = h->tiles = NULL;
+}
+
+/* Zero copy: map the vector buffers for the host, or unmap them for the kernel.  Mapping a buffer   */
+/* created on a host array (CL_MEM_USE_HOST_PTR) returns that array, so nothing is copied on a CPU. */
+static cl_int map_vectors(spmv_handle *h, cl_bool blocking, cl_event *done)
+{
+   void *x, *y;
+   cl_int rc;
+
+   x = clEnqueueMapBuffer(h->queue, h->input_buffer, CL_FALSE, CL_MAP_WRITE, 0, (size_t) h->nx_pad * h->nrhs * h->value_size,
+                          0, NULL, NULL, &rc);
+   if (rc != CL_SUCCESS) return rc;
+   y = clEnqueueMapBuffer(h->queue, h->output_buffer, blocking, CL_MAP_READ, 0, (size_t) h->output_rows * h->nrhs * h->value_size,
+                          0, NULL, done, &rc);
+   if (rc != CL_SUCCESS) return rc;
+   if (x != h->host_input || y != h->host_output) return CL_INVALID_OPERATION;
+   h->vectors_mapped = 1;
+   return CL_SUCCESS;
+}
+
+static cl_int unmap_vectors(spmv_handle *h)
+{
+   cl_int rc;
+
+   rc = clEnqueueUnmapMemObject(h->queue, h->input_buffer, h->host_input, 0, NULL, NULL);
+   if (rc != CL_SUCCESS) return rc;
+   rc = clEnqueueUnmapMemObject(h->queue, h->output_buffer, h->host_output, 0, NULL, NULL);
+   if (rc != CL_SUCCESS) return rc;
+   h->vectors_mapped = 0;
+   return CL_SUCCESS;
+}
+
+/* ================================================================================= */
+/* Create a handle for a Matrix Market file.                                         */
+/* ================================================================================= */
+
+spmv_handle *spmv_create(const char *file_name, const spmv_options *opts)
+{
+   spmv_handle *h;
+   cl_int rc;
+   unsigned int kernel_type, format;
+   char *source;
+   size_t param_size;
+   cl_uint preferred_alignment = 16; // used by "LIB_ALLOC_CHECK" macro
+
+   h = (spmv_handle *) calloc(1, sizeof(spmv_handle));
+   if (h == NULL) return NULL;
+   h->nrhs = (opts->nrhs > 0) ? opts->nrhs : 1;
+   h->precision = opts->precision;
+   h->value_size = (h->precision == PRECISION_SINGLE) ? sizeof(float) : sizeof(double);
+   h->packet_size = (h->precision == PRECISION_DOUBLE) ? sizeof(packet_dp) : sizeof(packet);
+   h->zero_copy = opts->zero_copy;
+
+   if (find_device(opts->device_type, &h->platform, &h->device, &h->device_type) != 0) {
+      printf("spmv_create: no devices of the requested type were found\n");
+      spmv_destroy(h);
+      return NULL;
+   }
+
+   /* An explicit choice of tiled kernel, or anything only the tiled kernels do, implies the tiled format. */
+   format = opts->format;
+   if (format == FORMAT_AUTO && (opts->kernel_type != KERNEL_DEFAULT || h->nrhs > 1 || h->precision != PRECISION_SINGLE ||
+                                 opts->sym_storage || opts->reorder != REORDER_NONE)) {
+      format = FORMAT_TILED;
+   }
+   kernel_type = opts->kernel_type;
+   if (kernel_type == KERNEL_DEFAULT) {
+      kernel_type = (h->device_type == CL_DEVICE_TYPE_ACCELERATOR && !opts->sym_storage) ? KERNEL_AWGC : KERNEL_LS;
+   }
+   h->kernel_type = kernel_type;
+   if (format != FORMAT_TILED && (h->nrhs > 1 || h->precision != PRECISION_SINGLE || opts->reorder != REORDER_NONE)) {
+      printf("spmv_create: block, fp64 and reordered multiplies need the tiled format\n");
+      spmv_destroy(h);
+      return NULL;
+   }
+   if (h->nrhs > 1 && h->precision != PRECISION_SINGLE) {
+      printf("spmv_create: the block (SpMM) kernels are single precision only\n");
+      spmv_destroy(h);
+      return NULL;
+   }
+   if (opts->autotune && h->precision != PRECISION_SINGLE) {
+      printf("spmv_create: the autotuner times single precision tiles only\n");
+      spmv_destroy(h);
+      return NULL;
+   }
+   if (opts->sym_storage && (kernel_type != KERNEL_LS || format != FORMAT_TILED)) {
+      printf("spmv_create: symmetric storage needs the tiled format and the LS kernel\n");
+      spmv_destroy(h);
+      return NULL;
+   }
+   /* A discrete device cannot work on host memory in place, so zero copy is for CPU devices. */
+   if (h->zero_copy && h->device_type != CL_DEVICE_TYPE_CPU) {
+      printf("spmv_create: zero copy is only supported on a CPU device\n");
+      spmv_destroy(h);
+      return NULL;
+   }
+
+   rc = clGetDeviceInfo(h->device, CL_DEVICE_NAME, 0, NULL, &param_size);
+   LIB_CHECK("clGetDeviceInfo(size of CL_DEVICE_NAME)")
+   LIB_ALLOC_CHECK(h->device_name, param_size, "device name")
+   rc = clGetDeviceInfo(h->device, CL_DEVICE_NAME, param_size, h->device_name, NULL);
+   LIB_CHECK("clGetDeviceInfo(CL_DEVICE_NAME)")
+
+   /* fp64 arithmetic is an optional extension of OpenCL 1.x. */
+   if (h->precision != PRECISION_SINGLE) {
+      char *extensions;
+      rc = clGetDeviceInfo(h->device, CL_DEVICE_EXTENSIONS, 0, NULL, &param_size);
+      LIB_CHECK("clGetDeviceInfo(size of CL_DEVICE_EXTENSIONS)")
+      LIB_ALLOC_CHECK(extensions, param_size, "device extensions")
+      rc = clGetDeviceInfo(h->device, CL_DEVICE_EXTENSIONS, param_size, extensions, NULL);
+      int has_fp64 = (rc == CL_SUCCESS && strstr(extensions, "cl_khr_fp64") != NULL);
+      free(extensions);
+      LIB_CHECK("clGetDeviceInfo(CL_DEVICE_EXTENSIONS)")
+      if (!has_fp64) {
+         printf("spmv_create: this device does not support double precision (cl_khr_fp64)\n");
+         spmv_destroy(h);
+         return NULL;
+      }
+   }
+
+   /* ================================================================== */
+   /* Context, in-order queue and program.                               */
+   /* ================================================================== */
+
+   cl_context_properties properties[3];
+   properties[0] = CL_CONTEXT_PLATFORM;
+   properties[1] = (cl_context_properties) h->platform;
+   properties[2] = 0;
+   h->context = clCreateContext(properties, 1, &h->device, NULL, NULL, &rc);
+   LIB_CHECK("clCreateContext")
+   h->queue = clCreateCommandQueue(h->context, h->device, opts->profiling ? CL_QUEUE_PROFILING_ENABLE : 0, &rc);
+   LIB_CHECK("clCreateCommandQueue")
+
+   source = load_program_source((opts->kernel_source != NULL) ? opts->kernel_source : "spmv.cl");
+   if (source == NULL) {
+      spmv_destroy(h);
+      return NULL;
+   }
+   h->program = clCreateProgramWithSource(h->context, 1, (const char **) &source, NULL, &rc);
+   free(source);
+   LIB_CHECK("clCreateProgramWithSource")
+   /* The SpMM kernels are specialized on the block width when the program is built, */
+   /* and the tiled kernels on their precision.                                      */
+   h->build_options[0] = '\0';
+   if (h->nrhs > 1) sprintf(h->build_options + strlen(h->build_options), " -DNRHS=%d", h->nrhs);
+   if (h->precision == PRECISION_DOUBLE) strcat(h->build_options, " -DDOUBLE");
+   if (h->precision == PRECISION_MIXED) strcat(h->build_options, " -DMIXED");
+   rc = clBuildProgram(h->program, 1, &h->device, h->build_options, NULL, NULL);
+   LIB_CHECK("clBuildProgram")
+
+   if (kernel_type == KERNEL_AWGC) {
+      strcpy(h->kernel_name, (h->nrhs > 1) ? "tiled_spmm_kernel_AWGC" : "tiled_spmv_kernel_AWGC");
+   }
+   else {
+      strcpy(h->kernel_name, (h->nrhs > 1) ? "tiled_spmm_kernel_LS" : (opts->sym_storage ? "tiled_spmv_kernel_LS_SYM" : "tiled_spmv_kernel_LS"));
+   }
+   h->kernel = clCreateKernel(h->program, h->kernel_name, &rc);
+   LIB_CHECK("clCreateKernel")
+
+   printf("We'll run kernel %s on device %s\n", ((kernel_type == KERNEL_LS) ? "kernel_ls" : "kernel_awgc"), h->device_name);
+   if (h->nrhs > 1) printf("multiplying by a block of %d right-hand sides\n", h->nrhs);
+   if (h->precision != PRECISION_SINGLE) printf("running in %s precision\n", precision_name(h->precision));
+
+   /* ================================================================== */
+   /* Device parameters which shape the tiles.                           */
+   /* ================================================================== */
+
+   size_t kernel_wg_size;
+   cl_ulong total_local_mem, used_local_mem, local_mem_size;
+   cl_uint max_compute_units;
+   int gpu_wgsz = (opts->gpu_wgsz > 0) ? opts->gpu_wgsz : MAX_WGSZ;
+
+   rc = clGetDeviceInfo(h->device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(cl_uint), &preferred_alignment, NULL);
+   LIB_CHECK("clGetDeviceInfo(CL_DEVICE_MEM_BASE_ADDR_ALIGN)")
+   if (preferred_alignment > 1024) preferred_alignment = 1024;
+   preferred_alignment /= 8;  /* Convert from units of bits to units of bytes. */
+   rc = clGetKernelWorkGroupInfo(h->kernel, h->device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_wg_size, NULL);
+   LIB_CHECK("clGetKernelWorkGroupInfo(CL_KERNEL_WORK_GROUP_SIZE)")
+   rc = clGetDeviceInfo(h->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &total_local_mem, NULL);
+   LIB_CHECK("clGetDeviceInfo(CL_DEVICE_LOCAL_MEM_SIZE)")
+   rc = clGetKernelWorkGroupInfo(h->kernel, h->device, CL_KERNEL_LOCAL_MEM_SIZE, sizeof(cl_ulong), &used_local_mem, NULL);
+   LIB_CHECK("clGetKernelWorkGroupInfo(CL_KERNEL_LOCAL_MEM_SIZE)")
+   rc = clGetDeviceInfo(h->device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &max_compute_units, NULL);
+   LIB_CHECK("clGetDeviceInfo(CL_DEVICE_MAX_COMPUTE_UNITS)")
+   local_mem_size = total_local_mem - used_local_mem;
+
+   /* ================================================================== */
+   /* Build (or map in) the tiled matrix, straight into the handle.      */
+   /* ================================================================== */
+
+   matrix_gen_struct mgs;
+   unsigned int memsize;
+
+   memset(&mgs, 0, sizeof(mgs));
+   mgs.matrix_header = &h->matrix_header;
+   mgs.seg_workspace = &h->seg_workspace;
+   mgs.num_header_packets = &h->num_header_packets;
+   mgs.row_index_array = &h->row_index_array;
+   mgs.x_index_array = &h->x_index_array;
+   mgs.data_array = &h->data_array;
+   /* fp64 tiles are built from the fp64 values in the file (or from the generator), never from rounded ones. */
+   mgs.data_array_dp = (h->precision == PRECISION_DOUBLE) ? &h->data_array_dp : NULL;
+   mgs.matdata_dp = &h->matdata_dp;
+   mgs.nx_pad = &h->nx_pad;
+   mgs.nyround = &h->nyround;
+   mgs.slab_startrow = &h->slab_startrow;
+   mgs.nx = &h->nx;
+   mgs.ny = &h->ny;
+   mgs.non_zero = &h->non_zero;
+   mgs.file_name = (char *) file_name;
+   mgs.preferred_alignment = preferred_alignment;
+   mgs.max_compute_units = &max_compute_units;
+   mgs.kernel_type = kernel_type;
+   mgs.column_span = &h->column_span;
+   /* Every row of the local input and output staging areas is nrhs values wide when multiplying  */
+   /* a block, so the tiles are shaped as if the device had only 1/nrhs of its local memory.      */
+   /* fp64 vectors count double; that also covers the fp64 packets, which are only 1.5 times as  */
+   /* large as the fp32 ones.                                                                     */
+   unsigned int local_scale = h->nrhs * (unsigned int) (h->value_size / sizeof(float));
+   mgs.local_mem_size = (unsigned int) (local_mem_size / local_scale);
+   if (local_scale > 1 && h->device_type == CL_DEVICE_TYPE_GPU) {
+      while (gpu_wgsz > 16 && (cl_ulong) gpu_wgsz * h->nrhs * h->value_size > local_mem_size) gpu_wgsz /= 2;
+   }
+   mgs.segcachesize = &h->segcachesize;
+   mgs.max_slabheight = &h->max_slabheight;
+   mgs.device_type = h->device_type;
+   mgs.gpu_wgsz = &gpu_wgsz;
+   mgs.kernel_wg_size = kernel_wg_size;
+   mgs.nslabs_round = &h->nslabs_round;
+   mgs.memsize = &memsize;
+   mgs.partitioner = opts->partitioner;
+   mgs.slab_scale = 1.0f;
+   mgs.sym_storage = opts->sym_storage;
+   mgs.reorder = opts->reorder;
+   mgs.perm = &h->perm;
+   if (matrix_synth_parse(file_name, &mgs) != 0) mgs.synth = SYNTH_NONE;
+
+   /* If a tile cache is in use, and it holds this matrix already built for these device  */
+   /* parameters, map it in rather than parsing and tiling the Matrix Market file again. */
+   cl_ulong cache_key = 0;
+   int cache_hit = 0;
+   double setup_start = wall_time();
+   if (opts->cache_dir != NULL) {
+      if (tile_cache_key(&mgs, &cache_key) != 0) {
+         printf("Error opening maxtrix file %s\n", file_name);
+         spmv_destroy(h);
+         return NULL;
+      }
+      cache_hit = (tile_cache_load(opts->cache_dir, cache_key, &mgs, &h->tcs) == 0);
+   }
+   if (!cache_hit) {
+      if (matrix_gen(&mgs) != 0) {
+         printf("spmv_create: could not read or generate matrix %s\n", file_name);
+         spmv_destroy(h);
+         return NULL;
+      }
+      if (opts->cache_dir != NULL) tile_cache_store(opts->cache_dir, cache_key, &mgs);
+   }
+   printf("tiled matrix ready in %.3f ms%s\n", 1000.0 * (wall_time() - setup_start), cache_hit ? " (cached)" : "");
+   h->symmetric = mgs.symmetric;
+
+   /* ================================================================== */
+   /* Settle on the sparse format.  For anything other than the tiled    */
+   /* format, swap in that format's kernel and build its arrays from the */
+   /* CSR copy of the matrix.                                            */
+   /* ================================================================== */
+
+   if (format == FORMAT_AUTO) {
+      format = format_select(h->device_type, h->ny, h->non_zero, h->row_index_array);
+   }
+   h->format = format;
+   if (format != FORMAT_TILED) {
+      clReleaseKernel(h->kernel);
+      strcpy(h->kernel_name, format_kernel_name(format));
+      h->kernel = clCreateKernel(h->program, h->kernel_name, &rc);
+      LIB_CHECK("clCreateKernel(format)")
+      h->fs.format = format;
+      if (format_setup(&h->fs, h->context, h->device, h->device_type, h->kernel,
+                       h->ny, h->non_zero, h->row_index_array, h->x_index_array, h->data_array) != 0) {
+         spmv_destroy(h);
+         return NULL;
+      }
+      printf("We'll run kernel %s (%s format) instead\n", h->kernel_name, format_name(format));
+   }
+
+   /* A matrix file that is not marked symmetric was tiled in full, and needs the plain LS kernel. */
+   if (opts->sym_storage && !h->symmetric) {
+      printf("%s is not a symmetric matrix; storing it in full\n", file_name);
+      clReleaseKernel(h->kernel);
+      strcpy(h->kernel_name, "tiled_spmv_kernel_LS");
+      h->kernel = clCreateKernel(h->program, h->kernel_name, &rc);
+      LIB_CHECK("clCreateKernel(LS)")
+   }
+   if (h->symmetric) {
+      cl_uint n = h->ny;
+      h->zero = clCreateKernel(h->program, "vector_zero", &rc);
+      LIB_CHECK("clCreateKernel(vector_zero)")
+      rc = clSetKernelArg(h->zero, 1, sizeof(cl_uint), &n);
+      LIB_CHECK("clSetKernelArg(vector_zero)")
+   }
+
+   /* On the GPU, the LS kernel's slabs are one work group high, so there is nothing to tune. */
+   if (opts->autotune && format == FORMAT_TILED) {
+      if (kernel_type == KERNEL_LS && h->device_type == CL_DEVICE_TYPE_GPU) {
+         printf("autotune: the GPU LS kernel's slabs follow the work group size; use -l to tune it\n");
+      }
+      else if (partition_autotune(&mgs, h->context, h->device, h->kernel, h->nrhs) != 0) {
+         spmv_destroy(h);
+         return NULL;
+      }
+   }
+
+   /* ================================================================== */
+   /* Work sizes, fixed for the life of the handle.                      */
+   /* ================================================================== */
+
+   unsigned int i;
+   h->team_size = (h->device_type == CL_DEVICE_TYPE_GPU) ? 16 : 1;
+   if (format != FORMAT_TILED) {
+      h->ndims = h->fs.ndims;
+      for (i=0; i<h->ndims; ++i) {
+         h->global_work_size[i] = h->fs.global_work_size[i];
+         h->local_work_size[i] = h->fs.local_work_size[i];
+      }
+   }
+   else if (kernel_type == KERNEL_AWGC) {
+      h->ndims = 1;
+      h->global_work_size[0] = h->nslabs_round;
+      h->local_work_size[0] = 1;
+   }
+   else {
+      h->ndims = 2;
+      h->global_work_size[0] = h->local_work_size[0] = (h->device_type == CL_DEVICE_TYPE_GPU) ? gpu_wgsz : CPU_WGSZ;
+      h->global_work_size[1] = h->nslabs_round;
+      h->local_work_size[1] = 1;
+      if (h->local_work_size[0] > kernel_wg_size) {
+         while (h->local_work_size[0] > kernel_wg_size) {
+            h->local_work_size[0] /= 2;
+            h->global_work_size[0] /= 2;
+         }
+         printf("coercing work group size to fit within hardware limits.  New size is %d\n", (int) h->local_work_size[0]);
+      }
+   }
+
+   /* ================================================================== */
+   /* Resident buffers, with the matrix uploaded once.                   */
+   /* ================================================================== */
+
+   /* In double precision the finished tiles are widened to fp64 packets first, with the fp64 values kept by matrix_tile. */
+   h->tiles = h->matrix_header;
+   if (h->precision == PRECISION_DOUBLE) {
+      h->tiles_dp = matrix_widen(h->matrix_header, h->nslabs_round, h->num_header_packets, h->matdata_dp, &memsize);
+      h->tiles = (slab_header *) h->tiles_dp;
+   }
+
+   /* A handle for the host copy of the tiles alone (to split across devices, say) stops here. */
+   if (opts->tiles_only) {
+      return h;
+   }
+
+   /* The header occupies the front of the tiles, so "tiles" addresses the whole of it, whether it   */
+   /* was just built in "seg_workspace", is being read straight out of the tile cache, or is the fp64 */
+   /* copy made by matrix_widen().  "memsize" adds room for the kernels to read past the end.         */
+   /* The other formats built their own buffers in format_setup().                                    */
+   if (format == FORMAT_TILED) {
+      h->matrix_buffer = clCreateBuffer(h->context, CL_MEM_READ_ONLY, memsize, NULL, &rc);
+      LIB_CHECK("clCreateBuffer(matrix)")
+      rc = clEnqueueWriteBuffer(h->queue, h->matrix_buffer, CL_TRUE, 0, h->packet_size * h->tiles[h->nslabs_round].offset,
+                                h->tiles, 0, NULL, NULL);
+      LIB_CHECK("clEnqueueWriteBuffer(matrix)")
+   }
+
+   /* The padding of the input, and rows no slab writes, must read as zero.  With zero copy the    */
+   /* vectors live in page-aligned host arrays, which a CPU device uses in place, and which stay   */
+   /* mapped for the host between multiplies (see spmv_vectors()).                                  */
+   size_t input_size = (size_t) h->nx_pad * h->nrhs * h->value_size;
+   h->output_rows = h->slab_startrow[h->nslabs_round] - h->slab_startrow[0];
+   size_t output_size = (size_t) h->output_rows * h->nrhs * h->value_size;
+   if (h->zero_copy) {
+      h->host_input = zero_copy_alloc(input_size);
+      h->host_output = zero_copy_alloc(output_size);
+      if (h->host_input == NULL || h->host_output == NULL) {
+         spmv_destroy(h);
+         return NULL;
+      }
+      h->input_buffer = clCreateBuffer(h->context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, input_size, h->host_input, &rc);
+      LIB_CHECK("clCreateBuffer(input)")
+      h->output_buffer = clCreateBuffer(h->context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, output_size, h->host_output, &rc);
+      LIB_CHECK("clCreateBuffer(output)")
+   }
+   else {
+      void *zero;
+      size_t zero_size = (input_size > output_size) ? input_size : output_size;
+      LIB_ALLOC_CHECK(zero, zero_size, "zero vector")
+      memset(zero, 0, zero_size);
+      h->input_buffer = clCreateBuffer(h->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, input_size, zero, &rc);
+      if (rc == CL_SUCCESS) {
+         h->output_buffer = clCreateBuffer(h->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, output_size, zero, &rc);
+      }
+      free(zero);
+      LIB_CHECK("clCreateBuffer(vectors)")
+   }
+
+   /* Arguments from 2 on describe the matrix, and were set by format_setup() for the other formats. */
+   if (format == FORMAT_TILED) {
+      rc = tiled_kernel_args(h->kernel, kernel_type, h->input_buffer, h->output_buffer, h->matrix_buffer, h->column_span,
+                             h->max_slabheight, h->team_size, h->segcachesize, h->num_header_packets, h->nrhs, h->precision);
+      LIB_CHECK("clSetKernelArg(tiled)")
+   }
+   else {
+      rc  = clSetKernelArg(h->kernel, 0, sizeof(cl_mem), &h->input_buffer);
+      rc |= clSetKernelArg(h->kernel, 1, sizeof(cl_mem), &h->output_buffer);
+      LIB_CHECK("clSetKernelArg(vectors)")
+   }
+
+   if (h->zero_copy) {
+      rc = map_vectors(h, CL_TRUE, NULL);
+      LIB_CHECK("clEnqueueMapBuffer(vectors)")
+   }
+   if (h->perm != NULL) {
+      LIB_ALLOC_CHECK(h->staging_x, (size_t) h->nx * h->nrhs * h->value_size, "staging_x")
+      LIB_ALLOC_CHECK(h->staging_y, (size_t) h->ny * h->nrhs * h->value_size, "staging_y")
+   }
+   if (!opts->keep_matrix) {
+      release_host_matrix(h);
+   }
+   return h;
+}
+
+void spmv_shape(const spmv_handle *h, unsigned int *nx, unsigned int *ny, unsigned int *non_zero)
+{
+   if (nx != NULL) *nx = h->nx;
+   if (ny != NULL) *ny = h->ny;
+   if (non_zero != NULL) *non_zero = h->non_zero;
+}
+
+cl_int spmv_vectors(spmv_handle *h, void **x, void **y)
+{
+   if (!h->zero_copy || !h->vectors_mapped || h->perm != NULL) return CL_INVALID_OPERATION;
+   *x = h->host_input;
+   *y = h->host_output;
+   return CL_SUCCESS;
+}
+
+/* Queue the write of x, the multiply and the read of y, in that order on the in-order queue.  With  */
+/* zero copy the vector buffers are unmapped around the multiply, and x and y are not copied if they */
+/* are the handle's own arrays.                                                                      */
+static cl_int spmv_enqueue(spmv_handle *h, const void *x, void *y, cl_bool blocking, cl_event *done)
+{
+   int in_place_x = h->zero_copy && x == h->host_input;
+   int in_place_y = h->zero_copy && y == h->host_output;
+   cl_int rc;
+
+   if (h->input_buffer == NULL) return CL_INVALID_OPERATION;
+   if (h->zero_copy && h->vectors_mapped) {
+      rc = unmap_vectors(h);
+      if (rc != CL_SUCCESS) return rc;
+   }
+   if (!in_place_x) {
+      rc = clEnqueueWriteBuffer(h->queue, h->input_buffer, CL_FALSE, 0, (size_t) h->nx * h->nrhs * h->value_size, x, 0, NULL, NULL);
+      if (rc != CL_SUCCESS) return rc;
+   }
+   if (h->symmetric) {
+      size_t n = h->ny;
+      rc = clSetKernelArg(h->zero, 0, sizeof(cl_mem), &h->output_buffer);
+      if (rc != CL_SUCCESS) return rc;
+      rc = clEnqueueNDRangeKernel(h->queue, h->zero, 1, NULL, &n, NULL, 0, NULL, NULL);
+      if (rc != CL_SUCCESS) return rc;
+   }
+   rc = clEnqueueNDRangeKernel(h->queue, h->kernel, h->ndims, NULL, h->global_work_size, h->local_work_size, 0, NULL, NULL);
+   if (rc != CL_SUCCESS) return rc;
+   if (!in_place_y) {
+      rc = clEnqueueReadBuffer(h->queue, h->output_buffer, blocking, 0, (size_t) h->ny * h->nrhs * h->value_size, y, 0, NULL,
+                               h->zero_copy ? NULL : done);
+      if (rc != CL_SUCCESS) return rc;
+   }
+   if (h->zero_copy) {
+      return map_vectors(h, blocking, done);
+   }
+   return CL_SUCCESS;
+}
+
+cl_int spmv_apply(spmv_handle *h, const void *x, void *y)
+{
+   size_t width = h->nrhs * h->value_size;
+   cl_int rc;
+
+   if (h->perm == NULL) {
+      return spmv_enqueue(h, x, y, CL_TRUE, NULL);
+   }
+   /* The tiles of a reordered matrix take their input, and give their output, in the reordered numbering. */
+   memcpy(h->staging_x, x, h->nx * width);
+   reorder_vector(h->perm, h->nx, width, h->staging_x, 1);
+   rc = spmv_enqueue(h, h->staging_x, h->staging_y, CL_TRUE, NULL);
+   if (rc == CL_SUCCESS) {
+      reorder_vector(h->perm, h->ny, width, h->staging_y, 0);
+      memcpy(y, h->staging_y, h->ny * width);
+   }
+   return rc;
+}
+
+cl_int spmv_apply_async(spmv_handle *h, const void *x, void *y, cl_event *done)
+{
+   if (h->perm != NULL) return CL_INVALID_OPERATION;
+   return spmv_enqueue(h, x, y, CL_FALSE, done);
+}
+
+void spmv_destroy(spmv_handle *h)
+{
+   if (h == NULL) return;
+   if (h->vectors_mapped) unmap_vectors(h);
+   if (h->queue != NULL) clFinish(h->queue);
+   if (h->input_buffer != NULL) clReleaseMemObject(h->input_buffer);
+   if (h->output_buffer != NULL) clReleaseMemObject(h->output_buffer);
+   if (h->matrix_buffer != NULL) clReleaseMemObject(h->matrix_buffer);
+   format_release(&h->fs);
+   if (h->zero != NULL) clReleaseKernel(h->zero);
+   if (h->kernel != NULL) clReleaseKernel(h->kernel);
+   if (h->program != NULL) clReleaseProgram(h->program);
+   if (h->queue != NULL) clReleaseCommandQueue(h->queue);
+   if (h->context != NULL) clReleaseContext(h->context);
+   release_host_matrix(h);
+   free(h->host_input);
+   free(h->host_output);
+   free(h->perm);
+   free(h->staging_x);
+   free(h->staging_y);
+   free(h->device_name);
+   free(h);
+}
@@ -0,0 +1,81 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+#ifndef SPMV_LIB_H
+#define SPMV_LIB_H
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/* ============================================================================ */
+/* Library interface to the SpMV kernels (see spmv_lib.c).                      */
+/*                                                                              */
+/* spmv_create() picks a device, builds spmv.cl, tiles the matrix and uploads   */
+/* it once.  Every spmv_apply() after that only moves the two vectors and runs  */
+/* the kernel; nothing is rebuilt or uploaded again.                            */
+/*                                                                              */
+/* The vectors are floats, or doubles in double and mixed precision.  With      */
+/* nrhs > 1, x and y hold a block of nrhs vectors, interleaved: element i of    */
+/* vector v is at i*nrhs + v.                                                   */
+/* ============================================================================ */
+
+typedef struct _spmv_handle spmv_handle;   /* opaque */
+
+typedef struct _spmv_options {
+   cl_device_type device_type;       /* CL_DEVICE_TYPE_DEFAULT: an accelerator, else a GPU, else a CPU */
+   unsigned int kernel_type;         /* KERNEL_DEFAULT (0), KERNEL_LS (1) or KERNEL_AWGC (2) */
+   unsigned int partitioner;         /* PARTITION_ROWS (0) or PARTITION_COST (1) */
+   unsigned int reorder;             /* REORDER_NONE (0), REORDER_RCM (1) or REORDER_ND (2) */
+   unsigned int sym_storage;         /* tile only the upper triangle of a symmetric matrix file (LS kernel) */
+   int gpu_wgsz;                     /* work group size on a GPU; 0 for the default */
+   const char *cache_dir;            /* directory for the tile cache, or NULL */
+   const char *kernel_source;        /* path of spmv.cl, or NULL for "spmv.cl" in the working directory */
+   unsigned int format;              /* FORMAT_TILED (1, the default), FORMAT_AUTO (0), or csr (2), csrv, ell, sell (5) */
+   unsigned int nrhs;                /* right-hand sides per multiply: 1 (the default), 4, 8 or 16; tiled only */
+   unsigned int precision;           /* PRECISION_SINGLE (0), _DOUBLE (1) or _MIXED (2); tiled only */
+   unsigned int zero_copy;           /* CPU device: multiply in place on page-aligned host arrays (see spmv_vectors()) */
+   unsigned int autotune;            /* time both partitioners at several slab counts, and keep the fastest */
+   unsigned int profiling;           /* create the queue with CL_QUEUE_PROFILING_ENABLE */
+   unsigned int keep_matrix;         /* keep the host copy of the matrix (CSR arrays and tiles) in the handle */
+   unsigned int tiles_only;          /* build and keep the host tiles, but no device buffers (spmv_apply() fails) */
+} spmv_options;
+
+void spmv_default_options(spmv_options *);
+
+/* Build a handle for the Matrix Market file "file_name", or for a generated matrix if  */
+/* file_name is a generator spec such as "poisson3d:100" (see matrix_synth.c).           */
+/* Returns NULL on failure.                                                              */
+spmv_handle *spmv_create(const char *file_name, const spmv_options *);
+
+/* Matrix shape: x has nx elements, y has ny. */
+void spmv_shape(const spmv_handle *, unsigned int *nx, unsigned int *ny, unsigned int *non_zero);
+
+/* y = A x, returning once y is filled in.  Returns CL_SUCCESS or an OpenCL error code. */
+cl_int spmv_apply(spmv_handle *, const void *x, void *y);
+
+/* y = A x, returning as soon as the work is queued.  "done" (if not NULL) receives an event which   */
+/* completes once y is filled in; the caller releases it.  x must not change, and y must not be read, */
+/* until then.  Not available for a reordered matrix, which needs the host to permute y afterwards   */
+/* (CL_INVALID_OPERATION).                                                                            */
+cl_int spmv_apply_async(spmv_handle *, const void *x, void *y, cl_event *done);
+
+/* Zero copy only: the page-aligned arrays the vector buffers are created on (CL_MEM_USE_HOST_PTR).  They */
+/* stay mapped for the host between multiplies; x has room for nx rounded up to the tiles' padding, its   */
+/* padding zeroed, and y for ny.  spmv_apply() and spmv_apply_async() given these two arrays move no     */
+/* data: they unmap them, run the kernel on them in place and map them back.  Any other x and y are      */
+/* copied in and out as usual.  Returns CL_INVALID_OPERATION without zero copy or for a reordered matrix. */
+cl_int spmv_vectors(spmv_handle *, void **x, void **y);
+
+void spmv_destroy(spmv_handle *);
+
+#endif
@@ -0,0 +1,152 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+/* ================================================================================= */
+/* Statistics on the shape of the tiled matrix, and on how fast the kernel runs.     */
+/*                                                                                   */
+/* The format figures (slabs, packets, fill ratio, bytes per non-zero) say whether a */
+/* matrix tiles well.  The kernel figures (GB/s, GFLOP/s, taken from profiling       */
+/* events) say how well the kernel is using the device.  A low fill ratio with good  */
+/* bandwidth points at the format; a good fill ratio with poor bandwidth points at   */
+/* the kernel.                                                                       */
+/* ================================================================================= */
+
+/* Walk the slab headers of a finished tiled matrix and count its packets.  */
+/* "perm" maps the tiled matrix's rows back to the CSR rows, when reordered. */
+void stats_tiled(stats_struct *st, slab_header *matrix_header, unsigned int nslabs_round, unsigned int num_header_packets,
+                 unsigned int *slab_startrow, unsigned int *row_index_array, const unsigned int *perm)
+{
+   unsigned int i, r;
+
+   st->nslabs = nslabs_round;
+   st->empty_slabs = 0;
+   st->header_packets = matrix_header[0].offset;  /* the slab headers themselves */
+   st->data_packets = 0;
+   st->pad_packets = 0;
+   st->min_slab_packets = 0xffffffff;
+   st->max_slab_packets = 0;
+
+   for (i=0; i<nslabs_round; ++i) {
+      unsigned int npackets = matrix_header[i+1].offset - matrix_header[i].offset;
+      unsigned int slab_non_zero = row_index_array[slab_startrow[i+1]] - row_index_array[slab_startrow[i]];
+      if (perm != NULL) {
+         for (slab_non_zero=0, r=slab_startrow[i]; r<slab_startrow[i+1] && slab_non_zero == 0; ++r) {
+            if (r < st->ny) slab_non_zero += row_index_array[perm[r]+1] - row_index_array[perm[r]];
+         }
+      }
+      if (slab_non_zero == 0) {
+         /* A slab with no non-zeros still carries zeroed packets flagging "no work". */
+         ++st->empty_slabs;
+         st->pad_packets += npackets;
+         continue;
+      }
+      /* On the GPU, each slab starts with the team header packets. */
+      st->header_packets += num_header_packets;
+      npackets -= num_header_packets;
+      st->data_packets += npackets;
+      if (npackets < st->min_slab_packets) st->min_slab_packets = npackets;
+      if (npackets > st->max_slab_packets) st->max_slab_packets = npackets;
+   }
+   if (st->min_slab_packets == 0xffffffff) st->min_slab_packets = 0;
+
+   /* Every stored non-zero lands in exactly one of the 16 slots of one data packet. */
+   st->fill = (st->data_packets > 0) ? (double) st->stored_non_zero / (16.0 * (double) st->data_packets) : 0.0;
+   st->matrix_bytes = (unsigned long long) matrix_header[nslabs_round].offset * st->packet_bytes;
+}
+
+/* Elapsed device time of a completed command, in milliseconds. */
+double stats_event_ms(cl_event event)
+{
+   cl_int rc;
+   cl_ulong start, end;
+
+   rc = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+   CHECK_RESULT("clGetEventProfilingInfo(start)")
+   rc = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+   CHECK_RESULT("clGetEventProfilingInfo(end)")
+   return 1.0e-6 * (double) (end - start);
+}
+
+/* Derive the rates from the timings, print everything, and write it to "json_file". */
+/* The bytes moved per call count the matrix once and the input and output vectors  */
+/* once each, so they are a lower bound on the real traffic: the achieved GB/s can   */
+/* be compared directly against the device's peak memory bandwidth.  The bytes per   */
+/* non-zero are per stored non-zero, while the GFLOP/s count the multiply-adds of    */
+/* the full matrix, which symmetric storage still performs.                          */
+void stats_report(stats_struct *st, const char *json_file)
+{
+   FILE *fp;
+   double seconds;
+
+   st->bytes_per_call = st->matrix_bytes + (unsigned long long) (st->nx + st->ny) * st->nrhs * st->value_bytes;
+   st->bytes_per_nnz = (st->stored_non_zero > 0) ? (double) st->bytes_per_call / (double) st->stored_non_zero : 0.0;
+   seconds = 1.0e-3 * st->kernel_ms_min;
+   st->gbs = (seconds > 0.0) ? 1.0e-9 * (double) st->bytes_per_call / seconds : 0.0;
+   st->gflops = (seconds > 0.0) ? 1.0e-9 * 2.0 * (double) st->non_zero * st->nrhs / seconds : 0.0;
+
+   printf("\n");
+   printf("matrix: %d x %d, %d non-zeros, format %s, kernel %s, %s precision\n", st->ny, st->nx, st->non_zero, st->format, st->kernel, st->precision);
+   if (st->stored_non_zero != st->non_zero) {
+      printf("stored non-zeros: %d (upper triangle)\n", st->stored_non_zero);
+   }
+   if (st->nslabs > 0) {
+      printf("slabs: %d (%d empty), packets per slab: min %d, max %d\n",
+             st->nslabs, st->empty_slabs, st->min_slab_packets, st->max_slab_packets);
+      printf("packets: %d data, %d header, %d padding; fill ratio %.3f (%.1f of 16 slots used)\n",
+             st->data_packets, st->header_packets, st->pad_packets, st->fill, 16.0 * st->fill);
+   }
+   printf("matrix bytes: %llu, bytes moved per call: %llu (%.2f per non-zero)\n",
+          st->matrix_bytes, st->bytes_per_call, st->bytes_per_nnz);
+   printf("kernel time over %d runs: min %.4f ms, median %.4f ms, p95 %.4f ms, avg %.4f ms\n",
+          st->runs, st->kernel_ms_min, st->kernel_ms_median, st->kernel_ms_p95, st->kernel_ms_avg);
+   printf("best rates: %.2f GB/s, %.2f GFLOP/s\n", st->gbs, st->gflops);
+
+   if (json_file == NULL) return;
+   fp = fopen(json_file, "w");
+   if (fp == NULL) {
+      printf("could not open %s for writing\n", json_file);
+      return;
+   }
+   fprintf(fp, "{\n");
+   fprintf(fp, "  \"matrix\": \"%s\",\n", st->file_name);
+   fprintf(fp, "  \"device\": \"%s\",\n", st->device_name);
+   fprintf(fp, "  \"format\": \"%s\",\n", st->format);
+   fprintf(fp, "  \"kernel\": \"%s\",\n", st->kernel);
+   fprintf(fp, "  \"precision\": \"%s\",\n", st->precision);
+   fprintf(fp, "  \"nx\": %u,\n", st->nx);
+   fprintf(fp, "  \"ny\": %u,\n", st->ny);
+   fprintf(fp, "  \"non_zero\": %u,\n", st->non_zero);
+   fprintf(fp, "  \"stored_non_zero\": %u,\n", st->stored_non_zero);
+   fprintf(fp, "  \"nrhs\": %u,\n", st->nrhs);
+   fprintf(fp, "  \"slabs\": %u,\n", st->nslabs);
+   fprintf(fp, "  \"empty_slabs\": %u,\n", st->empty_slabs);
+   fprintf(fp, "  \"data_packets\": %u,\n", st->data_packets);
+   fprintf(fp, "  \"header_packets\": %u,\n", st->header_packets);
+   fprintf(fp, "  \"pad_packets\": %u,\n", st->pad_packets);
+   fprintf(fp, "  \"min_slab_packets\": %u,\n", st->min_slab_packets);
+   fprintf(fp, "  \"max_slab_packets\": %u,\n", st->max_slab_packets);
+   fprintf(fp, "  \"fill_ratio\": %.6f,\n", st->fill);
+   fprintf(fp, "  \"matrix_bytes\": %llu,\n", st->matrix_bytes);
+   fprintf(fp, "  \"bytes_per_call\": %llu,\n", st->bytes_per_call);
+   fprintf(fp, "  \"bytes_per_nnz\": %.4f,\n", st->bytes_per_nnz);
+   fprintf(fp, "  \"runs\": %u,\n", st->runs);
+   fprintf(fp, "  \"kernel_ms_min\": %.6f,\n", st->kernel_ms_min);
+   fprintf(fp, "  \"kernel_ms_avg\": %.6f,\n", st->kernel_ms_avg);
+   fprintf(fp, "  \"kernel_ms_median\": %.6f,\n", st->kernel_ms_median);
+   fprintf(fp, "  \"kernel_ms_p95\": %.6f,\n", st->kernel_ms_p95);
+   fprintf(fp, "  \"gbytes_per_sec\": %.4f,\n", st->gbs);
+   fprintf(fp, "  \"gflops\": %.4f\n", st->gflops);
+   fprintf(fp, "}\n");
+   fclose(fp);
+   printf("statistics written to %s\n", json_file);
+}
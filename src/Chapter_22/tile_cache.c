@@ -0,0 +1,350 @@
+//
+// Book:      OpenCL(R) Programming Guide
+// Authors:   Aaftab Munshi, Benedict Gaster, Timothy Mattson, James Fung, Dan Ginsburg
+// ISBN-10:   0-321-74964-2
+// ISBN-13:   978-0-321-74964-2
+// Publisher: Addison-Wesley Professional
+// URLs:      http://safari.informit.com/9780132488006/
+//            http://www.openclprogrammingguide.com
+//
+
+
+#include "spmv.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* ================================================================================= */
+/* Binary cache of the finished tiled matrix.                                        */
+/*                                                                                   */
+/* The tiled format produced by matrix_gen depends only on the matrix file and on a  */
+/* handful of device parameters, so once it has been built it can be written to     */
+/* disk and mapped back in on later runs instead of reparsing the Matrix Market      */
+/* file.  A cache file is laid out as follows:                                       */
+/*                                                                                   */
+/*    tile_cache_header                                                              */
+/*    slab_startrow[nslabs_round+1]                                                  */
+/*    row_index_array[nyround+1]      (CSR copy, used by the verification step)      */
+/*    x_index_array[non_zero+1]                                                      */
+/*    data_array[non_zero]                                                           */
+/*    data_array_dp[non_zero]         (only for fp64 tiles)                          */
+/*    perm[ny]                        (only if the matrix was reordered)             */
+/*    (pad to a multiple of TILE_CACHE_ALIGN bytes)                                  */
+/*    tiled matrix, matrix_header[nslabs_round].offset packets                       */
+/*    matdata_dp[16 per packet]       (only for fp64 tiles; tile_bytes long, since   */
+/*                                    16 doubles are the size of a packet)           */
+/*                                                                                   */
+/* The file name and the header both carry a key hashed from the matrix file         */
+/* contents and the device parameters, so a stale or foreign cache is never used.   */
+/* ================================================================================= */
+
+#define TILE_CACHE_MAGIC   0x454C4954564D5053ULL   /* "SPMVTILE" */
+#define TILE_CACHE_VERSION 5
+#define TILE_CACHE_ALIGN   4096
+
+typedef struct _tile_cache_header {
+   cl_ulong magic;
+   cl_uint version;
+   cl_uint packet_size;
+   cl_ulong key;
+   cl_uint nx, ny, non_zero, nx_pad, nyround;
+   cl_uint column_span, segcachesize, max_slabheight;
+   cl_uint nslabs_round, memsize, num_header_packets;
+   cl_uint max_compute_units;
+   cl_int gpu_wgsz;
+   cl_uint symmetric;                /* the tiles hold only the upper triangle */
+   cl_uint reordered;                /* the tiles are in the numbering of the stored perm[] */
+   cl_uint fp64;                     /* the fp64 values of the CSR arrays and of the packets are stored too */
+   cl_ulong tile_offset;             /* byte offset of the tiled matrix within the file */
+   cl_ulong tile_bytes;              /* number of bytes of tiled matrix data */
+} tile_cache_header;
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+static cl_ulong fnv1a(cl_ulong h, const void *data, size_t len)
+{
+   const unsigned char *p = (const unsigned char *) data;
+   size_t i;
+
+   for (i=0; i<len; ++i) {
+      h ^= p[i];
+      h *= FNV_PRIME;
+   }
+   return h;
+}
+
+/* Fold the whole of a matrix file into h. */
+static int tile_cache_hash_file(const char *file_name, cl_ulong *hp)
+{
+   struct stat statbuf;
+   int fd;
+   cl_ulong h = *hp;
+
+   fd = open(file_name, O_RDONLY);
+   if (fd < 0 || fstat(fd, &statbuf) != 0) {
+      if (fd >= 0) close(fd);
+      return -1;
+   }
+   if (statbuf.st_size > 0) {
+      void *map = mmap(NULL, (size_t) statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+         close(fd);
+         return -1;
+      }
+      /* Fold the file eight bytes at a time; a byte-wise FNV pass over a multi-gigabyte */
+      /* matrix would eat into the time the cache is supposed to save.                     */
+      const unsigned char *p = (const unsigned char *) map;
+      size_t len = (size_t) statbuf.st_size;
+      size_t i;
+      for (i=0; i+8<=len; i+=8) {
+         cl_ulong w;
+         memcpy(&w, &p[i], 8);
+         h = (h ^ w) * FNV_PRIME;
+      }
+      h = fnv1a(h, &p[i], len-i);
+      munmap(map, (size_t) statbuf.st_size);
+   }
+   close(fd);
+   *hp = h;
+   return 0;
+}
+
+/* ================================================================================= */
+/* Hash the matrix file (or the spec of a generated matrix) and the parameters which */
+/* matrix_gen uses to shape the tiles.                                               */
+/* Must be called before matrix_gen, since matrix_gen updates several of these.      */
+/* ================================================================================= */
+
+int tile_cache_key(matrix_gen_struct *mgs, cl_ulong *key)
+{
+   cl_ulong h = FNV_OFFSET;
+
+   if (mgs->synth != SYNTH_NONE) {
+      cl_uint spec[4];
+      spec[0] = mgs->synth;
+      spec[1] = mgs->synth_size;
+      spec[2] = mgs->synth_param;
+      spec[3] = mgs->synth_seed;
+      h = fnv1a(h, spec, sizeof(spec));
+   }
+   else if (tile_cache_hash_file(mgs->file_name, &h) != 0) {
+      return -1;
+   }
+
+   cl_uint params[13];
+   params[0] = TILE_CACHE_VERSION;
+   params[1] = (cl_uint) sizeof(packet);
+   params[2] = mgs->kernel_type;
+   params[3] = (cl_uint) mgs->device_type;
+   params[4] = mgs->preferred_alignment;
+   params[5] = *(mgs->max_compute_units);
+   params[6] = mgs->local_mem_size;
+   params[7] = (cl_uint) *(mgs->gpu_wgsz);
+   params[8] = mgs->partitioner;
+   memcpy(&params[9], &mgs->slab_scale, sizeof(cl_uint));
+   params[10] = mgs->sym_storage;
+   params[11] = mgs->reorder;
+   params[12] = (mgs->data_array_dp != NULL);
+   h = fnv1a(h, params, sizeof(params));
+   cl_ulong wg = (cl_ulong) mgs->kernel_wg_size;
+   h = fnv1a(h, &wg, sizeof(wg));
+
+   *key = h;
+   return 0;
+}
+
+static void tile_cache_path(const char *cache_dir, const char *file_name, cl_ulong key, char *path, size_t len)
+{
+   char *tmp = strdup(file_name);
+   snprintf(path, len, "%s/%s.%016llx.tile", cache_dir, basename(tmp), (unsigned long long) key);
+   free(tmp);
+}
+
+/* ================================================================================= */
+/* Look for a cache file matching "key".  On a hit, the matrix_gen_struct outputs    */
+/* are filled in exactly as matrix_gen would have filled them, except that           */
+/* *seg_workspace is NULL and *matrix_header points into the mapped file.  The       */
+/* caller copies the tiles into the device buffer, then calls tile_cache_release.    */
+/* Returns 0 on a hit, -1 on a miss.                                                 */
+/* ================================================================================= */
+
+int tile_cache_load(const char *cache_dir, cl_ulong key, matrix_gen_struct *mgs, tile_cache_struct *tcs)
+{
+   char path[1024];
+   struct stat statbuf;
+   tile_cache_header *hdr;
+   unsigned char *base;
+   size_t pos;
+   int fd;
+
+   tcs->map = NULL;
+   tcs->map_size = 0;
+
+   tile_cache_path(cache_dir, mgs->file_name, key, path, sizeof(path));
+   fd = open(path, O_RDONLY);
+   if (fd < 0) return -1;
+   if (fstat(fd, &statbuf) != 0 || (size_t) statbuf.st_size < sizeof(tile_cache_header)) {
+      close(fd);
+      return -1;
+   }
+   base = (unsigned char *) mmap(NULL, (size_t) statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if ((void *) base == MAP_FAILED) return -1;
+
+   hdr = (tile_cache_header *) base;
+   if (hdr->magic != TILE_CACHE_MAGIC || hdr->version != TILE_CACHE_VERSION || hdr->packet_size != sizeof(packet) ||
+       hdr->key != key || hdr->fp64 != (mgs->data_array_dp != NULL) ||
+       hdr->tile_offset + hdr->tile_bytes + (hdr->fp64 ? hdr->tile_bytes : 0) > (cl_ulong) statbuf.st_size) {
+      printf("ignoring stale tile cache %s\n", path);
+      munmap(base, (size_t) statbuf.st_size);
+      return -1;
+   }
+
+   unsigned int preferred_alignment = mgs->preferred_alignment; // used by "MEMORY_ALLOC_CHECK" macro
+   *(mgs->nx) = hdr->nx;
+   *(mgs->ny) = hdr->ny;
+   *(mgs->non_zero) = hdr->non_zero;
+   *(mgs->nx_pad) = hdr->nx_pad;
+   *(mgs->nyround) = hdr->nyround;
+   *(mgs->column_span) = hdr->column_span;
+   *(mgs->segcachesize) = hdr->segcachesize;
+   *(mgs->max_slabheight) = hdr->max_slabheight;
+   *(mgs->nslabs_round) = hdr->nslabs_round;
+   *(mgs->memsize) = hdr->memsize;
+   *(mgs->num_header_packets) = hdr->num_header_packets;
+   *(mgs->max_compute_units) = hdr->max_compute_units;
+   *(mgs->gpu_wgsz) = hdr->gpu_wgsz;
+   mgs->symmetric = hdr->symmetric;
+
+   pos = sizeof(tile_cache_header);
+   MEMORY_ALLOC_CHECK(*(mgs->slab_startrow), ((hdr->nslabs_round + 1) * sizeof (unsigned int)), "slab_startrow")
+   memcpy(*(mgs->slab_startrow), &base[pos], (hdr->nslabs_round + 1) * sizeof (unsigned int));
+   pos += (hdr->nslabs_round + 1) * sizeof (unsigned int);
+   MEMORY_ALLOC_CHECK(*(mgs->row_index_array), ((hdr->nyround + 1) * sizeof (int)), "row_index_array")
+   memcpy(*(mgs->row_index_array), &base[pos], (hdr->nyround + 1) * sizeof (int));
+   pos += (hdr->nyround + 1) * sizeof (int);
+   MEMORY_ALLOC_CHECK(*(mgs->x_index_array), ((hdr->non_zero + 1) * sizeof (int)), "x_index_array")
+   memcpy(*(mgs->x_index_array), &base[pos], (hdr->non_zero + 1) * sizeof (int));
+   pos += (hdr->non_zero + 1) * sizeof (int);
+   MEMORY_ALLOC_CHECK(*(mgs->data_array), (hdr->non_zero * sizeof (float)), "data_array")
+   memcpy(*(mgs->data_array), &base[pos], hdr->non_zero * sizeof (float));
+   pos += hdr->non_zero * sizeof (float);
+   if (hdr->fp64) {
+      MEMORY_ALLOC_CHECK(*(mgs->data_array_dp), (hdr->non_zero * sizeof (double)), "data_array_dp")
+      memcpy(*(mgs->data_array_dp), &base[pos], hdr->non_zero * sizeof (double));
+      pos += hdr->non_zero * sizeof (double);
+   }
+   *(mgs->perm) = NULL;
+   if (hdr->reordered) {
+      MEMORY_ALLOC_CHECK(*(mgs->perm), ((hdr->ny + 1) * sizeof (unsigned int)), "perm")
+      memcpy(*(mgs->perm), &base[pos], hdr->ny * sizeof (unsigned int));
+   }
+
+   *(mgs->seg_workspace) = NULL;
+   *(mgs->matrix_header) = (slab_header *) &base[hdr->tile_offset];
+   /* The 16 fp64 values of a packet take 128 bytes, the size of the packet itself. */
+   if (hdr->fp64) {
+      MEMORY_ALLOC_CHECK(*(mgs->matdata_dp), (size_t) hdr->tile_bytes, "matdata_dp")
+      memcpy(*(mgs->matdata_dp), &base[hdr->tile_offset + hdr->tile_bytes], (size_t) hdr->tile_bytes);
+   }
+
+   tcs->map = base;
+   tcs->map_size = (size_t) statbuf.st_size;
+   printf("nx = %d, ny = %d, non_zero = %d (tiled matrix from cache %s)\n", hdr->nx, hdr->ny, hdr->non_zero, path);
+   return 0;
+}
+
+void tile_cache_release(tile_cache_struct *tcs)
+{
+   if (tcs->map != NULL) {
+      munmap(tcs->map, tcs->map_size);
+      tcs->map = NULL;
+      tcs->map_size = 0;
+   }
+}
+
+/* ================================================================================= */
+/* Write the output of a completed matrix_gen call to the cache.  The file is built  */
+/* under a temporary name and renamed into place, so concurrent runs never observe   */
+/* a partially written cache.  Failure to write the cache is not fatal.              */
+/* ================================================================================= */
+
+int tile_cache_store(const char *cache_dir, cl_ulong key, matrix_gen_struct *mgs)
+{
+   char path[1024], tmp_path[1040];
+   tile_cache_header hdr;
+   FILE *fh;
+   size_t pos;
+   int ok;
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic = TILE_CACHE_MAGIC;
+   hdr.version = TILE_CACHE_VERSION;
+   hdr.packet_size = sizeof(packet);
+   hdr.key = key;
+   hdr.nx = *(mgs->nx);
+   hdr.ny = *(mgs->ny);
+   hdr.non_zero = *(mgs->non_zero);
+   hdr.nx_pad = *(mgs->nx_pad);
+   hdr.nyround = *(mgs->nyround);
+   hdr.column_span = *(mgs->column_span);
+   hdr.segcachesize = *(mgs->segcachesize);
+   hdr.max_slabheight = *(mgs->max_slabheight);
+   hdr.nslabs_round = *(mgs->nslabs_round);
+   hdr.memsize = *(mgs->memsize);
+   hdr.num_header_packets = *(mgs->num_header_packets);
+   hdr.max_compute_units = *(mgs->max_compute_units);
+   hdr.gpu_wgsz = *(mgs->gpu_wgsz);
+   hdr.symmetric = mgs->symmetric;
+   hdr.reordered = (*(mgs->perm) != NULL);
+   hdr.fp64 = (mgs->data_array_dp != NULL);
+
+   pos = sizeof(tile_cache_header);
+   pos += (hdr.nslabs_round + 1) * sizeof (unsigned int);
+   pos += (hdr.nyround + 1) * sizeof (int);
+   pos += (hdr.non_zero + 1) * sizeof (int);
+   pos += hdr.non_zero * sizeof (float);
+   if (hdr.fp64) pos += hdr.non_zero * sizeof (double);
+   if (hdr.reordered) pos += hdr.ny * sizeof (unsigned int);
+   hdr.tile_offset = (pos + TILE_CACHE_ALIGN - 1) & ~((cl_ulong) TILE_CACHE_ALIGN - 1);
+   hdr.tile_bytes = (cl_ulong) sizeof(packet) * (*(mgs->matrix_header))[hdr.nslabs_round].offset;
+
+   mkdir(cache_dir, 0755);
+   tile_cache_path(cache_dir, mgs->file_name, key, path, sizeof(path));
+   snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int) getpid());
+   fh = fopen(tmp_path, "wb");
+   if (fh == NULL) {
+      printf("could not create tile cache %s\n", tmp_path);
+      return -1;
+   }
+
+   ok = (fwrite(&hdr, sizeof(hdr), 1, fh) == 1);
+   ok = ok && (fwrite(*(mgs->slab_startrow), sizeof (unsigned int), hdr.nslabs_round + 1, fh) == hdr.nslabs_round + 1);
+   ok = ok && (fwrite(*(mgs->row_index_array), sizeof (int), hdr.nyround + 1, fh) == hdr.nyround + 1);
+   ok = ok && (fwrite(*(mgs->x_index_array), sizeof (int), hdr.non_zero + 1, fh) == hdr.non_zero + 1);
+   ok = ok && (fwrite(*(mgs->data_array), sizeof (float), hdr.non_zero, fh) == hdr.non_zero);
+   if (hdr.fp64) {
+      ok = ok && (fwrite(*(mgs->data_array_dp), sizeof (double), hdr.non_zero, fh) == hdr.non_zero);
+   }
+   if (hdr.reordered) {
+      ok = ok && (fwrite(*(mgs->perm), sizeof (unsigned int), hdr.ny, fh) == hdr.ny);
+   }
+   while (ok && pos < hdr.tile_offset) {
+      ok = (fputc(0, fh) != EOF);
+      ++pos;
+   }
+   ok = ok && (fwrite(*(mgs->matrix_header), 1, (size_t) hdr.tile_bytes, fh) == (size_t) hdr.tile_bytes);
+   if (hdr.fp64) {
+      ok = ok && (fwrite(*(mgs->matdata_dp), 1, (size_t) hdr.tile_bytes, fh) == (size_t) hdr.tile_bytes);
+   }
+   ok = (fclose(fh) == 0) && ok;
+
+   if (!ok || rename(tmp_path, path) != 0) {
+      printf("could not write tile cache %s\n", path);
+      unlink(tmp_path);
+      return -1;
+   }
+   printf("tiled matrix written to cache %s\n", path);
+   return 0;
+}